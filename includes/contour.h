@@ -0,0 +1,54 @@
+//
+//  contour.h
+//  cMag
+//
+//  Iso-lines of a grid of values by marching squares, joined into
+//  polylines and thinned, for compact vector drawings of field slices.
+//
+
+#ifndef CMAG_CONTOUR_H
+#define CMAG_CONTOUR_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+typedef struct contourlines *ContourLinesPtr;
+
+//the iso-lines at one level, in grid coordinates: x is the column and y
+//the row, both from 0 at the first grid point. Closed lines end on the
+//point they start on.
+typedef struct contourlines {
+    int numLines;
+    int numPoints;    //over all the lines
+    int *lengths;     //the points of each line
+    double *x;        //numPoints columns
+    double *y;        //numPoints rows
+
+    //the grid, and the range of each block of cells, so a level only
+    //visits the blocks it crosses
+    const double *grid;
+    int numCols;
+    int numRows;
+    int blockCols;     //blocks across a row of cells
+    int blockCapacity;
+    double *blockMin;  //-HUGE_VAL if a corner is NaN
+    double *blockMax;
+
+    //room, and scratch space reused from level to level
+    int lineCapacity;
+    int pointCapacity;
+    int numEdges;
+    int *edgeSegments; //the two segments that cross each cell edge, or -1
+    int segmentCapacity;
+    int *segments;     //the two edges of each segment
+    unsigned char *used;
+} ContourLines;
+
+//external prototypes
+extern ContourLinesPtr createContourLines(void);
+extern void freeContourLines(ContourLinesPtr);
+extern bool setContourGrid(ContourLinesPtr, const double *, int, int);
+extern bool traceContours(ContourLinesPtr, double, double);
+extern char *contourUnitTest(void);
+
+#endif //CMAG_CONTOUR_H
@@ -18,13 +18,10 @@
 #define ARRAYSIZE(arr) (IS_ARRAY(arr) ? (sizeof(arr) / sizeof(arr[0])) : 0)
 
 
-#define FMDEBUG 1
-
 #define ROOT3OVER2 0.8660254037844386468
 
-// debug print
-#define debugPrint(fmt, ...) \
-  do { if (FMDEBUG) fprintf(stdout, fmt, __VA_ARGS__); } while (0)
+//tilt in degrees of the CLAS12 tilted sector frames about their y axes
+#define SECTOR_TILT 25.0
 
 //magic word used to test if byte swapping is required
 #define MAGICWORD 0xced
@@ -36,6 +33,8 @@ typedef struct fieldmetrics *FieldMetricsPtr;
 typedef struct fieldvalue *FieldValuePtr;
 typedef struct cell3d *Cell3DPtr;
 typedef struct cell2d *Cell2DPtr;
+typedef struct fieldprobe *FieldProbePtr;
+typedef struct fieldpyramid *FieldPyramidPtr;
 
 //some strings for prints
 extern const char *csLabels[];
@@ -79,7 +78,7 @@ typedef struct fieldvalue {
 
 //holds some metrics of the field
 typedef struct fieldmetrics {
-    unsigned int maxFieldIndex; //the index where we find the max field value
+    size_t maxFieldIndex; //the index where we find the max field value
     double maxFieldMagnitude; //the value of the max field index
     double avgFieldMagnitude; //the average field magnitude
 
@@ -113,6 +112,7 @@ typedef struct cell3d {
     double g[3];
     double a[8];
 
+    FieldValuePtr values; //the field values read, a NUMA local replica for a probe
     FieldValuePtr b[2][2][2]; //field at 4 corners of cell
 } Cell3D;
 
@@ -134,14 +134,26 @@ typedef struct cell2d {
     double rhoNorm; //cached value to speed up evaluation
     double zNorm; //cached value to speed up evaluation
 
+    FieldValuePtr values; //the field values read, a NUMA local replica for a probe
     FieldValuePtr b[2][2]; //field at 4 corners of cell
 
 } Cell2D;
 
+//a probe is a private cell for one field, so that each thread can
+//query the same field without disturbing the others
+typedef struct fieldprobe {
+    MagneticFieldPtr fieldPtr; //the field being probed
+    Cell3DPtr cell3DPtr;  //the probe's cell if the field is a torus
+    Cell2DPtr cell2DPtr;  //the probe's cell if the field is a solenoid
+} FieldProbe;
+
 typedef enum {TORUS, SOLENOID} FieldType;
 
-//holds the entire field map
+//holds the entire field map. The structure, its grids, cell, header and
+//values all live in one block, the arena (see readField)
 typedef struct magneticfield {
+    void *arena; //the block holding the map; freeFieldMap frees it
+
     FieldMapHeaderPtr headerPtr; //pointer to the header data
 
     char *path; //the path to the file
@@ -149,7 +161,7 @@ typedef struct magneticfield {
     bool symmetric; //is this a symmetric grid (solenoid always is)
     FieldType  type;
     char *creationDate;  //date the map was created
-    unsigned int numValues;  //total number of field values
+    size_t numValues;  //total number of field values
 
     //a grid pointer for each coordinate
     GridPtr phiGridPtr;
@@ -168,28 +180,60 @@ typedef struct magneticfield {
     double shiftZ; //misplacement shift in the z direction (cm)
 
     //some auxiliary data to cache
-    unsigned int N23; // for faster indexing
+    size_t N23; // for faster indexing
 
     //use 1D array which will require manual indexing
     FieldValue *fieldValues;
+
+    //optional copies of fieldValues, one per NUMA node (see magfieldnuma.h)
+    FieldValuePtr *replicas;
+    int numReplicas;
+
+    //optional min/max pyramid of |B| and its gradient (see magfieldpyramid.h)
+    FieldPyramidPtr pyramidPtr;
+
+    //optional |B| per grid point, unscaled (see magfieldmagnitude.h)
+    float *magnitudes;
 } MagneticField;
 
 // external function prototypes
-extern int getCompositeIndex(MagneticFieldPtr, int, int, int);
-extern void invertCompositeIndex(MagneticFieldPtr fieldPtr, int index, int *phiIndex, int *rhoIndex, int *zIndex);
+extern size_t getCompositeIndex(MagneticFieldPtr, int, int, int);
+extern void invertCompositeIndex(MagneticFieldPtr fieldPtr, size_t index, int *phiIndex, int *rhoIndex, int *zIndex);
 extern char *compositeIndexUnitTest();
 extern char *containsUnitTest();
 extern char *nearestNeighborUnitTest();
-extern FieldValuePtr getFieldAtIndex(MagneticFieldPtr, int );
+extern char *interpolationUnitTest(void);
+extern FieldValuePtr getFieldAtIndex(MagneticFieldPtr, size_t);
 extern void getFieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr);
 extern void getFieldValueTorus(FieldValuePtr, double, double, double, MagneticFieldPtr);
 extern void getFieldValueSolenoid(FieldValuePtr, double, double, double, MagneticFieldPtr);
 extern void getCompositeFieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr, MagneticFieldPtr);
+extern void getProbeFieldValue(FieldValuePtr, double, double, double, FieldProbePtr);
+extern void getProbeFieldValues(FieldValuePtr, const double *, const double *, const double *, size_t, FieldProbePtr);
+extern void getCompositeProbeFieldValue(FieldValuePtr, double, double, double, FieldProbePtr, FieldProbePtr);
+extern FieldValue fieldValueAt(double, double, double, MagneticFieldPtr);
+extern FieldValue probeFieldValueAt(double, double, double, FieldProbePtr);
+extern FieldValue compositeFieldValueAt(double, double, double, MagneticFieldPtr, MagneticFieldPtr);
+extern FieldValue compositeProbeFieldValueAt(double, double, double, FieldProbePtr, FieldProbePtr);
+extern void getProbeFieldComponents(const double *, const double *, const double *, size_t,
+                                    FieldProbePtr, float *, float *, float *);
+extern void getCylindricalFieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr);
+extern void getProbeCylindricalFieldValue(FieldValuePtr, double, double, double, FieldProbePtr);
+extern void getCompositeCylindricalFieldValue(FieldValuePtr, double, double, double,
+                                              MagneticFieldPtr, MagneticFieldPtr);
+extern void getSectorFieldValue(FieldValuePtr, int, double, double, double, MagneticFieldPtr);
+extern void getProbeSectorFieldValue(FieldValuePtr, int, double, double, double, FieldProbePtr);
+extern void getCompositeSectorFieldValue(FieldValuePtr, int, double, double, double,
+                                         MagneticFieldPtr, MagneticFieldPtr);
+extern void tiltedSectorToLab(int, double, double, double, double *, double *, double *);
+extern void labToTiltedSector(int, double, double, double, double *, double *, double *);
+extern char *coordinatesUnitTest(void);
 extern void setAlgorithm(enum Algorithm);
+extern enum Algorithm getAlgorithm(void);
 bool containsCartesian(MagneticFieldPtr, double, double, double);
 bool containsCylindrical(MagneticFieldPtr, double, double);
-extern void resetCell3D(Cell3DPtr, double, double, double);
-extern void resetCell2D(Cell2DPtr, double, double);
+extern bool resetCell3D(Cell3DPtr, double, double, double);
+extern bool resetCell2D(Cell2DPtr, double, double);
 extern void getCoordinateIndices(MagneticFieldPtr, double, double, double,
                           int *, int *, int *);
 
@@ -0,0 +1,63 @@
+//
+//  magfieldbdl.h
+//  cMag
+//
+//  A precomputed table of the bending power of straight lines from the
+//  target, over polar angle, azimuth and optionally the vertex z, with
+//  an interpolated lookup. The table is built from a composite field and
+//  saved in its own file alongside the maps.
+//
+
+#ifndef CMAG_MAGFIELDBDL_H
+#define CMAG_MAGFIELDBDL_H
+
+#include "magfield.h"
+#include "magfieldcomposite.h"
+
+//table files start with this word ("cMBL" read as little endian bytes)
+#define BDLMAGICWORD 0x4c424d63
+#define BDLVERSION 1
+
+//the extension added to a map path to name its table
+#define BDLEXTENSION ".bdl"
+
+typedef struct bdltable *BdlTablePtr;
+
+//the directions and vertices of a table. Angles are in degrees, lengths in cm
+typedef struct bdlgrid {
+    double thetaMin; //polar angle from the z axis of the first row
+    double thetaMax; //polar angle of the last row
+    double zMin;     //the first vertex z
+    double zMax;     //the last vertex z, ignored if nZ is 1
+    double length;   //length of each line; 0 to reach beyond all the maps
+    unsigned int nTheta; //polar angles, including the ends
+    unsigned int nPhi;   //azimuths, evenly spaced over [0, 360)
+    unsigned int nZ;     //vertex z values, including the ends
+    unsigned int reserved;
+} BdlGrid;
+
+//the table. For each vertex, polar angle and azimuth (fastest) it holds
+//the integral of B x dl along the line, resolved on the unit vectors of
+//theta and phi, in kG cm. B x dl is transverse to the line, so this is all of it
+typedef struct bdltable {
+    BdlGrid grid;
+    unsigned int fingerprint; //of the maps the table was built from
+    double thetaNorm; //cached 1/spacing for the lookup
+    double phiNorm;
+    double zNorm;
+    float *values;    //2 per node
+} BdlTable;
+
+//external prototypes
+extern BdlTablePtr buildBdlTable(CompositeFieldPtr, const BdlGrid *, int);
+extern void freeBdlTable(BdlTablePtr);
+extern bool lookupBdl(BdlTablePtr, double, double, double, double *, double *);
+extern double lookupBendingPower(BdlTablePtr, double, double, double);
+extern unsigned int compositeFingerprint(CompositeFieldPtr);
+extern char *bdlTablePath(const char *, char *, size_t);
+extern bool writeBdlTable(BdlTablePtr, const char *);
+extern BdlTablePtr readBdlTable(const char *, CompositeFieldPtr);
+extern void printBdlTable(BdlTablePtr, FILE *);
+extern char *bdlUnitTest(void);
+
+#endif //CMAG_MAGFIELDBDL_H
@@ -0,0 +1,64 @@
+//
+//  magfieldcomposite.h
+//  cMag
+//
+//  A composite of any number of field maps (torus, solenoid, beamline
+//  magnets, correction maps). Each map has a bounding volume, and an index
+//  of z bins sends each query only to the maps that can contain it.
+//
+
+#ifndef CMAG_MAGFIELDCOMPOSITE_H
+#define CMAG_MAGFIELDCOMPOSITE_H
+
+#include "magfield.h"
+
+//the number of z bins in a composite's index
+#define CMAG_COMPOSITE_ZBINS 64
+
+typedef struct fieldbounds *FieldBoundsPtr;
+typedef struct compositefield *CompositeFieldPtr;
+typedef struct compositeprobe *CompositeProbePtr;
+
+//the lab region a map can have a nonzero field in, allowing for its shifts
+typedef struct fieldbounds {
+    double rhoMinSq; //square of the minimum distance from the beam line
+    double rhoMaxSq; //square of the maximum distance from the beam line
+    double zMin;     //minimum z in cm
+    double zMax;     //maximum z in cm
+} FieldBounds;
+
+//the maps of a composite and the index of them
+typedef struct compositefield {
+    int numFields;            //the number of maps
+    MagneticFieldPtr *fields; //the maps, in the order given
+    FieldBoundsPtr bounds;    //a bounding volume per map
+
+    double zMin;     //z range covered by all the maps
+    double zMax;
+    double zBinNorm; //bins per cm
+    int *binStart;   //the maps of bin i are binFields[binStart[i]..binStart[i+1]-1]
+    int *binFields;  //indices into fields, in order, for each bin
+} CompositeField;
+
+//a private set of probes of a composite's maps, one per thread
+typedef struct compositeprobe {
+    CompositeFieldPtr compositePtr; //the composite being probed
+    FieldProbePtr *probes;          //a probe per map
+} CompositeProbe;
+
+//external prototypes
+extern CompositeFieldPtr createCompositeField(MagneticFieldPtr *, int);
+extern void freeCompositeField(CompositeFieldPtr);
+extern void refreshCompositeField(CompositeFieldPtr);
+extern CompositeProbePtr createCompositeProbe(CompositeFieldPtr);
+extern void freeCompositeProbe(CompositeProbePtr);
+extern void getCompositeValue(FieldValuePtr, double, double, double, CompositeFieldPtr);
+extern void getCompositeValues(FieldValuePtr, const double *, const double *, const double *, size_t,
+                               CompositeFieldPtr);
+extern void getCompositeProbeValue(FieldValuePtr, double, double, double, CompositeProbePtr);
+extern void getCompositeProbeValues(FieldValuePtr, const double *, const double *, const double *, size_t,
+                                    CompositeProbePtr);
+extern void printCompositeField(CompositeFieldPtr, FILE *);
+extern char *compositeUnitTest(void);
+
+#endif //CMAG_MAGFIELDCOMPOSITE_H
@@ -6,9 +6,27 @@
 #define CMAG_MAGFIELDDRAW_H
 
 #include "magfield.h"
+#include "mapcolor.h"
 
 //external function prototypes
 extern void createSVGImageFixedPhi(char *path, double, MagneticFieldPtr, MagneticFieldPtr);
 extern void createSVGImageFixedZ(char *path, double, MagneticFieldPtr, MagneticFieldPtr);
+extern bool createRasterImageFixedPhi(char *path, double, MagneticFieldPtr, MagneticFieldPtr);
+extern bool createRasterImageFixedZ(char *path, double, MagneticFieldPtr, MagneticFieldPtr);
+extern void setDrawThreads(int);
+extern int getDrawThreads(void);
+extern void setDrawRaster(bool);
+extern bool getDrawRaster(void);
+extern void setDrawContours(bool);
+extern bool getDrawContours(void);
+extern void setDrawArrows(double);
+extern double getDrawArrows(void);
+extern void setDrawFieldLines(int);
+extern int getDrawFieldLines(void);
+extern void setDrawPixelSize(double);
+extern double getDrawPixelSize(void);
+extern void setDrawColorMap(ColorMapPtr);
+extern ColorMapPtr getDrawColorMap(void);
+extern char *drawUnitTest(void);
 
 #endif //CMAG_MAGFIELDDRAW_H
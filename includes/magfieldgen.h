@@ -0,0 +1,29 @@
+//
+//  magfieldgen.h
+//  cMag
+//
+//  Generation of synthetic field map files from analytic fields, for
+//  testing and benchmarking where the CLAS12 maps are not available.
+//
+
+#ifndef CMAG_MAGFIELDGEN_H
+#define CMAG_MAGFIELDGEN_H
+
+#include "magfield.h"
+
+//file names used by generateSyntheticMaps
+#define SYNTHETIC_SOLENOID "Synthetic_solenoid.dat"
+#define SYNTHETIC_SYMMETRIC_TORUS "Synthetic_symm_torus.dat"
+#define SYNTHETIC_FULL_TORUS "Synthetic_full_torus.dat"
+
+//external prototypes
+extern void analyticSolenoidField(FieldValuePtr, double, double, double);
+extern void analyticTorusField(FieldValuePtr, double, double, double);
+extern bool generateFieldMap(const char *, FieldMapHeaderPtr, FieldType, bool, int);
+extern bool generateSolenoidMap(const char *, unsigned int, unsigned int, bool, int);
+extern bool generateTorusMap(const char *, unsigned int, unsigned int, unsigned int, bool, bool, int);
+extern bool generateSyntheticMaps(const char *, double, bool, int);
+extern bool mapFilePath(char *, const char *, const char *, const char *);
+extern char *generatorUnitTest(void);
+
+#endif //CMAG_MAGFIELDGEN_H
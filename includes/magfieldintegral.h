@@ -0,0 +1,37 @@
+//
+//  magfieldintegral.h
+//  cMag
+//
+//  Field integrals along straight line segments, by walking the cells of
+//  the (phi, rho, z) grid that a segment crosses and integrating the
+//  interpolated field inside each cell with Gauss-Legendre quadrature.
+//
+
+#ifndef CMAG_MAGFIELDINTEGRAL_H
+#define CMAG_MAGFIELDINTEGRAL_H
+
+#include "magfield.h"
+#include "magfieldcomposite.h"
+
+//Gauss-Legendre points used per cell
+#define CMAG_GAUSS_POINTS 3
+
+//the result of integrating along a segment
+typedef struct fieldintegral {
+    double bdl[3];      //the integral of B dl along the segment, kG cm, Cartesian components
+    double bCrossDl[3]; //the integral of B x dl along the segment, kG cm
+    double length;      //the length of the segment, cm
+    int numCells;       //the pieces of the segment inside a map, one per cell crossed
+    int numEvaluations; //the field evaluations made
+} FieldIntegral;
+
+//external prototypes
+extern void integrateLine(FieldProbePtr, const double *, const double *, FieldIntegral *);
+extern void integrateLines(FieldProbePtr, const double *, const double *, size_t, FieldIntegral *);
+extern void integrateCompositeLine(CompositeProbePtr, const double *, const double *, FieldIntegral *);
+extern void integrateCompositeLines(CompositeProbePtr, const double *, const double *, size_t,
+                                    FieldIntegral *);
+extern void printFieldIntegral(const FieldIntegral *, FILE *);
+extern char *integralUnitTest(void);
+
+#endif //CMAG_MAGFIELDINTEGRAL_H
@@ -8,13 +8,68 @@
 
 #include "magfield.h"
 
+//version 2 files start with this word ("cMG2" read as little endian bytes)
+#define MAGICWORD2 0x32474d63
+#define FILEVERSION2 2
+
+//written in the byte order of the writer, so the reader can tell whether to swap
+#define BYTEORDERMARK 0x01020304
+
+//the header and every data section start on a multiple of this
+#define V2ALIGNMENT 4096
+
+#define V2MAXSECTIONS 16
+
+//what a section holds. Unknown types are skipped by the loader,
+//so derived data can be added without breaking older readers.
+typedef enum {
+    SECTION_FIELD_VALUES = 1, //the FieldValue array, as in version 1
+    SECTION_MAGNITUDE = 2     //one float |B| per grid point
+} SectionType;
+
+//how the grid points of a section are laid out
+typedef enum {
+    LAYOUT_LINEAR = 0,    //composite index order, as in version 1
+    LAYOUT_BRICKED = 1,   //small 3D blocks stored contiguously
+    LAYOUT_QUANTIZED = 2  //reduced precision values
+} SectionLayout;
+
+//one entry of the section table
+typedef struct sectionentry {
+    unsigned int type;         //a SectionType
+    unsigned int layout;       //a SectionLayout
+    unsigned long long offset; //from the start of the file, a multiple of V2ALIGNMENT
+    unsigned long long size;   //bytes of data, not counting the padding
+    unsigned int elementSize;  //bytes per grid point
+    unsigned int crc;          //CRC32C of the data
+} SectionEntry;
+
+//the version 2 header, padded with zeros to V2ALIGNMENT bytes in the file
+typedef struct fieldmapheader2 {
+    unsigned int magicWord;   //MAGICWORD2
+    unsigned int version;     //FILEVERSION2
+    unsigned int byteOrder;   //BYTEORDERMARK
+    unsigned int headerCrc;   //CRC32C of this structure with headerCrc = 0
+    unsigned int alignment;   //V2ALIGNMENT
+    unsigned int numSections; //entries used in the section table
+    unsigned int reserved1;   //reserved
+    unsigned int reserved2;   //reserved
+    FieldMapHeader grid;      //the version 1 header: grid, units and date
+    SectionEntry sections[V2MAXSECTIONS];
+} FieldMapHeader2;
 
 // external function prototypes
 extern MagneticFieldPtr initializeTorus(const char *);
 extern MagneticFieldPtr initializeSolenoid(const char *);
-extern void createCell3D(MagneticFieldPtr);
-extern void createCell2D(MagneticFieldPtr);
 extern void freeCell3D(Cell3DPtr);
 extern void freeCell2D(Cell2DPtr);
+extern FieldProbePtr createProbe(MagneticFieldPtr);
+extern void freeProbe(FieldProbePtr);
+extern int getFileVersion(const char *);
+extern bool writeFieldMap2(MagneticFieldPtr, const char *);
+extern bool convertFieldMap(const char *, const char *);
+extern char *formatUnitTest(void);
+extern char *headerUnitTest(void);
+extern char *arenaUnitTest(void);
 
 #endif //CMAG_MAGFIELDIO_H
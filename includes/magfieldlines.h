@@ -0,0 +1,64 @@
+//
+//  magfieldlines.h
+//  cMag
+//
+//  Field lines, traced by integrating the direction of B from seed points
+//  with an adaptive Runge-Kutta stepper, in 3D or within a plane. Used to
+//  draw field lines on slices and to check the symmetry of maps.
+//
+
+#ifndef CMAG_MAGFIELDLINES_H
+#define CMAG_MAGFIELDLINES_H
+
+#include "magfield.h"
+
+typedef struct fieldlineparams *FieldLineParamsPtr;
+typedef struct fieldline *FieldLinePtr;
+
+//why a field line ended
+typedef enum {
+    LINE_OUT_OF_BOUNDS, //left the box of the parameters
+    LINE_WEAK_FIELD,    //the field, in the plane if there is one, fell below minField
+    LINE_CLOSED,        //came back to its seed
+    LINE_MAX_LENGTH,    //reached maxLength
+    LINE_MAX_POINTS     //reached maxPoints
+} FieldLineEnd;
+
+//how to trace a field line
+typedef struct fieldlineparams {
+    double tolerance;     //the largest position error of a step, cm
+    double minStep;       //cm
+    double maxStep;       //cm
+    double maxLength;     //cm
+    int maxPoints;        //points kept, the seed included
+    double minField;      //kG
+    double closeDistance; //a line back this close to its seed is closed, cm, 0 for never
+    double lo[3];         //the box the line stays in, cm
+    double hi[3];
+    bool inPlane;         //follow the field projected onto the plane through the seed
+    double normal[3];     //the unit normal of that plane
+    int direction;        //1 to follow B, -1 to go against it
+    int numThreads;       //for traceFieldLines, 0 for one per online processor
+} FieldLineParams;
+
+//a traced field line. Zero it before its first use; it can then be
+//traced into again and again, reusing its points.
+typedef struct fieldline {
+    int numPoints;
+    int capacity;
+    double *points;      //x, y, z of each point in cm, from the seed
+    double length;       //cm
+    int numSteps;        //accepted steps
+    int numRejected;     //steps retried with a smaller step
+    int numEvaluations;  //field evaluations
+    FieldLineEnd end;
+} FieldLine;
+
+//external prototypes
+extern void defaultFieldLineParams(FieldLineParamsPtr);
+extern bool traceFieldLine(FieldLinePtr, const double *, FieldProbePtr, FieldProbePtr, const FieldLineParams *);
+extern FieldLinePtr traceFieldLines(const double *, int, MagneticFieldPtr, MagneticFieldPtr, const FieldLineParams *);
+extern void freeFieldLines(FieldLinePtr, int);
+extern char *fieldLineUnitTest(void);
+
+#endif //CMAG_MAGFIELDLINES_H
@@ -0,0 +1,65 @@
+//
+//  magfieldlog.h
+//  cMag
+//
+//  Leveled, rate limited logging that is safe to call from the query path.
+//  Messages are formatted into a ring owned by the calling thread and
+//  written out by a background thread, so logging never takes the stdio
+//  lock on the caller's thread.
+//
+
+#ifndef CMAG_MAGFIELDLOG_H
+#define CMAG_MAGFIELDLOG_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+//compile with -DCMAG_LOG_DEBUG=0 to remove the LOG_DEBUG calls entirely.
+//When 1 (the default) they are compiled in but only emitted if the
+//runtime level is LOG_LEVEL_DEBUG.
+#ifndef CMAG_LOG_DEBUG
+#define CMAG_LOG_DEBUG 1
+#endif
+
+//messages per thread held for the flusher; more than this are dropped
+#define CMAG_LOG_RING_SIZE 128
+
+//longest message kept, including the terminating null
+#define CMAG_LOG_MESSAGE_SIZE 256
+
+//each thread may log a burst of this many messages, then this many per second
+#define CMAG_LOG_BURST 50
+#define CMAG_LOG_RATE 10
+
+//how often the flusher wakes up, in ms
+#define CMAG_LOG_FLUSH_MS 100
+
+//the levels, most severe first
+typedef enum {LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG} LogLevel;
+
+//the runtime level; messages less severe than this are skipped
+extern volatile int logLevel;
+
+#define LOG_AT(level, ...) \
+  do { if ((level) <= logLevel) logMessage((level), __VA_ARGS__); } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+
+#if CMAG_LOG_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+//external prototypes
+extern void logMessage(LogLevel, const char *, ...) __attribute__((format(printf, 2, 3)));
+extern void setLogLevel(LogLevel);
+extern LogLevel getLogLevel(void);
+extern void setLogStream(FILE *);
+extern void flushLog(void);
+extern unsigned long long getLogDropped(void);
+extern char *logUnitTest(void);
+
+#endif //CMAG_MAGFIELDLOG_H
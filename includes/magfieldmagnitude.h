@@ -0,0 +1,28 @@
+//
+//  magfieldmagnitude.h
+//  cMag
+//
+//  An optional grid of |B|, one float per grid point, and a fast path for
+//  callers that only need the magnitude of the field: renderers, metrics
+//  and step size heuristics.
+//
+
+#ifndef CMAG_MAGFIELDMAGNITUDE_H
+#define CMAG_MAGFIELDMAGNITUDE_H
+
+#include "magfield.h"
+
+//external prototypes
+extern void setMagnitudeGrids(bool);
+extern bool getMagnitudeGrids(void);
+extern bool buildMagnitudeGrid(MagneticFieldPtr);
+extern void freeMagnitudeGrid(MagneticFieldPtr);
+extern double getFieldMagnitude(double, double, double, MagneticFieldPtr);
+extern void getFieldMagnitudes(double *, const double *, const double *, const double *, size_t,
+                               MagneticFieldPtr);
+extern double getCompositeFieldMagnitude(double, double, double, MagneticFieldPtr, MagneticFieldPtr);
+extern double getProbeFieldMagnitude(double, double, double, FieldProbePtr);
+extern double getCompositeProbeFieldMagnitude(double, double, double, FieldProbePtr, FieldProbePtr);
+extern char *magnitudeUnitTest(void);
+
+#endif //CMAG_MAGFIELDMAGNITUDE_H
@@ -0,0 +1,53 @@
+//
+//  magfieldmem.h
+//  cMag
+//
+//  Allocation of the large per-map arrays (field values and derived
+//  grids) with huge page backing, so random lookups do not miss the TLB
+//  on nearly every access.
+//
+
+#ifndef CMAG_MAGFIELDMEM_H
+#define CMAG_MAGFIELDMEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+//arrays smaller than this are not worth a huge page
+#define CMAG_HUGE_PAGE_MIN (1024 * 1024)
+
+#define CMAG_PAGE_2M (2UL * 1024 * 1024)
+#define CMAG_PAGE_1G (1024UL * 1024 * 1024)
+
+//how to back a large array. Each policy falls back to the next
+//smaller one if the system cannot provide the pages.
+typedef enum {
+    PAGES_DEFAULT,     //ordinary 4 KiB pages
+    PAGES_TRANSPARENT, //2 MiB aligned with madvise(MADV_HUGEPAGE), the default
+    PAGES_HUGE_2M,     //MAP_HUGETLB with 2 MiB pages
+    PAGES_HUGE_1G      //MAP_HUGETLB with 1 GiB pages
+} PagePolicy;
+
+//what an allocation actually got
+typedef struct fieldarrayinfo {
+    void *base;           //the start of the allocation
+    size_t bytes;         //bytes requested
+    size_t mappedBytes;   //bytes reserved, after rounding to the page size
+    PagePolicy requested; //the policy in force when allocated
+    PagePolicy obtained;  //the policy that succeeded
+    size_t hugeBytes;     //bytes of the array currently backed by huge pages
+    bool mapped;          //a mapping of its own, so it can be given a memory policy
+} FieldArrayInfo;
+
+//external prototypes
+extern void setPagePolicy(PagePolicy);
+extern PagePolicy getPagePolicy(void);
+extern const char *pagePolicyName(PagePolicy);
+extern void *allocFieldArray(size_t);
+extern void freeFieldArray(void *);
+extern bool getFieldArrayInfo(const void *, FieldArrayInfo *);
+extern void printFieldArrayInfo(const void *, FILE *);
+extern char *memUnitTest(void);
+
+#endif //CMAG_MAGFIELDMEM_H
@@ -0,0 +1,27 @@
+//
+//  magfieldnuma.h
+//  cMag
+//
+//  Replication of the read-only field values across NUMA nodes, so that
+//  threads on every socket read their corner values from local memory.
+//
+
+#ifndef CMAG_MAGFIELDNUMA_H
+#define CMAG_MAGFIELDNUMA_H
+
+#include "magfield.h"
+
+//the most NUMA nodes we will replicate to
+#define CMAG_MAX_NUMA_NODES 64
+
+//external prototypes
+extern int numaNodeCount(void);
+extern int currentNumaNode(void);
+extern void setNumaReplication(bool);
+extern bool getNumaReplication(void);
+extern bool replicateFieldMap(MagneticFieldPtr);
+extern void freeReplicas(MagneticFieldPtr);
+extern FieldValuePtr localFieldValues(MagneticFieldPtr);
+extern char *numaUnitTest(void);
+
+#endif //CMAG_MAGFIELDNUMA_H
@@ -0,0 +1,63 @@
+//
+//  magfieldpyramid.h
+//  cMag
+//
+//  A min/max pyramid over a field map: the extremes of |B| and a bound on
+//  its gradient for blocks of cells, and for blocks of blocks up to the
+//  whole map. Used for step size control in swimmers and for "where is
+//  the field above X" queries, without scanning the field values.
+//
+
+#ifndef CMAG_MAGFIELDPYRAMID_H
+#define CMAG_MAGFIELDPYRAMID_H
+
+#include "magfield.h"
+
+//cells per side of the blocks at the base of a pyramid
+#define CMAG_PYRAMID_BLOCK 2
+
+//enough levels for any grid
+#define CMAG_PYRAMID_MAX_LEVELS 32
+
+//the summary of a block, or of a query region
+typedef struct fieldextrema {
+    float minField;    //the smallest |B| at a grid point, kG
+    float maxField;    //the largest |B| anywhere, kG
+    float maxGradient; //a bound on the magnitude of the gradient of B, kG/cm
+} FieldExtrema;
+
+//a region found by findFieldRegions, in the coordinates of the map grid
+typedef struct fieldregion {
+    double phiMin, phiMax; //degrees
+    double rhoMin, rhoMax; //cm
+    double zMin, zMax;     //cm
+    FieldExtrema extrema;  //scaled by the map's scale factor
+} FieldRegion;
+
+//the pyramid. Level 0 has a node per block of CMAG_PYRAMID_BLOCK cells
+//per side, and each level above halves every dimension, up to one node.
+//Nodes are stored level by level, phi slowest and z fastest
+typedef struct fieldpyramid {
+    int numLevels;
+    unsigned int cells[3];                          //cells of the map in phi, rho and z
+    unsigned int dims[CMAG_PYRAMID_MAX_LEVELS][3];  //nodes of each level
+    size_t offsets[CMAG_PYRAMID_MAX_LEVELS];        //first node of each level
+    size_t numNodes;
+    FieldExtrema *nodes;
+} FieldPyramid;
+
+//the node of a region found by findFieldRegions
+typedef void (*FieldRegionCallback)(const FieldRegion *, void *);
+
+//external prototypes
+extern void setFieldPyramids(bool);
+extern bool getFieldPyramids(void);
+extern bool buildFieldPyramid(MagneticFieldPtr, int);
+extern void freeFieldPyramid(MagneticFieldPtr);
+extern bool getGridExtrema(MagneticFieldPtr, double, double, double, double, double, double, FieldExtrema *);
+extern bool getFieldExtrema(MagneticFieldPtr, const double *, const double *, FieldExtrema *);
+extern double safeStepLength(MagneticFieldPtr, double, double, double, double, double);
+extern int findFieldRegions(MagneticFieldPtr, double, int, FieldRegionCallback, void *);
+extern char *pyramidUnitTest(void);
+
+#endif //CMAG_MAGFIELDPYRAMID_H
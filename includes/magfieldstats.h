@@ -0,0 +1,70 @@
+//
+//  magfieldstats.h
+//  cMag
+//
+//  Optional per-thread counters for the field query path.
+//
+
+#ifndef CMAG_MAGFIELDSTATS_H
+#define CMAG_MAGFIELDSTATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+//compile with -DCMAG_STATS=1 to turn on the query counters.
+//When 0 (the default) the STATS_INC macro compiles to nothing.
+#ifndef CMAG_STATS
+#define CMAG_STATS 0
+#endif
+
+//counters live in slots padded to this size so threads never share a line
+#define CMAG_CACHE_LINE 64
+
+//the slots for threads alive at the same time. A thread's slot is freed
+//when it exits, its counts kept. Threads beyond this number share one more
+//slot, counting into it atomically.
+#define CMAG_MAX_STATS_SLOTS 256
+
+typedef struct fieldstats *FieldStatsPtr;
+
+//the counters for one thread (or the aggregate over all threads)
+typedef struct fieldstats {
+    unsigned long long calls;           //calls to getFieldValue
+    unsigned long long cellHits;        //queries answered by the cached cell
+    unsigned long long cellResets;      //queries that required a cell reset
+    unsigned long long outOfBounds;     //queries outside the grid (zero field)
+    unsigned long long symmetricFlips;  //symmetric torus reflections
+    unsigned long long sectorRotations; //symmetric torus sector rotations
+    unsigned long long badIndices;      //cell resets that found no grid index
+} FieldStats;
+
+//the calling thread's slot, NULL until the first counted query, and
+//whether it is the shared slot
+extern _Thread_local FieldStatsPtr threadStatsPtr;
+extern _Thread_local bool threadStatsShared;
+
+//count one, whether or not the counters are compiled in
+#define STATS_COUNT(counter) \
+  do { \
+    FieldStatsPtr statsPtr_ = threadStatsPtr ? threadStatsPtr : claimStatsSlot(); \
+    if (threadStatsShared) { \
+      __atomic_fetch_add(&(statsPtr_->counter), 1, __ATOMIC_RELAXED); \
+    } \
+    else { \
+      statsPtr_->counter++; \
+    } \
+  } while (0)
+
+#if CMAG_STATS
+#define STATS_INC(counter) STATS_COUNT(counter)
+#else
+#define STATS_INC(counter) do { } while (0)
+#endif
+
+//external prototypes
+extern FieldStatsPtr claimStatsSlot(void);
+extern void getFieldStats(FieldStatsPtr);
+extern void resetFieldStats(void);
+extern char *statsUnitTest(void);
+
+#endif //CMAG_MAGFIELDSTATS_H
@@ -0,0 +1,70 @@
+//
+//  magfieldtrace.h
+//  cMag
+//
+//  Recording of field queries to a compact binary trace, and
+//  deterministic replay of such a trace against any field map.
+//
+
+#ifndef CMAG_MAGFIELDTRACE_H
+#define CMAG_MAGFIELDTRACE_H
+
+#include "magfield.h"
+
+//the trace file begins with this word (in the byte order of the recording machine)
+#define TRACEMAGICWORD 0x63547263
+#define TRACEVERSION 1
+
+//records per thread buffer (16 bytes each)
+#define TRACEBUFFERSIZE 8192
+
+//the field id of a trace record. Torus and solenoid match FieldType.
+#define TRACE_TORUS 0
+#define TRACE_SOLENOID 1
+#define TRACE_COMPOSITE 2
+
+typedef struct tracerecord *TraceRecordPtr;
+typedef struct replayresult *ReplayResultPtr;
+
+//the header of a trace file
+typedef struct traceheader {
+    unsigned int magicWord;  //TRACEMAGICWORD
+    unsigned int version;    //TRACEVERSION
+    unsigned int recordSize; //sizeof(TraceRecord)
+    unsigned int reserved;   //reserved
+} TraceHeader;
+
+//one recorded query
+typedef struct tracerecord {
+    float x;              //the x coordinate in cm
+    float y;              //the y coordinate in cm
+    float z;              //the z coordinate in cm
+    unsigned int fieldId; //TRACE_TORUS, TRACE_SOLENOID or TRACE_COMPOSITE
+} TraceRecord;
+
+//the outcome of replaying a trace
+typedef struct replayresult {
+    unsigned long numQueries;  //number of queries replayed
+    unsigned long numSkipped;  //queries whose field was not supplied
+    double seconds;            //wall time of the replay loop
+    double nsPerQuery;         //average time per query in ns
+    long long cacheMisses;     //hardware cache misses, or -1 if unavailable
+    double checksum;           //sum of the field magnitudes, to compare runs
+} ReplayResult;
+
+//nonzero while a recording is active (checked in the query path)
+extern volatile int traceRecording;
+
+//external prototypes
+extern bool startTraceRecording(const char *);
+extern void stopTraceRecording(void);
+extern void traceRecord(double, double, double, unsigned int);
+extern bool replayTrace(const char *, MagneticFieldPtr, MagneticFieldPtr, ReplayResultPtr);
+extern void printReplayResult(ReplayResultPtr, FILE *);
+extern char *traceUnitTest(void);
+
+//record a query if a recording is active
+#define TRACE_QUERY(x, y, z, id) \
+  do { if (traceRecording) traceRecord((x), (y), (z), (id)); } while (0)
+
+#endif //CMAG_MAGFIELDTRACE_H
@@ -21,8 +21,8 @@ extern const char *fieldUnits(MagneticFieldPtr);
 extern const char *lengthUnits(MagneticFieldPtr);
 extern double fieldMagnitude(FieldValue *);
 extern void printFieldSummary(MagneticFieldPtr, FILE *);
+extern void printFieldStats(FILE *);
 extern void printFieldValue(FieldValue *, FILE *);
-extern MagneticFieldPtr createFieldMap(void);
 extern void freeFieldMap(MagneticFieldPtr);
 extern int randomInt(int, int);
 extern double randomDouble(double, double);
@@ -38,8 +38,13 @@ extern char *conversionUnitTest();
 int binarySearch(double *, int, int, double);
 int descBinarySearch(double *, int, int, double);
 extern char *binarySearchUnitTest();
+extern char *workersUnitTest();
 extern int sign(double);
+extern unsigned int crc32c(unsigned int, const void *, size_t);
+extern bool fieldMapSize(FieldMapHeaderPtr, size_t *, size_t *);
 extern void sortArray(double *, int);
+extern int numWorkers(int, size_t);
+extern void runWorkers(void *(*)(void *), void *, size_t, int);
 extern double relativePhi(double);
 extern int getSector(double);
 
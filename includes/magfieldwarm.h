@@ -0,0 +1,48 @@
+//
+//  magfieldwarm.h
+//  cMag
+//
+//  Warming a field map before the first query, and measuring how long
+//  queries take to reach steady state from a cold start.
+//
+
+#ifndef CMAG_MAGFIELDWARM_H
+#define CMAG_MAGFIELDWARM_H
+
+#include "magfield.h"
+
+//what warmField touches; combine with |
+#define WARM_PAGES   0x1 //every page of the values the calling thread's probes read
+#define WARM_DERIVED 0x2 //the coordinate grids and any NUMA replicas
+#define WARM_QUERIES 0x4 //a burst of queries, to warm the query code itself
+#define WARM_ALL     (WARM_PAGES | WARM_DERIVED | WARM_QUERIES)
+
+//the most threads used to touch pages
+#define CMAG_WARM_THREADS 8
+
+//queries made by WARM_QUERIES
+#define CMAG_WARM_QUERIES 4096
+
+//queries are at steady state once the median of a window of this many
+//is within CMAG_STEADY_FACTOR of the steady state median
+#define CMAG_STEADY_WINDOW 64
+#define CMAG_STEADY_FACTOR 1.5
+
+//the latency of the first queries after a cold start
+typedef struct coldstartprofile {
+    int numQueries;        //queries timed
+    double firstQueryNs;   //latency of the very first query
+    double worstNs;        //the slowest query
+    double steadyNs;       //median latency over the second half of the queries
+    int queriesToSteady;   //queries made before reaching steady state
+    double timeToSteadyNs; //total time of those queries
+} ColdStartProfile;
+
+//external prototypes
+extern bool warmField(MagneticFieldPtr, int);
+extern bool warmFieldRegion(MagneticFieldPtr, int, double, double, double, double, double, double);
+extern bool profileColdStart(FieldProbePtr, const double *, const double *, const double *, int, ColdStartProfile *);
+extern void printColdStartProfile(const ColdStartProfile *, FILE *);
+extern char *warmUnitTest(void);
+
+#endif //CMAG_MAGFIELDWARM_H
@@ -13,6 +13,9 @@
 
 typedef struct grid *GridPtr;
 
+//room for any grid string (see gridString)
+#define GRIDSTRLEN 128
+
 extern enum Algorithm {INTERPOLATION, NEAREST_NEIGHBOR} fieldAlgorithm;
 
 /**
@@ -29,7 +32,9 @@ typedef struct grid {
 
 //external prototypes
 extern GridPtr createGrid(const char*, double, double, unsigned int);
+extern void initGrid(GridPtr, char *, double *, double, double, unsigned int);
 extern char *gridStr(GridPtr);
+extern char *gridString(GridPtr, char *, size_t);
 extern double valueAtIndex(GridPtr, int);
 extern char *gridUnitTest(void);
 extern int getIndex(const GridPtr, const double);
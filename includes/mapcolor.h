@@ -5,6 +5,9 @@
 #ifndef CMAG_MAPCOLOR_H
 #define CMAG_MAPCOLOR_H
 
+#include <stdlib.h>
+#include <stdbool.h>
+
 typedef struct colormap *ColorMapPtr;
 
 typedef struct colormap {
@@ -12,12 +15,26 @@ typedef struct colormap {
     char *tooSmallColor; //for values < min value
     char *tooBigColor; //for values > max value
 
-    double values[74]; //n+1 descending ordered values
-    char *colors[73]; //n colors of map
+    double *values; //n+1 descending ordered values
+    char **colors; //n colors of map
+
+    //derived by the map, for lookups
+    unsigned int *packed; //0xrrggbb of too big, the n colors, then too small
+    int numBins; //bins of the lookup table, 0 to binary search instead
+    double binScale; //bins per unit of value, from values[n]
+    unsigned int *binCounts; //thresholds in higher bins, per bin
+    double *binThresholds; //the threshold in each bin, or -HUGE_VAL
+    bool owned; //false for the shared default map
 } ColorMap;
 
 //external ptototypes
 extern char *getColor(ColorMapPtr, double);
+extern int getColorIndex(ColorMapPtr, double);
+extern void getColorRGB(ColorMapPtr, double, unsigned char *);
+extern void colorize(ColorMapPtr, const double *, size_t, unsigned char *);
 
 extern ColorMapPtr defaultColorMap();
+extern ColorMapPtr readColorMap(const char *);
+extern void freeColorMap(ColorMapPtr);
+extern char *colorMapUnitTest(void);
 #endif //CMAG_MAPCOLOR_H
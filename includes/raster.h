@@ -0,0 +1,29 @@
+//
+//  raster.h
+//  cMag
+//
+//  A small raster image writer with no external dependencies: binary PPM,
+//  and PNG with a built-in deflate encoder. Used to draw field slices as
+//  one image rather than one svg rectangle per pixel.
+//
+
+#ifndef CMAG_RASTER_H
+#define CMAG_RASTER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+//the length of the base64 encoding of n bytes, without a terminator
+#define BASE64_LENGTH(n) (4 * (((n) + 2) / 3))
+
+//external prototypes
+extern unsigned char *encodePNG(const unsigned char *, int, int, size_t *);
+extern bool writePNG(const char *, const unsigned char *, int, int);
+extern bool writePPM(const char *, const unsigned char *, int, int);
+extern bool writeRaster(const char *, const unsigned char *, int, int);
+extern unsigned int rasterCrc32(unsigned int, const void *, size_t);
+extern unsigned int rasterAdler32(unsigned int, const void *, size_t);
+extern size_t base64Encode(char *, const unsigned char *, size_t);
+extern char *rasterUnitTest(void);
+
+#endif //CMAG_RASTER_H
@@ -1,7 +1,8 @@
 //
 // This mini svg creation package was  adopted from onewritten by Chris Webb
 // which is available at https://github.com/CodeDrome/svg-library-c
-// We did modify it to write to the file as it goes, which made it way faster.
+// We did modify it to write to the file as it goes, through a buffer of its
+// own and without printf, which made it way faster.
 //
 
 #ifndef CMAGDEVEL_SVG_H
@@ -12,11 +13,16 @@
 #include<stdio.h>
 #include<math.h>
 
+//the text buffered before a write
+#define SVG_BUFFER_SIZE 65536
+
 typedef struct svg {
     FILE *fd;
     int height;
     int width;
     bool finalized;
+    size_t length;                 //the characters in the buffer
+    char buffer[SVG_BUFFER_SIZE];
 } svg;
 
 //external prototypes
@@ -26,8 +32,16 @@ void svgEnd(svg*);
 void svgCircle(svg* psvg, char* stroke, int strokewidth, char* fill, int r, int cx, int cy);
 void svgLine(svg* psvg, char* stroke, int strokewidth, int x1, int y1, int x2, int y2);
 void svgRectangle(svg* psvg, int width, int height, int x, int y, char* fill, char* stroke, int strokewidth, int radiusx, int radiusy);
+void svgRectangles(svg* psvg, int num, const int* x, const int* y, const int* width, const int* height,
+                   char* fill, char* stroke, int strokewidth);
+void svgPolylines(svg* psvg, char* stroke, int strokewidth, int numLines, const int* lengths,
+                  const int* x, const int* y);
+void svgFinePolylines(svg* psvg, char* stroke, int strokewidth, int numLines, const int* lengths,
+                      const double* x, const double* y);
 void svgFill(svg* psvg, char* fill);
+bool svgImage(svg* psvg, int width, int height, int x, int y, const unsigned char* rgb, int cols, int rows);
 void svgText(svg* psvg, int x, int y, char* fontfamily, int fontsize, char* fill, char* stroke, char* text);
 void svgRotatedText(svg* psvg, int x, int y, char* fontfamily, int fontsize, char* fill, char* stroke, int angle, char* text);
 void svgEllipse(svg* psvg, int cx, int cy, int rx, int ry, char* fill, char* stroke, int strokewidth);
+char *svgUnitTest(void);
 #endif //CMAGDEVEL_SVG_H
@@ -0,0 +1,511 @@
+//
+//  accuracy.c
+//  cMag
+//
+//  Accuracy versus speed of every evaluation mode across map resolutions.
+//  Synthetic maps are generated at each resolution and evaluated on a fixed
+//  point set against a reference: the analytic field, or (with -ref dense)
+//  the interpolated map of the highest resolution. For each field the max
+//  and RMS error and the time per query are reported, and the modes that
+//  no other mode beats on both error and speed are marked as the Pareto
+//  front. The magnitude grid mode interpolates a grid of |B| and is scored
+//  on the error of |B| alone. The exit status is nonzero if the error fails
+//  to shrink as the resolution grows, if interpolation is less accurate
+//  than nearest neighbor, or if the magnitude grid's error of |B| exceeds
+//  MAGNITUDEBOUND times the vector error of interpolation, so the harness
+//  can gate changes to the evaluation code.
+//
+//  usage: cMagAccuracy workDir [-res r1,r2,...] [-n points] [-ref analytic|dense] [-o results.json]
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "magfield.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldgen.h"
+#include "magfieldmagnitude.h"
+
+#define MAXRESOLUTIONS 16
+
+//relative slack allowed before a growing error counts as a regression
+#define ERRORSLACK 0.05
+
+//the magnitude grid's RMS error of |B| may be at most this many times the
+//RMS vector error of interpolation at the same resolution. Both are second
+//order, and the error of |B| from interpolating the vector is never larger
+//than the vector error, so only a broken grid comes close
+#define MAGNITUDEBOUND 1.5
+
+//keeps the timed loop from being optimized away
+static volatile double sink;
+
+//the evaluation modes: an algorithm over the stored float map, or over
+//its grid of |B|
+typedef struct evalmode {
+    const char *name;
+    enum Algorithm algorithm;
+    bool magnitudeGrid;
+} EvalMode;
+
+static EvalMode modes[] = {
+        {"interpolation", INTERPOLATION, false},
+        {"nearest_neighbor", NEAREST_NEIGHBOR, false},
+        {"magnitude_grid", INTERPOLATION, true},
+};
+#define NUMMODES ARRAYSIZE(modes)
+
+//the fields, by synthetic file name and analytic source
+typedef struct accuracycase {
+    const char *name;
+    const char *fileName;
+    FieldType type;
+} AccuracyCase;
+
+static AccuracyCase cases[] = {
+        {"solenoid", SYNTHETIC_SOLENOID, SOLENOID},
+        {"symmetric_torus", SYNTHETIC_SYMMETRIC_TORUS, TORUS},
+        {"full_torus", SYNTHETIC_FULL_TORUS, TORUS},
+};
+#define NUMCASES ARRAYSIZE(cases)
+
+//one row of the table
+typedef struct accuracyrow {
+    int caseIndex;
+    double resolution;
+    int modeIndex;
+    double megabytes;    //size of the stored values (or magnitudes)
+    double nsPerQuery;
+    double maxError;     //kG
+    double rmsError;     //kG
+    double relRmsError;  //RMS error over the RMS reference magnitude
+    bool pareto;
+} AccuracyRow;
+
+//local prototypes
+static int parseResolutions(const char *, double *);
+static int compareDoubles(const void *, const void *);
+static void makePoints(MagneticFieldPtr, int, double *, double *, double *);
+static void referenceValues(AccuracyCase *, MagneticFieldPtr, int, double *, double *, double *, FieldValuePtr);
+static bool measure(MagneticFieldPtr, int, double *, double *, double *, FieldValuePtr, bool, AccuracyRow *);
+static void markPareto(AccuracyRow *, int);
+static int checkRegressions(AccuracyRow *, int);
+static double nowSeconds(void);
+
+/**
+ * The main method of the accuracy application.
+ */
+int main(int argc, const char * argv[]) {
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s workDir [-res r1,r2,...] [-n points] [-ref analytic|dense] [-o results.json]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const char *workDir = argv[1];
+    const char *outPath = "accuracy_results.json";
+    const char *resList = "0.25,0.5,1";
+    int numPoints = 200000;
+    bool denseReference = false;
+
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "-res") == 0) && (i + 1 < argc)) {
+            resList = argv[++i];
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            numPoints = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-ref") == 0) && (i + 1 < argc)) {
+            denseReference = (strcmp(argv[++i], "dense") == 0);
+        }
+        else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)) {
+            outPath = argv[++i];
+        }
+        else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    double resolutions[MAXRESOLUTIONS];
+    int numResolutions = parseResolutions(resList, resolutions);
+    if ((numResolutions < 1) || (denseReference && (numResolutions < 2)) || (numPoints < 1)) {
+        fprintf(stderr, "\ncMag ERROR need positive resolutions (two or more for a dense reference) and points\n");
+        return 1;
+    }
+
+    //the densest map is the reference rather than a row of the table
+    int numTested = denseReference ? numResolutions - 1 : numResolutions;
+
+    //one directory of synthetic maps per resolution
+    char dirs[MAXRESOLUTIONS][512];
+    mkdir(workDir, 0755);
+    for (int r = 0; r < numResolutions; r++) {
+        snprintf(dirs[r], sizeof(dirs[r]), "%s/res%g", workDir, resolutions[r]);
+        mkdir(dirs[r], 0755);
+        if (!generateSyntheticMaps(dirs[r], resolutions[r], false, 4)) {
+            return 1;
+        }
+    }
+
+    double *x = (double *) malloc(numPoints * sizeof(double));
+    double *y = (double *) malloc(numPoints * sizeof(double));
+    double *z = (double *) malloc(numPoints * sizeof(double));
+    FieldValuePtr reference = (FieldValuePtr) malloc(numPoints * sizeof(FieldValue));
+
+    int numRows = NUMCASES * numTested * NUMMODES;
+    AccuracyRow *rows = (AccuracyRow *) calloc(numRows, sizeof(AccuracyRow));
+    int row = 0;
+    enum Algorithm saveAlgorithm = getAlgorithm();
+
+    for (size_t c = 0; c < NUMCASES; c++) {
+        char path[sizeof(dirs[0]) + 64];
+
+        //the points are drawn inside the densest grid, which all resolutions share
+        snprintf(path, sizeof(path), "%s/%s", dirs[numResolutions - 1], cases[c].fileName);
+        MagneticFieldPtr dense = (cases[c].type == TORUS) ? initializeTorus(path) : initializeSolenoid(path);
+        if (dense == NULL) {
+            return 1;
+        }
+
+        srand48(12345); //same points every run
+        makePoints(dense, numPoints, x, y, z);
+        referenceValues(cases + c, denseReference ? dense : NULL, numPoints, x, y, z, reference);
+        freeFieldMap(dense);
+
+        for (int r = 0; r < numTested; r++) {
+            snprintf(path, sizeof(path), "%s/%s", dirs[r], cases[c].fileName);
+            MagneticFieldPtr fieldPtr = (cases[c].type == TORUS) ? initializeTorus(path) : initializeSolenoid(path);
+            if (fieldPtr == NULL) {
+                return 1;
+            }
+
+            for (size_t m = 0; m < NUMMODES; m++) {
+                setAlgorithm(modes[m].algorithm);
+                rows[row].caseIndex = c;
+                rows[row].resolution = resolutions[r];
+                rows[row].modeIndex = m;
+                rows[row].megabytes = fieldPtr->numValues *
+                                      (modes[m].magnitudeGrid ? sizeof(float) : sizeof(FieldValue)) /
+                                      (1024.0 * 1024.0);
+                if (!measure(fieldPtr, numPoints, x, y, z, reference, modes[m].magnitudeGrid, rows + row)) {
+                    return 1;
+                }
+                row++;
+            }
+            freeFieldMap(fieldPtr);
+        }
+    }
+
+    setAlgorithm(saveAlgorithm);
+    markPareto(rows, numRows);
+
+    FILE *out = fopen(outPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open accuracy output: [%s]\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"accuracy\": \"cMag\",\n  \"points\": %d,\n  \"reference\": \"%s\",\n  \"results\": [",
+            numPoints, denseReference ? "dense" : "analytic");
+    fprintf(stdout, "\nreference: %s, %d points\n", denseReference ? "densest map" : "analytic field", numPoints);
+    fprintf(stdout, "\n%-16s %6s %-17s %9s %9s %11s %11s %9s %7s\n",
+            "field", "res", "mode", "MB", "ns/query", "max (kG)", "rms (kG)", "rel rms", "pareto");
+
+    for (int i = 0; i < numRows; i++) {
+        AccuracyRow *rp = rows + i;
+        const char *field = cases[rp->caseIndex].name;
+        const char *mode = modes[rp->modeIndex].name;
+
+        fprintf(stdout, "%-16s %6.3g %-17s %9.2f %9.2f %11.4e %11.4e %8.4f%% %7s\n", field, rp->resolution, mode,
+                rp->megabytes, rp->nsPerQuery, rp->maxError, rp->rmsError, 100 * rp->relRmsError,
+                rp->pareto ? "*" : "");
+
+        fprintf(out, "%s\n    {\"field\": \"%s\", \"resolution\": %g, \"mode\": \"%s\", \"megabytes\": %.3f, "
+                     "\"ns_per_query\": %.3f, \"max_error\": %.6e, \"rms_error\": %.6e, \"rel_rms_error\": %.6e, "
+                     "\"pareto\": %s}",
+                (i == 0) ? "" : ",", field, rp->resolution, mode, rp->megabytes, rp->nsPerQuery,
+                rp->maxError, rp->rmsError, rp->relRmsError, rp->pareto ? "true" : "false");
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    fprintf(stdout, "\naccuracy results written to [%s]\n", outPath);
+
+    int numRegressions = checkRegressions(rows, numRows);
+
+    free(x);
+    free(y);
+    free(z);
+    free(reference);
+    free(rows);
+    return (numRegressions == 0) ? 0 : 1;
+}
+
+/**
+ * Evaluate a map on the points, comparing with the reference values.
+ * @param fieldPtr the map.
+ * @param num the number of points.
+ * @param x the x coordinates.
+ * @param y the y coordinates.
+ * @param z the z coordinates.
+ * @param reference the reference values.
+ * @param magnitudeGrid if true, compare only |B|, interpolated from a magnitude grid built for the map.
+ * @param rp upon return holds the errors and the time per query.
+ * @return false if the magnitude grid could not be built.
+ */
+static bool measure(MagneticFieldPtr fieldPtr, int num, double *x, double *y, double *z,
+                    FieldValuePtr reference, bool magnitudeGrid, AccuracyRow *rp) {
+
+    if (magnitudeGrid && !buildMagnitudeGrid(fieldPtr)) {
+        return false;
+    }
+
+    FieldProbePtr probe = createProbe(fieldPtr);
+    FieldValue fieldValue;
+
+    double maxError = 0;
+    double sumSquares = 0;
+    double sumRefSquares = 0;
+
+    for (int i = 0; i < num; i++) {
+        double e2;
+        if (magnitudeGrid) {
+            double d = getProbeFieldMagnitude(x[i], y[i], z[i], probe) - fieldMagnitude(reference + i);
+            e2 = d * d;
+        }
+        else {
+            getProbeFieldValue(&fieldValue, x[i], y[i], z[i], probe);
+            double d1 = fieldValue.b1 - reference[i].b1;
+            double d2 = fieldValue.b2 - reference[i].b2;
+            double d3 = fieldValue.b3 - reference[i].b3;
+            e2 = d1 * d1 + d2 * d2 + d3 * d3;
+        }
+
+        maxError = fmax(maxError, sqrt(e2));
+        sumSquares += e2;
+        sumRefSquares += fieldMagnitude(reference + i) * fieldMagnitude(reference + i);
+    }
+
+    //timed separately so the error bookkeeping is not charged to the query
+    double checksum = 0;
+    double start = nowSeconds();
+    if (magnitudeGrid) {
+        for (int i = 0; i < num; i++) {
+            checksum += getProbeFieldMagnitude(x[i], y[i], z[i], probe);
+        }
+    }
+    else {
+        for (int i = 0; i < num; i++) {
+            getProbeFieldValue(&fieldValue, x[i], y[i], z[i], probe);
+            checksum += fieldValue.b1;
+        }
+    }
+    double seconds = nowSeconds() - start;
+    sink = checksum;
+
+    freeProbe(probe);
+    if (magnitudeGrid) {
+        freeMagnitudeGrid(fieldPtr);
+    }
+
+    rp->maxError = maxError;
+    rp->rmsError = sqrt(sumSquares / num);
+    rp->relRmsError = (sumRefSquares > 0) ? sqrt(sumSquares / sumRefSquares) : 0;
+    rp->nsPerQuery = 1.0e9 * seconds / num;
+    return true;
+}
+
+/**
+ * Fill the reference values for the points.
+ * @param accuracyCase the field.
+ * @param dense the dense map to interpolate, or NULL to use the analytic field.
+ * @param num the number of points.
+ * @param x the x coordinates.
+ * @param y the y coordinates.
+ * @param z the z coordinates.
+ * @param reference upon return, the reference values.
+ */
+static void referenceValues(AccuracyCase *accuracyCase, MagneticFieldPtr dense, int num,
+                            double *x, double *y, double *z, FieldValuePtr reference) {
+    if (dense != NULL) {
+        setAlgorithm(INTERPOLATION);
+        FieldProbePtr probe = createProbe(dense);
+        for (int i = 0; i < num; i++) {
+            getProbeFieldValue(reference + i, x[i], y[i], z[i], probe);
+        }
+        freeProbe(probe);
+        return;
+    }
+
+    for (int i = 0; i < num; i++) {
+        if (accuracyCase->type == TORUS) {
+            analyticTorusField(reference + i, x[i], y[i], z[i]);
+        }
+        else {
+            analyticSolenoidField(reference + i, x[i], y[i], z[i]);
+        }
+    }
+}
+
+/**
+ * Random points, uniform in phi, rho and z, inside the grid of a map.
+ * @param fieldPtr the map.
+ * @param num the number of points.
+ * @param x upon return, the x coordinates.
+ * @param y upon return, the y coordinates.
+ * @param z upon return, the z coordinates.
+ */
+static void makePoints(MagneticFieldPtr fieldPtr, int num, double *x, double *y, double *z) {
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+
+    for (int i = 0; i < num; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(rhoGrid->minVal, rhoGrid->maxVal);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+        z[i] = randomDouble(zGrid->minVal, zGrid->maxVal);
+    }
+}
+
+/**
+ * Mark the rows on the Pareto front of each field: those for which no
+ * other row of the same field is at least as fast and as accurate, and
+ * strictly better in one of the two.
+ * @param rows the rows.
+ * @param num the number of rows.
+ */
+static void markPareto(AccuracyRow *rows, int num) {
+    for (int i = 0; i < num; i++) {
+        rows[i].pareto = true;
+        for (int j = 0; j < num; j++) {
+            if ((j == i) || (rows[j].caseIndex != rows[i].caseIndex)) {
+                continue;
+            }
+            bool noWorse = (rows[j].nsPerQuery <= rows[i].nsPerQuery) && (rows[j].rmsError <= rows[i].rmsError);
+            bool better = (rows[j].nsPerQuery < rows[i].nsPerQuery) || (rows[j].rmsError < rows[i].rmsError);
+            if (noWorse && better) {
+                rows[i].pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Check that, for each field, the RMS error of every mode does not grow
+ * with resolution, that interpolation is no less accurate than nearest
+ * neighbor at the same resolution, and that the magnitude grid is within
+ * its bound of interpolation. Rows are in field, resolution (ascending),
+ * mode order.
+ * @param rows the rows.
+ * @param num the number of rows.
+ * @return the number of regressions found, each reported on stderr.
+ */
+static int checkRegressions(AccuracyRow *rows, int num) {
+    int count = 0;
+
+    for (int i = 0; i < num; i++) {
+        AccuracyRow *rp = rows + i;
+
+        //the same field and mode at the next lower resolution
+        if (((size_t) i >= NUMMODES) && (rows[i - NUMMODES].caseIndex == rp->caseIndex)) {
+            AccuracyRow *lower = rows + i - NUMMODES;
+            if (rp->rmsError > (1 + ERRORSLACK) * lower->rmsError) {
+                fprintf(stderr, "\ncMag ERROR accuracy regression: %s %s rms error %g at resolution %g "
+                                "exceeds %g at resolution %g\n", cases[rp->caseIndex].name,
+                        modes[rp->modeIndex].name, rp->rmsError, rp->resolution, lower->rmsError, lower->resolution);
+                count++;
+            }
+        }
+    }
+
+    for (int i = 0; i < num; i++) {
+        AccuracyRow *rp = rows + i;
+        if (modes[rp->modeIndex].algorithm != NEAREST_NEIGHBOR) {
+            continue;
+        }
+        for (int j = 0; j < num; j++) {
+            AccuracyRow *other = rows + j;
+            if ((other->caseIndex == rp->caseIndex) && (other->resolution == rp->resolution) &&
+                (modes[other->modeIndex].algorithm == INTERPOLATION) && !modes[other->modeIndex].magnitudeGrid &&
+                (other->rmsError > (1 + ERRORSLACK) * rp->rmsError)) {
+                fprintf(stderr, "\ncMag ERROR accuracy regression: %s interpolation rms error %g exceeds "
+                                "nearest neighbor %g at resolution %g\n", cases[rp->caseIndex].name,
+                        other->rmsError, rp->rmsError, rp->resolution);
+                count++;
+            }
+        }
+    }
+
+    for (int i = 0; i < num; i++) {
+        AccuracyRow *rp = rows + i;
+        if (!modes[rp->modeIndex].magnitudeGrid) {
+            continue;
+        }
+        for (int j = 0; j < num; j++) {
+            AccuracyRow *other = rows + j;
+            if ((other->caseIndex == rp->caseIndex) && (other->resolution == rp->resolution) &&
+                (modes[other->modeIndex].algorithm == INTERPOLATION) && !modes[other->modeIndex].magnitudeGrid &&
+                (rp->rmsError > MAGNITUDEBOUND * other->rmsError)) {
+                fprintf(stderr, "\ncMag ERROR accuracy regression: %s magnitude grid rms error %g exceeds "
+                                "%g times interpolation %g at resolution %g\n", cases[rp->caseIndex].name,
+                        rp->rmsError, MAGNITUDEBOUND, other->rmsError, rp->resolution);
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Parse a comma separated list of resolutions, sorted ascending.
+ * @param list the list.
+ * @param resolutions upon return, the resolutions.
+ * @return the number of resolutions, or -1 if one is not positive.
+ */
+static int parseResolutions(const char *list, double *resolutions) {
+    int num = 0;
+    const char *s = list;
+
+    while ((*s != '\0') && (num < MAXRESOLUTIONS)) {
+        char *end;
+        double r = strtod(s, &end);
+        if ((end == s) || (r <= 0)) {
+            return -1;
+        }
+        resolutions[num++] = r;
+        s = (*end == ',') ? end + 1 : end;
+        if ((*end != ',') && (*end != '\0')) {
+            return -1;
+        }
+    }
+
+    qsort(resolutions, num, sizeof(double), compareDoubles);
+    return num;
+}
+
+/**
+ * Comparator for sorting doubles ascending.
+ */
+static int compareDoubles(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * A monotonic clock.
+ * @return the time in seconds.
+ */
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
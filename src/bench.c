@@ -0,0 +1,561 @@
+//
+//  bench.c
+//  cMag
+//
+//  Throughput benchmark of the field evaluation paths. Every combination
+//  of field (solenoid, symmetric torus, full torus, composite), access
+//  pattern and algorithm is timed for 1, 2, 4, ... threads, each thread
+//  using its own probes, with the scalar (one call per point) and, for
+//  single fields, the batch (getProbeFieldValues) kernel. Results are
+//  written as JSON. Finally each map is read afresh, with and without
+//  warmField, and the latency of the first queries is profiled.
+//
+//  usage: cMagBench [dataDir] [-n points] [-t maxThreads] [-o results.json]
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "magfield.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldgen.h"
+#include "magfieldwarm.h"
+
+//the access patterns
+typedef enum {RANDOM, TRAJECTORY, SECTOR_SWEEP, OUTSIDE} Pattern;
+static const char *patternNames[] = {"random", "trajectory", "sector_sweep", "outside"};
+#define NUMPATTERNS 4
+
+//trajectory step size in cm
+#define TRAJECTORYSTEP 0.5
+
+//points per call of the batch kernel
+#define BATCHSIZE 256
+
+//queries profiled after a cold start
+#define COLDPOINTS 20000
+
+//a field, or pair of fields, to benchmark
+typedef struct benchcase {
+    const char *name;
+    MagneticFieldPtr field1;
+    MagneticFieldPtr field2; //NULL unless composite
+} BenchCase;
+
+//the points of one pattern
+typedef struct pointset {
+    int num;
+    double *x;
+    double *y;
+    double *z;
+} PointSet;
+
+//holds the threads of a case until all of them have been created, then
+//lets them run, or tells them to quit if one could not be created
+typedef struct benchgate {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool open;
+    bool cancelled;
+    pthread_barrier_t barrier;  //lines the threads up to start the clock
+} BenchGate;
+
+//what one benchmark thread needs, and what it reports back
+typedef struct benchthread {
+    BenchCase *benchCase;
+    PointSet *points;
+    int offset;             //where in the point set this thread starts
+    bool batch;             //use the batch kernel
+    BenchGate *gate;
+    double seconds;         //time to evaluate all the points
+    double checksum;        //sum of the components, keeps the work honest
+} BenchThread;
+
+//local prototypes
+static void makePoints(PointSet *, Pattern, BenchCase *, int);
+static void freePoints(PointSet *);
+static void *benchLoop(void *);
+static bool runCase(BenchCase *, PointSet *, int, bool, double *, double *, double *);
+static double nowSeconds(void);
+static void caseBounds(BenchCase *, double *, double *, double *, double *);
+static bool coldStart(const char *, const char *, bool, bool, FILE *, bool);
+
+/**
+ * The main method of the benchmark application.
+ */
+int main(int argc, const char * argv[]) {
+
+    const char *dataDir = NULL;
+    const char *outPath = "bench_results.json";
+    int numPoints = 1000000;
+    int maxThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            numPoints = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) {
+            maxThreads = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)) {
+            outPath = argv[++i];
+        }
+        else {
+            dataDir = argv[i];
+        }
+    }
+
+    if (maxThreads < 1) {
+        maxThreads = 1;
+    }
+
+    char homeDir[255];
+    if (dataDir == NULL) {
+        snprintf(homeDir, sizeof(homeDir), "%s/magfield", getenv("HOME"));
+        dataDir = homeDir;
+    }
+
+    char solenoidPath[512];
+    char torusSymmetricPath[512];
+    char torusFullPath[512];
+    mapFilePath(solenoidPath, dataDir, "Symm_solenoid_r601_phi1_z1201_13June2018.dat", SYNTHETIC_SOLENOID);
+    mapFilePath(torusSymmetricPath, dataDir, "Symm_torus_r2501_phi16_z251_24Apr2018.dat", SYNTHETIC_SYMMETRIC_TORUS);
+    mapFilePath(torusFullPath, dataDir, "Full_torus_r251_phi181_z251_03March2020.dat", SYNTHETIC_FULL_TORUS);
+
+    MagneticFieldPtr solenoid = initializeSolenoid(solenoidPath);
+    MagneticFieldPtr symmetricTorus = initializeTorus(torusSymmetricPath);
+    MagneticFieldPtr fullTorus = initializeTorus(torusFullPath);
+
+    if ((solenoid == NULL) || (symmetricTorus == NULL) || (fullTorus == NULL)) {
+        fprintf(stderr, "\ncMag ERROR could not load the benchmark maps from [%s]\n", dataDir);
+        return 1;
+    }
+
+    BenchCase cases[] = {
+            {"solenoid", solenoid, NULL},
+            {"symmetric_torus", symmetricTorus, NULL},
+            {"full_torus", fullTorus, NULL},
+            {"composite", symmetricTorus, solenoid},
+    };
+    int numCases = ARRAYSIZE(cases);
+
+    //1, 2, 4, ... and finally the max
+    int threadCounts[32];
+    int numCounts = 0;
+    for (int nt = 1; (nt < maxThreads) && (numCounts < 31); nt *= 2) {
+        threadCounts[numCounts++] = nt;
+    }
+    threadCounts[numCounts++] = maxThreads;
+
+    enum Algorithm algorithms[] = {INTERPOLATION, NEAREST_NEIGHBOR};
+    const char *algorithmNames[] = {"interpolation", "nearest_neighbor"};
+
+    FILE *out = fopen(outPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open benchmark output: [%s]\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"benchmark\": \"cMag\",\n  \"points\": %d,\n  \"results\": [", numPoints);
+    fprintf(stdout, "\n\n%-16s %-13s %-17s %-7s %7s %10s %14s\n",
+            "field", "pattern", "algorithm", "kernel", "threads", "ns/call", "calls/s");
+
+    srand48(12345); //fixed seed so runs are comparable
+    bool first = true;
+
+    for (int c = 0; c < numCases; c++) {
+        for (int p = 0; p < NUMPATTERNS; p++) {
+            PointSet points;
+            makePoints(&points, (Pattern) p, cases + c, numPoints);
+
+            for (int a = 0; a < 2; a++) {
+                setAlgorithm(algorithms[a]);
+
+                //the batch kernel is single field only
+                int numKernels = (cases[c].field2 == NULL) ? 2 : 1;
+
+                for (int k = 0; k < numKernels; k++) {
+                    const char *kernel = (k == 0) ? "scalar" : "batch";
+
+                    for (int t = 0; t < numCounts; t++) {
+                        int nt = threadCounts[t];
+                        double callsPerSecond, nsPerCall, checksum;
+                        if (!runCase(cases + c, &points, nt, k == 1, &callsPerSecond, &nsPerCall, &checksum)) {
+                            return 1;
+                        }
+
+                        fprintf(stdout, "%-16s %-13s %-17s %-7s %7d %10.2f %14.0f\n", cases[c].name,
+                                patternNames[p], algorithmNames[a], kernel, nt, nsPerCall, callsPerSecond);
+
+                        fprintf(out, "%s\n    {\"field\": \"%s\", \"pattern\": \"%s\", \"algorithm\": \"%s\", "
+                                     "\"kernel\": \"%s\", \"threads\": %d, \"ns_per_call\": %.3f, "
+                                     "\"calls_per_s\": %.1f, \"checksum\": %.6e}",
+                                first ? "" : ",", cases[c].name, patternNames[p], algorithmNames[a],
+                                kernel, nt, nsPerCall, callsPerSecond, checksum);
+                        first = false;
+                    }
+                }
+            }
+            freePoints(&points);
+        }
+    }
+
+    //cold starts, in the order the maps would be read
+    fprintf(out, "\n  ],\n  \"cold_start\": [");
+    const char *coldNames[] = {"solenoid", "symmetric_torus", "full_torus"};
+    const char *coldPaths[] = {solenoidPath, torusSymmetricPath, torusFullPath};
+    setAlgorithm(INTERPOLATION);
+    first = true;
+
+    for (int c = 0; c < 3; c++) {
+        for (int w = 0; w < 2; w++) {
+            if (!coldStart(coldNames[c], coldPaths[c], c > 0, w == 1, out, first)) {
+                return 1;
+            }
+            first = false;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    fprintf(stdout, "\nbenchmark results written to [%s]\n", outPath);
+    return 0;
+}
+
+/**
+ * Time one case with a given number of threads. Each thread evaluates
+ * every point, starting at a different offset.
+ * @param benchCase the field(s) to evaluate.
+ * @param points the points.
+ * @param numThreads the number of threads.
+ * @param batch if true use the batch kernel.
+ * @param callsPerSecond upon success, the aggregate number of calls per second.
+ * @param nsPerCall upon success, the average time of one call in one thread.
+ * @param checksum upon success, the sum of the components over all threads.
+ * @return false if not all the threads could be created.
+ */
+static bool runCase(BenchCase *benchCase, PointSet *points, int numThreads, bool batch,
+                    double *callsPerSecond, double *nsPerCall, double *checksum) {
+
+    pthread_t threads[numThreads];
+    BenchThread work[numThreads];
+    BenchGate gate = {.open = false, .cancelled = false};
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.changed, NULL);
+
+    int numStarted = 0;
+    for (int i = 0; i < numThreads; i++) {
+        work[i].benchCase = benchCase;
+        work[i].points = points;
+        work[i].offset = (int) (((long) i * points->num) / numThreads);
+        work[i].gate = &gate;
+        work[i].batch = batch;
+        if (pthread_create(threads + i, NULL, benchLoop, work + i) != 0) {
+            break;
+        }
+        numStarted++;
+    }
+
+    //the barrier only counts threads that exist, so it is set up once they all do
+    pthread_mutex_lock(&gate.lock);
+    gate.cancelled = (numStarted < numThreads);
+    if (!gate.cancelled) {
+        pthread_barrier_init(&gate.barrier, NULL, numThreads);
+    }
+    gate.open = true;
+    pthread_cond_broadcast(&gate.changed);
+    pthread_mutex_unlock(&gate.lock);
+
+    double maxSeconds = 0;
+    double sumSeconds = 0;
+    *checksum = 0;
+
+    for (int i = 0; i < numStarted; i++) {
+        pthread_join(threads[i], NULL);
+        sumSeconds += work[i].seconds;
+        *checksum += work[i].checksum;
+        if (work[i].seconds > maxSeconds) {
+            maxSeconds = work[i].seconds;
+        }
+    }
+
+    if (!gate.cancelled) {
+        pthread_barrier_destroy(&gate.barrier);
+    }
+    pthread_cond_destroy(&gate.changed);
+    pthread_mutex_destroy(&gate.lock);
+
+    if (gate.cancelled) {
+        fprintf(stderr, "\ncMag ERROR could only create %d of %d benchmark threads for %s\n",
+                numStarted, numThreads, benchCase->name);
+        return false;
+    }
+
+    double totalCalls = (double) numThreads * points->num;
+    *nsPerCall = 1.0e9 * sumSeconds / totalCalls;
+    *callsPerSecond = totalCalls / maxSeconds;
+    return true;
+}
+
+/**
+ * The body of a benchmark thread.
+ * @param arg the BenchThread.
+ * @return NULL.
+ */
+static void *benchLoop(void *arg) {
+    BenchThread *work = (BenchThread *) arg;
+    BenchCase *benchCase = work->benchCase;
+    PointSet *points = work->points;
+
+    FieldProbePtr probe1 = createProbe(benchCase->field1);
+    FieldProbePtr probe2 = (benchCase->field2 == NULL) ? NULL : createProbe(benchCase->field2);
+
+    FieldValue fieldValue;
+    double checksum = 0;
+
+    BenchGate *gate = work->gate;
+    pthread_mutex_lock(&gate->lock);
+    while (!gate->open) {
+        pthread_cond_wait(&gate->changed, &gate->lock);
+    }
+    bool cancelled = gate->cancelled;
+    pthread_mutex_unlock(&gate->lock);
+
+    if (cancelled) {
+        work->seconds = 0;
+        work->checksum = 0;
+        freeProbe(probe1);
+        freeProbe(probe2);
+        return NULL;
+    }
+
+    pthread_barrier_wait(&gate->barrier);
+    double start = nowSeconds();
+
+    int n = points->num;
+
+    if (work->batch) {
+        FieldValue values[BATCHSIZE];
+
+        //from the offset to the end, then from the start to the offset
+        int ranges[2][2] = {{work->offset, n}, {0, work->offset}};
+        for (int r = 0; r < 2; r++) {
+            for (int i = ranges[r][0]; i < ranges[r][1]; i += BATCHSIZE) {
+                int num = (ranges[r][1] - i < BATCHSIZE) ? ranges[r][1] - i : BATCHSIZE;
+                getProbeFieldValues(values, points->x + i, points->y + i, points->z + i, num, probe1);
+                for (int j = 0; j < num; j++) {
+                    checksum += values[j].b1 + values[j].b2 + values[j].b3;
+                }
+            }
+        }
+    }
+
+    for (int j = 0, i = work->offset; (j < n) && !work->batch; j++, i++) {
+        if (i == n) {
+            i = 0;
+        }
+        if (probe2 == NULL) {
+            getProbeFieldValue(&fieldValue, points->x[i], points->y[i], points->z[i], probe1);
+        }
+        else {
+            getCompositeProbeFieldValue(&fieldValue, points->x[i], points->y[i], points->z[i], probe1, probe2);
+        }
+        checksum += fieldValue.b1 + fieldValue.b2 + fieldValue.b3;
+    }
+
+    work->seconds = nowSeconds() - start;
+    work->checksum = checksum;
+
+    freeProbe(probe1);
+    freeProbe(probe2);
+    return NULL;
+}
+
+/**
+ * Read a map afresh, optionally warm it, and profile the first queries.
+ * The time to the first answer is the read, the warm-up and the first
+ * query together.
+ * @param name the name of the map, for the output.
+ * @param path the path to the map.
+ * @param torus true for a torus map.
+ * @param warmed if true, call warmField(WARM_ALL) before querying.
+ * @param out the JSON output.
+ * @param first true for the first JSON entry.
+ * @return true on success.
+ */
+static bool coldStart(const char *name, const char *path, bool torus, bool warmed, FILE *out, bool first) {
+    double start = nowSeconds();
+    MagneticFieldPtr fieldPtr = torus ? initializeTorus(path) : initializeSolenoid(path);
+    if (fieldPtr == NULL) {
+        return false;
+    }
+    double loaded = nowSeconds();
+
+    if (warmed) {
+        warmField(fieldPtr, WARM_ALL);
+    }
+    double ready = nowSeconds();
+
+    BenchCase benchCase = {name, fieldPtr, NULL};
+    PointSet points;
+    makePoints(&points, RANDOM, &benchCase, COLDPOINTS);
+
+    ColdStartProfile profile;
+    FieldProbePtr probe = createProbe(fieldPtr);
+    bool ok = profileColdStart(probe, points.x, points.y, points.z, points.num, &profile);
+    freeProbe(probe);
+    freePoints(&points);
+    freeFieldMap(fieldPtr);
+
+    if (!ok) {
+        return false;
+    }
+
+    double loadMs = 1.0e3 * (loaded - start);
+    double warmMs = 1.0e3 * (ready - loaded);
+    double firstAnswerMs = loadMs + warmMs + 1.0e-6 * profile.firstQueryNs;
+
+    fprintf(stdout, "\ncold start %-16s %-6s load %.1f ms, warm %.1f ms, first answer %.1f ms\n",
+            name, warmed ? "warm" : "cold", loadMs, warmMs, firstAnswerMs);
+    printColdStartProfile(&profile, stdout);
+
+    fprintf(out, "%s\n    {\"field\": \"%s\", \"warmed\": %s, \"load_ms\": %.3f, \"warm_ms\": %.3f, "
+                 "\"first_answer_ms\": %.3f, \"first_query_ns\": %.1f, \"worst_ns\": %.1f, "
+                 "\"steady_ns\": %.2f, \"queries_to_steady\": %d, \"time_to_steady_us\": %.3f}",
+            first ? "" : ",", name, warmed ? "true" : "false", loadMs, warmMs, firstAnswerMs,
+            profile.firstQueryNs, profile.worstNs, profile.steadyNs, profile.queriesToSteady,
+            1.0e-3 * profile.timeToSteadyNs);
+    return true;
+}
+
+/**
+ * Generate the points for an access pattern.
+ * @param points upon return holds the points.
+ * @param pattern the access pattern.
+ * @param benchCase the field(s), used for the grid boundaries.
+ * @param num the number of points.
+ */
+static void makePoints(PointSet *points, Pattern pattern, BenchCase *benchCase, int num) {
+    points->num = num;
+    points->x = (double *) malloc(num * sizeof(double));
+    points->y = (double *) malloc(num * sizeof(double));
+    points->z = (double *) malloc(num * sizeof(double));
+
+    double rhoMin, rhoMax, zMin, zMax;
+    caseBounds(benchCase, &rhoMin, &rhoMax, &zMin, &zMax);
+
+    //for trajectories
+    double dx = 0, dy = 0, dz = 0;
+    double x = 0, y = 0, z = 0;
+    bool newTrack = true;
+
+    //for sector sweeps
+    double sweepRho = 0, sweepZ = 0;
+
+    for (int i = 0; i < num; i++) {
+        double phi, rho;
+
+        switch (pattern) {
+            case RANDOM:
+                phi = randomDouble(0, 360);
+                rho = randomDouble(rhoMin, rhoMax);
+                cylindricalToCartesian(&x, &y, phi, rho);
+                z = randomDouble(zMin, zMax);
+                break;
+
+            case TRAJECTORY: //straight tracks from the target in small steps
+                if (newTrack) {
+                    double theta = toRadians(randomDouble(5, 40));
+                    phi = toRadians(randomDouble(0, 360));
+                    dx = TRAJECTORYSTEP * sin(theta) * cos(phi);
+                    dy = TRAJECTORYSTEP * sin(theta) * sin(phi);
+                    dz = TRAJECTORYSTEP * cos(theta);
+                    x = 0;
+                    y = 0;
+                    z = (zMin > 0) ? zMin : 0;
+                    newTrack = false;
+                }
+                x += dx;
+                y += dy;
+                z += dz;
+                newTrack = (hypot(x, y) > rhoMax) || (z > zMax);
+                break;
+
+            case SECTOR_SWEEP: //full turns in phi at a fixed rho and z
+                if ((i % 360) == 0) {
+                    sweepRho = randomDouble(rhoMin, rhoMax);
+                    sweepZ = randomDouble(zMin, zMax);
+                }
+                cylindricalToCartesian(&x, &y, (i % 360) + 0.5, sweepRho);
+                z = sweepZ;
+                break;
+
+            case OUTSIDE:
+                phi = randomDouble(0, 360);
+                if (drand48() < 0.5) {
+                    rho = randomDouble(rhoMax + 1, 2 * rhoMax);
+                    z = randomDouble(zMin, zMax);
+                }
+                else {
+                    rho = randomDouble(rhoMin, rhoMax);
+                    z = randomDouble(zMax + 1, zMax + 500);
+                }
+                cylindricalToCartesian(&x, &y, phi, rho);
+                break;
+        }
+
+        points->x[i] = x;
+        points->y[i] = y;
+        points->z[i] = z;
+    }
+}
+
+/**
+ * Get the combined rho and z extent of the field(s) of a case.
+ * @param benchCase the case.
+ * @param rhoMin upon return, the min rho.
+ * @param rhoMax upon return, the max rho.
+ * @param zMin upon return, the min z.
+ * @param zMax upon return, the max z.
+ */
+static void caseBounds(BenchCase *benchCase, double *rhoMin, double *rhoMax, double *zMin, double *zMax) {
+    MagneticFieldPtr f1 = benchCase->field1;
+    MagneticFieldPtr f2 = benchCase->field2;
+
+    *rhoMin = f1->rhoGridPtr->minVal;
+    *rhoMax = f1->rhoGridPtr->maxVal;
+    *zMin = f1->zGridPtr->minVal;
+    *zMax = f1->zGridPtr->maxVal;
+
+    if (f2 != NULL) {
+        *rhoMin = fmin(*rhoMin, f2->rhoGridPtr->minVal);
+        *rhoMax = fmax(*rhoMax, f2->rhoGridPtr->maxVal);
+        *zMin = fmin(*zMin, f2->zGridPtr->minVal);
+        *zMax = fmax(*zMax, f2->zGridPtr->maxVal);
+    }
+}
+
+/**
+ * Free the points of a pattern.
+ * @param points the points.
+ */
+static void freePoints(PointSet *points) {
+    free(points->x);
+    free(points->y);
+    free(points->z);
+}
+
+/**
+ * A monotonic clock.
+ * @return the time in seconds.
+ */
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
@@ -0,0 +1,606 @@
+//
+//  contour.c
+//  cMag
+//
+//  Iso-lines of a grid of values by marching squares. Each cell of four
+//  grid points crossed by the level gets one or two segments between
+//  points interpolated on its edges, saddles being resolved by the mean of
+//  the corners. A crossing point belongs to one edge, and an edge to at
+//  most two cells, so the segments are joined into polylines by following
+//  the edges they share. Lines are then thinned with Douglas-Peucker.
+//
+
+#include "contour.h"
+#include "munittest.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+//cells across a block, whose range is kept
+#define CONTOUR_BLOCK 16
+
+//the edges of a cell
+#define TOP    0
+#define RIGHT  1
+#define BOTTOM 2
+#define LEFT   3
+
+//the edges joined by the segment of each case of the corners at or above
+//the level, top left 8, top right 4, bottom right 2, bottom left 1. The
+//saddles, 5 and 10, are resolved separately.
+static const signed char caseEdges[16][2] = {
+        {-1, -1}, {LEFT, BOTTOM}, {BOTTOM, RIGHT}, {LEFT, RIGHT},
+        {TOP, RIGHT}, {-1, -1}, {TOP, BOTTOM}, {LEFT, TOP},
+        {LEFT, TOP}, {TOP, BOTTOM}, {-1, -1}, {TOP, RIGHT},
+        {LEFT, RIGHT}, {BOTTOM, RIGHT}, {LEFT, BOTTOM}, {-1, -1}};
+
+//local prototypes
+static bool addSegment(ContourLinesPtr, int, int, int);
+static bool addPoint(ContourLinesPtr, const double *, int, int, int, double);
+static bool joinSegments(ContourLinesPtr, const double *, int, int, int, double);
+static bool simplifyLines(ContourLinesPtr, double);
+static double crossing(double, double, double);
+
+/**
+ * Create an empty set of contour lines, to be reused from level to level.
+ * @return the lines, to be freed with freeContourLines, or NULL if out of memory.
+ */
+ContourLinesPtr createContourLines() {
+    ContourLinesPtr lines = (ContourLinesPtr) calloc(1, sizeof(ContourLines));
+    if (lines == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory for contour lines\n");
+    }
+    return lines;
+}
+
+/**
+ * Free a set of contour lines.
+ * @param lines the lines, may be NULL.
+ */
+void freeContourLines(ContourLinesPtr lines) {
+    if (lines == NULL) {
+        return;
+    }
+    free(lines->lengths);
+    free(lines->x);
+    free(lines->y);
+    free(lines->blockMin);
+    free(lines->blockMax);
+    free(lines->edgeSegments);
+    free(lines->segments);
+    free(lines->used);
+    free(lines);
+}
+
+/**
+ * Set the grid to trace, and find the range of each block of cells. The
+ * grid is not copied, and must not change while it is traced.
+ * @param lines the lines to trace with.
+ * @param grid the values, row by row.
+ * @param numCols the grid points in a row.
+ * @param numRows the rows.
+ * @return false if out of memory.
+ */
+bool setContourGrid(ContourLinesPtr lines, const double *grid, int numCols, int numRows) {
+    lines->grid = grid;
+    lines->numCols = numCols;
+    lines->numRows = numRows;
+    lines->numLines = 0;
+    lines->numPoints = 0;
+    if ((numCols < 2) || (numRows < 2)) {
+        lines->blockCols = 0;
+        return true;
+    }
+
+    //horizontal edges first, row by row, then the vertical ones
+    int numEdges = numRows * (numCols - 1) + (numRows - 1) * numCols;
+    if (numEdges > lines->numEdges) {
+        free(lines->edgeSegments);
+        lines->edgeSegments = (int *) malloc(2 * (size_t) numEdges * sizeof(int));
+        if (lines->edgeSegments == NULL) {
+            lines->numEdges = 0;
+            lines->blockCols = 0;
+            fprintf(stderr, "\ncMag ERROR out of memory for the %d edges of a contour grid\n", numEdges);
+            return false;
+        }
+        memset(lines->edgeSegments, 0xff, 2 * (size_t) numEdges * sizeof(int));
+        lines->numEdges = numEdges;
+    }
+
+    int blockCols = (numCols - 1 + CONTOUR_BLOCK - 1) / CONTOUR_BLOCK;
+    int numBlocks = blockCols * (numRows - 1);
+    if (numBlocks > lines->blockCapacity) {
+        free(lines->blockMin);
+        free(lines->blockMax);
+        lines->blockMin = (double *) malloc(numBlocks * sizeof(double));
+        lines->blockMax = (double *) malloc(numBlocks * sizeof(double));
+        if ((lines->blockMin == NULL) || (lines->blockMax == NULL)) {
+            lines->blockCapacity = 0;
+            lines->blockCols = 0;
+            fprintf(stderr, "\ncMag ERROR out of memory for the %d blocks of a contour grid\n", numBlocks);
+            return false;
+        }
+        lines->blockCapacity = numBlocks;
+    }
+    lines->blockCols = blockCols;
+
+    //a block spans its cells' corners, so neighbors share a column
+    for (int r = 0; r < numRows - 1; r++) {
+        for (int b = 0; b < blockCols; b++) {
+            int c0 = b * CONTOUR_BLOCK;
+            int c1 = (c0 + CONTOUR_BLOCK < numCols - 1) ? c0 + CONTOUR_BLOCK : numCols - 1;
+            double low = HUGE_VAL;
+            double high = -HUGE_VAL;
+            bool missing = false;
+            for (int i = r; i <= r + 1; i++) {
+                const double *value = grid + (size_t) i * numCols;
+                for (int c = c0; c <= c1; c++) {
+                    low = (value[c] < low) ? value[c] : low;
+                    high = (value[c] > high) ? value[c] : high;
+                    missing = missing || isnan(value[c]);
+                }
+            }
+            lines->blockMin[r * blockCols + b] = missing ? -HUGE_VAL : low;
+            lines->blockMax[r * blockCols + b] = high;
+        }
+    }
+    return true;
+}
+
+/**
+ * Trace the iso-lines of the grid set by setContourGrid at a level. Grid
+ * points at or above the level are inside, those below it or NaN outside.
+ * Blocks of cells all inside or all outside are skipped.
+ * @param lines upon return, the lines, replacing any traced before.
+ * @param level the value of the iso-lines.
+ * @param tolerance how far, in grid spacings, thinned lines may stray
+ * from the traced ones. 0 keeps every point.
+ * @return false if out of memory.
+ */
+bool traceContours(ContourLinesPtr lines, double level, double tolerance) {
+    lines->numLines = 0;
+    lines->numPoints = 0;
+    if (lines->blockCols == 0) {
+        return true;
+    }
+
+    const double *grid = lines->grid;
+    int numCols = lines->numCols;
+    int numRows = lines->numRows;
+    int numHorizontal = numRows * (numCols - 1);
+    int numSegments = 0;
+    bool added = true;
+    const double *row = grid;
+    for (int r = 0; added && (r < numRows - 1); r++, row += numCols) {
+        const double *next = row + numCols;
+        for (int b = 0; added && (b < lines->blockCols); b++) {
+            int block = r * lines->blockCols + b;
+            if ((lines->blockMax[block] < level) || (lines->blockMin[block] >= level)) {
+                continue;
+            }
+            int c0 = b * CONTOUR_BLOCK;
+            int c1 = (c0 + CONTOUR_BLOCK < numCols - 1) ? c0 + CONTOUR_BLOCK : numCols - 1;
+
+            //the right corners of one cell are the left corners of the next
+            int corners = ((row[c0] >= level) << 2) | ((next[c0] >= level) << 1);
+            for (int c = c0; added && (c < c1); c++) {
+                corners = ((corners & 4) << 1) | ((corners & 2) >> 1) |
+                          ((row[c + 1] >= level) << 2) | ((next[c + 1] >= level) << 1);
+                if ((corners == 0) || (corners == 15)) {
+                    continue;
+                }
+
+                int edges[4];
+                edges[TOP] = r * (numCols - 1) + c;
+                edges[BOTTOM] = edges[TOP] + numCols - 1;
+                edges[LEFT] = numHorizontal + r * numCols + c;
+                edges[RIGHT] = edges[LEFT] + 1;
+
+                if ((corners == 5) || (corners == 10)) {
+                    double mean = 0.25 * (row[c] + row[c + 1] + next[c] + next[c + 1]);
+                    bool linked = ((mean >= level) == (corners == 5));
+                    added = linked ?
+                            addSegment(lines, numSegments, edges[LEFT], edges[TOP]) :
+                            addSegment(lines, numSegments, edges[TOP], edges[RIGHT]);
+                    numSegments += added;
+                    added = added && (linked ?
+                            addSegment(lines, numSegments, edges[BOTTOM], edges[RIGHT]) :
+                            addSegment(lines, numSegments, edges[LEFT], edges[BOTTOM]));
+                    numSegments += added;
+                }
+                else {
+                    added = addSegment(lines, numSegments, edges[(int) caseEdges[corners][0]],
+                                       edges[(int) caseEdges[corners][1]]);
+                    numSegments += added;
+                }
+            }
+        }
+    }
+
+    bool joined = added && ((numSegments == 0) ||
+                            joinSegments(lines, grid, numCols, numHorizontal, numSegments, level));
+
+    //leave the edges clear for the next level
+    for (int s = 0; s < 2 * numSegments; s++) {
+        int edge = lines->segments[s];
+        lines->edgeSegments[2 * edge] = -1;
+        lines->edgeSegments[2 * edge + 1] = -1;
+    }
+
+    if (!joined) {
+        return false;
+    }
+    return (tolerance <= 0) || simplifyLines(lines, tolerance);
+}
+
+/**
+ * Record a segment and the edges it crosses.
+ * @param lines the lines being traced.
+ * @param segment the index of the segment.
+ * @param edge1 one edge.
+ * @param edge2 the other edge.
+ * @return false if out of memory.
+ */
+static bool addSegment(ContourLinesPtr lines, int segment, int edge1, int edge2) {
+    if (segment >= lines->segmentCapacity) {
+        int capacity = (lines->segmentCapacity < 1024) ? 1024 : 2 * lines->segmentCapacity;
+        int *segments = (int *) realloc(lines->segments, 2 * (size_t) capacity * sizeof(int));
+        if (segments == NULL) {
+            fprintf(stderr, "\ncMag ERROR out of memory for %d contour segments\n", capacity);
+            return false;
+        }
+        lines->segments = segments;
+        lines->segmentCapacity = capacity;
+    }
+
+    lines->segments[2 * segment] = edge1;
+    lines->segments[2 * segment + 1] = edge2;
+    int *slot = lines->edgeSegments + 2 * edge1;
+    slot[slot[0] >= 0] = segment;
+    slot = lines->edgeSegments + 2 * edge2;
+    slot[slot[0] >= 0] = segment;
+    return true;
+}
+
+/**
+ * Join the segments into lines, following the edges they share. Each line
+ * is followed back to a free end first, or all the way round if closed.
+ * @param lines the lines being traced.
+ * @param grid the values.
+ * @param numCols the grid points in a row.
+ * @param numHorizontal the number of horizontal edges.
+ * @param numSegments the number of segments.
+ * @param level the value of the iso-lines.
+ * @return false if out of memory.
+ */
+static bool joinSegments(ContourLinesPtr lines, const double *grid, int numCols, int numHorizontal,
+                         int numSegments, double level) {
+    free(lines->used);
+    lines->used = (unsigned char *) calloc(numSegments, 1);
+    if (lines->used == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory joining %d contour segments\n", numSegments);
+        return false;
+    }
+
+    const int *segments = lines->segments;
+    const int *edgeSegments = lines->edgeSegments;
+
+    for (int s = 0; s < numSegments; s++) {
+        if (lines->used[s]) {
+            continue;
+        }
+
+        //back to a free end, or round to s
+        int current = s;
+        int edge = segments[2 * s];
+        while (true) {
+            const int *slot = edgeSegments + 2 * edge;
+            int next = (slot[0] == current) ? slot[1] : slot[0];
+            if ((next < 0) || (next == s)) {
+                if (next == s) {
+                    current = s;
+                    edge = segments[2 * s];
+                }
+                break;
+            }
+            edge = (segments[2 * next] == edge) ? segments[2 * next + 1] : segments[2 * next];
+            current = next;
+        }
+
+        //then forward, a point per edge
+        if (lines->numLines >= lines->lineCapacity) {
+            int capacity = (lines->lineCapacity < 64) ? 64 : 2 * lines->lineCapacity;
+            int *lengths = (int *) realloc(lines->lengths, capacity * sizeof(int));
+            if (lengths == NULL) {
+                fprintf(stderr, "\ncMag ERROR out of memory for %d contour lines\n", capacity);
+                return false;
+            }
+            lines->lengths = lengths;
+            lines->lineCapacity = capacity;
+        }
+        int first = lines->numPoints;
+        if (!addPoint(lines, grid, numCols, numHorizontal, edge, level)) {
+            return false;
+        }
+        while (true) {
+            lines->used[current] = 1;
+            edge = (segments[2 * current] == edge) ? segments[2 * current + 1] : segments[2 * current];
+            if (!addPoint(lines, grid, numCols, numHorizontal, edge, level)) {
+                return false;
+            }
+            const int *slot = edgeSegments + 2 * edge;
+            int next = (slot[0] == current) ? slot[1] : slot[0];
+            if ((next < 0) || lines->used[next]) {
+                break;
+            }
+            current = next;
+        }
+        lines->lengths[lines->numLines++] = lines->numPoints - first;
+    }
+    return true;
+}
+
+/**
+ * Add the point where the level crosses an edge.
+ * @param lines the lines being traced.
+ * @param grid the values.
+ * @param numCols the grid points in a row.
+ * @param numHorizontal the number of horizontal edges.
+ * @param edge the edge.
+ * @param level the value of the iso-lines.
+ * @return false if out of memory.
+ */
+static bool addPoint(ContourLinesPtr lines, const double *grid, int numCols, int numHorizontal, int edge,
+                     double level) {
+    if (lines->numPoints >= lines->pointCapacity) {
+        int capacity = (lines->pointCapacity < 1024) ? 1024 : 2 * lines->pointCapacity;
+        double *x = (double *) realloc(lines->x, capacity * sizeof(double));
+        if (x != NULL) {
+            lines->x = x;
+        }
+        double *y = (double *) realloc(lines->y, capacity * sizeof(double));
+        if (y != NULL) {
+            lines->y = y;
+        }
+        if ((x == NULL) || (y == NULL)) {
+            fprintf(stderr, "\ncMag ERROR out of memory for %d contour points\n", capacity);
+            return false;
+        }
+        lines->pointCapacity = capacity;
+    }
+
+    int n = lines->numPoints++;
+    if (edge < numHorizontal) {
+        int r = edge / (numCols - 1);
+        int c = edge - r * (numCols - 1);
+        const double *p = grid + (size_t) r * numCols + c;
+        lines->x[n] = c + crossing(p[0], p[1], level);
+        lines->y[n] = r;
+    }
+    else {
+        edge -= numHorizontal;
+        int r = edge / numCols;
+        int c = edge - r * numCols;
+        const double *p = grid + (size_t) r * numCols + c;
+        lines->x[n] = c;
+        lines->y[n] = r + crossing(p[0], p[numCols], level);
+    }
+    return true;
+}
+
+/**
+ * Where the level crosses between two grid values, by linear interpolation.
+ * @param a the value at the start.
+ * @param b the value at the end.
+ * @param level the level.
+ * @return the fraction of the way from a to b, [0..1].
+ */
+static double crossing(double a, double b, double level) {
+    double t = (level - a) / (b - a);
+    if (!(t >= 0)) {
+        return 0;
+    }
+    return (t > 1) ? 1 : t;
+}
+
+/**
+ * Thin the traced lines with Douglas-Peucker: keep the ends of a line,
+ * then the point farthest from the chord between kept points if it is
+ * beyond the tolerance, and so on between the points kept.
+ * @param lines the traced lines, thinned in place.
+ * @param tolerance the largest distance of a dropped point from the thinned line.
+ * @return false if out of memory.
+ */
+static bool simplifyLines(ContourLinesPtr lines, double tolerance) {
+    if (lines->numPoints == 0) {
+        return true;
+    }
+    int *stack = (int *) malloc(2 * (size_t) lines->numPoints * sizeof(int));
+    unsigned char *keep = (unsigned char *) calloc(lines->numPoints, 1);
+    if ((stack == NULL) || (keep == NULL)) {
+        free(stack);
+        free(keep);
+        fprintf(stderr, "\ncMag ERROR out of memory thinning %d contour points\n", lines->numPoints);
+        return false;
+    }
+
+    double *x = lines->x;
+    double *y = lines->y;
+    double tolerance2 = tolerance * tolerance;
+    int read = 0;
+    int written = 0;
+
+    for (int line = 0; line < lines->numLines; line++) {
+        int first = read;
+        int last = read + lines->lengths[line] - 1;
+        keep[first] = 1;
+        keep[last] = 1;
+
+        int top = 0;
+        stack[top++] = first;
+        stack[top++] = last;
+        while (top > 0) {
+            int b = stack[--top];
+            int a = stack[--top];
+            double dx = x[b] - x[a];
+            double dy = y[b] - y[a];
+            double length2 = dx * dx + dy * dy;
+
+            //the squared distances from the chord, or from a if the chord
+            //is empty, as it is for a closed line
+            int farthest = -1;
+            double farthest2 = tolerance2;
+            for (int i = a + 1; i < b; i++) {
+                double ex = x[i] - x[a];
+                double ey = y[i] - y[a];
+                double cross = dx * ey - dy * ex;
+                double distance2 = (length2 > 0) ? cross * cross / length2 : ex * ex + ey * ey;
+                if (distance2 > farthest2) {
+                    farthest = i;
+                    farthest2 = distance2;
+                }
+            }
+            if (farthest >= 0) {
+                keep[farthest] = 1;
+                stack[top++] = a;
+                stack[top++] = farthest;
+                stack[top++] = farthest;
+                stack[top++] = b;
+            }
+        }
+
+        int start = written;
+        for (int i = first; i <= last; i++) {
+            if (keep[i]) {
+                x[written] = x[i];
+                y[written] = y[i];
+                written++;
+            }
+        }
+        lines->lengths[line] = written - start;
+        read = last + 1;
+    }
+    lines->numPoints = written;
+
+    free(stack);
+    free(keep);
+    return true;
+}
+
+/**
+ * Unit test for the contours.
+ * @return NULL if the test passes, or an error message.
+ */
+char *contourUnitTest() {
+    ContourLinesPtr lines = createContourLines();
+    mu_assert("Could not create contour lines", lines != NULL);
+
+    //a cone, whose iso-lines are circles about its center
+    int numCols = 61;
+    int numRows = 47;
+    double cx = 30.3;
+    double cy = 22.6;
+    double *grid = (double *) malloc((size_t) numCols * numRows * sizeof(double));
+    for (int r = 0; r < numRows; r++) {
+        for (int c = 0; c < numCols; c++) {
+            grid[r * numCols + c] = 100 - hypot(c - cx, r - cy);
+        }
+    }
+
+    int traced = 0;
+    mu_assert("Could not set the grid", setContourGrid(lines, grid, numCols, numRows));
+    for (int pass = 0; pass < 2; pass++) {
+        double tolerance = (pass == 0) ? 0 : 0.1;
+        mu_assert("Could not trace", traceContours(lines, 90, tolerance));
+        mu_assert("A circle should be one line", lines->numLines == 1);
+
+        int n = lines->lengths[0];
+        mu_assert("A circle should be closed",
+                  (lines->x[0] == lines->x[n - 1]) && (lines->y[0] == lines->y[n - 1]));
+        if (pass == 0) {
+            traced = n;
+            mu_assert("A traced circle has too few points", n > 60);
+        }
+        else {
+            mu_assert("A thinned circle has too many or too few points", (n > 12) && (3 * n < 2 * traced));
+        }
+
+        double worst = 0;
+        for (int i = 0; i < n; i++) {
+            double error = fabs(hypot(lines->x[i] - cx, lines->y[i] - cy) - 10);
+            worst = (error > worst) ? error : worst;
+        }
+        mu_assert("A circle point is off the circle", worst < 0.1);
+    }
+
+    //a circle crossing the top gives an open arc, ends on the border
+    mu_assert("Could not trace", traceContours(lines, 77, 0));
+    mu_assert("An arc should be one line", lines->numLines == 1);
+    int n = lines->lengths[0];
+    mu_assert("An arc should be open", (lines->x[0] != lines->x[n - 1]) || (lines->y[0] != lines->y[n - 1]));
+    bool onBorder = true;
+    int ends[2] = {0, n - 1};
+    for (int i = 0; i < 2; i++) {
+        double x = lines->x[ends[i]];
+        double y = lines->y[ends[i]];
+        onBorder = onBorder && ((x == 0) || (y == 0) || (x == numCols - 1) || (y == numRows - 1));
+    }
+    mu_assert("An arc should end on the border", onBorder);
+
+    //levels outside the values, and a flat grid, give no lines
+    mu_assert("Could not trace", traceContours(lines, 200, 0));
+    mu_assert("A level above the grid has lines", lines->numLines == 0);
+    mu_assert("Could not trace", traceContours(lines, -200, 0));
+    mu_assert("A level below the grid has lines", lines->numLines == 0);
+
+    //a saddle: two peaks, joined by a mean above the level, else apart
+    double saddle[4][4] = {{0, 0, 0, 0}, {0, 9, 1, 0}, {0, 1, 9, 0}, {0, 0, 0, 0}};
+    mu_assert("Could not trace", setContourGrid(lines, &saddle[0][0], 4, 4) && traceContours(lines, 4, 0));
+    mu_assert("Peaks with a high mean should be one line", lines->numLines == 1);
+    saddle[1][2] = saddle[2][1] = -7;
+    mu_assert("Could not trace", setContourGrid(lines, &saddle[0][0], 4, 4) && traceContours(lines, 4, 0));
+    mu_assert("Peaks with a low mean should be two lines", lines->numLines == 2);
+
+    //many bumps and a few holes: every crossed cell's segments used once,
+    //skipped blocks or not, and every line closed or on the border
+    for (int r = 0; r < numRows; r++) {
+        for (int c = 0; c < numCols; c++) {
+            grid[r * numCols + c] = (c < 20) ? sin(0.7 * c) * cos(0.9 * r) + 0.3 * sin(0.31 * c * r) : -1;
+        }
+    }
+    grid[5 * numCols + 7] = grid[30 * numCols + 12] = grid[40 * numCols + 50] = NAN;
+    int crossed = 0;
+    for (int r = 0; r < numRows - 1; r++) {
+        for (int c = 0; c < numCols - 1; c++) {
+            const double *p = grid + r * numCols + c;
+            int corners = ((p[0] >= 0.1) << 3) | ((p[1] >= 0.1) << 2) |
+                          ((p[numCols + 1] >= 0.1) << 1) | (p[numCols] >= 0.1);
+            crossed += ((corners == 5) || (corners == 10)) ? 2 : ((corners != 0) && (corners != 15));
+        }
+    }
+    mu_assert("Could not trace", setContourGrid(lines, grid, numCols, numRows) && traceContours(lines, 0.1, 0));
+    mu_assert("Segments are lost", lines->numPoints - lines->numLines == crossed);
+    int start = 0;
+    bool good = (lines->numLines > 10);
+    for (int line = 0; line < lines->numLines; line++) {
+        int last = start + lines->lengths[line] - 1;
+        bool closed = (lines->x[start] == lines->x[last]) && (lines->y[start] == lines->y[last]);
+        double x0 = lines->x[start], y0 = lines->y[start], x1 = lines->x[last], y1 = lines->y[last];
+        bool open = ((x0 == 0) || (y0 == 0) || (x0 == numCols - 1) || (y0 == numRows - 1)) &&
+                    ((x1 == 0) || (y1 == 0) || (x1 == numCols - 1) || (y1 == numRows - 1));
+        good = good && (lines->lengths[line] > 1) && (closed || open);
+        start = last + 1;
+    }
+    mu_assert("A line is neither closed nor ends on the border", good);
+    mu_assert("Points are lost", start == lines->numPoints);
+
+    traced = lines->numPoints;
+    mu_assert("Could not trace", traceContours(lines, 0.1, 0.25));
+    mu_assert("Thinning should keep the lines and drop points",
+              (lines->numPoints < traced) && (lines->numLines > 10));
+
+    free(grid);
+    freeContourLines(lines);
+    fprintf(stdout, "\nPASSED contourUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,37 @@
+//
+//  convert.c
+//  cMag
+//
+//  Converts a field map file (version 1 or 2) to the version 2 format:
+//  native byte order, 4 KiB aligned sections and CRC32C checksums.
+//
+//  usage: cMagConvert inputMap outputMap
+//
+
+#include <stdio.h>
+#include "magfieldio.h"
+
+/**
+ * The main method of the converter application.
+ */
+int main(int argc, const char * argv[]) {
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s inputMap outputMap\n", argv[0]);
+        return 1;
+    }
+
+    int version = getFileVersion(argv[1]);
+    if (version < 0) {
+        fprintf(stderr, "\ncMag ERROR not a field map file: [%s]\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(stdout, "Converting [%s] (version %d) to version %d [%s]\n", argv[1], version, FILEVERSION2, argv[2]);
+    if (!convertFieldMap(argv[1], argv[2])) {
+        return 1;
+    }
+
+    fprintf(stdout, "done.\n");
+    return 0;
+}
@@ -0,0 +1,64 @@
+//
+//  generate.c
+//  cMag
+//
+//  Writes a synthetic solenoid, symmetric torus and full torus map from
+//  the analytic fields, for machines that do not have the CLAS12 maps.
+//
+//  usage: cMagGenerate outDir [-res resolution] [-big] [-t threads]
+//  resolution scales the number of grid intervals of the production maps
+//  (default 1); -big writes big endian files like the JAVA maps.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "magfieldgen.h"
+
+/**
+ * The main method of the generator application.
+ */
+int main(int argc, const char * argv[]) {
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s outDir [-res resolution] [-big] [-t threads]\n", argv[0]);
+        return 1;
+    }
+
+    const char *outDir = argv[1];
+    double resolution = 1;
+    bool bigEndian = false;
+    int numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 2; i < argc; i++) {
+        if ((strcmp(argv[i], "-res") == 0) && (i + 1 < argc)) {
+            resolution = atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) {
+            numThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-big") == 0) {
+            bigEndian = true;
+        }
+        else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (resolution <= 0) {
+        fprintf(stderr, "the resolution must be positive\n");
+        return 1;
+    }
+
+    fprintf(stdout, "Generating synthetic maps in [%s] (resolution %-4.2f, %s endian, %d threads)\n",
+            outDir, resolution, bigEndian ? "big" : "native", numThreads);
+
+    if (!generateSyntheticMaps(outDir, resolution, bigEndian, numThreads)) {
+        return 1;
+    }
+
+    fprintf(stdout, "done.\n");
+    return 0;
+}
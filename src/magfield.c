@@ -6,11 +6,16 @@
 //
 
 #include "magfield.h"
+#include "magfieldio.h"
 #include "magfieldutil.h"
+#include "magfieldstats.h"
+#include "magfieldtrace.h"
+#include "magfieldlog.h"
 #include "munittest.h"
 #include "testdata.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 //used for unit testing only
@@ -23,9 +28,19 @@ enum Algorithm _algorithm = INTERPOLATION;
 static double cosSect[] = { NAN, 1, 0.5, -0.5, -1, -0.5, 0.5 };
 static double sinSect[] = { NAN, 0, ROOT3OVER2, ROOT3OVER2, 0, -ROOT3OVER2, -ROOT3OVER2 };
 
+//for the tilt of the sector frames, cos and sin of SECTOR_TILT
+#define COSTILT 0.9063077870366499
+#define SINTILT 0.42261826174069944
+
 //local prototypes
 static bool containedInCell3D(Cell3DPtr, double, double, double);
 static bool containedInCell2D(Cell2DPtr, double, double);
+static void fieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr, Cell3DPtr, Cell2DPtr);
+static void torusValue(FieldValuePtr, double, double, double, Cell3DPtr);
+static void solenoidValue(FieldValuePtr, double, double, double, Cell2DPtr);
+static void solenoidCylindrical(double *, double *, double, double, Cell2DPtr);
+static void cylindricalValue(FieldValuePtr, double, double, double, MagneticFieldPtr, Cell3DPtr, Cell2DPtr);
+static void sectorValue(FieldValuePtr, int, double, double, double, MagneticFieldPtr, Cell3DPtr, Cell2DPtr);
 
 //static void getFieldValueTorus(FieldValuePtr, double, double, double, MagneticFieldPtr);
 //static void getFieldValueSolenoid(FieldValuePtr, double, double, double, MagneticFieldPtr);
@@ -34,7 +49,7 @@ static void torusCalculate(FieldValuePtr,
                            double,
                            double,
                            double,
-                           MagneticFieldPtr);
+                           Cell3DPtr);
 
 
 /**
@@ -44,11 +59,19 @@ static void torusCalculate(FieldValuePtr,
 void setAlgorithm(enum Algorithm algorithm) {
     if (algorithm != _algorithm) {
         _algorithm = algorithm;
-        fprintf(stdout, "The algorithm for finding field values has been changed to: %s",
-                (_algorithm == INTERPOLATION) ? "INTERPOLATION" : "NEAREST_NEIGHBOR");
+        LOG_INFO("The algorithm for finding field values has been changed to: %s",
+                 (_algorithm == INTERPOLATION) ? "INTERPOLATION" : "NEAREST_NEIGHBOR");
     }
 }
 
+/**
+ * Get the global option for the algorithm used to extract field values.
+ * @return either INTERPOLATION or NEAREST_NEIGHBOR.
+ */
+enum Algorithm getAlgorithm() {
+    return _algorithm;
+}
+
 /**
  * This checks whether the given point is within the boundary of the field. This is so the methods
  * that retrieve a field value can short-circuit to zero. Note ther is no phi parameter, because
@@ -134,8 +157,10 @@ bool containedInCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
  * @param phi the azimuthal angle, in degrees
  * @param rho the transverse coordinate, in cm.
  * @param z the z coordinate, in cm.
+ * @return false if a coordinate had no grid index, in which case the
+ * cell is left unchanged.
  */
-void resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
+bool resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
     MagneticFieldPtr fieldPtr = cell3DPtr->fieldPtr;
     GridPtr phiGrid = fieldPtr->phiGridPtr;
     GridPtr rhoGrid = fieldPtr->rhoGridPtr;
@@ -145,25 +170,28 @@ void resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
     int nPhi, nRho, nZ;
     getCoordinateIndices(fieldPtr, phi, rho, z, &nPhi, &nRho, &nZ);
 
-    cell3DPtr->phiIndex = nPhi;
-    cell3DPtr->rhoIndex = nRho;
-    cell3DPtr->zIndex = nZ;
-
     if (nPhi < 0) {
-        fprintf(stdout, "WARNING cell3D bad index for phi = %-12.5f\n", phi);
-        return;
+        STATS_INC(badIndices);
+        LOG_WARN("cell3D bad index for phi = %-12.5f", phi);
+        return false;
     }
 
     if (nRho < 0) {
-        fprintf(stdout, "WARNING cell3D bad index for rho = %-12.5f\n", rho);
-        return;
+        STATS_INC(badIndices);
+        LOG_WARN("cell3D bad index for rho = %-12.5f", rho);
+        return false;
     }
 
     if (nZ < 0) {
-        fprintf(stdout, "WARNING cell3D bad index for z = %-12.5f\n", z);
-        return;
+        STATS_INC(badIndices);
+        LOG_WARN("cell3D bad index for z = %-12.5f", z);
+        return false;
     }
 
+    cell3DPtr->phiIndex = nPhi;
+    cell3DPtr->rhoIndex = nRho;
+    cell3DPtr->zIndex = nZ;
+
     // precompute the boundaries and some factors
     cell3DPtr->phiMin = phiGrid->values[nPhi];
     cell3DPtr->phiMax = phiGrid->values[nPhi + 1];
@@ -177,29 +205,29 @@ void resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
     cell3DPtr->zMax = zGrid->values[nZ + 1];
     cell3DPtr->zNorm = 1. / zGrid->delta;
 
-    int i000 = getCompositeIndex(fieldPtr, nPhi, nRho, nZ);
-    int i001 = i000 + 1; // nPhi nRho nZ+1
-
-    int i010 = getCompositeIndex(fieldPtr, nPhi, nRho + 1, nZ); // nPhi nRho+1 nZ
-    int i011 = i010 + 1; // nPhi nRho+1 nZ+1
-
-    int i100 = getCompositeIndex(fieldPtr, nPhi + 1, nRho, nZ); // nPhi+1 nRho nZ
-    int i101 = i100 + 1; // nPhi+1 nRho nZ+1
+    size_t i000 = getCompositeIndex(fieldPtr, nPhi, nRho, nZ);
+    size_t i001 = i000 + 1; // nPhi nRho nZ+1
 
-    int i110 = getCompositeIndex(fieldPtr, nPhi + 1, nRho + 1, nZ); // nPhi+1 nRho+1 nZ
-    int i111 = i110 + 1; // nPhi+1 nRho+1 nZ+1
+    size_t i010 = getCompositeIndex(fieldPtr, nPhi, nRho + 1, nZ); // nPhi nRho+1 nZ
+    size_t i011 = i010 + 1; // nPhi nRho+1 nZ+1
 
-    // field at 8 corners
+    size_t i100 = getCompositeIndex(fieldPtr, nPhi + 1, nRho, nZ); // nPhi+1 nRho nZ
+    size_t i101 = i100 + 1; // nPhi+1 nRho nZ+1
 
-    cell3DPtr->b[0][0][0] = getFieldAtIndex(fieldPtr, i000);
-    cell3DPtr->b[0][0][1] = getFieldAtIndex(fieldPtr, i001);
-    cell3DPtr->b[0][1][0] = getFieldAtIndex(fieldPtr, i010);
-    cell3DPtr->b[0][1][1] = getFieldAtIndex(fieldPtr, i011);
-    cell3DPtr->b[1][0][0] = getFieldAtIndex(fieldPtr, i100);
-    cell3DPtr->b[1][0][1] = getFieldAtIndex(fieldPtr, i101);
-    cell3DPtr->b[1][1][0] = getFieldAtIndex(fieldPtr, i110);
-    cell3DPtr->b[1][1][1] = getFieldAtIndex(fieldPtr, i111);
+    size_t i110 = getCompositeIndex(fieldPtr, nPhi + 1, nRho + 1, nZ); // nPhi+1 nRho+1 nZ
+    size_t i111 = i110 + 1; // nPhi+1 nRho+1 nZ+1
 
+    // field at 8 corners, from the cell's copy of the values. The
+    // indices are in range because the grid indices were.
+    cell3DPtr->b[0][0][0] = cell3DPtr->values + i000;
+    cell3DPtr->b[0][0][1] = cell3DPtr->values + i001;
+    cell3DPtr->b[0][1][0] = cell3DPtr->values + i010;
+    cell3DPtr->b[0][1][1] = cell3DPtr->values + i011;
+    cell3DPtr->b[1][0][0] = cell3DPtr->values + i100;
+    cell3DPtr->b[1][0][1] = cell3DPtr->values + i101;
+    cell3DPtr->b[1][1][0] = cell3DPtr->values + i110;
+    cell3DPtr->b[1][1][1] = cell3DPtr->values + i111;
+    return true;
 }
 
 /**
@@ -209,8 +237,10 @@ void resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
  * @param cell2DPtr a pointer to the 2D cell.
  * @param rho the transverse coordinate, in cm.
  * @param z the z coordinate, in cm.
+ * @return false if a coordinate had no grid index, in which case the
+ * cell is left unchanged.
  */
-void resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
+bool resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
     MagneticFieldPtr fieldPtr = cell2DPtr->fieldPtr;
 
     GridPtr rhoGrid = fieldPtr->rhoGridPtr;
@@ -220,19 +250,21 @@ void resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
     int dummy, nRho, nZ;
     getCoordinateIndices(fieldPtr, 0.0, rho, z, &dummy, &nRho, &nZ);
 
-    cell2DPtr->rhoIndex = nRho;
-    cell2DPtr->zIndex = nZ;
-
     if (nRho < 0) {
-        fprintf(stdout, "WARNING cell2D bad index for rho = %-12.5f\n", rho);
-        return;
+        STATS_INC(badIndices);
+        LOG_WARN("cell2D bad index for rho = %-12.5f", rho);
+        return false;
     }
 
     if (nZ < 0) {
-        fprintf(stdout, "WARNING cell2D bad index for z = %-12.5f\n", z);
-        return;
+        STATS_INC(badIndices);
+        LOG_WARN("cell2D bad index for z = %-12.5f", z);
+        return false;
     }
 
+    cell2DPtr->rhoIndex = nRho;
+    cell2DPtr->zIndex = nZ;
+
     // precompute the boundaries and some factors
 
     cell2DPtr->rhoMin = rhoGrid->values[nRho];
@@ -243,23 +275,26 @@ void resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
     cell2DPtr->zMax = zGrid->values[nZ + 1];
     cell2DPtr->zNorm = 1. / zGrid->delta;
 
-    int i00 = getCompositeIndex(fieldPtr, 0, nRho, nZ);
-    int i01 = i00 + 1;
+    size_t i00 = getCompositeIndex(fieldPtr, 0, nRho, nZ);
+    size_t i01 = i00 + 1;
 
-    int i10 = getCompositeIndex(fieldPtr, 0, nRho + 1, nZ);
-    int i11 = i10 + 1;
-
-    // field at 4 corners
-    cell2DPtr->b[0][0] = getFieldAtIndex(fieldPtr, i00);
-    cell2DPtr->b[0][1] = getFieldAtIndex(fieldPtr, i01);
-    cell2DPtr->b[1][0] = getFieldAtIndex(fieldPtr, i10);
-    cell2DPtr->b[1][1] = getFieldAtIndex(fieldPtr, i11);
+    size_t i10 = getCompositeIndex(fieldPtr, 0, nRho + 1, nZ);
+    size_t i11 = i10 + 1;
 
+    // field at 4 corners, from the cell's copy of the values
+    cell2DPtr->b[0][0] = cell2DPtr->values + i00;
+    cell2DPtr->b[0][1] = cell2DPtr->values + i01;
+    cell2DPtr->b[1][0] = cell2DPtr->values + i10;
+    cell2DPtr->b[1][1] = cell2DPtr->values + i11;
+    return true;
 }
 
+
 /**
  * Obtain the value of the field by tri-linear interpolation or nearest neighbor,
- * depending on settings.
+ * depending on settings. This uses the field's own cell, so it must not be
+ * called on the same field from more than one thread; threads should
+ * each use their own probe and getProbeFieldValue instead.
  * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
  * return it will hold the value of the field in kG, in Cartesian components
  * Bx, By, BZ, regardless of the field coordinate system of the map.
@@ -274,15 +309,64 @@ void getFieldValue(FieldValuePtr fieldValuePtr,
                    double z,
                    MagneticFieldPtr fieldPtr) {
 
+    TRACE_QUERY(x, y, z, fieldPtr->type);
+    fieldValue(fieldValuePtr, x, y, z, fieldPtr, fieldPtr->cell3DPtr, fieldPtr->cell2DPtr);
+}
+
+/**
+ * Obtain the value of the field through a probe. A probe carries its own
+ * cell, so any number of threads may query the same field at once as long
+ * as each uses its own probe (see createProbe).
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the field in kG, in Cartesian components
+ * Bx, By, BZ, regardless of the field coordinate system of the map.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a pointer to a probe of the field map.
+ */
+void getProbeFieldValue(FieldValuePtr fieldValuePtr,
+                        double x,
+                        double y,
+                        double z,
+                        FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    TRACE_QUERY(x, y, z, fieldPtr->type);
+    fieldValue(fieldValuePtr, x, y, z, fieldPtr, probePtr->cell3DPtr, probePtr->cell2DPtr);
+}
+
+/**
+ * The work behind getFieldValue and getProbeFieldValue, shared with the
+ * composite functions so that a composite query is only traced once.
+ * @param fieldValuePtr upon return holds the field in kG, Cartesian components.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ * @param cell3DPtr the cell to use if the field is a torus.
+ * @param cell2DPtr the cell to use if the field is a solenoid.
+ */
+static void fieldValue(FieldValuePtr fieldValuePtr,
+                       double x,
+                       double y,
+                       double z,
+                       MagneticFieldPtr fieldPtr,
+                       Cell3DPtr cell3DPtr,
+                       Cell2DPtr cell2DPtr) {
+
     //here is where we apply any shifts
     x -= fieldPtr->shiftX;
     y -= fieldPtr->shiftY;
     z -= fieldPtr->shiftZ;
 
+    STATS_INC(calls);
+
     //see if we are contained
     double rho = hypot(x, y);
 
     if (!containsCylindrical(fieldPtr, rho, z)) {
+        STATS_INC(outOfBounds);
         fieldValuePtr->b1 = 0;
         fieldValuePtr->b2 = 0;
         fieldValuePtr->b3 = 0;
@@ -290,13 +374,12 @@ void getFieldValue(FieldValuePtr fieldValuePtr,
 
         //will even need phi for solenoid to rotate
         double phi = toDegrees(atan2(y, x));
-        double rho = hypot(x, y);
 
         if (fieldPtr->type == TORUS) {
-            getFieldValueTorus(fieldValuePtr, phi, rho, z, fieldPtr);
+            torusValue(fieldValuePtr, phi, rho, z, cell3DPtr);
         }
         else  { //solenoid
-            getFieldValueSolenoid(fieldValuePtr, phi, rho, z, fieldPtr);
+            solenoidValue(fieldValuePtr, phi, rho, z, cell2DPtr);
         }
 
         //scale the field
@@ -314,33 +397,70 @@ void getFieldValue(FieldValuePtr fieldValuePtr,
  * @param phi the phi coordinate in degrees.
  * @param rho the rho coordinate in cm.
  * @param z the z coordinate in cm.
- * @param fieldPtr a pointer to a torus field map.
+ * @param cell the cell (probe) to use.
  */
 static void torusCalculate(FieldValuePtr fieldValuePtr,
                            double phi,
                            double rho,
                            double z,
-                           MagneticFieldPtr fieldPtr) {
+                           Cell3DPtr cell) {
 
-    Cell3DPtr cell = fieldPtr->cell3DPtr;
-
-    if (!containedInCell3D(cell, phi, rho, z)) {
-        resetCell3D(cell, phi, rho, z);
+    if (containedInCell3D(cell, phi, rho, z)) {
+        STATS_INC(cellHits);
+    }
+    else {
+        STATS_INC(cellResets);
+        if (!resetCell3D(cell, phi, rho, z)) {
+            fieldValuePtr->b1 = 0;
+            fieldValuePtr->b2 = 0;
+            fieldValuePtr->b3 = 0;
+            return;
+        }
     }
 
-    //nearest neighbor
-    double fractPhi = (phi - cell->phiMin) * cell->phiNorm;
-    double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
-    double fractZ = (z - cell->zMin) * cell->zNorm;
+    double *f = cell->f;
+    f[0] = (phi - cell->phiMin) * cell->phiNorm;
+    f[1] = (rho - cell->rhoMin) * cell->rhoNorm;
+    f[2] = (z - cell->zMin) * cell->zNorm;
 
-    int N1 = (fractPhi < 0.5) ? 0 : 1;
-    int N2 = (fractRho < 0.5) ? 0 : 1;
-    int N3 = (fractZ < 0.5) ? 0 : 1;
+    if (_algorithm == NEAREST_NEIGHBOR) {
+        int N1 = (f[0] < 0.5) ? 0 : 1;
+        int N2 = (f[1] < 0.5) ? 0 : 1;
+        int N3 = (f[2] < 0.5) ? 0 : 1;
 
-    fieldValuePtr->b1 = cell->b[N1][N2][N3]->b1; // Bx
-    fieldValuePtr->b2 = cell->b[N1][N2][N3]->b2; // By
-    fieldValuePtr->b3 = cell->b[N1][N2][N3]->b3; // Bz
+        fieldValuePtr->b1 = cell->b[N1][N2][N3]->b1; // Bx
+        fieldValuePtr->b2 = cell->b[N1][N2][N3]->b2; // By
+        fieldValuePtr->b3 = cell->b[N1][N2][N3]->b3; // Bz
+        return;
+    }
 
+    //tri-linear interpolation
+    double *g = cell->g;
+    g[0] = 1 - f[0];
+    g[1] = 1 - f[1];
+    g[2] = 1 - f[2];
+
+    double *a = cell->a;
+    a[0] = g[0] * g[1] * g[2];
+    a[1] = g[0] * g[1] * f[2];
+    a[2] = g[0] * f[1] * g[2];
+    a[3] = g[0] * f[1] * f[2];
+    a[4] = f[0] * g[1] * g[2];
+    a[5] = f[0] * g[1] * f[2];
+    a[6] = f[0] * f[1] * g[2];
+    a[7] = f[0] * f[1] * f[2];
+
+    FieldValuePtr *b = &(cell->b[0][0][0]);
+    double b1 = 0, b2 = 0, b3 = 0;
+    for (int i = 0; i < 8; i++) {
+        b1 += a[i] * b[i]->b1;
+        b2 += a[i] * b[i]->b2;
+        b3 += a[i] * b[i]->b3;
+    }
+
+    fieldValuePtr->b1 = (float) b1; // Bx
+    fieldValuePtr->b2 = (float) b2; // By
+    fieldValuePtr->b3 = (float) b3; // Bz
 }
 
 /**
@@ -359,15 +479,32 @@ void getFieldValueTorus(FieldValuePtr fieldValuePtr,
                    double rho,
                    double z,
                    MagneticFieldPtr fieldPtr) {
+    torusValue(fieldValuePtr, phi, rho, z, fieldPtr->cell3DPtr);
+}
 
-    if (fieldPtr->symmetric) { //torus with 12-fold symmetry
+/**
+ * Get the TORUS field value using the given cell.
+ * @param fieldValuePtr upon return holds the field in kG, Cartesian components.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell (probe) of a torus field map.
+ */
+static void torusValue(FieldValuePtr fieldValuePtr,
+                       double phi,
+                       double rho,
+                       double z,
+                       Cell3DPtr cell) {
+
+    if (cell->fieldPtr->symmetric) { //torus with 12-fold symmetry
         // relativePhi (-30, 30) phi relative to middle of sector
         double relPhi = relativePhi(phi);
         bool flip = (relPhi < 0.0);
-        torusCalculate(fieldValuePtr, fabs(relPhi), rho, z, fieldPtr);
+        torusCalculate(fieldValuePtr, fabs(relPhi), rho, z, cell);
 
         //do we need to flip?
         if (flip) {
+            STATS_INC(symmetricFlips);
             //flip x and z components
             fieldValuePtr->b1 = -fieldValuePtr->b1;
             fieldValuePtr->b3 = -fieldValuePtr->b3;
@@ -377,6 +514,7 @@ void getFieldValueTorus(FieldValuePtr fieldValuePtr,
         int sector = getSector(phi);
 
         if (sector > 1) {
+            STATS_INC(sectorRotations);
             double cos = cosSect[sector];
             double sin = sinSect[sector];
             double bx = fieldValuePtr->b1;
@@ -390,7 +528,7 @@ void getFieldValueTorus(FieldValuePtr fieldValuePtr,
         if (phi < 0) {
             phi += 360;
         }
-        torusCalculate(fieldValuePtr, phi, rho, z, fieldPtr);
+        torusCalculate(fieldValuePtr, phi, rho, z, cell);
     }
 
 
@@ -413,30 +551,115 @@ void getFieldValueSolenoid(FieldValuePtr fieldValuePtr,
                            double rho,
                            double z,
                            MagneticFieldPtr fieldPtr) {
+    solenoidValue(fieldValuePtr, phi, rho, z, fieldPtr->cell2DPtr);
+}
+
+/**
+ * Get the SOLENOID field value using the given cell.
+ * @param fieldValuePtr upon return holds the field in kG, Cartesian components.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell (probe) of a solenoid field map.
+ */
+static void solenoidValue(FieldValuePtr fieldValuePtr,
+                          double phi,
+                          double rho,
+                          double z,
+                          Cell2DPtr cell) {
+
+    double bRho, bZ;
+    solenoidCylindrical(&bRho, &bZ, rho, z, cell);
 
-    Cell2DPtr cell = fieldPtr->cell2DPtr;
+    //rotate with knowledge that for solenoid Bphi = 0 in map
+    double phiRad = toRadians(phi);
 
-    if (!containedInCell2D(cell, rho, z)) {
-        resetCell2D(cell, rho, z);
+    fieldValuePtr->b1 = bRho*cos(phiRad);
+    fieldValuePtr->b2 = bRho*sin(phiRad);
+    fieldValuePtr->b3 = bZ;
+}
+
+/**
+ * Get the cylindrical components of the SOLENOID field using the given
+ * cell. The solenoid has no phi component, so no rotation is needed.
+ * @param bRho upon return the rho component in kG.
+ * @param bZ upon return the z component in kG.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell (probe) of a solenoid field map.
+ */
+static void solenoidCylindrical(double *bRho,
+                                double *bZ,
+                                double rho,
+                                double z,
+                                Cell2DPtr cell) {
+
+    if (containedInCell2D(cell, rho, z)) {
+        STATS_INC(cellHits);
+    }
+    else {
+        STATS_INC(cellResets);
+        if (!resetCell2D(cell, rho, z)) {
+            *bRho = 0;
+            *bZ = 0;
+            return;
+        }
     }
 
-    //nearest neighbor
     double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
     double fractZ = (z - cell->zMin) * cell->zNorm;
 
-    int N2 = (fractRho < 0.5) ? 0 : 1;
-    int N3 = (fractZ < 0.5) ? 0 : 1;
-
-    fieldValuePtr->b1 = 0; // Bphi is 0
-    fieldValuePtr->b2 = cell->b[N2][N3]->b2; // Brho
-    fieldValuePtr->b3 = cell->b[N2][N3]->b3; // Bz
+    if (_algorithm == NEAREST_NEIGHBOR) {
+        int N2 = (fractRho < 0.5) ? 0 : 1;
+        int N3 = (fractZ < 0.5) ? 0 : 1;
 
-    //rotate with knowledge that for solenoid Bphi = 0 in map
-    double phiRad = toRadians(phi);
-    double bRho = fieldValuePtr->b2;
+        *bRho = cell->b[N2][N3]->b2; // Brho
+        *bZ = cell->b[N2][N3]->b3;   // Bz
+    }
+    else { //bi-linear interpolation
+        double gRho = 1 - fractRho;
+        double gZ = 1 - fractZ;
+
+        double a00 = gRho * gZ;
+        double a01 = gRho * fractZ;
+        double a10 = fractRho * gZ;
+        double a11 = fractRho * fractZ;
+
+        *bRho = a00 * cell->b[0][0]->b2 + a01 * cell->b[0][1]->b2 +
+                a10 * cell->b[1][0]->b2 + a11 * cell->b[1][1]->b2;
+        *bZ = a00 * cell->b[0][0]->b3 + a01 * cell->b[0][1]->b3 +
+              a10 * cell->b[1][0]->b3 + a11 * cell->b[1][1]->b3;
+    }
+}
 
-    fieldValuePtr->b1 = bRho*cos(phiRad);
-    fieldValuePtr->b2 = bRho*sin(phiRad);
+/**
+ * Obtain the value of the field at many points through a probe. This is
+ * the batch form of getProbeFieldValue: one call per block of points
+ * rather than per point. Nearby consecutive points share the probe's
+ * cached cell, so a trajectory is best passed in order.
+ * @param fieldValues space for num values. Upon return, the field at each
+ * point in kG, in Cartesian components.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param num the number of points.
+ * @param probePtr a pointer to a probe of the field map.
+ */
+void getProbeFieldValues(FieldValuePtr fieldValues,
+                         const double *x,
+                         const double *y,
+                         const double *z,
+                         size_t num,
+                         FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    Cell3DPtr cell3DPtr = probePtr->cell3DPtr;
+    Cell2DPtr cell2DPtr = probePtr->cell2DPtr;
+
+    for (size_t i = 0; i < num; i++) {
+        TRACE_QUERY(x[i], y[i], z[i], fieldPtr->type);
+        fieldValue(fieldValues + i, x[i], y[i], z[i], fieldPtr, cell3DPtr, cell2DPtr);
+    }
 }
 
 /**
@@ -468,17 +691,562 @@ void getCompositeFieldValue(FieldValuePtr fieldValuePtr,
 
     FieldValue temp;
 
+    TRACE_QUERY(x, y, z, TRACE_COMPOSITE);
+
+    if (field1 != NULL) {
+        fieldValue(fieldValuePtr, x, y, z, field1, field1->cell3DPtr, field1->cell2DPtr);
+    }
+    if (field2 != NULL) {
+        fieldValue(&temp, x, y, z, field2, field2->cell3DPtr, field2->cell2DPtr);
+        fieldValuePtr->b1 += temp.b1;
+        fieldValuePtr->b2 += temp.b2;
+        fieldValuePtr->b3 += temp.b3;
+    }
+}
+
+/**
+ * Obtain the combined value of two fields through probes. This is the
+ * thread safe version of getCompositeFieldValue.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the combined value of the field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probe1 a probe of the first field (can be NULL).
+ * @param probe2 a probe of the second field (can be NULL).
+ */
+void getCompositeProbeFieldValue(FieldValuePtr fieldValuePtr,
+                                 double x,
+                                 double y,
+                                 double z,
+                                 FieldProbePtr probe1,
+                                 FieldProbePtr probe2) {
+
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    FieldValue temp;
+
+    TRACE_QUERY(x, y, z, TRACE_COMPOSITE);
+
+    if (probe1 != NULL) {
+        fieldValue(fieldValuePtr, x, y, z, probe1->fieldPtr, probe1->cell3DPtr, probe1->cell2DPtr);
+    }
+    if (probe2 != NULL) {
+        fieldValue(&temp, x, y, z, probe2->fieldPtr, probe2->cell3DPtr, probe2->cell2DPtr);
+        fieldValuePtr->b1 += temp.b1;
+        fieldValuePtr->b2 += temp.b2;
+        fieldValuePtr->b3 += temp.b3;
+    }
+}
+
+/**
+ * Obtain the value of the field, returned by value. Like getFieldValue,
+ * but the caller needs no FieldValue storage, so it is natural to keep
+ * the result on the stack. Never touches the heap.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ * @return the field in kG, in Cartesian components Bx, By, Bz.
+ */
+FieldValue fieldValueAt(double x, double y, double z, MagneticFieldPtr fieldPtr) {
+    FieldValue value;
+    getFieldValue(&value, x, y, z, fieldPtr);
+    return value;
+}
+
+/**
+ * Obtain the value of the field through a probe, returned by value.
+ * The thread safe form of fieldValueAt. Never touches the heap.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a pointer to a probe of the field map.
+ * @return the field in kG, in Cartesian components Bx, By, Bz.
+ */
+FieldValue probeFieldValueAt(double x, double y, double z, FieldProbePtr probePtr) {
+    FieldValue value;
+    getProbeFieldValue(&value, x, y, z, probePtr);
+    return value;
+}
+
+/**
+ * Obtain the combined value of two fields, returned by value.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ * @return the combined field in kG, in Cartesian components Bx, By, Bz.
+ */
+FieldValue compositeFieldValueAt(double x, double y, double z,
+                                 MagneticFieldPtr field1, MagneticFieldPtr field2) {
+    FieldValue value;
+    getCompositeFieldValue(&value, x, y, z, field1, field2);
+    return value;
+}
+
+/**
+ * Obtain the combined value of two fields through probes, returned by
+ * value. The thread safe form of compositeFieldValueAt.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probe1 a probe of the first field (can be NULL).
+ * @param probe2 a probe of the second field (can be NULL).
+ * @return the combined field in kG, in Cartesian components Bx, By, Bz.
+ */
+FieldValue compositeProbeFieldValueAt(double x, double y, double z,
+                                      FieldProbePtr probe1, FieldProbePtr probe2) {
+    FieldValue value;
+    getCompositeProbeFieldValue(&value, x, y, z, probe1, probe2);
+    return value;
+}
+
+/**
+ * Obtain the field at many points through a probe, written into caller
+ * arrays of components rather than FieldValues. Convenient for callers
+ * that keep their own structure-of-arrays buffers. Never touches the heap.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param num the number of points.
+ * @param probePtr a pointer to a probe of the field map.
+ * @param bx upon return, the num x components in kG.
+ * @param by upon return, the num y components in kG.
+ * @param bz upon return, the num z components in kG.
+ */
+void getProbeFieldComponents(const double *x, const double *y, const double *z, size_t num,
+                             FieldProbePtr probePtr, float *bx, float *by, float *bz) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    FieldValue value;
+
+    for (size_t i = 0; i < num; i++) {
+        TRACE_QUERY(x[i], y[i], z[i], fieldPtr->type);
+        fieldValue(&value, x[i], y[i], z[i], fieldPtr, probePtr->cell3DPtr, probePtr->cell2DPtr);
+        bx[i] = value.b1;
+        by[i] = value.b2;
+        bz[i] = value.b3;
+    }
+}
+
+/**
+ * Obtain the value of the field at a point given in cylindrical
+ * coordinates, with the field returned in cylindrical components. Callers
+ * that already have (phi, rho, z) save the hypot and atan2 of the
+ * Cartesian entry points, and for the solenoid all trigonometry.
+ * @param fieldValuePtr upon return holds the field in kG, in cylindrical
+ * components: b1 = Bphi, b2 = Brho, b3 = Bz.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ */
+void getCylindricalFieldValue(FieldValuePtr fieldValuePtr,
+                              double phi,
+                              double rho,
+                              double z,
+                              MagneticFieldPtr fieldPtr) {
+
+    TRACE_QUERY(rho*cos(toRadians(phi)), rho*sin(toRadians(phi)), z, fieldPtr->type);
+    cylindricalValue(fieldValuePtr, phi, rho, z, fieldPtr, fieldPtr->cell3DPtr, fieldPtr->cell2DPtr);
+}
+
+/**
+ * Obtain the value of the field at a point given in cylindrical
+ * coordinates through a probe. The thread safe form of
+ * getCylindricalFieldValue.
+ * @param fieldValuePtr upon return holds the field in kG, in cylindrical
+ * components: b1 = Bphi, b2 = Brho, b3 = Bz.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a pointer to a probe of the field map.
+ */
+void getProbeCylindricalFieldValue(FieldValuePtr fieldValuePtr,
+                                   double phi,
+                                   double rho,
+                                   double z,
+                                   FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    TRACE_QUERY(rho*cos(toRadians(phi)), rho*sin(toRadians(phi)), z, fieldPtr->type);
+    cylindricalValue(fieldValuePtr, phi, rho, z, fieldPtr, probePtr->cell3DPtr, probePtr->cell2DPtr);
+}
+
+/**
+ * Obtain the combined value of two fields at a point given in cylindrical
+ * coordinates, in cylindrical components.
+ * @param fieldValuePtr upon return holds the field in kG, in cylindrical
+ * components: b1 = Bphi, b2 = Brho, b3 = Bz.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ */
+void getCompositeCylindricalFieldValue(FieldValuePtr fieldValuePtr,
+                                       double phi,
+                                       double rho,
+                                       double z,
+                                       MagneticFieldPtr field1,
+                                       MagneticFieldPtr field2) {
+
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    FieldValue temp;
+
+    TRACE_QUERY(rho*cos(toRadians(phi)), rho*sin(toRadians(phi)), z, TRACE_COMPOSITE);
+
     if (field1 != NULL) {
-        getFieldValue(fieldValuePtr, x, y, z, field1);
+        cylindricalValue(fieldValuePtr, phi, rho, z, field1, field1->cell3DPtr, field1->cell2DPtr);
     }
     if (field2 != NULL) {
-        getFieldValue(&temp, x, y, z, field2);
+        cylindricalValue(&temp, phi, rho, z, field2, field2->cell3DPtr, field2->cell2DPtr);
         fieldValuePtr->b1 += temp.b1;
         fieldValuePtr->b2 += temp.b2;
         fieldValuePtr->b3 += temp.b3;
     }
 }
 
+/**
+ * The work behind the cylindrical entry points.
+ * @param fieldValuePtr upon return holds the field in kG, in cylindrical
+ * components: b1 = Bphi, b2 = Brho, b3 = Bz.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ * @param cell3DPtr the cell to use if the field is a torus.
+ * @param cell2DPtr the cell to use if the field is a solenoid.
+ */
+static void cylindricalValue(FieldValuePtr fieldValuePtr,
+                             double phi,
+                             double rho,
+                             double z,
+                             MagneticFieldPtr fieldPtr,
+                             Cell3DPtr cell3DPtr,
+                             Cell2DPtr cell2DPtr) {
+
+    double bx, by;
+
+    //a transverse shift moves the map off the beam line, so the
+    //point must go through Cartesian coordinates
+    if ((fieldPtr->shiftX != 0) || (fieldPtr->shiftY != 0)) {
+        double phiRad = toRadians(phi);
+        double cosPhi = cos(phiRad);
+        double sinPhi = sin(phiRad);
+        fieldValue(fieldValuePtr, rho*cosPhi, rho*sinPhi, z, fieldPtr, cell3DPtr, cell2DPtr);
+        bx = fieldValuePtr->b1;
+        by = fieldValuePtr->b2;
+        fieldValuePtr->b1 = (float) (-bx*sinPhi + by*cosPhi);
+        fieldValuePtr->b2 = (float) (bx*cosPhi + by*sinPhi);
+        return;
+    }
+
+    z -= fieldPtr->shiftZ;
+
+    STATS_INC(calls);
+
+    if (!containsCylindrical(fieldPtr, rho, z)) {
+        STATS_INC(outOfBounds);
+        fieldValuePtr->b1 = 0;
+        fieldValuePtr->b2 = 0;
+        fieldValuePtr->b3 = 0;
+        return;
+    }
+
+    if (fieldPtr->type == SOLENOID) {
+        double bRho, bZ;
+        solenoidCylindrical(&bRho, &bZ, rho, z, cell2DPtr);
+        fieldValuePtr->b1 = 0;
+        fieldValuePtr->b2 = (float) (bRho * fieldPtr->scale);
+        fieldValuePtr->b3 = (float) (bZ * fieldPtr->scale);
+        return;
+    }
+
+    //the torus map holds Cartesian components. Cylindrical components
+    //do not change under a sector rotation, so a symmetric map only needs
+    //the reflection of the lower half sector: Brho and Bz change sign
+    double sign = 1;
+    if (fieldPtr->symmetric) {
+        phi = relativePhi(phi);
+        if (phi < 0.0) {
+            STATS_INC(symmetricFlips);
+            phi = -phi;
+            sign = -1;
+        }
+    }
+    else if ((phi < 0.0) || (phi > 360.0)) {
+        phi = fmod(phi, 360.0);
+        if (phi < 0.0) {
+            phi += 360.0;
+        }
+    }
+
+    torusCalculate(fieldValuePtr, phi, rho, z, cell3DPtr);
+
+    double phiRad = toRadians(phi);
+    double cosPhi = cos(phiRad);
+    double sinPhi = sin(phiRad);
+    double scale = fieldPtr->scale;
+    bx = fieldValuePtr->b1;
+    by = fieldValuePtr->b2;
+
+    fieldValuePtr->b1 = (float) (scale * (-bx*sinPhi + by*cosPhi));
+    fieldValuePtr->b2 = (float) (sign * scale * (bx*cosPhi + by*sinPhi));
+    fieldValuePtr->b3 = (float) (sign * scale * fieldValuePtr->b3);
+}
+
+/**
+ * Convert a point in CLAS12 tilted sector coordinates to the lab. The
+ * tilted frame of a sector is its midplane frame (x outward through the
+ * middle of the sector) rotated by SECTOR_TILT degrees about y, so that
+ * z is normal to the drift chamber planes. Vectors convert the same way.
+ * @param sector the sector [1..6].
+ * @param xt the tilted x coordinate.
+ * @param yt the tilted y coordinate.
+ * @param zt the tilted z coordinate.
+ * @param x upon return the lab x coordinate.
+ * @param y upon return the lab y coordinate.
+ * @param z upon return the lab z coordinate.
+ */
+void tiltedSectorToLab(int sector, double xt, double yt, double zt,
+                       double *x, double *y, double *z) {
+    double xs = xt*COSTILT + zt*SINTILT;
+    double ys = yt;
+    double zs = -xt*SINTILT + zt*COSTILT;
+
+    *x = xs*cosSect[sector] - ys*sinSect[sector];
+    *y = xs*sinSect[sector] + ys*cosSect[sector];
+    *z = zs;
+}
+
+/**
+ * Convert a point in the lab to CLAS12 tilted sector coordinates; the
+ * inverse of tiltedSectorToLab. Vectors convert the same way.
+ * @param sector the sector [1..6].
+ * @param x the lab x coordinate.
+ * @param y the lab y coordinate.
+ * @param z the lab z coordinate.
+ * @param xt upon return the tilted x coordinate.
+ * @param yt upon return the tilted y coordinate.
+ * @param zt upon return the tilted z coordinate.
+ */
+void labToTiltedSector(int sector, double x, double y, double z,
+                       double *xt, double *yt, double *zt) {
+    double xs = x*cosSect[sector] + y*sinSect[sector];
+    double ys = -x*sinSect[sector] + y*cosSect[sector];
+
+    *xt = xs*COSTILT - z*SINTILT;
+    *yt = ys;
+    *zt = xs*SINTILT + z*COSTILT;
+}
+
+/**
+ * Obtain the value of the field at a point given in the CLAS12 tilted
+ * coordinates of a sector, with the field returned in the same frame
+ * (see tiltedSectorToLab). The field is found in the sector frame
+ * directly, without a round trip through the lab.
+ * @param fieldValuePtr upon return holds the field in kG, in tilted
+ * sector Cartesian components.
+ * @param sector the sector [1..6].
+ * @param x the tilted x coordinate in cm.
+ * @param y the tilted y coordinate in cm.
+ * @param z the tilted z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ */
+void getSectorFieldValue(FieldValuePtr fieldValuePtr,
+                         int sector,
+                         double x,
+                         double y,
+                         double z,
+                         MagneticFieldPtr fieldPtr) {
+
+    sectorValue(fieldValuePtr, sector, x, y, z, fieldPtr, fieldPtr->cell3DPtr, fieldPtr->cell2DPtr);
+}
+
+/**
+ * Obtain the value of the field at a point given in the CLAS12 tilted
+ * coordinates of a sector through a probe. The thread safe form of
+ * getSectorFieldValue.
+ * @param fieldValuePtr upon return holds the field in kG, in tilted
+ * sector Cartesian components.
+ * @param sector the sector [1..6].
+ * @param x the tilted x coordinate in cm.
+ * @param y the tilted y coordinate in cm.
+ * @param z the tilted z coordinate in cm.
+ * @param probePtr a pointer to a probe of the field map.
+ */
+void getProbeSectorFieldValue(FieldValuePtr fieldValuePtr,
+                              int sector,
+                              double x,
+                              double y,
+                              double z,
+                              FieldProbePtr probePtr) {
+
+    sectorValue(fieldValuePtr, sector, x, y, z, probePtr->fieldPtr, probePtr->cell3DPtr, probePtr->cell2DPtr);
+}
+
+/**
+ * Obtain the combined value of two fields at a point given in the CLAS12
+ * tilted coordinates of a sector, in the same frame.
+ * @param fieldValuePtr upon return holds the field in kG, in tilted
+ * sector Cartesian components.
+ * @param sector the sector [1..6].
+ * @param x the tilted x coordinate in cm.
+ * @param y the tilted y coordinate in cm.
+ * @param z the tilted z coordinate in cm.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ */
+void getCompositeSectorFieldValue(FieldValuePtr fieldValuePtr,
+                                  int sector,
+                                  double x,
+                                  double y,
+                                  double z,
+                                  MagneticFieldPtr field1,
+                                  MagneticFieldPtr field2) {
+
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    FieldValue temp;
+
+    if (field1 != NULL) {
+        sectorValue(fieldValuePtr, sector, x, y, z, field1, field1->cell3DPtr, field1->cell2DPtr);
+    }
+    if (field2 != NULL) {
+        sectorValue(&temp, sector, x, y, z, field2, field2->cell3DPtr, field2->cell2DPtr);
+        fieldValuePtr->b1 += temp.b1;
+        fieldValuePtr->b2 += temp.b2;
+        fieldValuePtr->b3 += temp.b3;
+    }
+}
+
+/**
+ * The work behind the tilted sector entry points.
+ * @param fieldValuePtr upon return holds the field in kG, in tilted
+ * sector Cartesian components.
+ * @param sector the sector [1..6].
+ * @param xt the tilted x coordinate in cm.
+ * @param yt the tilted y coordinate in cm.
+ * @param zt the tilted z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ * @param cell3DPtr the cell to use if the field is a torus.
+ * @param cell2DPtr the cell to use if the field is a solenoid.
+ */
+static void sectorValue(FieldValuePtr fieldValuePtr,
+                        int sector,
+                        double xt,
+                        double yt,
+                        double zt,
+                        MagneticFieldPtr fieldPtr,
+                        Cell3DPtr cell3DPtr,
+                        Cell2DPtr cell2DPtr) {
+
+    if ((sector < 1) || (sector > 6)) {
+        LOG_WARN("bad sector %d for a sector coordinate query", sector);
+        fieldValuePtr->b1 = 0;
+        fieldValuePtr->b2 = 0;
+        fieldValuePtr->b3 = 0;
+        return;
+    }
+
+    //undo the tilt, giving the sector midplane frame
+    double xs = xt*COSTILT + zt*SINTILT;
+    double ys = yt;
+    double z = -xt*SINTILT + zt*COSTILT;
+
+    double cosS = cosSect[sector];
+    double sinS = sinSect[sector];
+
+    if (traceRecording) {
+        traceRecord(xs*cosS - ys*sinS, xs*sinS + ys*cosS, z, fieldPtr->type);
+    }
+
+    //the field in the sector midplane frame
+    double bx, by, bz;
+
+    if ((fieldPtr->shiftX != 0) || (fieldPtr->shiftY != 0)) {
+        //a transverse shift moves the map off the beam line, so the
+        //point must go through the lab
+        fieldValue(fieldValuePtr, xs*cosS - ys*sinS, xs*sinS + ys*cosS, z, fieldPtr, cell3DPtr, cell2DPtr);
+        bx = fieldValuePtr->b1*cosS + fieldValuePtr->b2*sinS;
+        by = -fieldValuePtr->b1*sinS + fieldValuePtr->b2*cosS;
+        bz = fieldValuePtr->b3;
+    }
+    else {
+        z -= fieldPtr->shiftZ;
+
+        STATS_INC(calls);
+
+        double rho = hypot(xs, ys);
+
+        if (!containsCylindrical(fieldPtr, rho, z)) {
+            STATS_INC(outOfBounds);
+            fieldValuePtr->b1 = 0;
+            fieldValuePtr->b2 = 0;
+            fieldValuePtr->b3 = 0;
+            return;
+        }
+
+        if (fieldPtr->type == SOLENOID) {
+            //no phi component, and the direction of rho needs no trig
+            double bRho, bZ;
+            solenoidCylindrical(&bRho, &bZ, rho, z, cell2DPtr);
+            double cosPhi = (rho > 0) ? xs/rho : 1;
+            double sinPhi = (rho > 0) ? ys/rho : 0;
+            bx = bRho*cosPhi;
+            by = bRho*sinPhi;
+            bz = bZ;
+        }
+        else {
+            double relPhi = toDegrees(atan2(ys, xs));
+
+            if (fieldPtr->symmetric && (fabs(relPhi) <= 30.0)) {
+                //the sector midplane frame is the frame of the symmetric map
+                torusCalculate(fieldValuePtr, fabs(relPhi), rho, z, cell3DPtr);
+                bx = fieldValuePtr->b1;
+                by = fieldValuePtr->b2;
+                bz = fieldValuePtr->b3;
+                if (relPhi < 0.0) {
+                    STATS_INC(symmetricFlips);
+                    bx = -bx;
+                    bz = -bz;
+                }
+            }
+            else {
+                //a full map, or a point outside the sector's wedge
+                double phi = relPhi + 60.0*(sector - 1);
+                if (phi >= 360.0) {
+                    phi -= 360.0;
+                }
+                torusValue(fieldValuePtr, phi, rho, z, cell3DPtr);
+                bx = fieldValuePtr->b1*cosS + fieldValuePtr->b2*sinS;
+                by = -fieldValuePtr->b1*sinS + fieldValuePtr->b2*cosS;
+                bz = fieldValuePtr->b3;
+            }
+        }
+
+        bx *= fieldPtr->scale;
+        by *= fieldPtr->scale;
+        bz *= fieldPtr->scale;
+    }
+
+    //and back to the tilted frame
+    fieldValuePtr->b1 = (float) (bx*COSTILT - bz*SINTILT);
+    fieldValuePtr->b2 = (float) by;
+    fieldValuePtr->b3 = (float) (bx*SINTILT + bz*COSTILT);
+}
+
 
 /**
  * Get the composite index into the 1D data array holding
@@ -489,8 +1257,8 @@ void getCompositeFieldValue(FieldValuePtr fieldValuePtr,
  * @param n3 the index for the third coordinate.
  * @return the composite index into the 1D data array.
  */
-int getCompositeIndex(MagneticFieldPtr fieldPtr, int n1, int n2, int n3) {
-    return n1 * fieldPtr->N23 + n2 * fieldPtr->zGridPtr->num + n3;
+size_t getCompositeIndex(MagneticFieldPtr fieldPtr, int n1, int n2, int n3) {
+    return (size_t) n1 * fieldPtr->N23 + (size_t) n2 * fieldPtr->zGridPtr->num + n3;
 }
 
 /**
@@ -504,21 +1272,21 @@ int getCompositeIndex(MagneticFieldPtr fieldPtr, int n1, int n2, int n3) {
  * @param rhoIndex will hold the index for the second coordinate.
  * @param zIndex will hold the index for the third coordinate.
  */
-void invertCompositeIndex(MagneticFieldPtr fieldPtr, int index,
+void invertCompositeIndex(MagneticFieldPtr fieldPtr, size_t index,
                           int *phiIndex, int *rhoIndex, int *zIndex) {
-    if ((index < 0) || (index >= fieldPtr->numValues)) {
+    if (index >= fieldPtr->numValues) {
         *phiIndex = -1;
         *rhoIndex = -1;
         *zIndex = -1;
     }
     else {
-        int NZ = fieldPtr->zGridPtr->num;
-        int n3 = index % NZ;
-        index = (index - n3) / NZ;
+        size_t NZ = fieldPtr->zGridPtr->num;
+        int n3 = (int) (index % NZ);
+        index /= NZ;
 
-        int NRho = fieldPtr->rhoGridPtr->num;
-        int n2 = index % NRho;
-        int n1 = (index - n2) / NRho;
+        size_t NRho = fieldPtr->rhoGridPtr->num;
+        int n2 = (int) (index % NRho);
+        int n1 = (int) (index / NRho);
         *phiIndex  = n1;
         *rhoIndex  = n2;
         *zIndex  = n3;
@@ -544,29 +1312,48 @@ void getCoordinateIndices(MagneticFieldPtr fieldPtr, double phi, double rho, dou
 
 
 /**
- * A unit test for the test field.
+ * A unit test of nearest neighbor values for the test field. The reference
+ * values come from the CLAS12 solenoid and torus maps, so this is only run
+ * with those maps, never with the synthetic ones.
  * @return an error message if the test fails, or NULL if it passes.
- * @return
  */
 char *nearestNeighborUnitTest() {
 
     double resolution = 0.1;   //gauss
 
     setAlgorithm(NEAREST_NEIGHBOR);
-    FieldValuePtr fieldValuePtr = (FieldValuePtr) malloc (sizeof(FieldValue));
 
     if (testFieldPtr->type == TORUS) {
-
+        double teslaResolution = 1.0e-5; //0.1 gauss
+
+        for (int i = 0; i < ARRAYSIZE(torusNN); i++) {
+            double *data = torusNN[i];
+            FieldValue value = fieldValueAt(data[0], data[1], data[2], testFieldPtr);
+
+            //test data in Tesla
+            double b[3] = {0.1*value.b1, 0.1*value.b2, 0.1*value.b3};
+
+            for (int j = 0; j < 3; j++) {
+                //components that vanish by symmetry are stored as rounding noise, so
+                //only compare the signs of components that are clearly nonzero
+                if ((fabs(data[3+j]) > teslaResolution) && (sign(b[j]) != sign(data[3+j]))) {
+                    mu_assert("The torus components had different signs", false);
+                }
+                if (fabs(b[j] - data[3+j]) > teslaResolution) {
+                    mu_assert("The torus components had different values", false);
+                }
+            }
+        }
     }
     else { //solenoid
         for (int i = 0; i < ARRAYSIZE(solenoidNN); i++) {
             double *data = solenoidNN[i];
-            getFieldValue(fieldValuePtr, data[0], data[1], data[2], testFieldPtr);
+            FieldValue value = fieldValueAt(data[0], data[1], data[2], testFieldPtr);
 
             //test data in Gauss
-            double bx = 1000*fieldValuePtr->b1;
-            double by = 1000*fieldValuePtr->b2;
-            double bz = 1000*fieldValuePtr->b3;
+            double bx = 1000*value.b1;
+            double by = 1000*value.b2;
+            double bz = 1000*value.b3;
 
             if (sign(bx) != sign(data[3])) {
                 mu_assert("The X components had different signs", false);
@@ -652,6 +1439,237 @@ char *containsUnitTest() {
     return NULL;
 }
 
+/**
+ * A unit test for the cylindrical and tilted sector entry points. Both
+ * must agree with the Cartesian entry point, with and without a shift.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *coordinatesUnitTest() {
+
+    int count = 100000;
+    double tolerance = 1.0e-5 * (1.0 + testFieldPtr->metricsPtr->maxFieldMagnitude);
+    double saveShiftX = testFieldPtr->shiftX;
+    double saveShiftZ = testFieldPtr->shiftZ;
+    FieldValue cart, other;
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        //the second pass with a shift
+        testFieldPtr->shiftX = (pass == 0) ? 0 : 2.5;
+        testFieldPtr->shiftZ = (pass == 0) ? 0 : -1.5;
+
+        double rhoMax = 1.05 * testFieldPtr->rhoGridPtr->maxVal;
+        double zMin = testFieldPtr->zGridPtr->minVal - 10;
+        double zMax = testFieldPtr->zGridPtr->maxVal + 10;
+
+        for (int i = 0; i < count; i++) {
+            double phi = randomDouble(-180, 540);
+            double rho = randomDouble(0, rhoMax);
+            double z = randomDouble(zMin, zMax);
+
+            double phiRad = toRadians(phi);
+            double cosPhi = cos(phiRad);
+            double sinPhi = sin(phiRad);
+
+            getFieldValue(&cart, rho*cosPhi, rho*sinPhi, z, testFieldPtr);
+            getCylindricalFieldValue(&other, phi, rho, z, testFieldPtr);
+
+            double bPhi = -cart.b1*sinPhi + cart.b2*cosPhi;
+            double bRho = cart.b1*cosPhi + cart.b2*sinPhi;
+
+            mu_assert("The cylindrical Bphi differs", fabs(other.b1 - bPhi) < tolerance);
+            mu_assert("The cylindrical Brho differs", fabs(other.b2 - bRho) < tolerance);
+            mu_assert("The cylindrical Bz differs", fabs(other.b3 - cart.b3) < tolerance);
+        }
+
+        for (int i = 0; i < count; i++) {
+            int sector = randomInt(1, 6);
+            double xt = randomDouble(-50, rhoMax);
+            double yt = randomDouble(-0.6*rhoMax, 0.6*rhoMax);
+            double zt = randomDouble(zMin, zMax);
+
+            double x, y, z, bx, by, bz;
+            tiltedSectorToLab(sector, xt, yt, zt, &x, &y, &z);
+            getFieldValue(&cart, x, y, z, testFieldPtr);
+            labToTiltedSector(sector, cart.b1, cart.b2, cart.b3, &bx, &by, &bz);
+
+            getSectorFieldValue(&other, sector, xt, yt, zt, testFieldPtr);
+
+            mu_assert("The sector Bx differs", fabs(other.b1 - bx) < tolerance);
+            mu_assert("The sector By differs", fabs(other.b2 - by) < tolerance);
+            mu_assert("The sector Bz differs", fabs(other.b3 - bz) < tolerance);
+        }
+    }
+
+    testFieldPtr->shiftX = saveShiftX;
+    testFieldPtr->shiftZ = saveShiftZ;
+
+    fprintf(stdout, "\nPASSED coordinatesUnitTest\n");
+    return NULL;
+}
+
+/**
+ * The field of the interpolation unit test's maps: linear in each of phi,
+ * rho and z, so that tri-linear (and bi-linear) interpolation reproduces
+ * it everywhere, not just at the grid points.
+ * @param fieldValuePtr upon return, the field.
+ * @param phi the azimuthal angle in degrees.
+ * @param rho the transverse coordinate in cm.
+ * @param z the z coordinate in cm.
+ */
+static void linearField(FieldValuePtr fieldValuePtr, double phi, double rho, double z) {
+    fieldValuePtr->b1 = (float) (1 + 0.01*phi - 0.002*rho + 1.0e-5*phi*z);
+    fieldValuePtr->b2 = (float) (0.5 + 0.02*rho + 0.001*z + 2.0e-5*rho*z);
+    fieldValuePtr->b3 = (float) (-1 + 0.003*z + 0.001*phi - 1.0e-7*phi*rho*z);
+}
+
+/**
+ * Write a map of the linear field of the interpolation unit test.
+ * @param path the path to the map file.
+ * @param header the header, with the grid filled in.
+ * @return true on success.
+ */
+static bool writeLinearMap(const char *path, FieldMapHeaderPtr header) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool written = (fwrite(header, sizeof(FieldMapHeader), 1, file) == 1);
+    for (unsigned int i = 0; written && (i < header->nq1); i++) {
+        double phi = (header->nq1 < 2) ? 0 : header->q1min + i*(header->q1max - header->q1min)/(header->nq1 - 1);
+        for (unsigned int j = 0; written && (j < header->nq2); j++) {
+            double rho = header->q2min + j*(header->q2max - header->q2min)/(header->nq2 - 1);
+            for (unsigned int k = 0; written && (k < header->nq3); k++) {
+                double z = header->q3min + k*(header->q3max - header->q3min)/(header->nq3 - 1);
+                FieldValue value;
+                linearField(&value, phi, rho, z);
+                if (header->nq1 < 2) { //a solenoid holds (0, Brho, Bz)
+                    value.b1 = 0;
+                }
+                written = (fwrite(&value, sizeof(FieldValue), 1, file) == 1);
+            }
+        }
+    }
+    return (fclose(file) == 0) && written;
+}
+
+/**
+ * Compare the field of an interpolation unit test map with the linear field.
+ * @param fieldPtr the map.
+ * @param phi the azimuthal angle in degrees.
+ * @param rho the transverse coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @return true if they agree to float precision.
+ */
+static bool isLinear(MagneticFieldPtr fieldPtr, double phi, double rho, double z) {
+    FieldValue value, expected;
+    linearField(&expected, phi, rho, z);
+
+    if (fieldPtr->type == TORUS) {
+        getFieldValueTorus(&value, phi, rho, z, fieldPtr);
+    }
+    else { //in the phi = 0 plane the solenoid's (Bx, By, Bz) is (Brho, 0, Bz)
+        getFieldValueSolenoid(&value, 0, rho, z, fieldPtr);
+        expected.b1 = expected.b2;
+        expected.b2 = 0;
+    }
+
+    double tolerance = 1.0e-5;
+    return (fabs(value.b1 - expected.b1) < tolerance) && (fabs(value.b2 - expected.b2) < tolerance) &&
+           (fabs(value.b3 - expected.b3) < tolerance);
+}
+
+/**
+ * A unit test of interpolation on small synthetic maps, a full torus and a
+ * solenoid, of a field that interpolation reproduces: the value is exact
+ * at every grid point and every cell midpoint, and anywhere in the first
+ * and last cells in rho and z, up to and including the grid's edges.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *interpolationUnitTest() {
+    const char *path = "cMagInterpolationUnitTest.dat";
+    enum Algorithm saveAlgorithm = getAlgorithm();
+    setAlgorithm(INTERPOLATION);
+
+    for (int pass = 0; pass < 2; pass++) {
+        FieldType type = (pass == 0) ? TORUS : SOLENOID;
+
+        FieldMapHeader header;
+        memset(&header, 0, sizeof(FieldMapHeader));
+        header.magicWord = MAGICWORD;
+        header.fieldCS = (type == TORUS) ? 1 : 0;
+        header.q1max = 360;
+        header.nq1 = (type == TORUS) ? 13 : 1;
+        header.q2min = 10;
+        header.q2max = 210;
+        header.nq2 = 11;
+        header.q3min = -100;
+        header.q3max = 300;
+        header.nq3 = 21;
+
+        mu_assert("Could not write the interpolation test map", writeLinearMap(path, &header));
+        MagneticFieldPtr fieldPtr = (type == TORUS) ? initializeTorus(path) : initializeSolenoid(path);
+        remove(path);
+        mu_assert("Could not read the interpolation test map", fieldPtr != NULL);
+
+        GridPtr phiGrid = fieldPtr->phiGridPtr;
+        GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+        GridPtr zGrid = fieldPtr->zGridPtr;
+        int nPhi = (type == TORUS) ? phiGrid->num : 1;
+        int nRho = rhoGrid->num;
+        int nZ = zGrid->num;
+
+        //the grid points, then the cell midpoints
+        for (int i = 0; i < nPhi; i++) {
+            double phi = (type == TORUS) ? phiGrid->values[i] : 0;
+            for (int j = 0; j < nRho; j++) {
+                for (int k = 0; k < nZ; k++) {
+                    mu_assert("Interpolation is not exact at a grid point",
+                              isLinear(fieldPtr, phi, rhoGrid->values[j], zGrid->values[k]));
+                }
+            }
+        }
+
+        for (int i = 0; i < ((type == TORUS) ? nPhi - 1 : 1); i++) {
+            double phi = (type == TORUS) ? phiGrid->values[i] + 0.5*phiGrid->delta : 0;
+            for (int j = 0; j < nRho - 1; j++) {
+                for (int k = 0; k < nZ - 1; k++) {
+                    mu_assert("Interpolation is not linear at a cell midpoint",
+                              isLinear(fieldPtr, phi, rhoGrid->values[j] + 0.5*rhoGrid->delta,
+                                       zGrid->values[k] + 0.5*zGrid->delta));
+                }
+            }
+        }
+
+        //anywhere in the first and last cells in rho and in z
+        for (int i = 0; i < 10000; i++) {
+            double phi = (type == TORUS) ? randomDouble(0, 360) : 0;
+            double rhoFirst = randomDouble(rhoGrid->minVal, rhoGrid->minVal + rhoGrid->delta);
+            double rhoLast = randomDouble(rhoGrid->maxVal - rhoGrid->delta, rhoGrid->maxVal);
+            double zFirst = randomDouble(zGrid->minVal, zGrid->minVal + zGrid->delta);
+            double zLast = randomDouble(zGrid->maxVal - zGrid->delta, zGrid->maxVal);
+            double rho = randomDouble(rhoGrid->minVal, rhoGrid->maxVal);
+            double z = randomDouble(zGrid->minVal, zGrid->maxVal);
+
+            mu_assert("Interpolation is wrong in the first rho cell", isLinear(fieldPtr, phi, rhoFirst, z));
+            mu_assert("Interpolation is wrong in the last rho cell", isLinear(fieldPtr, phi, rhoLast, z));
+            mu_assert("Interpolation is wrong in the first z cell", isLinear(fieldPtr, phi, rho, zFirst));
+            mu_assert("Interpolation is wrong in the last z cell", isLinear(fieldPtr, phi, rho, zLast));
+            mu_assert("Interpolation is wrong in a corner cell", isLinear(fieldPtr, phi, rhoFirst, zLast) &&
+                                                                 isLinear(fieldPtr, phi, rhoLast, zFirst));
+        }
+
+        mu_assert("Interpolation is wrong at the grid's far edges",
+                  isLinear(fieldPtr, (type == TORUS) ? 360 : 0, rhoGrid->maxVal, zGrid->maxVal));
+        freeFieldMap(fieldPtr);
+    }
+
+    setAlgorithm(saveAlgorithm);
+    fprintf(stdout, "\nPASSED interpolationUnitTest\n");
+    return NULL;
+}
+
 /**
  * A unit test for the composite indexing
  * @return an error message if the test fails, or NULL if it passes.
@@ -663,12 +1681,12 @@ char *compositeIndexUnitTest() {
     bool result;
 
     for (int i = 0; i < count; i++) {
-        int compositeIndex = randomInt(0, testFieldPtr->numValues-1);
+        size_t compositeIndex = (size_t) (drand48() * testFieldPtr->numValues);
 
         //break it apart an put it back together.
         invertCompositeIndex(testFieldPtr, compositeIndex, &phiIndex, &rhoIndex, &zIndex);
 
-        int testIndex = getCompositeIndex(testFieldPtr, phiIndex, rhoIndex, zIndex);
+        size_t testIndex = getCompositeIndex(testFieldPtr, phiIndex, rhoIndex, zIndex);
         result = (testIndex == compositeIndex);
 
         mu_assert("Reconstructed index did not match composite index.", result);
@@ -684,8 +1702,8 @@ char *compositeIndexUnitTest() {
  * @param compositeIndex the composite index.
  * @return a pointer to the field value, or NULL if out of range.
  */
-FieldValuePtr getFieldAtIndex(MagneticFieldPtr fieldPtr, int compositeIndex) {
-    if ((compositeIndex < 0) || (compositeIndex > fieldPtr->numValues)) {
+FieldValuePtr getFieldAtIndex(MagneticFieldPtr fieldPtr, size_t compositeIndex) {
+    if (compositeIndex >= fieldPtr->numValues) {
         return NULL;
     }
     return fieldPtr->fieldValues + compositeIndex;
@@ -0,0 +1,609 @@
+//
+//  magfieldbdl.c
+//  cMag
+//
+//  A lookup table of the field integral along straight lines from the
+//  target. Seeding and fast simulation ask for the bending power in a
+//  direction many times per event, and integrating through the maps each
+//  time costs thousands of field evaluations. The table holds the
+//  integral of B x dl for a fine grid of polar angle, azimuth and
+//  (optionally) vertex z, built once in parallel with the cell walk of
+//  magfieldintegral.c, and is interpolated trilinearly in a few
+//  nanoseconds. A table depends on every map of the composite it was
+//  built from, with their scales and shifts, so it lives in a file of its
+//  own next to a map and carries a fingerprint of them; a stale table is
+//  refused on reading.
+//
+
+#include "magfieldbdl.h"
+#include "magfieldintegral.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+//the header of a table file, followed by the values
+typedef struct bdlfileheader {
+    unsigned int magicWord;   //BDLMAGICWORD
+    unsigned int version;     //BDLVERSION
+    unsigned int byteOrder;   //BYTEORDERMARK
+    unsigned int headerCrc;   //CRC32C of this structure with headerCrc = 0
+    unsigned int fingerprint; //of the composite the table was built from
+    unsigned int dataCrc;     //CRC32C of the values
+    unsigned int reserved1;   //reserved
+    unsigned int reserved2;   //reserved
+    BdlGrid grid;
+} BdlFileHeader;
+
+//the rows (one vertex and polar angle each) handed out to the threads
+typedef struct bdlwork {
+    BdlTablePtr tablePtr;
+    CompositeFieldPtr compositePtr;
+    unsigned int numRows;
+    unsigned int nextRow; //taken atomically
+} BdlWork;
+
+//local prototypes
+static BdlTablePtr allocateTable(const BdlGrid *);
+static bool validGrid(const BdlGrid *);
+static void *fillRows(void *);
+static void fillNode(CompositeProbePtr, const BdlGrid *, unsigned int, unsigned int, unsigned int, float *);
+static double nodeTheta(const BdlGrid *, unsigned int);
+static double nodeZ(const BdlGrid *, unsigned int);
+static double defaultLength(CompositeFieldPtr, const BdlGrid *);
+static size_t tableSize(const BdlGrid *);
+
+/**
+ * Build a table by integrating B x dl along a straight line from the
+ * vertex (0, 0, z) in the direction of every (theta, phi) node.
+ * @param compositePtr the maps to integrate through. The table records
+ * their fingerprint; if their scales or shifts change, rebuild it.
+ * @param gridPtr the directions and vertices.
+ * @param numThreads the threads to build with. If less than 1, one per
+ * online processor.
+ * @return the table, or NULL on error. Free it with freeBdlTable.
+ */
+BdlTablePtr buildBdlTable(CompositeFieldPtr compositePtr, const BdlGrid *gridPtr, int numThreads) {
+    if ((compositePtr == NULL) || !validGrid(gridPtr)) {
+        fprintf(stderr, "\ncMag ERROR bad grid or composite for a bdl table\n");
+        return NULL;
+    }
+
+    BdlGrid grid = *gridPtr;
+    if (grid.length <= 0) {
+        grid.length = defaultLength(compositePtr, &grid);
+    }
+
+    BdlTablePtr tablePtr = allocateTable(&grid);
+    if (tablePtr == NULL) {
+        return NULL;
+    }
+    tablePtr->fingerprint = compositeFingerprint(compositePtr);
+
+    BdlWork work;
+    work.tablePtr = tablePtr;
+    work.compositePtr = compositePtr;
+    work.numRows = grid.nZ * grid.nTheta;
+    work.nextRow = 0;
+
+    //the threads claim rows from the shared counter
+    runWorkers(fillRows, &work, 0, numWorkers(numThreads, work.numRows));
+
+    //rows no thread claimed were left because no thread had a probe
+    if (work.nextRow < work.numRows) {
+        fprintf(stderr, "\ncMag ERROR out of memory building a bdl table\n");
+        freeBdlTable(tablePtr);
+        return NULL;
+    }
+    return tablePtr;
+}
+
+/**
+ * Free a table.
+ * @param tablePtr the table, may be NULL.
+ */
+void freeBdlTable(BdlTablePtr tablePtr) {
+    if (tablePtr != NULL) {
+        free(tablePtr->values);
+        free(tablePtr);
+    }
+}
+
+/**
+ * Interpolate the integral of B x dl for a direction and vertex. The
+ * azimuth wraps; the polar angle and vertex z must be inside the table.
+ * @param tablePtr the table.
+ * @param theta the polar angle from the z axis in degrees.
+ * @param phi the azimuth in degrees, any value.
+ * @param z the vertex z in cm, ignored if the table has one vertex.
+ * @param bTheta will hold the component on the unit vector of theta, kG cm.
+ * @param bPhi will hold the component on the unit vector of phi, kG cm.
+ * @return false, with zero integrals, if theta or z is outside the table.
+ */
+bool lookupBdl(BdlTablePtr tablePtr, double theta, double phi, double z, double *bTheta, double *bPhi) {
+    BdlGrid *gridPtr = &(tablePtr->grid);
+    *bTheta = 0;
+    *bPhi = 0;
+
+    double u = (theta - gridPtr->thetaMin) * tablePtr->thetaNorm;
+    if (!(u >= 0) || (u > gridPtr->nTheta - 1)) {
+        return false;
+    }
+
+    double w = 0;
+    if (gridPtr->nZ > 1) {
+        w = (z - gridPtr->zMin) * tablePtr->zNorm;
+        if (!(w >= 0) || (w > gridPtr->nZ - 1)) {
+            return false;
+        }
+    }
+
+    double v = phi * tablePtr->phiNorm;
+    v -= gridPtr->nPhi * floor(v / gridPtr->nPhi);
+
+    unsigned int it = (unsigned int) u;
+    unsigned int ip = (unsigned int) v;
+    unsigned int iz = (unsigned int) w;
+    it = (it > gridPtr->nTheta - 2) ? gridPtr->nTheta - 2 : it;
+    ip = (ip >= gridPtr->nPhi) ? gridPtr->nPhi - 1 : ip;
+    iz = (gridPtr->nZ < 2) ? 0 : ((iz > gridPtr->nZ - 2) ? gridPtr->nZ - 2 : iz);
+
+    double ft = u - it;
+    double fp = v - ip;
+    double fz = w - iz;
+    unsigned int ipNext = (ip + 1 == gridPtr->nPhi) ? 0 : ip + 1;
+
+    size_t rowStride = 2 * (size_t) gridPtr->nPhi;
+    size_t zStride = rowStride * gridPtr->nTheta;
+    int numZ = (gridPtr->nZ > 1) ? 2 : 1;
+
+    double sum0 = 0, sum1 = 0;
+    for (int k = 0; k < numZ; k++) {
+        double weightZ = (numZ == 1) ? 1 : (k ? fz : 1 - fz);
+        const float *row = tablePtr->values + (iz + k) * zStride + it * rowStride;
+        for (int j = 0; j < 2; j++) {
+            double weight = weightZ * (j ? ft : 1 - ft);
+            const float *r = row + j * rowStride;
+            sum0 += weight * ((1 - fp) * r[2 * ip] + fp * r[2 * ipNext]);
+            sum1 += weight * ((1 - fp) * r[2 * ip + 1] + fp * r[2 * ipNext + 1]);
+        }
+    }
+
+    *bTheta = sum0;
+    *bPhi = sum1;
+    return true;
+}
+
+/**
+ * The transverse bending power for a direction and vertex: the magnitude
+ * of the integral of B x dl.
+ * @param tablePtr the table.
+ * @param theta the polar angle from the z axis in degrees.
+ * @param phi the azimuth in degrees.
+ * @param z the vertex z in cm.
+ * @return the bending power in kG cm, or -1 if outside the table.
+ */
+double lookupBendingPower(BdlTablePtr tablePtr, double theta, double phi, double z) {
+    double bTheta, bPhi;
+    if (!lookupBdl(tablePtr, theta, phi, z, &bTheta, &bPhi)) {
+        return -1;
+    }
+    return sqrt(bTheta * bTheta + bPhi * bPhi);
+}
+
+/**
+ * A fingerprint of the maps of a composite: their grids and units,
+ * scales and shifts, in order. The values are not included, so a map
+ * regenerated on the same grid is not detected.
+ * @param compositePtr the composite.
+ * @return the fingerprint.
+ */
+unsigned int compositeFingerprint(CompositeFieldPtr compositePtr) {
+    unsigned int crc = crc32c(0, &(compositePtr->numFields), sizeof(int));
+    for (int i = 0; i < compositePtr->numFields; i++) {
+        MagneticFieldPtr fieldPtr = compositePtr->fields[i];
+        double placement[4] = {fieldPtr->scale, fieldPtr->shiftX, fieldPtr->shiftY, fieldPtr->shiftZ};
+        crc = crc32c(crc, fieldPtr->headerPtr, sizeof(FieldMapHeader));
+        crc = crc32c(crc, placement, sizeof(placement));
+    }
+    return crc;
+}
+
+/**
+ * The path of the table kept alongside a map.
+ * @param mapPath the path of the map.
+ * @param path will hold the path of the table.
+ * @param size the size of path.
+ * @return path, or NULL if it is too small.
+ */
+char *bdlTablePath(const char *mapPath, char *path, size_t size) {
+    size_t length = strlen(mapPath) + strlen(BDLEXTENSION);
+    if (length >= size) {
+        return NULL;
+    }
+    snprintf(path, size, "%s%s", mapPath, BDLEXTENSION);
+    return path;
+}
+
+/**
+ * Write a table to a file in the byte order of this machine.
+ * @param tablePtr the table.
+ * @param path the path of the file, usually from bdlTablePath.
+ * @return true on success.
+ */
+bool writeBdlTable(BdlTablePtr tablePtr, const char *path) {
+    size_t dataSize = tableSize(&(tablePtr->grid));
+
+    BdlFileHeader header;
+    memset(&header, 0, sizeof(BdlFileHeader));
+    header.magicWord = BDLMAGICWORD;
+    header.version = BDLVERSION;
+    header.byteOrder = BYTEORDERMARK;
+    header.fingerprint = tablePtr->fingerprint;
+    header.dataCrc = crc32c(0, tablePtr->values, dataSize);
+    header.grid = tablePtr->grid;
+    header.headerCrc = crc32c(0, &header, sizeof(BdlFileHeader));
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not create bdl table file: [%s]\n", path);
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(BdlFileHeader), 1, file) == 1) &&
+              (fwrite(tablePtr->values, 1, dataSize, file) == dataSize);
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok) {
+        fprintf(stderr, "\ncMag ERROR failed writing bdl table file: [%s]\n", path);
+        remove(path);
+    }
+    return ok;
+}
+
+/**
+ * Read a table from a file. Tables are cheap to rebuild, so one written
+ * in the other byte order is refused rather than swapped.
+ * @param path the path of the file.
+ * @param compositePtr if not NULL, the table must have been built from
+ * maps with the same fingerprint.
+ * @return the table, or NULL if the file is missing, corrupt or stale.
+ */
+BdlTablePtr readBdlTable(const char *path, CompositeFieldPtr compositePtr) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not read bdl table file: [%s]\n", path);
+        return NULL;
+    }
+
+    BdlFileHeader header;
+    BdlTablePtr tablePtr = NULL;
+    const char *problem = NULL;
+
+    if (fread(&header, sizeof(BdlFileHeader), 1, file) != 1) {
+        problem = "short header";
+    } else if ((header.magicWord != BDLMAGICWORD) || (header.byteOrder != BYTEORDERMARK)) {
+        problem = "not a bdl table in the byte order of this machine";
+    } else if (header.version != BDLVERSION) {
+        problem = "unsupported version";
+    } else {
+        unsigned int headerCrc = header.headerCrc;
+        header.headerCrc = 0;
+        if (crc32c(0, &header, sizeof(BdlFileHeader)) != headerCrc) {
+            problem = "header checksum mismatch";
+        } else if (!validGrid(&(header.grid))) {
+            problem = "bad grid";
+        } else if ((compositePtr != NULL) && (header.fingerprint != compositeFingerprint(compositePtr))) {
+            problem = "built from different maps, scales or shifts";
+        }
+    }
+
+    if (problem == NULL) {
+        size_t dataSize = tableSize(&(header.grid));
+        tablePtr = allocateTable(&(header.grid));
+        if (tablePtr == NULL) {
+            problem = "out of memory";
+        } else if (fread(tablePtr->values, 1, dataSize, file) != dataSize) {
+            problem = "short data";
+        } else if (crc32c(0, tablePtr->values, dataSize) != header.dataCrc) {
+            problem = "data checksum mismatch";
+        } else {
+            tablePtr->fingerprint = header.fingerprint;
+        }
+    }
+    fclose(file);
+
+    if (problem != NULL) {
+        fprintf(stderr, "\ncMag ERROR rejecting bdl table file [%s]: %s\n", path, problem);
+        freeBdlTable(tablePtr);
+        return NULL;
+    }
+    return tablePtr;
+}
+
+/**
+ * Print a summary of a table.
+ * @param tablePtr the table.
+ * @param stream the stream to print to.
+ */
+void printBdlTable(BdlTablePtr tablePtr, FILE *stream) {
+    BdlGrid *gridPtr = &(tablePtr->grid);
+    fprintf(stream, "\nBDL TABLE fingerprint: %08x", tablePtr->fingerprint);
+    fprintf(stream, "\n  theta: [%-.2f, %-.2f] deg, %u values", gridPtr->thetaMin, gridPtr->thetaMax,
+            gridPtr->nTheta);
+    fprintf(stream, "\n    phi: [0, 360) deg, %u values", gridPtr->nPhi);
+    fprintf(stream, "\n vertex: [%-.2f, %-.2f] cm, %u values", gridPtr->zMin,
+            (gridPtr->nZ > 1) ? gridPtr->zMax : gridPtr->zMin, gridPtr->nZ);
+    fprintf(stream, "\n length: %-.2f cm, %-.1f kB\n", gridPtr->length, tableSize(gridPtr) / 1024.);
+}
+
+/**
+ * Allocate a table and cache the spacings of its grid.
+ * @param gridPtr the grid, already valid.
+ * @return the table with uninitialized values, or NULL.
+ */
+static BdlTablePtr allocateTable(const BdlGrid *gridPtr) {
+    BdlTablePtr tablePtr = (BdlTablePtr) malloc(sizeof(BdlTable));
+    float *values = (float *) malloc(tableSize(gridPtr));
+    if ((tablePtr == NULL) || (values == NULL)) {
+        fprintf(stderr, "\ncMag ERROR out of memory allocating a bdl table\n");
+        free(tablePtr);
+        free(values);
+        return NULL;
+    }
+
+    tablePtr->grid = *gridPtr;
+    tablePtr->fingerprint = 0;
+    tablePtr->values = values;
+    tablePtr->thetaNorm = (gridPtr->nTheta - 1) / (gridPtr->thetaMax - gridPtr->thetaMin);
+    tablePtr->phiNorm = gridPtr->nPhi / 360.0;
+    tablePtr->zNorm = (gridPtr->nZ > 1) ? (gridPtr->nZ - 1) / (gridPtr->zMax - gridPtr->zMin) : 0;
+    return tablePtr;
+}
+
+/**
+ * Check a grid: at least two polar angles and two azimuths, increasing
+ * ranges, polar angles inside [0, 180] and a size that does not overflow.
+ * @param gridPtr the grid.
+ * @return true if it is usable.
+ */
+static bool validGrid(const BdlGrid *gridPtr) {
+    if ((gridPtr == NULL) || (gridPtr->nTheta < 2) || (gridPtr->nPhi < 2) || (gridPtr->nZ < 1)) {
+        return false;
+    }
+    if (!(gridPtr->thetaMin >= 0) || !(gridPtr->thetaMax <= 180) || !(gridPtr->thetaMax > gridPtr->thetaMin)) {
+        return false;
+    }
+    if ((gridPtr->nZ > 1) && !(gridPtr->zMax > gridPtr->zMin)) {
+        return false;
+    }
+    if (!isfinite(gridPtr->zMin) || !isfinite(gridPtr->length)) {
+        return false;
+    }
+    double nodes = (double) gridPtr->nTheta * gridPtr->nPhi * gridPtr->nZ;
+    return 2 * sizeof(float) * nodes < (double) (SIZE_MAX / 2);
+}
+
+/**
+ * The body of a build thread: take rows until none are left, with a
+ * private probe of the composite.
+ * @param arg the shared BdlWork.
+ * @return NULL.
+ */
+static void *fillRows(void *arg) {
+    BdlWork *work = (BdlWork *) arg;
+    BdlTablePtr tablePtr = work->tablePtr;
+    const BdlGrid *gridPtr = &(tablePtr->grid);
+    CompositeProbePtr probePtr = createCompositeProbe(work->compositePtr);
+    if (probePtr == NULL) {
+        return NULL; //the rows are left to the other threads
+    }
+
+    while (true) {
+        unsigned int row = __atomic_fetch_add(&(work->nextRow), 1, __ATOMIC_RELAXED);
+        if (row >= work->numRows) {
+            break;
+        }
+        unsigned int iz = row / gridPtr->nTheta;
+        unsigned int it = row % gridPtr->nTheta;
+        float *values = tablePtr->values + 2 * (size_t) row * gridPtr->nPhi;
+        for (unsigned int ip = 0; ip < gridPtr->nPhi; ip++) {
+            fillNode(probePtr, gridPtr, iz, it, ip, values + 2 * ip);
+        }
+    }
+
+    freeCompositeProbe(probePtr);
+    return NULL;
+}
+
+/**
+ * Integrate along the line of one node.
+ * @param probePtr a private probe of the composite.
+ * @param gridPtr the grid.
+ * @param iz the vertex index.
+ * @param it the polar angle index.
+ * @param ip the azimuth index.
+ * @param node will hold the theta and phi components.
+ */
+static void fillNode(CompositeProbePtr probePtr, const BdlGrid *gridPtr, unsigned int iz, unsigned int it,
+                     unsigned int ip, float *node) {
+    double theta = toRadians(nodeTheta(gridPtr, it));
+    double phi = toRadians((360.0 * ip) / gridPtr->nPhi);
+    double cosTheta = cos(theta), sinTheta = sin(theta);
+    double cosPhi = cos(phi), sinPhi = sin(phi);
+
+    double start[3] = {0, 0, nodeZ(gridPtr, iz)};
+    double end[3] = {gridPtr->length * sinTheta * cosPhi, gridPtr->length * sinTheta * sinPhi,
+                     start[2] + gridPtr->length * cosTheta};
+
+    FieldIntegral integral;
+    integrateCompositeLine(probePtr, start, end, &integral);
+
+    double *bxdl = integral.bCrossDl;
+    node[0] = (float) (cosTheta * (cosPhi * bxdl[0] + sinPhi * bxdl[1]) - sinTheta * bxdl[2]);
+    node[1] = (float) (cosPhi * bxdl[1] - sinPhi * bxdl[0]);
+}
+
+/**
+ * The polar angle of a row.
+ * @param gridPtr the grid.
+ * @param it the polar angle index.
+ * @return the angle in degrees.
+ */
+static double nodeTheta(const BdlGrid *gridPtr, unsigned int it) {
+    return gridPtr->thetaMin + ((gridPtr->thetaMax - gridPtr->thetaMin) * it) / (gridPtr->nTheta - 1);
+}
+
+/**
+ * The vertex z of a plane of the table.
+ * @param gridPtr the grid.
+ * @param iz the vertex index.
+ * @return the vertex z in cm.
+ */
+static double nodeZ(const BdlGrid *gridPtr, unsigned int iz) {
+    if (gridPtr->nZ < 2) {
+        return gridPtr->zMin;
+    }
+    return gridPtr->zMin + ((gridPtr->zMax - gridPtr->zMin) * iz) / (gridPtr->nZ - 1);
+}
+
+/**
+ * A line length that leaves the bounding volumes of all the maps from
+ * any vertex of the table.
+ * @param compositePtr the composite.
+ * @param gridPtr the grid.
+ * @return the length in cm.
+ */
+static double defaultLength(CompositeFieldPtr compositePtr, const BdlGrid *gridPtr) {
+    double rhoMaxSq = 0;
+    for (int i = 0; i < compositePtr->numFields; i++) {
+        rhoMaxSq = fmax(rhoMaxSq, compositePtr->bounds[i].rhoMaxSq);
+    }
+    double zVertexMax = fmax(fabs(gridPtr->zMin), fabs(nodeZ(gridPtr, gridPtr->nZ - 1)));
+    double zMax = fmax(fabs(compositePtr->zMin), fabs(compositePtr->zMax));
+    return sqrt(rhoMaxSq + zMax * zMax) + zVertexMax + 1;
+}
+
+/**
+ * The size of the values of a table.
+ * @param gridPtr the grid.
+ * @return the size in bytes.
+ */
+static size_t tableSize(const BdlGrid *gridPtr) {
+    return 2 * sizeof(float) * (size_t) gridPtr->nTheta * gridPtr->nPhi * gridPtr->nZ;
+}
+
+/**
+ * A unit test of the table: a threaded build matches a serial one and a
+ * direct integral at every node, the interpolation is linear between
+ * nodes and wraps in phi, and files round trip and refuse stale or
+ * corrupt tables.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *bdlUnitTest() {
+    const char *path = "cMagBdlUnitTest.bdl";
+
+    CompositeFieldPtr compositePtr = createCompositeField(&testFieldPtr, 1);
+    mu_assert("Could not create the composite", compositePtr != NULL);
+
+    BdlGrid grid = {5, 45, -5, 5, 0, 9, 36, 2, 0};
+    BdlTablePtr serialPtr = buildBdlTable(compositePtr, &grid, 1);
+    BdlTablePtr tablePtr = buildBdlTable(compositePtr, &grid, 3);
+    mu_assert("Could not build the tables", (serialPtr != NULL) && (tablePtr != NULL));
+    mu_assert("The threaded table differs from the serial one",
+              memcmp(serialPtr->values, tablePtr->values, tableSize(&(tablePtr->grid))) == 0);
+    freeBdlTable(serialPtr);
+
+    BdlGrid bad = grid;
+    bad.nTheta = 1;
+    mu_assert("A bad grid was accepted", buildBdlTable(compositePtr, &bad, 1) == NULL);
+
+    //every node is the integral through the map, and the table is not trivial
+    CompositeProbePtr probePtr = createCompositeProbe(compositePtr);
+    mu_assert("Could not create a probe of the composite", probePtr != NULL);
+    double maxPower = 0;
+    double bTheta, bPhi;
+    for (unsigned int iz = 0; iz < grid.nZ; iz++) {
+        for (unsigned int it = 0; it < grid.nTheta; it++) {
+            for (unsigned int ip = 0; ip < grid.nPhi; ip++) {
+                float node[2];
+                fillNode(probePtr, &(tablePtr->grid), iz, it, ip, node);
+                bool inside = lookupBdl(tablePtr, nodeTheta(&grid, it), (360.0 * ip) / grid.nPhi,
+                                        nodeZ(&grid, iz), &bTheta, &bPhi);
+                mu_assert("A node was outside the table", inside);
+                double scale = 1.0e-6 * (1 + fabs(node[0]) + fabs(node[1]));
+                mu_assert("A node differs from a direct integral",
+                          (fabs(bTheta - node[0]) < scale) && (fabs(bPhi - node[1]) < scale));
+                maxPower = fmax(maxPower, hypot(bTheta, bPhi));
+            }
+        }
+    }
+    freeCompositeProbe(probePtr);
+    mu_assert("The table has no bending power", maxPower > 0);
+
+    //the centre of a cell is the mean of its eight corners
+    double dTheta = (grid.thetaMax - grid.thetaMin) / (grid.nTheta - 1);
+    double dPhi = 360.0 / grid.nPhi;
+    double meanTheta = 0, meanPhi = 0;
+    for (int k = 0; k < 8; k++) {
+        lookupBdl(tablePtr, grid.thetaMin + 3 * dTheta + (k & 1) * dTheta, 350 + ((k >> 1) & 1) * dPhi,
+                  grid.zMin + ((k >> 2) & 1) * (grid.zMax - grid.zMin), &bTheta, &bPhi);
+        meanTheta += bTheta / 8;
+        meanPhi += bPhi / 8;
+    }
+    lookupBdl(tablePtr, grid.thetaMin + 3.5 * dTheta, 355, 0, &bTheta, &bPhi);
+    mu_assert("The interpolation is not trilinear",
+              (fabs(bTheta - meanTheta) < 1.0e-6 * maxPower) && (fabs(bPhi - meanPhi) < 1.0e-6 * maxPower));
+
+    //phi wraps, and theta and z outside the table are refused
+    double wrapTheta, wrapPhi;
+    lookupBdl(tablePtr, 20, 359.5, 1, &bTheta, &bPhi);
+    lookupBdl(tablePtr, 20, -0.5, 1, &wrapTheta, &wrapPhi);
+    mu_assert("Phi does not wrap", (fabs(bTheta - wrapTheta) < 1.0e-9 * maxPower) &&
+                                   (fabs(bPhi - wrapPhi) < 1.0e-9 * maxPower));
+    mu_assert("A polar angle outside the table was accepted", !lookupBdl(tablePtr, 50, 0, 0, &bTheta, &bPhi));
+    mu_assert("A vertex outside the table was accepted", lookupBendingPower(tablePtr, 20, 0, 6) < 0);
+
+    //a file round trip
+    char tablePath[256];
+    mu_assert("The table path is wrong",
+              strcmp(bdlTablePath("map.dat", tablePath, sizeof(tablePath)), "map.dat" BDLEXTENSION) == 0);
+    mu_assert("A short path buffer was accepted", bdlTablePath("map.dat", tablePath, 8) == NULL);
+    mu_assert("Could not write the table", writeBdlTable(tablePtr, path));
+
+    BdlTablePtr readPtr = readBdlTable(path, compositePtr);
+    mu_assert("Could not read the table", readPtr != NULL);
+    mu_assert("The table read differs", (memcmp(&(readPtr->grid), &(tablePtr->grid), sizeof(BdlGrid)) == 0) &&
+              (memcmp(readPtr->values, tablePtr->values, tableSize(&(tablePtr->grid))) == 0));
+    freeBdlTable(readPtr);
+
+    //a table of the maps at a different scale is stale
+    double scale = testFieldPtr->scale;
+    testFieldPtr->scale = 0.5 * scale;
+    fprintf(stdout, "\nexpect an error for a stale bdl table:");
+    readPtr = readBdlTable(path, compositePtr);
+    testFieldPtr->scale = scale;
+    mu_assert("A stale table was accepted", readPtr == NULL);
+
+    //flip one bit of the values
+    FILE *file = fopen(path, "r+b");
+    mu_assert("Could not reopen the table", file != NULL);
+    fseek(file, sizeof(BdlFileHeader) + 100, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, sizeof(BdlFileHeader) + 100, SEEK_SET);
+    fputc(c ^ 0x10, file);
+    fclose(file);
+
+    fprintf(stdout, "\nexpect a checksum error for the corrupted bdl table:");
+    readPtr = readBdlTable(path, NULL);
+    remove(path);
+    mu_assert("A corrupted table was accepted", readPtr == NULL);
+
+    freeBdlTable(tablePtr);
+    freeCompositeField(compositePtr);
+    fprintf(stdout, "\nPASSED bdlUnitTest\n");
+    return NULL;
+}
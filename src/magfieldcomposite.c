@@ -0,0 +1,484 @@
+//
+//  magfieldcomposite.c
+//  cMag
+//
+//  A composite of any number of field maps. getCompositeFieldValue sums
+//  exactly two maps and evaluates both for every point, although the
+//  solenoid covers a small region. Here each map gets a bounding volume
+//  in the lab (its grid, grown by any shift), and an index of z bins
+//  lists the maps that overlap each bin. A query looks up its bin, checks
+//  the few bounding volumes listed there, and evaluates only the maps
+//  that can contain the point, so a magnet far down the beam line costs
+//  nothing to queries in the detector.
+//
+
+#include "magfieldcomposite.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//bounding volumes are grown by these so that rounding in the square of
+//rho, or in a shift, can never exclude a point the map itself contains
+#define RELATIVE_PAD 1.0e-9
+#define Z_PAD 1.0e-6
+
+//local prototypes
+static void computeBounds(MagneticFieldPtr, FieldBoundsPtr);
+static void buildIndex(CompositeFieldPtr);
+static const int *candidates(CompositeFieldPtr, double, int *);
+static bool inBounds(FieldBoundsPtr, double, double);
+
+/**
+ * Create a composite of field maps. The maps are not copied and must
+ * outlive the composite. If a map's shifts change, call
+ * refreshCompositeField.
+ * @param fields the maps, in the order their values are summed.
+ * @param numFields the number of maps.
+ * @return the composite, or NULL on error. Free it with freeCompositeField.
+ */
+CompositeFieldPtr createCompositeField(MagneticFieldPtr *fields, int numFields) {
+    if ((fields == NULL) || (numFields < 1)) {
+        fprintf(stderr, "\ncMag ERROR a composite field needs at least one map.\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < numFields; i++) {
+        if (fields[i] == NULL) {
+            fprintf(stderr, "\ncMag ERROR map %d of a composite field is NULL.\n", i);
+            return NULL;
+        }
+    }
+
+    CompositeFieldPtr compositePtr = (CompositeFieldPtr) calloc(1, sizeof(CompositeField));
+    if (compositePtr != NULL) {
+        compositePtr->numFields = numFields;
+        compositePtr->fields = (MagneticFieldPtr *) malloc(numFields * sizeof(MagneticFieldPtr));
+        compositePtr->bounds = (FieldBoundsPtr) malloc(numFields * sizeof(FieldBounds));
+        compositePtr->binStart = (int *) malloc((CMAG_COMPOSITE_ZBINS + 1) * sizeof(int));
+        compositePtr->binFields = (int *) malloc(CMAG_COMPOSITE_ZBINS * numFields * sizeof(int));
+    }
+
+    if ((compositePtr == NULL) || (compositePtr->fields == NULL) || (compositePtr->bounds == NULL) ||
+        (compositePtr->binStart == NULL) || (compositePtr->binFields == NULL)) {
+        fprintf(stderr, "\ncMag ERROR out of memory creating a composite of %d maps.\n", numFields);
+        freeCompositeField(compositePtr);
+        return NULL;
+    }
+
+    memcpy(compositePtr->fields, fields, numFields * sizeof(MagneticFieldPtr));
+    refreshCompositeField(compositePtr);
+    return compositePtr;
+}
+
+/**
+ * Free a composite. Its maps are not affected.
+ * @param compositePtr the composite.
+ */
+void freeCompositeField(CompositeFieldPtr compositePtr) {
+    if (compositePtr == NULL) {
+        return;
+    }
+    free(compositePtr->fields);
+    free(compositePtr->bounds);
+    free(compositePtr->binStart);
+    free(compositePtr->binFields);
+    free(compositePtr);
+}
+
+/**
+ * Recompute the bounding volumes and the index, for example after a
+ * map's shifts were changed.
+ * @param compositePtr the composite.
+ */
+void refreshCompositeField(CompositeFieldPtr compositePtr) {
+    for (int i = 0; i < compositePtr->numFields; i++) {
+        computeBounds(compositePtr->fields[i], compositePtr->bounds + i);
+    }
+    buildIndex(compositePtr);
+}
+
+/**
+ * Compute the bounding volume of a map in the lab. A transverse shift
+ * moves the map's axis off the beam line, so the rho range grows by the
+ * size of the shift.
+ * @param fieldPtr the map.
+ * @param boundsPtr upon return, the map's bounding volume.
+ */
+static void computeBounds(MagneticFieldPtr fieldPtr, FieldBoundsPtr boundsPtr) {
+    double shift = hypot(fieldPtr->shiftX, fieldPtr->shiftY);
+    double rhoMin = fieldPtr->rhoGridPtr->minVal - shift;
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal + shift;
+
+    rhoMin = (rhoMin > 0) ? rhoMin * (1 - RELATIVE_PAD) : 0;
+    rhoMax *= (1 + RELATIVE_PAD);
+
+    boundsPtr->rhoMinSq = rhoMin * rhoMin;
+    boundsPtr->rhoMaxSq = rhoMax * rhoMax;
+    boundsPtr->zMin = fieldPtr->zGridPtr->minVal + fieldPtr->shiftZ - Z_PAD;
+    boundsPtr->zMax = fieldPtr->zGridPtr->maxVal + fieldPtr->shiftZ + Z_PAD;
+}
+
+/**
+ * Build the index: CMAG_COMPOSITE_ZBINS equal bins over the z range of
+ * all the maps, each listing the maps whose bounds overlap it.
+ * @param compositePtr the composite, with its bounds computed.
+ */
+static void buildIndex(CompositeFieldPtr compositePtr) {
+    FieldBoundsPtr bounds = compositePtr->bounds;
+    double zMin = bounds[0].zMin;
+    double zMax = bounds[0].zMax;
+
+    for (int i = 1; i < compositePtr->numFields; i++) {
+        zMin = fmin(zMin, bounds[i].zMin);
+        zMax = fmax(zMax, bounds[i].zMax);
+    }
+
+    compositePtr->zMin = zMin;
+    compositePtr->zMax = zMax;
+    compositePtr->zBinNorm = CMAG_COMPOSITE_ZBINS / (zMax - zMin);
+
+    double binWidth = (zMax - zMin) / CMAG_COMPOSITE_ZBINS;
+    int count = 0;
+
+    for (int bin = 0; bin < CMAG_COMPOSITE_ZBINS; bin++) {
+        double binLow = zMin + bin * binWidth;
+        double binHigh = binLow + binWidth;
+        compositePtr->binStart[bin] = count;
+
+        for (int i = 0; i < compositePtr->numFields; i++) {
+            if ((bounds[i].zMin <= binHigh) && (bounds[i].zMax >= binLow)) {
+                compositePtr->binFields[count++] = i;
+            }
+        }
+    }
+    compositePtr->binStart[CMAG_COMPOSITE_ZBINS] = count;
+}
+
+/**
+ * Find the maps that might contain a value of z.
+ * @param compositePtr the composite.
+ * @param z the z coordinate in cm.
+ * @param num upon return, the number of candidate maps.
+ * @return the indices of the candidate maps.
+ */
+static const int *candidates(CompositeFieldPtr compositePtr, double z, int *num) {
+    if ((z < compositePtr->zMin) || (z > compositePtr->zMax)) {
+        *num = 0;
+        return NULL;
+    }
+
+    int bin = (int) ((z - compositePtr->zMin) * compositePtr->zBinNorm);
+    if (bin >= CMAG_COMPOSITE_ZBINS) {
+        bin = CMAG_COMPOSITE_ZBINS - 1;
+    }
+
+    int start = compositePtr->binStart[bin];
+    *num = compositePtr->binStart[bin + 1] - start;
+    return compositePtr->binFields + start;
+}
+
+/**
+ * Check whether a point is inside a bounding volume.
+ * @param boundsPtr the bounding volume.
+ * @param rhoSq the square of the distance from the beam line.
+ * @param z the z coordinate in cm.
+ * @return true if the point is inside.
+ */
+static bool inBounds(FieldBoundsPtr boundsPtr, double rhoSq, double z) {
+    return (z >= boundsPtr->zMin) && (z <= boundsPtr->zMax) &&
+           (rhoSq >= boundsPtr->rhoMinSq) && (rhoSq <= boundsPtr->rhoMaxSq);
+}
+
+/**
+ * Obtain the summed value of the maps of a composite. Only maps whose
+ * bounding volumes contain the point are evaluated. Like getFieldValue
+ * this uses the maps' own cells, so it is not thread safe; threads should
+ * use getCompositeProbeValue.
+ * @param fieldValuePtr upon return holds the field in kG, in Cartesian
+ * components Bx, By, Bz.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param compositePtr the composite.
+ */
+void getCompositeValue(FieldValuePtr fieldValuePtr,
+                       double x,
+                       double y,
+                       double z,
+                       CompositeFieldPtr compositePtr) {
+
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    int num;
+    const int *list = candidates(compositePtr, z, &num);
+    if (num == 0) {
+        return;
+    }
+
+    double rhoSq = x*x + y*y;
+    FieldValue temp;
+
+    for (int i = 0; i < num; i++) {
+        int index = list[i];
+        if (inBounds(compositePtr->bounds + index, rhoSq, z)) {
+            getFieldValue(&temp, x, y, z, compositePtr->fields[index]);
+            fieldValuePtr->b1 += temp.b1;
+            fieldValuePtr->b2 += temp.b2;
+            fieldValuePtr->b3 += temp.b3;
+        }
+    }
+}
+
+/**
+ * Obtain the summed value of the maps of a composite at many points.
+ * The batch form of getCompositeValue.
+ * @param fieldValues space for num values. Upon return, the field at each
+ * point in kG, in Cartesian components.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param num the number of points.
+ * @param compositePtr the composite.
+ */
+void getCompositeValues(FieldValuePtr fieldValues,
+                        const double *x,
+                        const double *y,
+                        const double *z,
+                        size_t num,
+                        CompositeFieldPtr compositePtr) {
+
+    for (size_t i = 0; i < num; i++) {
+        getCompositeValue(fieldValues + i, x[i], y[i], z[i], compositePtr);
+    }
+}
+
+/**
+ * Create a probe of a composite: a probe of each of its maps, for the
+ * private use of one thread. Create it on the thread that uses it.
+ * @param compositePtr the composite.
+ * @return the probe, or NULL if out of memory. Free it with freeCompositeProbe.
+ */
+CompositeProbePtr createCompositeProbe(CompositeFieldPtr compositePtr) {
+    CompositeProbePtr probePtr = (CompositeProbePtr) malloc(sizeof(CompositeProbe));
+    FieldProbePtr *probes = (FieldProbePtr *) malloc(compositePtr->numFields * sizeof(FieldProbePtr));
+    if ((probePtr == NULL) || (probes == NULL)) {
+        fprintf(stderr, "\ncMag ERROR out of memory creating a probe of a composite.\n");
+        free(probePtr);
+        free(probes);
+        return NULL;
+    }
+
+    probePtr->compositePtr = compositePtr;
+    probePtr->probes = probes;
+
+    for (int i = 0; i < compositePtr->numFields; i++) {
+        probePtr->probes[i] = createProbe(compositePtr->fields[i]);
+    }
+    return probePtr;
+}
+
+/**
+ * Free a probe of a composite. The composite is not affected.
+ * @param probePtr the probe.
+ */
+void freeCompositeProbe(CompositeProbePtr probePtr) {
+    if (probePtr == NULL) {
+        return;
+    }
+    for (int i = 0; i < probePtr->compositePtr->numFields; i++) {
+        freeProbe(probePtr->probes[i]);
+    }
+    free(probePtr->probes);
+    free(probePtr);
+}
+
+/**
+ * Obtain the summed value of the maps of a composite through a probe.
+ * The thread safe form of getCompositeValue.
+ * @param fieldValuePtr upon return holds the field in kG, in Cartesian
+ * components Bx, By, Bz.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a probe of the composite.
+ */
+void getCompositeProbeValue(FieldValuePtr fieldValuePtr,
+                            double x,
+                            double y,
+                            double z,
+                            CompositeProbePtr probePtr) {
+
+    CompositeFieldPtr compositePtr = probePtr->compositePtr;
+
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    int num;
+    const int *list = candidates(compositePtr, z, &num);
+    if (num == 0) {
+        return;
+    }
+
+    double rhoSq = x*x + y*y;
+    FieldValue temp;
+
+    for (int i = 0; i < num; i++) {
+        int index = list[i];
+        if (inBounds(compositePtr->bounds + index, rhoSq, z)) {
+            getProbeFieldValue(&temp, x, y, z, probePtr->probes[index]);
+            fieldValuePtr->b1 += temp.b1;
+            fieldValuePtr->b2 += temp.b2;
+            fieldValuePtr->b3 += temp.b3;
+        }
+    }
+}
+
+/**
+ * Obtain the summed value of the maps of a composite at many points
+ * through a probe. The batch form of getCompositeProbeValue; nearby
+ * consecutive points share the probes' cached cells.
+ * @param fieldValues space for num values. Upon return, the field at each
+ * point in kG, in Cartesian components.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param num the number of points.
+ * @param probePtr a probe of the composite.
+ */
+void getCompositeProbeValues(FieldValuePtr fieldValues,
+                             const double *x,
+                             const double *y,
+                             const double *z,
+                             size_t num,
+                             CompositeProbePtr probePtr) {
+
+    for (size_t i = 0; i < num; i++) {
+        getCompositeProbeValue(fieldValues + i, x[i], y[i], z[i], probePtr);
+    }
+}
+
+/**
+ * Print the maps of a composite, their bounds and the index occupancy.
+ * @param compositePtr the composite.
+ * @param stream a file stream, e.g. stdout.
+ */
+void printCompositeField(CompositeFieldPtr compositePtr, FILE *stream) {
+    fprintf(stream, "composite of %d maps, z [%-8.2f, %-8.2f] cm in %d bins\n",
+            compositePtr->numFields, compositePtr->zMin, compositePtr->zMax, CMAG_COMPOSITE_ZBINS);
+
+    for (int i = 0; i < compositePtr->numFields; i++) {
+        FieldBoundsPtr boundsPtr = compositePtr->bounds + i;
+        fprintf(stream, "  %-30s rho [%-8.2f, %-8.2f]  z [%-8.2f, %-8.2f]\n",
+                compositePtr->fields[i]->name, sqrt(boundsPtr->rhoMinSq), sqrt(boundsPtr->rhoMaxSq),
+                boundsPtr->zMin, boundsPtr->zMax);
+    }
+
+    fprintf(stream, "maps per bin: %-5.2f\n",
+            (double) compositePtr->binStart[CMAG_COMPOSITE_ZBINS] / CMAG_COMPOSITE_ZBINS);
+}
+
+/**
+ * Read another copy of a map, the way it was first read.
+ * @param fieldPtr the map.
+ * @return the copy, or NULL on failure.
+ */
+static MagneticFieldPtr copyField(MagneticFieldPtr fieldPtr) {
+    return (fieldPtr->type == TORUS) ? initializeTorus(fieldPtr->path) : initializeSolenoid(fieldPtr->path);
+}
+
+/**
+ * A unit test for composites. A composite of a map and a copy must match
+ * getCompositeFieldValue exactly. Then a third copy, scaled and moved down
+ * the beam line, stands in for a beamline magnet: the composite must
+ * match the sum of the maps everywhere, and the index must keep the
+ * magnet out of the bins of the original map.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *compositeUnitTest() {
+    MagneticFieldPtr copy = copyField(testFieldPtr);
+    MagneticFieldPtr magnet = copyField(testFieldPtr);
+    mu_assert("Could not read copies of the map", (copy != NULL) && (magnet != NULL));
+
+    double zLength = testFieldPtr->zGridPtr->maxVal - testFieldPtr->zGridPtr->minVal;
+    double rhoMax = testFieldPtr->rhoGridPtr->maxVal;
+    magnet->shiftZ = 2 * zLength;
+    magnet->shiftX = 5;
+    magnet->scale = 0.5;
+
+    MagneticFieldPtr fields[] = {testFieldPtr, copy, magnet};
+    CompositeFieldPtr pairPtr = createCompositeField(fields, 2);
+    CompositeFieldPtr compositePtr = createCompositeField(fields, 3);
+    mu_assert("Could not create the composites", (pairPtr != NULL) && (compositePtr != NULL));
+    mu_assert("An empty composite was accepted", createCompositeField(fields, 0) == NULL);
+
+    //the first third of the bins cover the original map only
+    for (int bin = 0; bin < CMAG_COMPOSITE_ZBINS/3; bin++) {
+        for (int i = compositePtr->binStart[bin]; i < compositePtr->binStart[bin + 1]; i++) {
+            mu_assert("The magnet was indexed in the bins of the map", compositePtr->binFields[i] != 2);
+        }
+    }
+
+    int count = 20000;
+    double x[count], y[count], z[count];
+    FieldValue values[count];
+    double zMin = testFieldPtr->zGridPtr->minVal - 10;
+
+    for (int i = 0; i < count; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(0, 1.2*rhoMax);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+        z[i] = randomDouble(zMin, zMin + 3.5*zLength);
+    }
+
+    FieldValue expected, other, actual;
+    double tolerance = 1.0e-5 * (1.0 + testFieldPtr->metricsPtr->maxFieldMagnitude);
+
+    for (int i = 0; i < count; i++) {
+        getCompositeFieldValue(&expected, x[i], y[i], z[i], testFieldPtr, copy);
+        getCompositeValue(&actual, x[i], y[i], z[i], pairPtr);
+        mu_assert("The pair composite differs from getCompositeFieldValue",
+                  (actual.b1 == expected.b1) && (actual.b2 == expected.b2) && (actual.b3 == expected.b3));
+
+        getFieldValue(&other, x[i], y[i], z[i], magnet);
+        getCompositeValue(&actual, x[i], y[i], z[i], compositePtr);
+        mu_assert("The composite differs from the sum of its maps",
+                  (fabs(actual.b1 - expected.b1 - other.b1) < tolerance) &&
+                  (fabs(actual.b2 - expected.b2 - other.b2) < tolerance) &&
+                  (fabs(actual.b3 - expected.b3 - other.b3) < tolerance));
+    }
+
+    //the batch and probe forms must agree with the scalar form
+    CompositeProbePtr probePtr = createCompositeProbe(compositePtr);
+    mu_assert("Could not create a probe of the composite", probePtr != NULL);
+    getCompositeProbeValues(values, x, y, z, count, probePtr);
+    for (int i = 0; i < count; i++) {
+        getCompositeValue(&actual, x[i], y[i], z[i], compositePtr);
+        mu_assert("The probe batch differs from the scalar composite",
+                  (actual.b1 == values[i].b1) && (actual.b2 == values[i].b2) && (actual.b3 == values[i].b3));
+    }
+
+    getCompositeValues(values, x, y, z, count, compositePtr);
+    getCompositeProbeValue(&actual, x[count-1], y[count-1], z[count-1], probePtr);
+    mu_assert("The batch differs from the probe",
+              (actual.b1 == values[count-1].b1) && (actual.b3 == values[count-1].b3));
+
+    //moving the magnet back over the map puts it in every bin
+    magnet->shiftZ = 0;
+    refreshCompositeField(compositePtr);
+    mu_assert("The refreshed index is wrong", compositePtr->binStart[CMAG_COMPOSITE_ZBINS] == 3*CMAG_COMPOSITE_ZBINS);
+
+    freeCompositeProbe(probePtr);
+    freeCompositeField(pairPtr);
+    freeCompositeField(compositePtr);
+    freeFieldMap(copy);
+    freeFieldMap(magnet);
+
+    fprintf(stdout, "\nPASSED compositeUnitTest\n");
+    return NULL;
+}
@@ -6,6 +6,309 @@
 #include "svg.h"
 #include "mapcolor.h"
 #include "magfieldutil.h"
+#include "magfieldio.h"
+#include "magfieldmagnitude.h"
+#include "raster.h"
+#include "contour.h"
+#include "magfieldlines.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//pixels per side of the tiles an image is evaluated in
+#define DRAW_TILE 32
+
+//the region of the images at fixed phi, cm
+#define FIXED_PHI_ZMIN  -100
+#define FIXED_PHI_ZMAX   500
+#define FIXED_PHI_RHOMAX 360
+
+//the threads that evaluate an image, 0 for one per online processor
+static volatile int drawThreads = 0;
+
+//draw the field as one embedded raster image rather than a rectangle per
+//pixel, and the size of a raster pixel in cm
+static volatile bool drawRaster = true;
+static volatile double drawPixelSize = 2;
+
+//draw the field as iso-lines at the thresholds of the color map, over the
+//raster's grid, rather than as colors
+static volatile bool drawContours = false;
+
+//how far thinned iso-lines may stray from the traced ones, svg pixels
+#define CONTOUR_TOLERANCE 0.25
+
+//arrows of the field in the plane of a slice, on a grid this many cm
+//apart, 0 for none
+static volatile double drawArrowSpacing = 0;
+
+//field lines in the plane of a slice, traced both ways from a grid of
+//this many seeds a side, 0 for none
+static volatile int drawLineSeeds = 0;
+
+//the field lines are drawn through points at least this far apart, and
+//their steps stray at most this far from the line, svg pixels
+#define LINE_SPACING   2
+#define LINE_TOLERANCE 0.05
+
+//the color map of the images, NULL for the default
+static ColorMapPtr drawColorMap = NULL;
+
+//the most rows of the color legend
+#define MAX_LEGEND_ROWS 73
+
+//the |B| of every pixel of an image, evaluated a tile at a time by a pool
+//of threads, each with its own probes, then written out in order
+typedef struct drawwork {
+    MagneticFieldPtr torus;    //can be NULL
+    MagneticFieldPtr solenoid; //can be NULL
+    bool fixedPhi;             //true for rho vs z at fixed phi, false for y vs x at fixed z
+    double fixed;              //the fixed z in cm or phi in degrees
+    double col0;               //the x or z of the first column, cm
+    double colStep;            //from column to column, cm
+    double row0;               //the y or rho of the first row, cm
+    double rowStep;            //from row to row, cm
+    int numCols;
+    int numRows;
+    int tileCols;              //tiles across a row of tiles
+    unsigned int numTiles;
+    unsigned int nextTile;     //taken atomically
+    double *magnitudes;        //numRows x numCols, row by row
+} DrawWork;
+
+//the grid lines of an image, written as one path
+#define MAX_GRID_LINES 32
+typedef struct gridlines {
+    int num;
+    int lengths[MAX_GRID_LINES];
+    int x[2 * MAX_GRID_LINES];
+    int y[2 * MAX_GRID_LINES];
+} GridLines;
+
+//where the region of a slice is drawn: u is x at fixed z and z at fixed
+//phi, v is y or rho, and the region's top left corner is at left, top.
+//u grows to the right, and v down at fixed z and up at fixed phi.
+typedef struct sliceframe {
+    double umin;
+    double umax;
+    double vmin;
+    double vmax;
+    int left;
+    int top;
+} SliceFrame;
+
+//local prototypes
+static void addGridLine(GridLines *, int, int, int, int);
+static void drawLegend(svg *, ColorMapPtr, int, int);
+static double fixedZExtent(double);
+static void rasterGrid(DrawWork *, double, double, double, double);
+static bool drawRasterImage(svg *, DrawWork *, ColorMapPtr, int, int, int, int);
+static bool drawContourImage(svg *, DrawWork *, ColorMapPtr, int, int, int, int);
+static unsigned char *colorPixels(const DrawWork *, ColorMapPtr);
+static bool writeFieldRaster(const char *, DrawWork *);
+static void drawOverlays(svg *, const DrawWork *, const SliceFrame *);
+static bool drawArrows(svg *, const DrawWork *, const SliceFrame *, double);
+static bool drawFieldLines(svg *, const DrawWork *, const SliceFrame *, int);
+static void slicePoint(const DrawWork *, double, double, double *);
+static bool evaluateImage(DrawWork *);
+static void *evaluateTiles(void *);
+static void evaluateTile(DrawWork *, unsigned int, FieldProbePtr, FieldProbePtr);
+
+/**
+ * Pick up the number of drawing threads from the CMAG_DRAW_THREADS
+ * environment variable when the library is loaded.
+ */
+__attribute__((constructor))
+static void initDrawThreads() {
+    const char *env = getenv("CMAG_DRAW_THREADS");
+    if (env != NULL) {
+        drawThreads = atoi(env);
+    }
+}
+
+/**
+ * Pick up the raster options from the CMAG_DRAW_RASTER (0 to draw
+ * rectangles) and CMAG_DRAW_PIXEL (the pixel size in cm) environment
+ * variables when the library is loaded.
+ */
+__attribute__((constructor))
+static void initDrawRaster() {
+    const char *env = getenv("CMAG_DRAW_RASTER");
+    if (env != NULL) {
+        drawRaster = (strcmp(env, "0") != 0);
+    }
+    env = getenv("CMAG_DRAW_PIXEL");
+    if (env != NULL) {
+        setDrawPixelSize(atof(env));
+    }
+    env = getenv("CMAG_DRAW_CONTOURS");
+    if (env != NULL) {
+        drawContours = (strcmp(env, "0") != 0);
+    }
+}
+
+/**
+ * Pick up the overlays from the CMAG_DRAW_ARROWS (the arrow spacing in cm)
+ * and CMAG_DRAW_LINES (the field line seeds a side) environment variables
+ * when the library is loaded.
+ */
+__attribute__((constructor))
+static void initDrawOverlays() {
+    const char *env = getenv("CMAG_DRAW_ARROWS");
+    if (env != NULL) {
+        setDrawArrows(atof(env));
+    }
+    env = getenv("CMAG_DRAW_LINES");
+    if (env != NULL) {
+        setDrawFieldLines(atoi(env));
+    }
+}
+
+/**
+ * Pick up a color map file from the CMAG_COLOR_MAP environment variable
+ * when the library is loaded. The default map is used if it can not be read.
+ */
+__attribute__((constructor))
+static void initDrawColorMap() {
+    const char *env = getenv("CMAG_COLOR_MAP");
+    if ((env != NULL) && (env[0] != '\0')) {
+        drawColorMap = readColorMap(env);
+    }
+}
+
+/**
+ * Set the number of threads that evaluate the field for an image. The
+ * image is the same for any number.
+ * @param numThreads the number of threads, or 0 (the default) for one per
+ * online processor.
+ */
+void setDrawThreads(int numThreads) {
+    drawThreads = (numThreads < 0) ? 0 : numThreads;
+}
+
+/**
+ * Get the number of threads that evaluate the field for an image.
+ * @return the number of threads, 0 meaning one per online processor.
+ */
+int getDrawThreads() {
+    return drawThreads;
+}
+
+/**
+ * Set whether the svg images draw the field as one embedded PNG, the
+ * default, or as an svg rectangle for every 2 cm pixel. The labels and
+ * the color legend are svg either way.
+ * @param raster true for a raster.
+ */
+void setDrawRaster(bool raster) {
+    drawRaster = raster;
+}
+
+/**
+ * Get whether the svg images draw the field as an embedded raster.
+ * @return true if they do.
+ */
+bool getDrawRaster() {
+    return drawRaster;
+}
+
+/**
+ * Set whether the svg images draw the field as iso-lines of |B| at the
+ * thresholds of the color map, each in the color of the band above it,
+ * rather than as colors. The field is evaluated on the grid of the raster,
+ * so the pixel size sets how fine the lines are. Contours take precedence
+ * over the raster setting.
+ * @param contours true for iso-lines.
+ */
+void setDrawContours(bool contours) {
+    drawContours = contours;
+}
+
+/**
+ * Get whether the svg images draw the field as iso-lines.
+ * @return true if they do.
+ */
+bool getDrawContours() {
+    return drawContours;
+}
+
+/**
+ * Set whether the svg images draw arrows of the field in the plane of the
+ * slice over the field, on a grid, each at the center of its cell with a
+ * length proportional to the field in the plane. Arrows under 5% of the
+ * longest are left out.
+ * @param spacing the spacing of the arrows in cm, 0 (the default) for none.
+ */
+void setDrawArrows(double spacing) {
+    drawArrowSpacing = ((spacing > 0) && isfinite(spacing)) ? spacing : 0;
+}
+
+/**
+ * Get the spacing of the field arrows of the svg images.
+ * @return the spacing in cm, 0 if there are none.
+ */
+double getDrawArrows() {
+    return drawArrowSpacing;
+}
+
+/**
+ * Set whether the svg images draw field lines of the field in the plane of
+ * the slice over the field, traced both ways from a square grid of seeds
+ * by traceFieldLines, on the drawing threads.
+ * @param seedsPerSide the seeds along each side of the grid, 0 (the
+ * default) for none.
+ */
+void setDrawFieldLines(int seedsPerSide) {
+    drawLineSeeds = (seedsPerSide < 0) ? 0 : seedsPerSide;
+}
+
+/**
+ * Get the seeds a side of the field lines of the svg images.
+ * @return the seeds a side, 0 if there are no field lines.
+ */
+int getDrawFieldLines() {
+    return drawLineSeeds;
+}
+
+/**
+ * Set the size of a pixel of the rasters, in the svg images and the
+ * raster images. Pixels are adjusted slightly so a whole number of them
+ * spans the image. Rectangles are always 2 cm.
+ * @param size the pixel size in cm. Values that are not positive are ignored.
+ */
+void setDrawPixelSize(double size) {
+    if ((size > 0) && isfinite(size)) {
+        drawPixelSize = size;
+    }
+}
+
+/**
+ * Get the size of a pixel of the rasters.
+ * @return the pixel size in cm, 2 by default.
+ */
+double getDrawPixelSize() {
+    return drawPixelSize;
+}
+
+/**
+ * Set the color map of the images. The map is not copied, and must stay
+ * valid while it is set.
+ * @param colorMap the color map, or NULL for the default map.
+ */
+void setDrawColorMap(ColorMapPtr colorMap) {
+    drawColorMap = colorMap;
+}
+
+/**
+ * Get the color map of the images.
+ * @return the color map set, or the default map, or NULL if there was
+ * no memory to build the default map.
+ */
+ColorMapPtr getDrawColorMap() {
+    ColorMapPtr colorMap = drawColorMap;
+    return (colorMap == NULL) ? defaultColorMap() : colorMap;
+}
 
 /**
  * Create an SVG image of the fields at a fixed value of z.
@@ -16,9 +319,12 @@
  */
 void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
 
-    ColorMapPtr colorMap = defaultColorMap();
+    ColorMapPtr colorMap = getDrawColorMap();
+    if (colorMap == NULL) {
+        return;
+    }
 
-    double rhomax = (z > 99) ? 360 : 120;
+    double rhomax = fixedZExtent(z);
     int xmin = -rhomax;
     int xmax = rhomax;
     int ymin = -rhomax;
@@ -36,47 +342,62 @@ void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, Magnetic
     int width = imageWidth + marginLeft + marginRight;
     int height = imageHeight + marginTop + marginBottom;
 
-    svg* psvg;
-    psvg = svgStart(path, width, height);
+    DrawWork work = {.torus = torus, .solenoid = solenoid, .fixedPhi = false, .fixed = z,
+                     .col0 = xmin, .colStep = del, .row0 = ymin + del, .rowStep = del,
+                     .numCols = imageWidth / del, .numRows = imageHeight / del};
+    bool contours = drawContours;
+    bool raster = drawRaster || contours;
+    if (raster) {
+        rasterGrid(&work, xmin, xmax, ymin, ymax);
+    }
 
+    if (!evaluateImage(&work)) {
+        return;
+    }
+
+    svg* psvg;
     psvg = svgStart(path, width, height);
 
     svgFill(psvg, "#f0f0f0");
 
-    fprintf(stdout, "\nStarting svg image creation for: [%s]", path);
-
-    FieldValuePtr fieldValuePtr = (FieldValuePtr) malloc(sizeof (FieldValue));
-
-    int y = ymin+del;
-    while (y < ymax+del) {
-        if ((y % 50) == 0) {
-            fprintf(stdout, ".");
-        }
-        int yPic = y - ymin + marginTop; //x is vertical
-        int x = xmin;
-        while (x < xmax) {
-
-            int xPic = x - xmin + marginLeft;
-
-            getCompositeFieldValue(fieldValuePtr, x, y, z, torus, solenoid);
-            double magnitude = fieldMagnitude(fieldValuePtr);
-
-            char *color = getColor(colorMap, magnitude);
-            svgRectangle(psvg, del, del, xPic, yPic, color, "none", 0, 0, 0);
-
-            x += del;
+    int y;
+    if (contours) {
+        drawContourImage(psvg, &work, colorMap, marginLeft, marginTop, imageWidth, imageHeight);
+    }
+    else if (raster) {
+        drawRasterImage(psvg, &work, colorMap, marginLeft, marginTop, imageWidth, imageHeight);
+    }
+    else {
+        const double *magnitude = work.magnitudes;
+        y = ymin+del;
+        while (y < ymax+del) {
+            int yPic = y - ymin + marginTop; //x is vertical
+            int x = xmin;
+            while (x < xmax) {
+
+                int xPic = x - xmin + marginLeft;
+
+                char *color = getColor(colorMap, *magnitude++);
+                svgRectangle(psvg, del, del, xPic, yPic, color, "none", 0, 0, 0);
+
+                x += del;
+            }
+            y += del;
         }
-        y += del;
     }
+    free(work.magnitudes);
 
-    free(fieldValuePtr);
+    SliceFrame frame = {.umin = xmin, .umax = xmax, .vmin = ymin, .vmax = ymax,
+                        .left = marginLeft, .top = marginTop};
+    drawOverlays(psvg, &work, &frame);
 
     //border
     svgRectangle(psvg, imageWidth, imageHeight, marginLeft, marginTop, "none", "black", 1, 0, 0);
 
-    char *label = (char *) malloc(255);
+    char label[255];
 
 
+    GridLines gridLines = {.num = 0};
     int x = marginLeft - 6;
     y = ymin;
     while (y <= ymax) {
@@ -84,7 +405,7 @@ void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, Magnetic
 
         sprintf(label, "%d", y);
         svgRotatedText(psvg, x, yPic+8, "times", 12, "black", "none", -90, label);
-        svgLine(psvg, "#cccccc", 1, marginLeft, yPic, marginLeft+imageWidth, yPic);
+        addGridLine(&gridLines, marginLeft, yPic, marginLeft+imageWidth, yPic);
         y += 120;
     }
 
@@ -98,10 +419,11 @@ void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, Magnetic
         int xPic = x - xmin + marginLeft;
         sprintf(label, "%d", x);
         svgText(psvg, xPic-12, y, "times", 12, "black", "none", label);
-        svgLine(psvg, "#cccccc", 1, xPic, marginTop, xPic, marginTop+imageHeight);
+        addGridLine(&gridLines, xPic, marginTop, xPic, marginTop+imageHeight);
 
         x += 120;
     }
+    svgPolylines(psvg, "#cccccc", 1, gridLines.num, gridLines.lengths, gridLines.x, gridLines.y);
 
 
     //title and axes labels
@@ -112,29 +434,9 @@ void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, Magnetic
 
 
     //the gradient
-    x = width - 75;
-    y = marginTop + 40;
-    int nc = colorMap->numColors;
-    int gw = 20;
-    int gh = 4;
-    for (int i = 0; i < colorMap->numColors; i++) {
-        svgRectangle(psvg, gw, gh, x, y, colorMap->colors[i], "none", 0, 0, 0);
-        bool lab = ((i == 0)  || (i == nc/4) || (i == nc/2) || (i == 3*nc/4));
+    drawLegend(psvg, colorMap, width - 75, marginTop + 40);
 
-        if (lab) {
-            sprintf(label, " %-3.1f kG", colorMap->values[i]);
-            svgText(psvg, x+gw+4, y+5, "times", 11, "black", "none", label);
-        }
-        y+=gh;
-    }
-
-    sprintf(label, " %-3.1f kG", colorMap->values[nc+1]);
-    svgText(psvg, x+gw+4, y+5, "times", 11, "black", "none", label);
-
-    free(label);
     svgEnd(psvg);
-
-    fprintf(stdout, "done.\n");
 }
 
 /**
@@ -147,16 +449,15 @@ void createSVGImageFixedZ(char *path, double z, MagneticFieldPtr torus, Magnetic
  */
 void createSVGImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
 
-    ColorMapPtr colorMap = defaultColorMap();
-
-    double phiRad = toRadians(phi);
-    double cosPhi = cos(phiRad);
-    double sinPhi = sin(phiRad);
+    ColorMapPtr colorMap = getDrawColorMap();
+    if (colorMap == NULL) {
+        return;
+    }
 
-    int zmin = -100;
-    int zmax = 500;
+    int zmin = FIXED_PHI_ZMIN;
+    int zmax = FIXED_PHI_ZMAX;
     int rmin = 0;
-    int rmax = 360;
+    int rmax = FIXED_PHI_RHOMAX;
 
     int del = 2;
 
@@ -170,49 +471,63 @@ void createSVGImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, Magn
     int width = imageWidth + marginLeft + marginRight;
     int height = imageHeight + marginTop + marginBottom;
 
+    DrawWork work = {.torus = torus, .solenoid = solenoid, .fixedPhi = true, .fixed = phi,
+                     .col0 = zmin, .colStep = del, .row0 = rmin + del, .rowStep = del,
+                     .numCols = imageWidth / del, .numRows = imageHeight / del};
+    bool contours = drawContours;
+    bool raster = drawRaster || contours;
+    if (raster) {
+        rasterGrid(&work, zmin, zmax, rmax, rmin);
+    }
+
+    if (!evaluateImage(&work)) {
+        return;
+    }
+
     svg* psvg;
     psvg = svgStart(path, width, height);
 
     svgFill(psvg, "#f0f0f0");
 
+    int rho;
+    if (contours) {
+        drawContourImage(psvg, &work, colorMap, marginLeft, marginTop, imageWidth, imageHeight);
+    }
+    else if (raster) {
+        drawRasterImage(psvg, &work, colorMap, marginLeft, marginTop, imageWidth, imageHeight);
+    }
+    else {
+        const double *magnitude = work.magnitudes;
+        rho = rmin + del;
+        while (rho < rmax + del) {
+            int rhoPic = marginTop + imageHeight - rho; //rho is vertical
 
+            int z = zmin;
+            while (z < zmax) {
 
-    fprintf(stdout, "\nStarting svg image creation for: [%s]", path);
-
-    FieldValuePtr fieldValuePtr = (FieldValuePtr) malloc(sizeof (FieldValue));
-
-    int rho = rmin + del;
-    while (rho < rmax + del) {
-        if ((rho % 50) == 0) {
-            fprintf(stdout, ".");
-        }
-        int rhoPic = marginTop + imageHeight - rho; //rho is vertical
-
-
-        int z = zmin;
-        while (z < zmax) {
-
-            int zPic = z - zmin + marginLeft;
-
-            getCompositeFieldValue(fieldValuePtr, rho*cosPhi, rho*sinPhi, z, torus, solenoid);
-            double magnitude = fieldMagnitude(fieldValuePtr);
+                int zPic = z - zmin + marginLeft;
 
-            char *color = getColor(colorMap, magnitude);
-            svgRectangle(psvg, del, del, zPic, rhoPic, color, "none", 0, 0, 0);
+                char *color = getColor(colorMap, *magnitude++);
+                svgRectangle(psvg, del, del, zPic, rhoPic, color, "none", 0, 0, 0);
 
-            z += del;
+                z += del;
+            }
+            rho += del;
         }
-        rho += del;
     }
+    free(work.magnitudes);
 
-    free(fieldValuePtr);
+    SliceFrame frame = {.umin = zmin, .umax = zmax, .vmin = rmin, .vmax = rmax,
+                        .left = marginLeft, .top = marginTop};
+    drawOverlays(psvg, &work, &frame);
 
     //border
     svgRectangle(psvg, imageWidth, imageHeight, marginLeft, marginTop, "none", "black", 1, 0, 0);
 
-    char *label = (char *) malloc(255);
+    char label[255];
 
 
+    GridLines gridLines = {.num = 0};
     int z = marginLeft - 6;
     rho = rmin;
     while (rho <= rmax) {
@@ -220,7 +535,7 @@ void createSVGImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, Magn
 
         sprintf(label, "%d", rmax - rho);
         svgRotatedText(psvg, z, xPic+8, "times", 12, "black", "none", -90, label);
-        svgLine(psvg, "#cccccc", 1, marginLeft, xPic, marginLeft+imageWidth, xPic);
+        addGridLine(&gridLines, marginLeft, xPic, marginLeft+imageWidth, xPic);
         rho += 60;
     }
 
@@ -232,10 +547,11 @@ void createSVGImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, Magn
         int zPic = z - zmin + marginLeft;
         sprintf(label, "%d", z);
         svgText(psvg, zPic-12, rho, "times", 12, "black", "none", label);
-        svgLine(psvg, "#cccccc", 1, zPic, marginTop, zPic, marginTop+imageHeight);
+        addGridLine(&gridLines, zPic, marginTop, zPic, marginTop+imageHeight);
 
         z += 100;
     }
+    svgPolylines(psvg, "#cccccc", 1, gridLines.num, gridLines.lengths, gridLines.x, gridLines.y);
 
 
     //title and axes labels
@@ -245,31 +561,863 @@ void createSVGImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, Magn
     svgRotatedText(psvg, 20, marginTop + imageHeight/2, "times", 14, "black", "none", -90, "rho (cm)");
 
     //the gradient
-    int x = width - 75;
-    int y = marginTop + 40;
+    drawLegend(psvg, colorMap, width - 75, marginTop + 40);
+
+    svgEnd(psvg);
+}
+
+/**
+ * Create a raster image, PNG or PPM, of the fields at a fixed value of z.
+ * It covers the region of createSVGImageFixedZ, without labels, at the
+ * pixel size set by setDrawPixelSize.
+ * @param path the path to the image file, PPM if it ends in ".ppm", else PNG.
+ * @param z the fixed value of z in cm.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @return true on success.
+ */
+bool createRasterImageFixedZ(char *path, double z, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
+    double rhomax = fixedZExtent(z);
+    DrawWork work = {.torus = torus, .solenoid = solenoid, .fixedPhi = false, .fixed = z};
+    rasterGrid(&work, -rhomax, rhomax, -rhomax, rhomax);
+    return writeFieldRaster(path, &work);
+}
+
+/**
+ * Create a raster image, PNG or PPM, of the fields at a fixed value of
+ * phi, rho increasing upwards. It covers the region of
+ * createSVGImageFixedPhi, without labels, at the pixel size set by
+ * setDrawPixelSize.
+ * @param path the path to the image file, PPM if it ends in ".ppm", else PNG.
+ * @param phi the fixed value of phi in degrees.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @return true on success.
+ */
+bool createRasterImageFixedPhi(char *path, double phi, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
+    DrawWork work = {.torus = torus, .solenoid = solenoid, .fixedPhi = true, .fixed = phi};
+    rasterGrid(&work, FIXED_PHI_ZMIN, FIXED_PHI_ZMAX, FIXED_PHI_RHOMAX, 0);
+    return writeFieldRaster(path, &work);
+}
+
+/**
+ * Add a grid line to those to be drawn.
+ * @param lines the grid lines.
+ * @param x1 x coordinate of start.
+ * @param y1 y coordinate of start.
+ * @param x2 x coordinate of end.
+ * @param y2 y coordinate of end.
+ */
+static void addGridLine(GridLines *lines, int x1, int y1, int x2, int y2) {
+    if (lines->num < MAX_GRID_LINES) {
+        int n = lines->num++;
+        lines->lengths[n] = 2;
+        lines->x[2 * n] = x1;
+        lines->y[2 * n] = y1;
+        lines->x[2 * n + 1] = x2;
+        lines->y[2 * n + 1] = y2;
+    }
+}
+
+/**
+ * Draw the color legend of an image, a row per color from the top of the
+ * map down, labeled at the quarters and at the bottom. Maps with more
+ * colors than fit are sampled.
+ * @param psvg the svg object.
+ * @param colorMap the color map.
+ * @param x the left of the legend.
+ * @param y the top of the legend.
+ */
+static void drawLegend(svg *psvg, ColorMapPtr colorMap, int x, int y) {
+    char label[32];
+    int nc = colorMap->numColors;
+    int rows = (nc < MAX_LEGEND_ROWS) ? nc : MAX_LEGEND_ROWS;
     int gw = 20;
     int gh = 4;
-    int nc = colorMap->numColors;
 
-    for (int i = 0; i < nc; i++) {
-        svgRectangle(psvg, gw, gh, x, y, colorMap->colors[i], "none", 0, 0, 0);
+    for (int i = 0; i < rows; i++) {
+        int color = (int) (((long) i * nc) / rows);
+        svgRectangle(psvg, gw, gh, x, y, colorMap->colors[color], "none", 0, 0, 0);
 
-        bool lab = ((i == 0) ||  (i == nc/4) || (i == nc/2) || (i == 3*nc/4));
+        bool lab = ((i == 0) || (i == rows/4) || (i == rows/2) || (i == 3*rows/4));
 
         if (lab) {
-            sprintf(label, " %-3.1f kG", colorMap->values[i]);
+            sprintf(label, " %-3.1f kG", colorMap->values[color]);
             svgText(psvg, x+gw+4, y+5, "times", 11, "black", "none", label);
         }
         y+=gh;
     }
 
-    sprintf(label, " %-3.1f kG", colorMap->values[nc+1]);
+    sprintf(label, " %-3.1f kG", colorMap->values[nc]);
     svgText(psvg, x+gw+4, y+5, "times", 11, "black", "none", label);
+}
 
-    free(label);
-    svgEnd(psvg);
+/**
+ * The half width of the images at fixed z: the solenoid region upstream,
+ * all of the torus downstream.
+ * @param z the fixed value of z in cm.
+ * @return the largest |x| and |y| in cm.
+ */
+static double fixedZExtent(double z) {
+    return (z > 99) ? 360 : 120;
+}
+
+/**
+ * Lay out the pixels of a raster at the current pixel size, sampling at
+ * pixel centers.
+ * @param work the image.
+ * @param left the x or z of the left edge, cm.
+ * @param right the x or z of the right edge, cm.
+ * @param top the y or rho of the top edge, cm.
+ * @param bottom the y or rho of the bottom edge, cm.
+ */
+static void rasterGrid(DrawWork *work, double left, double right, double top, double bottom) {
+    double pixel = drawPixelSize;
+    work->numCols = (int) lround(fabs(right - left) / pixel);
+    work->numRows = (int) lround(fabs(bottom - top) / pixel);
+    work->numCols = (work->numCols < 1) ? 1 : work->numCols;
+    work->numRows = (work->numRows < 1) ? 1 : work->numRows;
+    work->colStep = (right - left) / work->numCols;
+    work->rowStep = (bottom - top) / work->numRows;
+    work->col0 = left + work->colStep / 2;
+    work->row0 = top + work->rowStep / 2;
+}
+
+/**
+ * Draw the evaluated field of an image as an embedded raster.
+ * @param psvg the svg.
+ * @param work the evaluated image.
+ * @param colorMap the color map.
+ * @param left the left of the image in the svg, pixels.
+ * @param top the top of the image in the svg, pixels.
+ * @param width the width of the image in the svg, pixels.
+ * @param height the height of the image in the svg, pixels.
+ * @return false on error.
+ */
+static bool drawRasterImage(svg *psvg, DrawWork *work, ColorMapPtr colorMap, int left, int top, int width, int height) {
+    unsigned char *rgb = colorPixels(work, colorMap);
+    bool drawn = (rgb != NULL) && svgImage(psvg, width, height, left, top, rgb, work->numCols, work->numRows);
+    free(rgb);
+    return drawn;
+}
+
+/**
+ * Draw the evaluated field of an image as iso-lines, a path per threshold
+ * of the color map in the color of the band above it, on white.
+ * @param psvg the svg.
+ * @param work the evaluated image.
+ * @param colorMap the color map.
+ * @param left the left of the image in the svg, pixels.
+ * @param top the top of the image in the svg, pixels.
+ * @param width the width of the image in the svg, pixels.
+ * @param height the height of the image in the svg, pixels.
+ * @return false on error.
+ */
+static bool drawContourImage(svg *psvg, DrawWork *work, ColorMapPtr colorMap, int left, int top, int width, int height) {
+    ContourLinesPtr lines = createContourLines();
+    if (lines == NULL) {
+        return false;
+    }
+
+    svgRectangle(psvg, width, height, left, top, "white", "none", 0, 0, 0);
+
+    //grid points are at pixel centers
+    double scaleX = (double) width / work->numCols;
+    double scaleY = (double) height / work->numRows;
+    double tolerance = CONTOUR_TOLERANCE / ((scaleX > scaleY) ? scaleX : scaleY);
+
+    bool drawn = setContourGrid(lines, work->magnitudes, work->numCols, work->numRows);
+    for (int i = 0; drawn && (i <= colorMap->numColors); i++) {
+        drawn = traceContours(lines, colorMap->values[i], tolerance);
+        for (int p = 0; p < lines->numPoints; p++) {
+            lines->x[p] = left + (lines->x[p] + 0.5) * scaleX;
+            lines->y[p] = top + (lines->y[p] + 0.5) * scaleY;
+        }
+        char *color = colorMap->colors[(i == 0) ? 0 : i - 1];
+        svgFinePolylines(psvg, color, 1, lines->numLines, lines->lengths, lines->x, lines->y);
+    }
+    freeContourLines(lines);
+    return drawn;
+}
 
-    fprintf(stdout, "done.\n");
+/**
+ * Draw the overlays that are on, arrows then field lines, over the field
+ * of an svg image.
+ * @param psvg the svg object.
+ * @param work the image, for its fields and slice.
+ * @param frame where the region is drawn.
+ */
+static void drawOverlays(svg *psvg, const DrawWork *work, const SliceFrame *frame) {
+    double spacing = drawArrowSpacing;
+    int seeds = drawLineSeeds;
+    if (spacing > 0) {
+        drawArrows(psvg, work, frame, spacing);
+    }
+    if (seeds > 0) {
+        drawFieldLines(psvg, work, frame, seeds);
+    }
 }
 
+/**
+ * Draw arrows of the field in the plane of a slice, at the centers of a
+ * grid of square cells, as one path. Their lengths are in proportion to
+ * the field in the plane, the longest 90% of a cell.
+ * @param psvg the svg object.
+ * @param work the image, for its fields and slice.
+ * @param frame where the region is drawn.
+ * @param spacing the size of a cell, cm.
+ * @return false if out of memory.
+ */
+static bool drawArrows(svg *psvg, const DrawWork *work, const SliceFrame *frame, double spacing) {
+    int cols = (int) ((frame->umax - frame->umin) / spacing);
+    int rows = (int) ((frame->vmax - frame->vmin) / spacing);
+    if ((cols < 1) || (rows < 1)) {
+        return true;
+    }
+    size_t numArrows = (size_t) cols * rows;
+
+    //the field in the plane, u and v, at each center, then the arrows as a
+    //shaft and a head each
+    double *field = (double *) malloc(2 * numArrows * sizeof(double));
+    int *lengths = (int *) malloc(2 * numArrows * sizeof(int));
+    double *x = (double *) malloc(5 * numArrows * sizeof(double));
+    double *y = (double *) malloc(5 * numArrows * sizeof(double));
+    if ((field == NULL) || (lengths == NULL) || (x == NULL) || (y == NULL)) {
+        fprintf(stderr, "\ncMag ERROR out of memory for %zu field arrows\n", numArrows);
+        free(field);
+        free(lengths);
+        free(x);
+        free(y);
+        return false;
+    }
 
+    FieldProbePtr torusProbe = (work->torus == NULL) ? NULL : createProbe(work->torus);
+    FieldProbePtr solenoidProbe = (work->solenoid == NULL) ? NULL : createProbe(work->solenoid);
+    double cosPhi = cos(toRadians(work->fixed));
+    double sinPhi = sin(toRadians(work->fixed));
+    double largest = 0;
+    for (int row = 0; row < rows; row++) {
+        double v = frame->vmin + (row + 0.5) * spacing;
+        for (int col = 0; col < cols; col++) {
+            double u = frame->umin + (col + 0.5) * spacing;
+            double p[3];
+            FieldValue value;
+            slicePoint(work, u, v, p);
+            getCompositeProbeFieldValue(&value, p[0], p[1], p[2], torusProbe, solenoidProbe);
+
+            double *b = field + 2 * ((size_t) row * cols + col);
+            if (work->fixedPhi) {
+                b[0] = value.b3;
+                b[1] = value.b1 * cosPhi + value.b2 * sinPhi;
+            }
+            else {
+                b[0] = value.b1;
+                b[1] = value.b2;
+            }
+            largest = fmax(largest, hypot(b[0], b[1]));
+        }
+    }
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+
+    int numLines = 0;
+    int numPoints = 0;
+    double headCos = cos(toRadians(25));
+    double headSin = sin(toRadians(25));
+    for (size_t i = 0; (largest > 0) && (i < numArrows); i++) {
+        double *b = field + 2 * i;
+        double magnitude = hypot(b[0], b[1]);
+        if (!(magnitude >= 0.05 * largest)) {
+            continue;
+        }
+
+        //the unit direction on the page, where v is down at fixed z
+        double dx = b[0] / magnitude;
+        double dy = (work->fixedPhi ? -b[1] : b[1]) / magnitude;
+        double half = 0.45 * spacing * magnitude / largest;
+        double head = 0.6 * half;
+        int row = (int) (i / cols);
+        int col = (int) (i % cols);
+        double cx = frame->left + (col + 0.5) * spacing;
+        double cy = frame->top + (row + 0.5) * spacing;
+        if (work->fixedPhi) {
+            cy = frame->top + (frame->vmax - frame->vmin) - (row + 0.5) * spacing;
+        }
+        double tipX = cx + half * dx;
+        double tipY = cy + half * dy;
+
+        lengths[numLines++] = 2;
+        x[numPoints] = cx - half * dx;
+        y[numPoints++] = cy - half * dy;
+        x[numPoints] = tipX;
+        y[numPoints++] = tipY;
+
+        lengths[numLines++] = 3;
+        x[numPoints] = tipX - head * (dx * headCos - dy * headSin);
+        y[numPoints++] = tipY - head * (dx * headSin + dy * headCos);
+        x[numPoints] = tipX;
+        y[numPoints++] = tipY;
+        x[numPoints] = tipX - head * (dx * headCos + dy * headSin);
+        y[numPoints++] = tipY - head * (-dx * headSin + dy * headCos);
+    }
+    svgFinePolylines(psvg, "black", 1, numLines, lengths, x, y);
+
+    free(field);
+    free(lengths);
+    free(x);
+    free(y);
+    return true;
+}
+
+/**
+ * Draw field lines of the field in the plane of a slice, traced both ways
+ * from a square grid of seeds on the drawing threads, as one path. Lines
+ * that close are traced one way only, and lines are cut where they leave
+ * the region.
+ * @param psvg the svg object.
+ * @param work the image, for its fields and slice.
+ * @param frame where the region is drawn.
+ * @param seedsPerSide the seeds along each side of the grid.
+ * @return false if out of memory.
+ */
+static bool drawFieldLines(svg *psvg, const DrawWork *work, const SliceFrame *frame, int seedsPerSide) {
+    double width = frame->umax - frame->umin;
+    double height = frame->vmax - frame->vmin;
+    int numSeeds = seedsPerSide * seedsPerSide;
+    double *seeds = (double *) malloc(3 * (size_t) numSeeds * sizeof(double));
+    if (seeds == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory for %d field line seeds\n", numSeeds);
+        return false;
+    }
+    for (int i = 0; i < numSeeds; i++) {
+        double u = frame->umin + ((i % seedsPerSide) + 0.5) * width / seedsPerSide;
+        double v = frame->vmin + ((i / seedsPerSide) + 0.5) * height / seedsPerSide;
+        slicePoint(work, u, v, seeds + 3 * i);
+    }
+
+    //in the plane, in a box just around the region
+    double cosPhi = cos(toRadians(work->fixed));
+    double sinPhi = sin(toRadians(work->fixed));
+    FieldLineParams params;
+    defaultFieldLineParams(&params);
+    params.tolerance = LINE_TOLERANCE;
+    params.maxStep = 0.01 * fmax(width, height);
+    params.maxLength = 2 * (width + height);
+    params.closeDistance = 1;
+    params.inPlane = true;
+    params.numThreads = drawThreads;
+    if (work->fixedPhi) {
+        double reach = fmax(fabs(frame->vmin), fabs(frame->vmax)) + 1;
+        params.normal[0] = -sinPhi;
+        params.normal[1] = cosPhi;
+        params.normal[2] = 0;
+        params.lo[0] = params.lo[1] = -reach;
+        params.hi[0] = params.hi[1] = reach;
+        params.lo[2] = frame->umin - 1;
+        params.hi[2] = frame->umax + 1;
+    }
+    else {
+        params.lo[0] = frame->umin - 1;
+        params.hi[0] = frame->umax + 1;
+        params.lo[1] = frame->vmin - 1;
+        params.hi[1] = frame->vmax + 1;
+        params.lo[2] = work->fixed - 1;
+        params.hi[2] = work->fixed + 1;
+    }
+
+    //then back from the seeds of the lines that did not close
+    FieldLinePtr lines[2];
+    int numTraced[2] = {numSeeds, 0};
+    lines[0] = traceFieldLines(seeds, numSeeds, work->torus, work->solenoid, &params);
+    for (int i = 0; (lines[0] != NULL) && (i < numSeeds); i++) {
+        if (lines[0][i].end != LINE_CLOSED) {
+            memmove(seeds + 3 * numTraced[1]++, seeds + 3 * i, 3 * sizeof(double));
+        }
+    }
+    params.direction = -1;
+    lines[1] = traceFieldLines(seeds, numTraced[1], work->torus, work->solenoid, &params);
+    free(seeds);
+
+    //room for every point, each on a line of its own at worst
+    size_t numPointsTraced = 0;
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; (lines[d] != NULL) && (i < numTraced[d]); i++) {
+            numPointsTraced += lines[d][i].numPoints;
+        }
+    }
+    int *lengths = (int *) malloc((numPointsTraced + 1) * sizeof(int));
+    double *x = (double *) malloc((numPointsTraced + 1) * sizeof(double));
+    double *y = (double *) malloc((numPointsTraced + 1) * sizeof(double));
+    bool drawn = (lines[0] != NULL) && (lines[1] != NULL) && (lengths != NULL) && (x != NULL) && (y != NULL);
+    if (!drawn) {
+        fprintf(stderr, "\ncMag ERROR out of memory for the field lines of an image\n");
+    }
+
+    //on the page, through points far enough apart, cut outside the region
+    int numLines = 0;
+    int numPoints = 0;
+    for (int d = 0; drawn && (d < 2); d++) {
+        for (int i = 0; i < numTraced[d]; i++) {
+            FieldLinePtr line = lines[d] + i;
+            int length = 0;
+            for (int j = 0; j <= line->numPoints; j++) {
+                bool inside = false;
+                double px = 0, py = 0;
+                if (j < line->numPoints) {
+                    const double *p = line->points + 3 * j;
+                    double u = work->fixedPhi ? p[2] : p[0];
+                    double v = work->fixedPhi ? (p[0] * cosPhi + p[1] * sinPhi) : p[1];
+                    inside = (u >= frame->umin) && (u <= frame->umax) && (v >= frame->vmin) && (v <= frame->vmax);
+                    px = frame->left + (u - frame->umin);
+                    py = work->fixedPhi ? frame->top + (frame->vmax - v) : frame->top + (v - frame->vmin);
+                }
+                if (inside) {
+                    bool last = (j == line->numPoints - 1);
+                    if ((length > 0) && !last &&
+                        (hypot(px - x[numPoints - 1], py - y[numPoints - 1]) < LINE_SPACING)) {
+                        continue;
+                    }
+                    x[numPoints] = px;
+                    y[numPoints++] = py;
+                    length++;
+                }
+                else if (length > 0) {
+                    if (length > 1) {
+                        lengths[numLines++] = length;
+                    }
+                    else {
+                        numPoints--;
+                    }
+                    length = 0;
+                }
+            }
+        }
+    }
+    if (drawn) {
+        svgFinePolylines(psvg, "black", 1, numLines, lengths, x, y);
+    }
+
+    freeFieldLines(lines[0], numTraced[0]);
+    freeFieldLines(lines[1], numTraced[1]);
+    free(lengths);
+    free(x);
+    free(y);
+    return drawn;
+}
+
+/**
+ * The Cartesian point of a point in the plane of a slice.
+ * @param work the image, for its slice.
+ * @param u the x at fixed z, or the z at fixed phi, cm.
+ * @param v the y at fixed z, or the rho at fixed phi, cm.
+ * @param p upon return, the x, y and z of the point, cm.
+ */
+static void slicePoint(const DrawWork *work, double u, double v, double *p) {
+    if (work->fixedPhi) {
+        cylindricalToCartesian(p, p + 1, work->fixed, v);
+        p[2] = u;
+    }
+    else {
+        p[0] = u;
+        p[1] = v;
+        p[2] = work->fixed;
+    }
+}
+
+/**
+ * Color the pixels of an evaluated image.
+ * @param work the evaluated image.
+ * @param colorMap the color map.
+ * @return the pixels, three bytes each, to be freed by the caller, or NULL if out of memory.
+ */
+static unsigned char *colorPixels(const DrawWork *work, ColorMapPtr colorMap) {
+    size_t numPixels = (size_t) work->numCols * work->numRows;
+    unsigned char *rgb = (unsigned char *) malloc(3 * numPixels);
+    if (rgb == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory for the %zu pixels of an image\n", numPixels);
+        return NULL;
+    }
+
+    colorize(colorMap, work->magnitudes, numPixels, rgb);
+    return rgb;
+}
+
+/**
+ * Evaluate, color and write a raster image.
+ * @param path the path to the image file, PPM if it ends in ".ppm", else PNG.
+ * @param work the image, laid out.
+ * @return true on success.
+ */
+static bool writeFieldRaster(const char *path, DrawWork *work) {
+    ColorMapPtr colorMap = getDrawColorMap();
+    if ((colorMap == NULL) || !evaluateImage(work)) {
+        return false;
+    }
+
+    unsigned char *rgb = colorPixels(work, colorMap);
+    free(work->magnitudes);
+    bool written = (rgb != NULL) && writeRaster(path, rgb, work->numCols, work->numRows);
+    free(rgb);
+    return written;
+}
+
+/**
+ * Evaluate |B| at every pixel of an image, a tile at a time, with the
+ * drawing threads. Tiles are claimed in any order, but each pixel has its
+ * own slot, so the result does not depend on the threads.
+ * @param work the image. Upon return its magnitudes, to be freed by the caller.
+ * @return false if there was no memory for the magnitudes.
+ */
+static bool evaluateImage(DrawWork *work) {
+    size_t numPixels = (size_t) work->numCols * work->numRows;
+    work->magnitudes = (double *) malloc(numPixels * sizeof(double));
+    if (work->magnitudes == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory for the %zu pixels of an image\n", numPixels);
+        return false;
+    }
+
+    work->tileCols = (work->numCols + DRAW_TILE - 1) / DRAW_TILE;
+    work->numTiles = (unsigned int) (work->tileCols * ((work->numRows + DRAW_TILE - 1) / DRAW_TILE));
+    work->nextTile = 0;
+
+    //the threads claim tiles from the shared counter
+    runWorkers(evaluateTiles, work, 0, numWorkers(drawThreads, work->numTiles));
+    return true;
+}
+
+/**
+ * The body of a drawing thread: take tiles until none are left, with
+ * private probes of the fields.
+ * @param arg the shared DrawWork.
+ * @return NULL.
+ */
+static void *evaluateTiles(void *arg) {
+    DrawWork *work = (DrawWork *) arg;
+    FieldProbePtr torusProbe = (work->torus == NULL) ? NULL : createProbe(work->torus);
+    FieldProbePtr solenoidProbe = (work->solenoid == NULL) ? NULL : createProbe(work->solenoid);
+
+    while (true) {
+        unsigned int tile = __atomic_fetch_add(&(work->nextTile), 1, __ATOMIC_RELAXED);
+        if (tile >= work->numTiles) {
+            break;
+        }
+        evaluateTile(work, tile, torusProbe, solenoidProbe);
+    }
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+    return NULL;
+}
+
+/**
+ * Evaluate |B| at the pixels of one tile.
+ * @param work the image.
+ * @param tile the index of the tile, row of tiles by row of tiles.
+ * @param torusProbe a private probe of the torus (can be NULL).
+ * @param solenoidProbe a private probe of the solenoid (can be NULL).
+ */
+static void evaluateTile(DrawWork *work, unsigned int tile, FieldProbePtr torusProbe, FieldProbePtr solenoidProbe) {
+    int firstRow = (int) (tile / work->tileCols) * DRAW_TILE;
+    int firstCol = (int) (tile % work->tileCols) * DRAW_TILE;
+    int lastRow = (firstRow + DRAW_TILE < work->numRows) ? firstRow + DRAW_TILE : work->numRows;
+    int lastCol = (firstCol + DRAW_TILE < work->numCols) ? firstCol + DRAW_TILE : work->numCols;
+
+    for (int row = firstRow; row < lastRow; row++) {
+        double v = work->row0 + row * work->rowStep;
+        double *magnitudes = work->magnitudes + (size_t) row * work->numCols;
+
+        //|B| does not depend on the frame, so use the Cartesian point
+        double x = 0, y = v, z = work->fixed;
+        if (work->fixedPhi) {
+            cylindricalToCartesian(&x, &y, work->fixed, v);
+        }
+
+        for (int col = firstCol; col < lastCol; col++) {
+            double u = work->col0 + col * work->colStep;
+            if (work->fixedPhi) {
+                z = u;
+            }
+            else {
+                x = u;
+            }
+            magnitudes[col] = getCompositeProbeFieldMagnitude(x, y, z, torusProbe, solenoidProbe);
+        }
+    }
+}
+
+/**
+ * Compare two files byte by byte. Only for the unit test.
+ * @param path1 the first file.
+ * @param path2 the second file.
+ * @return true if both can be read and are the same.
+ */
+static bool sameFiles(const char *path1, const char *path2) {
+    FILE *f1 = fopen(path1, "r");
+    FILE *f2 = fopen(path2, "r");
+    bool same = (f1 != NULL) && (f2 != NULL);
+    if (same) {
+        int c1, c2;
+        do {
+            c1 = fgetc(f1);
+            c2 = fgetc(f2);
+        } while ((c1 == c2) && (c1 != EOF));
+        same = (c1 == c2);
+    }
+    if (f1 != NULL) {
+        fclose(f1);
+    }
+    if (f2 != NULL) {
+        fclose(f2);
+    }
+    return same;
+}
+
+/**
+ * The size of a file. Only for the unit test.
+ * @param path the file.
+ * @return the size in bytes, or -1 if it cannot be read.
+ */
+static long fileSize(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+/**
+ * Count the svg paths in a file. Only for the unit test.
+ * @param path the file.
+ * @return the number of paths, or -1 if it cannot be read.
+ */
+static int countPaths(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        count += (strncmp(line, "    <path", 9) == 0);
+    }
+    fclose(fp);
+    return count;
+}
+
+/**
+ * A unit test that images are the same for any number of drawing
+ * threads, at fixed z and at fixed phi, as rasters and rectangles, with
+ * and without magnitude grids; that every pixel gets the magnitude at its
+ * point; that contour images have at most a path per level; that field
+ * arrows and lines are drawn; and that raster files have the right size,
+ * orientation and colors.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *drawUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    const char *paths[] = {"cMagDrawUnitTest1.svg", "cMagDrawUnitTest2.svg"};
+    int threads[] = {1, 3, 7};
+    int saved = getDrawThreads();
+    bool savedRaster = getDrawRaster();
+    bool savedContours = getDrawContours();
+    double savedPixel = getDrawPixelSize();
+    float *grid = fieldPtr->magnitudes;
+    char *message = NULL;
+
+    //for rasters then rectangles, the first two passes without a grid,
+    //the last two with one
+    fieldPtr->magnitudes = NULL;
+    setDrawPixelSize(2);
+    for (int pass = 0; (pass < 8) && (message == NULL); pass++) {
+        bool fixedPhi = (pass % 2) == 1;
+        setDrawRaster(pass < 4);
+        if ((pass % 4 == 2) && !buildMagnitudeGrid(fieldPtr)) {
+            message = "Could not build a magnitude grid";
+            break;
+        }
+        if (pass % 4 == 0) {
+            freeMagnitudeGrid(fieldPtr);
+        }
+
+        setDrawThreads(threads[0]);
+        if (fixedPhi) {
+            createSVGImageFixedPhi((char *) paths[0], 10, fieldPtr, NULL);
+        }
+        else {
+            createSVGImageFixedZ((char *) paths[0], 150, fieldPtr, NULL);
+        }
+
+        for (int i = 1; (i < 3) && (message == NULL); i++) {
+            setDrawThreads(threads[i]);
+            if (fixedPhi) {
+                createSVGImageFixedPhi((char *) paths[1], 10, fieldPtr, NULL);
+            }
+            else {
+                createSVGImageFixedZ((char *) paths[1], 150, fieldPtr, NULL);
+            }
+            if (!sameFiles(paths[0], paths[1])) {
+                message = "The image depends on the number of drawing threads";
+            }
+        }
+    }
+    setDrawThreads(saved);
+
+    //the raster svg is much smaller than the rectangles
+    long rectangles = -1;
+    if (message == NULL) {
+        setDrawRaster(false);
+        createSVGImageFixedZ((char *) paths[0], 150, fieldPtr, NULL);
+        setDrawRaster(true);
+        createSVGImageFixedZ((char *) paths[1], 150, fieldPtr, NULL);
+        rectangles = fileSize(paths[0]);
+        long raster = fileSize(paths[1]);
+        if ((raster <= 0) || (10 * raster > rectangles)) {
+            message = "The raster svg is not much smaller than the rectangles";
+        }
+    }
+
+    //contours are the same for any threads, a path per level crossed plus
+    //the grid lines, and much smaller than the rectangles too
+    if (message == NULL) {
+        setDrawContours(true);
+        setDrawThreads(1);
+        createSVGImageFixedPhi((char *) paths[0], 10, fieldPtr, NULL);
+        setDrawThreads(3);
+        createSVGImageFixedPhi((char *) paths[1], 10, fieldPtr, NULL);
+        setDrawThreads(saved);
+        setDrawContours(savedContours);
+        int numPaths = countPaths(paths[0]);
+        if (!sameFiles(paths[0], paths[1])) {
+            message = "The contours depend on the number of drawing threads";
+        }
+        else if ((numPaths < 10) || (numPaths > getDrawColorMap()->numColors + 2)) {
+            message = "The contours have the wrong number of paths";
+        }
+        else if (10 * fileSize(paths[0]) > rectangles) {
+            message = "The contour svg is not small";
+        }
+    }
+
+    //arrows and field lines are the same for any threads, and add a path
+    //each over the field
+    double savedArrows = getDrawArrows();
+    int savedLines = getDrawFieldLines();
+    for (int pass = 0; (pass < 2) && (message == NULL); pass++) {
+        bool fixedPhi = (pass == 1);
+        int numPaths[3];
+        for (int i = 0; i < 3; i++) {
+            setDrawArrows((i == 0) ? 0 : 20);
+            setDrawFieldLines((i == 0) ? 0 : 6);
+            setDrawThreads((i == 2) ? 3 : 1);
+            const char *path = paths[(i == 2) ? 1 : 0];
+            if (fixedPhi) {
+                createSVGImageFixedPhi((char *) path, 10, fieldPtr, NULL);
+            }
+            else {
+                createSVGImageFixedZ((char *) path, 150, fieldPtr, NULL);
+            }
+            numPaths[i] = countPaths(path);
+        }
+        if (!sameFiles(paths[0], paths[1])) {
+            message = "The field arrows or lines depend on the number of drawing threads";
+        }
+        else if (numPaths[1] != numPaths[0] + 2) {
+            message = "The field arrows or lines are missing";
+        }
+    }
+    setDrawArrows(savedArrows);
+    setDrawFieldLines(savedLines);
+    setDrawThreads(saved);
+
+    //every pixel evaluated, at the point it is drawn for
+    for (int pass = 0; (pass < 2) && (message == NULL); pass++) {
+        DrawWork work = {.torus = fieldPtr, .solenoid = NULL, .fixedPhi = (pass == 1), .fixed = 10};
+        rasterGrid(&work, -100, 500, 360, 0);
+        if (!evaluateImage(&work)) {
+            message = "Could not evaluate an image";
+            break;
+        }
+        for (int row = 0; (row < work.numRows) && (message == NULL); row++) {
+            for (int col = 0; col < work.numCols; col++) {
+                double u = work.col0 + col * work.colStep;
+                double v = work.row0 + row * work.rowStep;
+                double x = u, y = v, z = work.fixed;
+                if (work.fixedPhi) {
+                    cylindricalToCartesian(&x, &y, work.fixed, v);
+                    z = u;
+                }
+                if (work.magnitudes[row * work.numCols + col] != getCompositeFieldMagnitude(x, y, z, fieldPtr, NULL)) {
+                    message = "A pixel has the wrong magnitude";
+                    break;
+                }
+            }
+        }
+        free(work.magnitudes);
+    }
+
+    //a PNG has the size of the region in pixels, and a PPM the colors of
+    //the field at its pixel centers, z to the right and rho up
+    const char *png = "cMagDrawUnitTest.png";
+    const char *ppm = "cMagDrawUnitTest.ppm";
+    if (message == NULL) {
+        unsigned char header[24];
+        FILE *fp = NULL;
+        if (!createRasterImageFixedZ((char *) png, 150, fieldPtr, NULL) || ((fp = fopen(png, "rb")) == NULL) ||
+            (fread(header, 1, 24, fp) != 24) || (memcmp(header + 12, "IHDR", 4) != 0) ||
+            (header[18] != (360 >> 8)) || (header[19] != (360 & 0xff)) ||
+            (header[22] != (360 >> 8)) || (header[23] != (360 & 0xff))) {
+            message = "Bad PNG raster image";
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+    if (message == NULL) {
+        setDrawPixelSize(4);
+        int cols = (FIXED_PHI_ZMAX - FIXED_PHI_ZMIN) / 4;
+        int rows = FIXED_PHI_RHOMAX / 4;
+        char expected[32];
+        snprintf(expected, sizeof(expected), "P6\n%d %d\n255\n", cols, rows);
+        size_t headerSize = strlen(expected);
+        size_t size = headerSize + 3 * (size_t) cols * rows;
+        unsigned char *data = (unsigned char *) malloc(size);
+        FILE *fp = NULL;
+        if (!createRasterImageFixedPhi((char *) ppm, 10, fieldPtr, NULL) || ((fp = fopen(ppm, "rb")) == NULL) ||
+            (fread(data, 1, size, fp) != size) || (memcmp(data, expected, headerSize) != 0)) {
+            message = "Bad PPM raster image";
+        }
+        for (int i = 0; (i < 500) && (message == NULL); i++) {
+            int row = randomInt(0, rows - 1);
+            int col = randomInt(0, cols - 1);
+            double rho = FIXED_PHI_RHOMAX - 4 * (row + 0.5);
+            double x, y;
+            cylindricalToCartesian(&x, &y, 10, rho);
+            unsigned char rgb[3];
+            getColorRGB(defaultColorMap(), getCompositeFieldMagnitude(x, y, FIXED_PHI_ZMIN + 4 * (col + 0.5), fieldPtr, NULL), rgb);
+            if (memcmp(data + headerSize + 3 * ((size_t) row * cols + col), rgb, 3) != 0) {
+                message = "A raster pixel has the wrong color";
+            }
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        free(data);
+    }
+
+    freeMagnitudeGrid(fieldPtr);
+    fieldPtr->magnitudes = grid;
+    setDrawRaster(savedRaster);
+    setDrawContours(savedContours);
+    setDrawPixelSize(savedPixel);
+    remove(paths[0]);
+    remove(paths[1]);
+    remove(png);
+    remove(ppm);
+
+    mu_assert(message, message == NULL);
+    fprintf(stdout, "\nPASSED drawUnitTest\n");
+    return NULL;
+}
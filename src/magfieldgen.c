@@ -0,0 +1,504 @@
+//
+//  magfieldgen.c
+//  cMag
+//
+//  Writes field map files, in the same format as the CLAS12 maps, from
+//  two analytic fields: a finite solenoid (a stack of current loops) and
+//  a six coil toroid. The maps can have any grid resolution, so they can
+//  be made larger than the production maps for benchmarking.
+//
+
+#include "magfieldgen.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+//solenoid geometry (cm) and the field (kG) at its center
+#define SOLENOIDRADIUS 50.0
+#define SOLENOIDHALFLENGTH 50.0
+#define SOLENOIDLOOPS 64
+#define SOLENOIDCENTERFIELD 50.0
+#define WIRESOFTENING 1.0
+
+//toroid coil envelope (cm) and strength (kG cm)
+#define TORUSRHOIN 40.0
+#define TORUSRHOOUT 350.0
+#define TORUSZMIN 250.0
+#define TORUSZMAX 550.0
+#define TORUSEDGE 10.0
+#define TORUSSTRENGTH 1120.0
+
+//what one generator thread fills
+typedef struct genwork {
+    FieldMapHeaderPtr headerPtr;
+    FieldType type;
+    FieldValuePtr values;
+    size_t start; //first composite index
+    size_t end;   //one past the last composite index
+} GenWork;
+
+//local prototypes
+static void loopField(double, double, double, double *, double *);
+static void ellipticKE(double, double *, double *);
+static double smoothStep(double);
+static double gridValue(float, float, unsigned int, unsigned int);
+static void *fillValues(void *);
+static void swap32(char *, size_t);
+static void fillHeader(FieldMapHeaderPtr, FieldType, float, float, unsigned int,
+                       float, float, unsigned int, float, float, unsigned int);
+
+/**
+ * The analytic solenoid: a finite coil of SOLENOIDLOOPS current loops
+ * centered on the origin, normalized to SOLENOIDCENTERFIELD at the center.
+ * @param fieldValuePtr upon return holds (Bx, By, Bz) in kG.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ */
+void analyticSolenoidField(FieldValuePtr fieldValuePtr, double x, double y, double z) {
+    double rho = hypot(x, y);
+    double bRho = 0, bZ = 0;
+    double center = 0;
+    double a = SOLENOIDRADIUS;
+
+    for (int i = 0; i < SOLENOIDLOOPS; i++) {
+        double z0 = -SOLENOIDHALFLENGTH + (2 * SOLENOIDHALFLENGTH * i) / (SOLENOIDLOOPS - 1);
+        double br, bz;
+        loopField(a, rho, z - z0, &br, &bz);
+        bRho += br;
+        bZ += bz;
+
+        //on axis field at the center, for normalization
+        center += a * a / (2 * pow(a * a + z0 * z0, 1.5));
+    }
+
+    double norm = SOLENOIDCENTERFIELD / center;
+    bRho *= norm;
+    bZ *= norm;
+
+    double cosPhi = (rho > 0) ? x / rho : 1;
+    double sinPhi = (rho > 0) ? y / rho : 0;
+
+    fieldValuePtr->b1 = (float) (bRho * cosPhi);
+    fieldValuePtr->b2 = (float) (bRho * sinPhi);
+    fieldValuePtr->b3 = (float) bZ;
+}
+
+/**
+ * The analytic toroid: six coils at phi = 30, 90, ... degrees. The field is
+ * mostly azimuthal, falls as 1/rho inside a smooth (rho, z) envelope, and
+ * is strongest next to the coils. The small radial and z components are
+ * odd about each sector midplane, so the field has the same 12-fold
+ * symmetry that the symmetric torus maps assume.
+ * @param fieldValuePtr upon return holds (Bx, By, Bz) in kG.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ */
+void analyticTorusField(FieldValuePtr fieldValuePtr, double x, double y, double z) {
+    double rho = hypot(x, y);
+    double phi = atan2(y, x);
+
+    double envelope = smoothStep((rho - TORUSRHOIN) / TORUSEDGE) *
+                      smoothStep((TORUSRHOOUT - rho) / TORUSEDGE) *
+                      smoothStep((z - TORUSZMIN) / TORUSEDGE) *
+                      smoothStep((TORUSZMAX - z) / TORUSEDGE);
+
+    double strength = TORUSSTRENGTH / fmax(rho, TORUSRHOIN) * envelope;
+    double bPhi = strength * (1 - 0.25 * cos(6 * phi));
+    double bRho = 0.10 * strength * sin(6 * phi);
+    double bZ = 0.05 * strength * sin(6 * phi);
+
+    double cosPhi = cos(phi);
+    double sinPhi = sin(phi);
+
+    fieldValuePtr->b1 = (float) (bRho * cosPhi - bPhi * sinPhi);
+    fieldValuePtr->b2 = (float) (bRho * sinPhi + bPhi * cosPhi);
+    fieldValuePtr->b3 = (float) bZ;
+}
+
+/**
+ * Write a field map file from one of the analytic fields.
+ * @param path the path to the output file.
+ * @param headerPtr the header, which defines the grid. The field coordinate
+ * system is ignored: solenoid maps are written in cylindrical and torus maps
+ * in Cartesian components, which is what the reader expects.
+ * @param type SOLENOID or TORUS, selects the analytic field.
+ * @param bigEndian if true write in network (big endian) byte order, like
+ * the JAVA generated maps, otherwise in the byte order of this machine.
+ * @param numThreads the number of threads used to compute the values.
+ * @return true on success.
+ */
+bool generateFieldMap(const char *path, FieldMapHeaderPtr headerPtr, FieldType type,
+                      bool bigEndian, int numThreads) {
+
+    size_t numValues, numBytes;
+    if (!fieldMapSize(headerPtr, &numValues, &numBytes)) {
+        fprintf(stderr, "\ncMag ERROR bad or overflowing grid size for field map [%s]\n", path);
+        return false;
+    }
+
+    FieldValuePtr values = (FieldValuePtr) malloc(numBytes);
+    if (values == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory generating field map [%s]\n", path);
+        return false;
+    }
+
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+
+    GenWork work[numThreads];
+
+    for (int i = 0; i < numThreads; i++) {
+        work[i].headerPtr = headerPtr;
+        work[i].type = type;
+        work[i].values = values;
+        work[i].start = (numValues * i) / numThreads;
+        work[i].end = (numValues * (i + 1)) / numThreads;
+    }
+    runWorkers(fillValues, work, sizeof(GenWork), numThreads);
+
+    FieldMapHeader header = *headerPtr;
+    header.magicWord = MAGICWORD;
+    header.gridCS = 0;
+    header.fieldCS = (type == TORUS) ? 1 : 0;
+
+    bool hostBigEndian = (htonl(1) == 1);
+    if (bigEndian != hostBigEndian) {
+        swap32((char *) &header, sizeof(FieldMapHeader) / 4);
+        swap32((char *) values, 3 * numValues);
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not create field map file: [%s]\n", path);
+        free(values);
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(FieldMapHeader), 1, file) == 1) &&
+              (fwrite(values, sizeof(FieldValue), numValues, file) == numValues);
+    ok = (fclose(file) == 0) && ok;
+    free(values);
+
+    if (!ok) {
+        fprintf(stderr, "\ncMag ERROR failed writing field map file: [%s]\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Write a synthetic solenoid map on the CLAS12 solenoid grid extents,
+ * rho in [0, 300] and z in [-300, 300] cm.
+ * @param path the path to the output file.
+ * @param nRho the number of rho grid points (601 in production).
+ * @param nZ the number of z grid points (1201 in production).
+ * @param bigEndian if true write in big endian byte order.
+ * @param numThreads the number of threads used to compute the values.
+ * @return true on success.
+ */
+bool generateSolenoidMap(const char *path, unsigned int nRho, unsigned int nZ,
+                         bool bigEndian, int numThreads) {
+    FieldMapHeader header;
+    fillHeader(&header, SOLENOID, 0, 360, 1, 0, 300, nRho, -300, 300, nZ);
+    return generateFieldMap(path, &header, SOLENOID, bigEndian, numThreads);
+}
+
+/**
+ * Write a synthetic torus map on the CLAS12 torus grid extents,
+ * rho in [0, 500] and z in [100, 600] cm.
+ * @param path the path to the output file.
+ * @param nPhi the number of phi grid points (16 symmetric, 181 full in production).
+ * @param nRho the number of rho grid points.
+ * @param nZ the number of z grid points.
+ * @param symmetric if true phi covers [0, 30] degrees, otherwise [0, 360].
+ * @param bigEndian if true write in big endian byte order.
+ * @param numThreads the number of threads used to compute the values.
+ * @return true on success.
+ */
+bool generateTorusMap(const char *path, unsigned int nPhi, unsigned int nRho, unsigned int nZ,
+                      bool symmetric, bool bigEndian, int numThreads) {
+    FieldMapHeader header;
+    fillHeader(&header, TORUS, 0, symmetric ? 30 : 360, nPhi, 0, 500, nRho, 100, 600, nZ);
+    return generateFieldMap(path, &header, TORUS, bigEndian, numThreads);
+}
+
+/**
+ * Write a synthetic solenoid, symmetric torus and full torus into a directory,
+ * named SYNTHETIC_SOLENOID, SYNTHETIC_SYMMETRIC_TORUS and SYNTHETIC_FULL_TORUS.
+ * @param dir the output directory.
+ * @param resolution scales the number of grid intervals of the production maps;
+ * 1 gives the production grids, 0.1 small test maps, 2 maps eight times larger.
+ * @param bigEndian if true write in big endian byte order.
+ * @param numThreads the number of threads used to compute the values.
+ * @return true on success.
+ */
+bool generateSyntheticMaps(const char *dir, double resolution, bool bigEndian, int numThreads) {
+    char path[512];
+
+    #define NPOINTS(n) ((unsigned int) fmax(2, round(((n) - 1) * resolution) + 1))
+
+    snprintf(path, sizeof(path), "%s/%s", dir, SYNTHETIC_SOLENOID);
+    if (!generateSolenoidMap(path, NPOINTS(601), NPOINTS(1201), bigEndian, numThreads)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, SYNTHETIC_SYMMETRIC_TORUS);
+    if (!generateTorusMap(path, NPOINTS(16), NPOINTS(2501), NPOINTS(251), true, bigEndian, numThreads)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, SYNTHETIC_FULL_TORUS);
+    return generateTorusMap(path, NPOINTS(181), NPOINTS(251), NPOINTS(251), false, bigEndian, numThreads);
+
+    #undef NPOINTS
+}
+
+/**
+ * Build the path to a map in a data directory, preferring the CLAS12 map
+ * and falling back to the synthetic one if only that exists.
+ * @param path upon return, the path to use (at least 512 characters).
+ * @param dataDir the data directory.
+ * @param name the file name of the CLAS12 map.
+ * @param syntheticName the file name of the synthetic map.
+ * @return true if the synthetic map was chosen.
+ */
+bool mapFilePath(char *path, const char *dataDir, const char *name, const char *syntheticName) {
+    snprintf(path, 512, "%s/%s", dataDir, name);
+    if (access(path, R_OK) == 0) {
+        return false;
+    }
+
+    char altPath[512];
+    snprintf(altPath, sizeof(altPath), "%s/%s", dataDir, syntheticName);
+    if (access(altPath, R_OK) == 0) {
+        strcpy(path, altPath);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * The body of a generator thread: fill a range of composite indices.
+ * @param arg the GenWork.
+ * @return NULL.
+ */
+static void *fillValues(void *arg) {
+    GenWork *work = (GenWork *) arg;
+    FieldMapHeaderPtr hp = work->headerPtr;
+    size_t n23 = (size_t) hp->nq2 * hp->nq3;
+    FieldValue fv;
+
+    for (size_t index = work->start; index < work->end; index++) {
+        unsigned int n1 = (unsigned int) (index / n23);
+        unsigned int n2 = (unsigned int) ((index % n23) / hp->nq3);
+        unsigned int n3 = (unsigned int) (index % hp->nq3);
+
+        double phi = gridValue(hp->q1min, hp->q1max, hp->nq1, n1);
+        double rho = gridValue(hp->q2min, hp->q2max, hp->nq2, n2);
+        double z = gridValue(hp->q3min, hp->q3max, hp->nq3, n3);
+
+        FieldValuePtr out = work->values + index;
+
+        if (work->type == TORUS) {
+            double x, y;
+            cylindricalToCartesian(&x, &y, phi, rho);
+            analyticTorusField(out, x, y, z);
+        }
+        else { //solenoid maps hold (Bphi, Brho, Bz) in the phi = 0 plane
+            analyticSolenoidField(&fv, rho, 0, z);
+            out->b1 = 0;
+            out->b2 = fv.b1;
+            out->b3 = fv.b3;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The field of a single current loop (mu0 I = 1) in cylindrical components.
+ * The wire is given a small thickness so the field stays finite on it.
+ * @param a the loop radius.
+ * @param rho the rho coordinate of the field point.
+ * @param dz the z coordinate of the field point relative to the loop.
+ * @param bRho upon return, the rho component.
+ * @param bZ upon return, the z component.
+ */
+static void loopField(double a, double rho, double dz, double *bRho, double *bZ) {
+    double soft = WIRESOFTENING * WIRESOFTENING;
+    double dz2 = dz * dz;
+    double sum = (a + rho) * (a + rho) + dz2 + soft;
+    double diff = (a - rho) * (a - rho) + dz2 + soft;
+    double m = 4 * a * rho / sum;
+
+    double K, E;
+    ellipticKE(m, &K, &E);
+
+    double c = 1 / (2 * M_PI * sqrt(sum));
+    *bZ = c * (K + (a * a - rho * rho - dz2) / diff * E);
+    *bRho = (rho < 1.0e-6) ? 0 : c * dz / rho * (-K + (a * a + rho * rho + dz2) / diff * E);
+}
+
+/**
+ * Complete elliptic integrals of the first and second kind by the
+ * arithmetic-geometric mean.
+ * @param m the parameter (k squared), in [0, 1).
+ * @param K upon return, K(m).
+ * @param E upon return, E(m).
+ */
+static void ellipticKE(double m, double *K, double *E) {
+    double a = 1;
+    double b = sqrt(1 - m);
+    double c = sqrt(m);
+    double power = 0.5;
+    double sum = power * c * c;
+
+    while (fabs(c) > 1.0e-15) {
+        double an = (a + b) / 2;
+        double bn = sqrt(a * b);
+        c = (a - b) / 2;
+        power *= 2;
+        sum += power * c * c;
+        a = an;
+        b = bn;
+    }
+
+    *K = M_PI / (2 * a);
+    *E = *K * (1 - sum);
+}
+
+/**
+ * A smooth step from 0 (t << 0) to 1 (t >> 0).
+ * @param t the argument, in units of the edge width.
+ * @return the step value.
+ */
+static double smoothStep(double t) {
+    return 1 / (1 + exp(-t));
+}
+
+/**
+ * The value of grid point i, computed exactly as createGrid does.
+ * @param minVal the grid minimum.
+ * @param maxVal the grid maximum.
+ * @param num the number of grid points.
+ * @param i the index.
+ * @return the coordinate value.
+ */
+static double gridValue(float minVal, float maxVal, unsigned int num, unsigned int i) {
+    if (num < 2) {
+        return 0;
+    }
+    if (i == num - 1) {
+        return maxVal;
+    }
+    return minVal + i * (((double) maxVal - minVal) / (num - 1));
+}
+
+/**
+ * Fill in a header for a cylindrical grid in cm, degrees and kG.
+ */
+static void fillHeader(FieldMapHeaderPtr hp, FieldType type,
+                       float q1min, float q1max, unsigned int nq1,
+                       float q2min, float q2max, unsigned int nq2,
+                       float q3min, float q3max, unsigned int nq3) {
+    memset(hp, 0, sizeof(FieldMapHeader));
+    hp->magicWord = MAGICWORD;
+    hp->gridCS = 0;
+    hp->fieldCS = (type == TORUS) ? 1 : 0;
+    hp->lengthUnits = 0;
+    hp->angleUnits = 0;
+    hp->fieldUnits = 0;
+    hp->q1min = q1min;
+    hp->q1max = q1max;
+    hp->nq1 = nq1;
+    hp->q2min = q2min;
+    hp->q2max = q2max;
+    hp->nq2 = nq2;
+    hp->q3min = q3min;
+    hp->q3max = q3max;
+    hp->nq3 = nq3;
+
+    //creation date in ms, as JAVA would have written it
+    long long ms = (long long) time(NULL) * 1000;
+    hp->cdHigh = (int) (ms >> 32);
+    hp->cdLow = (int) (ms & 0xffffffffLL);
+}
+
+/**
+ * Byte swap a block of 32-bit entities
+ * @param ptr a pointer to the block.
+ * @param num32 the number of entities.
+ */
+static void swap32(char *ptr, size_t num32) {
+    for (size_t i = 0; i < num32; i++, ptr += 4) {
+        char t0 = ptr[0];
+        char t1 = ptr[1];
+        ptr[0] = ptr[3];
+        ptr[1] = ptr[2];
+        ptr[2] = t1;
+        ptr[3] = t0;
+    }
+}
+
+/**
+ * A unit test for the generator. Small maps are written in big endian
+ * order, read back by the normal reader, and every stored value is
+ * compared with the analytic field.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *generatorUnitTest() {
+    const char *path = "cMagGeneratorUnitTest.dat";
+    FieldValue expected;
+
+    for (int pass = 0; pass < 2; pass++) {
+        FieldType type = (pass == 0) ? TORUS : SOLENOID;
+
+        bool ok = (type == TORUS) ? generateTorusMap(path, 7, 26, 26, true, true, 2) :
+                  generateSolenoidMap(path, 31, 61, true, 2);
+        mu_assert("The generator failed to write a map.", ok);
+
+        MagneticFieldPtr fieldPtr = (type == TORUS) ? initializeTorus(path) : initializeSolenoid(path);
+        remove(path);
+        mu_assert("The generated map could not be read.", fieldPtr != NULL);
+        mu_assert("The generated map has the wrong type.", fieldPtr->type == type);
+
+        for (size_t i = 0; i < fieldPtr->numValues; i++) {
+            int nPhi, nRho, nZ;
+            invertCompositeIndex(fieldPtr, i, &nPhi, &nRho, &nZ);
+            double phi = fieldPtr->phiGridPtr->values[nPhi];
+            double rho = fieldPtr->rhoGridPtr->values[nRho];
+            double z = fieldPtr->zGridPtr->values[nZ];
+
+            FieldValuePtr stored = getFieldAtIndex(fieldPtr, i);
+            double x, y;
+            cylindricalToCartesian(&x, &y, phi, rho);
+
+            if (type == TORUS) {
+                analyticTorusField(&expected, x, y, z);
+                mu_assert("Generated torus value does not match the analytic field.",
+                          (fabs(stored->b1 - expected.b1) < 1.0e-4) &&
+                          (fabs(stored->b2 - expected.b2) < 1.0e-4) &&
+                          (fabs(stored->b3 - expected.b3) < 1.0e-4));
+            }
+            else {
+                analyticSolenoidField(&expected, rho, 0, z);
+                mu_assert("Generated solenoid value does not match the analytic field.",
+                          (stored->b1 == 0) &&
+                          (fabs(stored->b2 - expected.b1) < 1.0e-4) &&
+                          (fabs(stored->b3 - expected.b3) < 1.0e-4));
+            }
+        }
+
+        freeFieldMap(fieldPtr);
+    }
+
+    fprintf(stdout, "\nPASSED generatorUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,522 @@
+//
+//  magfieldintegral.c
+//  cMag
+//
+//  Field integrals along straight segments. Stepping along a line at a
+//  fixed spacing needs hundreds of queries and is still only approximate.
+//  Here the segment is walked cell by cell, in the manner of a DDA: the
+//  next crossing of a z plane, a rho cylinder and a phi half plane of the
+//  grid is found in closed form, and the nearest one ends the current
+//  piece. Inside a piece the interpolated field is smooth, so a few
+//  Gauss-Legendre points integrate it to interpolation accuracy.
+//
+//  The phi boundaries of a symmetric map repeat, reflected, in every half
+//  sector, so in the lab they are simply every multiple of the phi grid
+//  spacing, just as for a full map.
+//
+
+#include "magfieldintegral.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <math.h>
+
+//a value within this fraction of a cell of a grid plane is taken to be on it
+#define PLANE_EPS 1.0e-6
+
+//guards the walk against a numerical stall
+#define MAX_STEPS 1000000
+
+//Gauss-Legendre nodes and weights on [-1, 1]
+static const double gaussNodes[CMAG_GAUSS_POINTS] = {-0.7745966692414834, 0.0, 0.7745966692414834};
+static const double gaussWeights[CMAG_GAUSS_POINTS] = {0.5555555555555556, 0.8888888888888888,
+                                                       0.5555555555555556};
+
+//a segment in the frame of a map, with cached quantities for the walk
+typedef struct segment {
+    double p0[3];    //the start, in the map frame (shifts removed)
+    double d[3];     //end minus start
+    double shift[3]; //the map's shifts, to get back to the lab
+    double a, b, c;  //rho squared along the segment is a t^2 + 2 b t + c
+    double tStar;    //where the segment comes closest to the beam line
+    double cross;    //x0 dy - y0 dx; its sign is the sense of the phi sweep
+} Segment;
+
+//local prototypes
+static double nextPlane(double, double, double, int);
+static double rhoSquared(Segment *, double);
+static bool clipSegment(Segment *, MagneticFieldPtr, double *, double *);
+static double nextZ(Segment *, GridPtr, double);
+static double nextRho(Segment *, GridPtr, double);
+static double nextPhi(Segment *, GridPtr, double);
+static void integratePiece(Segment *, FieldProbePtr, double, double, double *, FieldIntegral *);
+static void walkMap(FieldProbePtr, const double *, const double *, double *, FieldIntegral *);
+static void finishIntegral(const double *, const double *, FieldIntegral *);
+
+/**
+ * Find the next grid plane strictly beyond a value in a direction.
+ * @param value the value.
+ * @param origin the value of grid plane 0.
+ * @param delta the grid spacing.
+ * @param dir +1 for the next larger plane, -1 for the next smaller.
+ * @return the value of the plane.
+ */
+static double nextPlane(double value, double origin, double delta, int dir) {
+    double k = (value - origin) / delta;
+    double kn = (dir > 0) ? floor(k + PLANE_EPS) + 1 : ceil(k - PLANE_EPS) - 1;
+    return origin + kn * delta;
+}
+
+/**
+ * The square of rho along a segment.
+ * @param segPtr the segment.
+ * @param t the segment parameter, 0 at the start and 1 at the end.
+ * @return rho squared at t.
+ */
+static double rhoSquared(Segment *segPtr, double t) {
+    return fmax(0, (segPtr->a * t + 2 * segPtr->b) * t + segPtr->c);
+}
+
+/**
+ * Clip a segment to the z range and outer radius of a map.
+ * @param segPtr the segment.
+ * @param fieldPtr the map.
+ * @param ta upon return, the parameter where the segment enters the map.
+ * @param tb upon return, the parameter where the segment leaves the map.
+ * @return false if the segment misses the map.
+ */
+static bool clipSegment(Segment *segPtr, MagneticFieldPtr fieldPtr, double *ta, double *tb) {
+    double t0 = 0;
+    double t1 = 1;
+
+    double z0 = segPtr->p0[2];
+    double dz = segPtr->d[2];
+    double zMin = fieldPtr->zGridPtr->minVal;
+    double zMax = fieldPtr->zGridPtr->maxVal;
+
+    if (dz == 0) {
+        if ((z0 < zMin) || (z0 > zMax)) {
+            return false;
+        }
+    }
+    else {
+        double tA = (zMin - z0) / dz;
+        double tB = (zMax - z0) / dz;
+        t0 = fmax(t0, fmin(tA, tB));
+        t1 = fmin(t1, fmax(tA, tB));
+    }
+
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal;
+    if (segPtr->a == 0) {
+        if (segPtr->c > rhoMax * rhoMax) {
+            return false;
+        }
+    }
+    else {
+        double disc = segPtr->b * segPtr->b - segPtr->a * (segPtr->c - rhoMax * rhoMax);
+        if (disc < 0) {
+            return false;
+        }
+        double root = sqrt(disc);
+        t0 = fmax(t0, (-segPtr->b - root) / segPtr->a);
+        t1 = fmin(t1, (-segPtr->b + root) / segPtr->a);
+    }
+
+    *ta = t0;
+    *tb = t1;
+    return (t1 > t0);
+}
+
+/**
+ * The parameter of the next z plane crossing.
+ * @param segPtr the segment.
+ * @param zGridPtr the z grid.
+ * @param t the current parameter.
+ * @return the parameter of the crossing, or INFINITY if there is none.
+ */
+static double nextZ(Segment *segPtr, GridPtr zGridPtr, double t) {
+    double dz = segPtr->d[2];
+    if (dz == 0) {
+        return INFINITY;
+    }
+    double z = segPtr->p0[2] + t * dz;
+    double plane = nextPlane(z, zGridPtr->minVal, zGridPtr->delta, (dz > 0) ? 1 : -1);
+    return (plane - segPtr->p0[2]) / dz;
+}
+
+/**
+ * The parameter of the next rho cylinder crossing. Rho falls until the
+ * closest approach to the beam line and rises after it, so the closest
+ * approach is also an event.
+ * @param segPtr the segment.
+ * @param rhoGridPtr the rho grid.
+ * @param t the current parameter.
+ * @return the parameter of the crossing, or INFINITY if there is none.
+ */
+static double nextRho(Segment *segPtr, GridPtr rhoGridPtr, double t) {
+    double a = segPtr->a;
+    double b = segPtr->b;
+    if (a == 0) {
+        return INFINITY;
+    }
+
+    double rho = sqrt(rhoSquared(segPtr, t));
+
+    if (t < segPtr->tStar) {
+        double r = nextPlane(rho, rhoGridPtr->minVal, rhoGridPtr->delta, -1);
+        if ((r <= 0) || (r * r <= rhoSquared(segPtr, segPtr->tStar))) {
+            return segPtr->tStar;
+        }
+        return (-b - sqrt(fmax(0, b * b - a * (segPtr->c - r * r)))) / a;
+    }
+
+    double r = nextPlane(rho, rhoGridPtr->minVal, rhoGridPtr->delta, 1);
+    return (-b + sqrt(fmax(0, b * b - a * (segPtr->c - r * r)))) / a;
+}
+
+/**
+ * The parameter of the next phi half plane crossing. Along a line that
+ * misses the beam line phi changes monotonically, by less than 180 degrees.
+ * @param segPtr the segment.
+ * @param phiGridPtr the phi grid.
+ * @param t the current parameter.
+ * @return the parameter of the crossing, or INFINITY if there is none.
+ */
+static double nextPhi(Segment *segPtr, GridPtr phiGridPtr, double t) {
+    if ((phiGridPtr->num < 2) || (segPtr->cross == 0)) {
+        return INFINITY;
+    }
+
+    double x0 = segPtr->p0[0];
+    double y0 = segPtr->p0[1];
+    double dx = segPtr->d[0];
+    double dy = segPtr->d[1];
+
+    double phi = toDegrees(atan2(y0 + t * dy, x0 + t * dx));
+    double plane = toRadians(nextPlane(phi, phiGridPtr->minVal, phiGridPtr->delta,
+                                       (segPtr->cross > 0) ? 1 : -1));
+    double cosPlane = cos(plane);
+    double sinPlane = sin(plane);
+
+    double denom = sinPlane * dx - cosPlane * dy;
+    if (denom == 0) {
+        return INFINITY;
+    }
+
+    //the line meets the whole plane once; it must be ahead, on the right half
+    double tp = (cosPlane * y0 - sinPlane * x0) / denom;
+    if ((tp <= t) || (cosPlane * (x0 + tp * dx) + sinPlane * (y0 + tp * dy) <= 0)) {
+        return INFINITY;
+    }
+    return tp;
+}
+
+/**
+ * Integrate the field over one piece of a segment that lies in one cell.
+ * @param segPtr the segment.
+ * @param probePtr the probe of the map.
+ * @param t1 the parameter at the start of the piece.
+ * @param t2 the parameter at the end of the piece.
+ * @param bdl the running integral of B dl, per unit segment parameter.
+ * @param resultPtr the result, whose counts are updated.
+ */
+static void integratePiece(Segment *segPtr, FieldProbePtr probePtr, double t1, double t2,
+                           double *bdl, FieldIntegral *resultPtr) {
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    double mid = 0.5 * (t1 + t2);
+    double half = 0.5 * (t2 - t1);
+
+    //pieces in the hole of a map, or beyond it, have no field
+    double rho = sqrt(rhoSquared(segPtr, mid));
+    if (!containsCylindrical(fieldPtr, rho, segPtr->p0[2] + mid * segPtr->d[2])) {
+        return;
+    }
+
+    FieldValue value;
+    for (int i = 0; i < CMAG_GAUSS_POINTS; i++) {
+        double t = mid + half * gaussNodes[i];
+        getProbeFieldValue(&value,
+                           segPtr->p0[0] + t * segPtr->d[0] + segPtr->shift[0],
+                           segPtr->p0[1] + t * segPtr->d[1] + segPtr->shift[1],
+                           segPtr->p0[2] + t * segPtr->d[2] + segPtr->shift[2],
+                           probePtr);
+        double w = gaussWeights[i] * half;
+        bdl[0] += w * value.b1;
+        bdl[1] += w * value.b2;
+        bdl[2] += w * value.b3;
+    }
+
+    resultPtr->numCells++;
+    resultPtr->numEvaluations += CMAG_GAUSS_POINTS;
+}
+
+/**
+ * Walk the cells a segment crosses in one map, adding to an integral.
+ * @param probePtr the probe of the map.
+ * @param start the start of the segment in the lab, (x, y, z) in cm.
+ * @param end the end of the segment in the lab, (x, y, z) in cm.
+ * @param bdl the running integral of B dl, per unit segment parameter.
+ * @param resultPtr the result, whose counts are updated.
+ */
+static void walkMap(FieldProbePtr probePtr, const double *start, const double *end,
+                    double *bdl, FieldIntegral *resultPtr) {
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    Segment seg;
+
+    seg.shift[0] = fieldPtr->shiftX;
+    seg.shift[1] = fieldPtr->shiftY;
+    seg.shift[2] = fieldPtr->shiftZ;
+
+    for (int i = 0; i < 3; i++) {
+        seg.p0[i] = start[i] - seg.shift[i];
+        seg.d[i] = end[i] - start[i];
+    }
+
+    seg.a = seg.d[0] * seg.d[0] + seg.d[1] * seg.d[1];
+    seg.b = seg.p0[0] * seg.d[0] + seg.p0[1] * seg.d[1];
+    seg.c = seg.p0[0] * seg.p0[0] + seg.p0[1] * seg.p0[1];
+    seg.tStar = (seg.a > 0) ? -seg.b / seg.a : 0;
+    seg.cross = seg.p0[0] * seg.d[1] - seg.p0[1] * seg.d[0];
+
+    double t, tEnd;
+    if (!clipSegment(&seg, fieldPtr, &t, &tEnd)) {
+        return;
+    }
+
+    //the next event of each kind; only the one that fires is recomputed
+    double tz = nextZ(&seg, fieldPtr->zGridPtr, t);
+    double tr = nextRho(&seg, fieldPtr->rhoGridPtr, t);
+    double tp = nextPhi(&seg, fieldPtr->phiGridPtr, t);
+
+    for (int step = 0; (step < MAX_STEPS) && (t < tEnd); step++) {
+        double tNext = fmin(fmin(tz, tr), fmin(tp, tEnd));
+
+        if (tNext > t) {
+            integratePiece(&seg, probePtr, t, tNext, bdl, resultPtr);
+            t = tNext;
+        }
+
+        if (tz <= t) {
+            tz = nextZ(&seg, fieldPtr->zGridPtr, t);
+        }
+        if (tr <= t) {
+            tr = nextRho(&seg, fieldPtr->rhoGridPtr, t);
+        }
+        if (tp <= t) {
+            tp = nextPhi(&seg, fieldPtr->phiGridPtr, t);
+        }
+    }
+}
+
+/**
+ * Fill in a result from the integral of B dl per unit segment parameter.
+ * @param start the start of the segment.
+ * @param end the end of the segment.
+ * @param resultPtr the result, with the integral in bdl.
+ */
+static void finishIntegral(const double *start, const double *end, FieldIntegral *resultPtr) {
+    double d[3] = {end[0] - start[0], end[1] - start[1], end[2] - start[2]};
+    double length = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+
+    //dl = d dt, so the integrals per unit parameter scale by the length
+    for (int i = 0; i < 3; i++) {
+        resultPtr->bdl[i] *= length;
+    }
+
+    double *bdl = resultPtr->bdl;
+    double *bxdl = resultPtr->bCrossDl;
+    if (length > 0) {
+        bxdl[0] = (bdl[1] * d[2] - bdl[2] * d[1]) / length;
+        bxdl[1] = (bdl[2] * d[0] - bdl[0] * d[2]) / length;
+        bxdl[2] = (bdl[0] * d[1] - bdl[1] * d[0]) / length;
+    }
+    else {
+        bxdl[0] = bxdl[1] = bxdl[2] = 0;
+    }
+    resultPtr->length = length;
+}
+
+/**
+ * Integrate a map's field along a straight segment, visiting exactly the
+ * cells the segment crosses. Thread safe when each thread uses its own
+ * probe.
+ * @param probePtr a probe of the map.
+ * @param start the start of the segment, (x, y, z) in cm.
+ * @param end the end of the segment, (x, y, z) in cm.
+ * @param resultPtr upon return, the integrals along the segment.
+ */
+void integrateLine(FieldProbePtr probePtr, const double *start, const double *end,
+                   FieldIntegral *resultPtr) {
+    resultPtr->bdl[0] = resultPtr->bdl[1] = resultPtr->bdl[2] = 0;
+    resultPtr->numCells = 0;
+    resultPtr->numEvaluations = 0;
+
+    walkMap(probePtr, start, end, resultPtr->bdl, resultPtr);
+    finishIntegral(start, end, resultPtr);
+}
+
+/**
+ * Integrate a map's field along many segments. The batch form of
+ * integrateLine; rays that share a start, such as rays from the target,
+ * are best passed in order of direction so that the probe's cell is reused.
+ * @param probePtr a probe of the map.
+ * @param starts the starts of the segments, num (x, y, z) triples in cm.
+ * @param ends the ends of the segments, num (x, y, z) triples in cm.
+ * @param num the number of segments.
+ * @param results space for num results.
+ */
+void integrateLines(FieldProbePtr probePtr, const double *starts, const double *ends, size_t num,
+                    FieldIntegral *results) {
+    for (size_t i = 0; i < num; i++) {
+        integrateLine(probePtr, starts + 3 * i, ends + 3 * i, results + i);
+    }
+}
+
+/**
+ * Integrate the field of a composite along a straight segment, walking
+ * the cells of each of its maps in turn.
+ * @param probePtr a probe of the composite.
+ * @param start the start of the segment, (x, y, z) in cm.
+ * @param end the end of the segment, (x, y, z) in cm.
+ * @param resultPtr upon return, the integrals along the segment.
+ */
+void integrateCompositeLine(CompositeProbePtr probePtr, const double *start, const double *end,
+                            FieldIntegral *resultPtr) {
+    resultPtr->bdl[0] = resultPtr->bdl[1] = resultPtr->bdl[2] = 0;
+    resultPtr->numCells = 0;
+    resultPtr->numEvaluations = 0;
+
+    for (int i = 0; i < probePtr->compositePtr->numFields; i++) {
+        walkMap(probePtr->probes[i], start, end, resultPtr->bdl, resultPtr);
+    }
+    finishIntegral(start, end, resultPtr);
+}
+
+/**
+ * Integrate the field of a composite along many segments. The batch form
+ * of integrateCompositeLine.
+ * @param probePtr a probe of the composite.
+ * @param starts the starts of the segments, num (x, y, z) triples in cm.
+ * @param ends the ends of the segments, num (x, y, z) triples in cm.
+ * @param num the number of segments.
+ * @param results space for num results.
+ */
+void integrateCompositeLines(CompositeProbePtr probePtr, const double *starts, const double *ends,
+                             size_t num, FieldIntegral *results) {
+    for (size_t i = 0; i < num; i++) {
+        integrateCompositeLine(probePtr, starts + 3 * i, ends + 3 * i, results + i);
+    }
+}
+
+/**
+ * Print the result of an integration.
+ * @param resultPtr the result.
+ * @param stream a file stream, e.g. stdout.
+ */
+void printFieldIntegral(const FieldIntegral *resultPtr, FILE *stream) {
+    fprintf(stream, "int B dl: (%-10.4f, %-10.4f, %-10.4f) kG cm\n",
+            resultPtr->bdl[0], resultPtr->bdl[1], resultPtr->bdl[2]);
+    fprintf(stream, "int B x dl: (%-10.4f, %-10.4f, %-10.4f) kG cm\n",
+            resultPtr->bCrossDl[0], resultPtr->bCrossDl[1], resultPtr->bCrossDl[2]);
+    fprintf(stream, "length: %-8.2f cm  cells: %d  evaluations: %d\n",
+            resultPtr->length, resultPtr->numCells, resultPtr->numEvaluations);
+}
+
+/**
+ * Integrate B dl along a segment by the midpoint rule, as a reference.
+ * @param probePtr a probe of the map.
+ * @param start the start of the segment.
+ * @param end the end of the segment.
+ * @param steps the number of steps.
+ * @param bdl upon return, the integral of B dl in kG cm.
+ */
+static void referenceIntegral(FieldProbePtr probePtr, const double *start, const double *end,
+                              int steps, double *bdl) {
+    double d[3] = {end[0] - start[0], end[1] - start[1], end[2] - start[2]};
+    double dl = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) / steps;
+    FieldValue value;
+
+    bdl[0] = bdl[1] = bdl[2] = 0;
+    for (int i = 0; i < steps; i++) {
+        double t = (i + 0.5) / steps;
+        getProbeFieldValue(&value, start[0] + t * d[0], start[1] + t * d[1], start[2] + t * d[2], probePtr);
+        bdl[0] += value.b1 * dl;
+        bdl[1] += value.b2 * dl;
+        bdl[2] += value.b3 * dl;
+    }
+}
+
+/**
+ * A unit test of the cell walk. Integrals along rays from the target, and
+ * along random segments, some crossing the beam line, must match a fine
+ * midpoint rule. The batch form must match the scalar form.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *integralUnitTest() {
+    int count = 200;
+    int steps = 20000;
+    double rhoMax = testFieldPtr->rhoGridPtr->maxVal;
+    double zMin = testFieldPtr->zGridPtr->minVal;
+    double zMax = testFieldPtr->zGridPtr->maxVal;
+    double starts[3 * count], ends[3 * count];
+
+    for (int i = 0; i < count; i++) {
+        double *start = starts + 3 * i;
+        double *end = ends + 3 * i;
+
+        if (i % 2 == 0) { //from the target
+            double theta = toRadians(randomDouble(1, 120));
+            double phi = toRadians(randomDouble(0, 360));
+            double r = 1.2 * hypot(rhoMax, fmax(fabs(zMin), fabs(zMax)));
+            start[0] = 0;
+            start[1] = 0;
+            start[2] = randomDouble(-5, 5);
+            end[0] = r * sin(theta) * cos(phi);
+            end[1] = r * sin(theta) * sin(phi);
+            end[2] = start[2] + r * cos(theta);
+        }
+        else {
+            for (int j = 0; j < 2; j++) {
+                double *p = (j == 0) ? start : end;
+                double phi = toRadians(randomDouble(0, 360));
+                double rho = randomDouble(0, 1.1 * rhoMax);
+                p[0] = rho * cos(phi);
+                p[1] = rho * sin(phi);
+                p[2] = randomDouble(zMin - 20, zMax + 20);
+            }
+            if (i % 10 == 1) { //straight through the beam line
+                end[0] = -start[0];
+                end[1] = -start[1];
+            }
+        }
+    }
+
+    FieldProbePtr probePtr = createProbe(testFieldPtr);
+    FieldIntegral results[count];
+    integrateLines(probePtr, starts, ends, count, results);
+
+    long evaluations = 0;
+    for (int i = 0; i < count; i++) {
+        FieldIntegral single;
+        double reference[3];
+
+        integrateLine(probePtr, starts + 3 * i, ends + 3 * i, &single);
+        mu_assert("The batch integral differs from the scalar integral",
+                  (single.bdl[0] == results[i].bdl[0]) && (single.bdl[2] == results[i].bdl[2]));
+
+        referenceIntegral(probePtr, starts + 3 * i, ends + 3 * i, steps, reference);
+        double tolerance = 1.0e-6 * testFieldPtr->metricsPtr->maxFieldMagnitude * single.length;
+
+        for (int j = 0; j < 3; j++) {
+            mu_assert("The cell walk integral differs from the midpoint rule",
+                      fabs(single.bdl[j] - reference[j]) < tolerance);
+        }
+        evaluations += single.numEvaluations;
+    }
+    freeProbe(probePtr);
+
+    fprintf(stdout, "\nPASSED integralUnitTest (%ld evaluations per segment versus %d)\n",
+            evaluations / count, steps);
+    return NULL;
+}
@@ -4,22 +4,69 @@
 
 #include "magfieldio.h"
 #include "magfieldutil.h"
+#include "magfieldlog.h"
+#include "magfieldmem.h"
+#include "magfieldnuma.h"
+#include "magfieldpyramid.h"
+#include "magfieldmagnitude.h"
+#include "munittest.h"
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <arpa/inet.h>
 #include <math.h>
+#include <limits.h>
 
 //do we have to swap bytes?
 //since the fields were produced by Java which uses
 //new format (BigEndian) we probably will have to swap.
 static bool swapBytes = false;
 
+//the version 2 header layout is part of the file format
+_Static_assert(sizeof(FieldMapHeader2) == 624, "FieldMapHeader2 layout changed");
+
+//room for the text of a creation date, from ctime_r
+#define DATESIZE 32
+
+//where each piece of a map is placed in its arena (see layoutMap)
+typedef struct mapparts {
+    void *arena;
+    MagneticFieldPtr fieldPtr;
+    GridPtr grids[3];
+    Cell3DPtr cell3DPtr;
+    Cell2DPtr cell2DPtr;
+    FieldMetricsPtr metricsPtr;
+    FieldMapHeaderPtr headerPtr;
+    char *names[3];
+    char *path;
+    char *creationDate;
+    double *gridValues[3];
+    FieldValuePtr fieldValues;
+} MapParts;
+
+//the coordinate names, q1 to q3
+static const char *gridNames[] = {"phi", "rho", "z"};
+
 //local prototypes
 static FieldMapHeaderPtr readMapHeader(FILE *);
 static MagneticFieldPtr readField(const char *);
+static bool readVersion1(FILE *, const char *, MapParts *);
+static bool readVersion2(FILE *, const char *, MapParts *);
+static bool createMapArena(const FieldMapHeader *, const char *, MapParts *);
+static size_t layoutMap(char *, const FieldMapHeader *, const char *, MapParts *);
+static void *place(char *, size_t *, size_t, size_t);
+static void swapHeader2(FieldMapHeader2 *);
+static int fileVersion(FILE *);
+static bool writePadding(FILE *, size_t);
 static long getFileSize(FILE*);
-static void swap32(char*, int);
-static char* getCreationDate(MagneticFieldPtr);
+static void swap32(char*, size_t);
+static void getCreationDate(FieldMapHeaderPtr, char *);
 static void computeFieldMetrics(MagneticFieldPtr);
+static Cell3DPtr newCell3D(MagneticFieldPtr, FieldValuePtr);
+static Cell2DPtr newCell2D(MagneticFieldPtr, FieldValuePtr);
+static void initCell3D(Cell3DPtr, MagneticFieldPtr, FieldValuePtr);
+static void initCell2D(Cell2DPtr, MagneticFieldPtr, FieldValuePtr);
+static bool inArena(const void *, size_t, const void *, size_t);
 
 /**
  * Initialize the torus field.
@@ -69,70 +116,77 @@ MagneticFieldPtr initializeSolenoid(const char *solenoidPath) {
 
 
 /**
- * Read a binary field map at the given location.
+ * Read a binary field map at the given location. The file may be in
+ * the original (version 1) format or in version 2; the version is
+ * detected from the first word. The whole map, metadata and values, is
+ * built in a single arena (see layoutMap), so freeFieldMap is one free.
  * @param path the full path to a field map file.
  * @return a valid field pointer on success, NULL on failure.
  */
 static MagneticFieldPtr readField(const char *path) {
 
-    debugPrint("\nAttempting to read field map from [%s]\n", path);
+    LOG_DEBUG("Attempting to read field map from [%s]", path);
     FILE *file = fopen(path, "r");
     if (file == NULL) {
         fprintf(stderr, "\ncMag ERROR could not read field map file: [%s]\n", path);
         return NULL;
     }
 
-    //get the header
-    FieldMapHeaderPtr headerPtr = readMapHeader(file);
-    if (headerPtr == NULL) {
-        fclose(file);
-        fprintf(stderr, "\ncMag ERROR could not read field map header from: [%s]\n", path);
-        return NULL;
-    }
-
-    MagneticFieldPtr fieldPtr = createFieldMap();
+    MapParts parts;
 
-    //copy the path and name
-    stringCopy(&(fieldPtr->path), path);
+    int version = fileVersion(file);
+    LOG_DEBUG("file format version: %d", version);
 
-    fieldPtr->headerPtr = headerPtr;
-    fieldPtr->numValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
-    fieldPtr->creationDate = getCreationDate(fieldPtr);
-
-    //malloc the data array
-    fieldPtr->fieldValues = malloc(fieldPtr->numValues * sizeof(FieldValue));
+    bool ok = (version == FILEVERSION2) ? readVersion2(file, path, &parts) :
+              readVersion1(file, path, &parts);
+    fclose(file);
 
-    //did we have enough memory?
-    if (fieldPtr->fieldValues == NULL) {
-        fprintf(stderr, "\ncMag ERROR out of memory when allocating space for field map.\n");
-        fclose(file);
+    if (!ok) {
         return NULL;
     }
 
-    //now we can read the field. Reading the header should have left
-    //the file pointer positioned at the right spot.
-    fread(fieldPtr->fieldValues, sizeof(FieldValue), fieldPtr->numValues, file);
-    fclose(file);
+    MagneticFieldPtr fieldPtr = parts.fieldPtr;
+    FieldMapHeaderPtr headerPtr = parts.headerPtr;
 
-    //swap?
-    if (swapBytes) {
-        for (int i = 0; i < fieldPtr->numValues; i++) {
-            swap32((char*) (fieldPtr->fieldValues + i), 3);
-        }
-    }
+    fieldPtr->arena = parts.arena;
+    fieldPtr->metricsPtr = parts.metricsPtr;
+    fieldPtr->scale = 1;
+    fieldPtr->shiftX = 0;
+    fieldPtr->shiftY = 0;
+    fieldPtr->shiftZ = 0;
+    fieldPtr->replicas = NULL;
+    fieldPtr->numReplicas = 0;
+    fieldPtr->pyramidPtr = NULL;
+    fieldPtr->magnitudes = NULL;
+
+    //the path, and the file name as the name
+    strcpy(parts.path, path);
+    fieldPtr->path = parts.path;
+    char *slash = strrchr(parts.path, '/');
+    fieldPtr->name = (slash == NULL) ? parts.path : slash + 1;
+
+    fieldPtr->headerPtr = headerPtr;
+    fieldMapSize(headerPtr, &(fieldPtr->numValues), NULL); //checked by the readers
+    getCreationDate(headerPtr, parts.creationDate);
+    fieldPtr->creationDate = parts.creationDate;
+    fieldPtr->fieldValues = parts.fieldValues;
 
     //create the coordinate grids
     //CLAS fields always have cylindrical grids
     //with q1 = phi, q2 = rho and q3 = z
-    fieldPtr->phiGridPtr = createGrid("phi", headerPtr->q1min,
-                                      headerPtr->q1max, headerPtr->nq1);
-    fieldPtr->rhoGridPtr = createGrid("rho", headerPtr->q2min,
-                                      headerPtr->q2max, headerPtr->nq2);
-    fieldPtr->zGridPtr = createGrid("z", headerPtr->q3min,
-                                    headerPtr->q3max, headerPtr->nq3);
+    double mins[3] = {headerPtr->q1min, headerPtr->q2min, headerPtr->q3min};
+    double maxs[3] = {headerPtr->q1max, headerPtr->q2max, headerPtr->q3max};
+    unsigned int nums[3] = {headerPtr->nq1, headerPtr->nq2, headerPtr->nq3};
+    for (int i = 0; i < 3; i++) {
+        strcpy(parts.names[i], gridNames[i]);
+        initGrid(parts.grids[i], parts.names[i], parts.gridValues[i], mins[i], maxs[i], nums[i]);
+    }
+    fieldPtr->phiGridPtr = parts.grids[0];
+    fieldPtr->rhoGridPtr = parts.grids[1];
+    fieldPtr->zGridPtr = parts.grids[2];
 
     //this is useful to cache for indexing purposes
-    fieldPtr->N23 = headerPtr->nq2 * headerPtr->nq3;
+    fieldPtr->N23 = (size_t) headerPtr->nq2 * headerPtr->nq3;
 
     //solenoid files have nq1 (nPhi) = 1 and are symmetric (no phi dependence apart from rotation)
     //torus symmetric if phi max = 30.
@@ -142,34 +196,433 @@ static MagneticFieldPtr readField(const char *path) {
         fieldPtr->type = SOLENOID;
         fieldPtr->symmetric = true;
         fieldPtr->cell3DPtr = NULL;
-        createCell2D(fieldPtr);
+        fieldPtr->cell2DPtr = parts.cell2DPtr;
+        initCell2D(fieldPtr->cell2DPtr, fieldPtr, fieldPtr->fieldValues);
     }
     else {
         fieldPtr->type = TORUS;
         if ((headerPtr->q1max - headerPtr->q1min) < 31) {
             fieldPtr->symmetric = true;
         }
-        createCell3D(fieldPtr);
+        fieldPtr->cell3DPtr = parts.cell3DPtr;
+        initCell3D(fieldPtr->cell3DPtr, fieldPtr, fieldPtr->fieldValues);
         fieldPtr->cell2DPtr = NULL;
     }
 
 
-    //compute some metrics
+    //compute some metrics, filling in |B| per grid point if asked to
+    if (getMagnitudeGrids()) {
+        fieldPtr->magnitudes = (float *) allocFieldArray(fieldPtr->numValues * sizeof(float));
+    }
     computeFieldMetrics(fieldPtr);
 
+    //copy the values to each NUMA node, if asked to
+    if (getNumaReplication()) {
+        replicateFieldMap(fieldPtr);
+    }
+
+    //summarize |B| and its gradient for region queries, if asked to
+    if (getFieldPyramids()) {
+        buildFieldPyramid(fieldPtr, 0);
+    }
+
     printFieldSummary(fieldPtr, stdout);
     return fieldPtr;
 }
 
 /**
- * Create a 3D cell, which is used by the torus.
- * Note that nothing is
- * returned, the field's 2D cell pointer is made to point at the cell,
- * and the cell is given a reference to the field.
- * @param fieldPtr a pointer to the solenoid field.
+ * Allocate the arena for a map and lay it out. The arena is a single
+ * huge page backed (if possible) field array. The header is copied in;
+ * the caller reads the values into parts->fieldValues.
+ * @param header the grid header, already checked.
+ * @param path the path to the file.
+ * @param parts upon success, where each piece of the map goes.
+ * @return true on success.
+ */
+static bool createMapArena(const FieldMapHeader *header, const char *path, MapParts *parts) {
+    size_t arenaBytes = layoutMap(NULL, header, path, parts);
+    char *arena = (char *) allocFieldArray(arenaBytes);
+
+    if (arena == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory when allocating space for field map.\n");
+        return false;
+    }
+
+    layoutMap(arena, header, path, parts);
+    parts->arena = arena;
+    *(parts->headerPtr) = *header;
+    LOG_DEBUG("map arena of %zu bytes, values at offset %zu", arenaBytes,
+              (size_t) ((char *) parts->fieldValues - arena));
+    return true;
+}
+
+/**
+ * Lay out the pieces of a map in an arena. The structures used on every
+ * query (the field, its grids and its cell) come first, so they share
+ * a few cache lines, then the rest of the metadata, then the values on
+ * a V2ALIGNMENT boundary, so they start on a page of their own.
+ * @param base the arena, or NULL just to find its size.
+ * @param header the grid header.
+ * @param path the path to the file.
+ * @param parts upon return, where each piece goes (if base is not NULL).
+ * @return the size of the arena in bytes.
+ */
+static size_t layoutMap(char *base, const FieldMapHeader *header, const char *path, MapParts *parts) {
+    size_t used = 0;
+    size_t line = 64;
+
+    parts->fieldPtr = (MagneticFieldPtr) place(base, &used, sizeof(MagneticField), line);
+    for (int i = 0; i < 3; i++) {
+        parts->grids[i] = (GridPtr) place(base, &used, sizeof(Grid), sizeof(double));
+    }
+
+    //only one of the cells is used
+    parts->cell3DPtr = NULL;
+    parts->cell2DPtr = NULL;
+    if (header->nq1 < 2) {
+        parts->cell2DPtr = (Cell2DPtr) place(base, &used, sizeof(Cell2D), line);
+    }
+    else {
+        parts->cell3DPtr = (Cell3DPtr) place(base, &used, sizeof(Cell3D), line);
+    }
+
+    parts->metricsPtr = (FieldMetricsPtr) place(base, &used, sizeof(FieldMetrics), line);
+    parts->headerPtr = (FieldMapHeaderPtr) place(base, &used, sizeof(FieldMapHeader), sizeof(double));
+
+    for (int i = 0; i < 3; i++) {
+        parts->names[i] = (char *) place(base, &used, strlen(gridNames[i]) + 1, 1);
+    }
+    parts->path = (char *) place(base, &used, strlen(path) + 1, 1);
+    parts->creationDate = (char *) place(base, &used, DATESIZE, 1);
+
+    unsigned int nums[3] = {header->nq1, header->nq2, header->nq3};
+    for (int i = 0; i < 3; i++) {
+        size_t num = (nums[i] < 2) ? 1 : nums[i];
+        parts->gridValues[i] = (double *) place(base, &used, num * sizeof(double), line);
+    }
+
+    size_t numValues, numBytes;
+    fieldMapSize((FieldMapHeaderPtr) header, &numValues, &numBytes); //checked by the readers
+    parts->fieldValues = (FieldValuePtr) place(base, &used, numBytes, V2ALIGNMENT);
+    return used;
+}
+
+/**
+ * Place a piece in an arena, after those already placed.
+ * @param base the arena, or NULL if only sizing.
+ * @param used the bytes used so far; advanced past the piece.
+ * @param bytes the size of the piece.
+ * @param align its alignment, a power of two.
+ * @return where the piece goes, or NULL if sizing.
+ */
+static void *place(char *base, size_t *used, size_t bytes, size_t align) {
+    size_t offset = (*used + align - 1) & ~(align - 1);
+    *used = offset + bytes;
+    return (base == NULL) ? NULL : base + offset;
+}
+
+/**
+ * Read the header and field values of a version 1 file into a new arena.
+ * @param file the open file, positioned at the start.
+ * @param path the path, for error messages.
+ * @param parts upon success, the arena, holding the header and the
+ * field values in native byte order.
+ * @return true on success.
+ */
+static bool readVersion1(FILE *file, const char *path, MapParts *parts) {
+
+    //get the header
+    FieldMapHeaderPtr headerPtr = readMapHeader(file);
+    if (headerPtr == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not read field map header from: [%s]\n", path);
+        return false;
+    }
+
+    //readMapHeader checked the size for overflow
+    size_t numValues;
+    fieldMapSize(headerPtr, &numValues, NULL);
+
+    bool ok = createMapArena(headerPtr, path, parts);
+    free(headerPtr);
+    if (!ok) {
+        return false;
+    }
+
+    //now we can read the field. Reading the header should have left
+    //the file pointer positioned at the right spot.
+    fread(parts->fieldValues, sizeof(FieldValue), numValues, file);
+
+    //swap?
+    if (swapBytes) {
+        swap32((char*) parts->fieldValues, 3 * numValues);
+    }
+    return true;
+}
+
+/**
+ * Read the header and field values of a version 2 file into a new arena,
+ * checking the header and data checksums.
+ * @param file the open file, positioned at the start.
+ * @param path the path, for error messages.
+ * @param parts upon success, the arena, holding the grid header and the
+ * field values in native byte order, V2ALIGNMENT aligned so the section
+ * could equally be mapped or read with O_DIRECT.
+ * @return true on success.
+ */
+static bool readVersion2(FILE *file, const char *path, MapParts *parts) {
+    FieldMapHeader2 header;
+    long actualFileSize = getFileSize(file);
+
+    if (fread(&header, sizeof(FieldMapHeader2), 1, file) != 1) {
+        fprintf(stderr, "\ncMag ERROR truncated version 2 header in: [%s]\n", path);
+        return false;
+    }
+
+    //the byte order mark tells us if we have to swap
+    unsigned int mark = header.byteOrder;
+    bool swap = (mark != BYTEORDERMARK);
+    if (swap) {
+        swap32((char *) &mark, 1);
+        if (mark != BYTEORDERMARK) {
+            fprintf(stderr, "\ncMag ERROR bad byte order mark in: [%s]\n", path);
+            return false;
+        }
+    }
+    LOG_DEBUG("byteswap required: %s", swap ? "yes" : "no");
+
+    //the header checksum is over the bytes as written, with the checksum zeroed
+    unsigned int headerCrc = header.headerCrc;
+    header.headerCrc = 0;
+    unsigned int computedCrc = crc32c(0, &header, sizeof(FieldMapHeader2));
+
+    if (swap) {
+        swapHeader2(&header);
+        swap32((char *) &headerCrc, 1);
+    }
+
+    if (headerCrc != computedCrc) {
+        fprintf(stderr, "\ncMag ERROR header checksum mismatch in: [%s]\n", path);
+        return false;
+    }
+
+    if ((header.version != FILEVERSION2) || (header.numSections > V2MAXSECTIONS)) {
+        fprintf(stderr, "\ncMag ERROR unsupported field map version %u in: [%s]\n", header.version, path);
+        return false;
+    }
+
+    //find the field values, skipping any derived data
+    SectionEntry *section = NULL;
+    for (unsigned int i = 0; i < header.numSections; i++) {
+        if (header.sections[i].type == SECTION_FIELD_VALUES) {
+            section = header.sections + i;
+            break;
+        }
+    }
+
+    if (section == NULL) {
+        fprintf(stderr, "\ncMag ERROR no field values section in: [%s]\n", path);
+        return false;
+    }
+
+    if ((section->layout != LAYOUT_LINEAR) || (section->elementSize != sizeof(FieldValue))) {
+        fprintf(stderr, "\ncMag ERROR unsupported field values layout %u in: [%s]\n", section->layout, path);
+        return false;
+    }
+
+    size_t numValues, numBytes;
+    if (!fieldMapSize(&(header.grid), &numValues, &numBytes)) {
+        fprintf(stderr, "\ncMag ERROR bad or overflowing grid size in: [%s]\n", path);
+        return false;
+    }
+
+    if ((section->size != numBytes) ||
+        (section->offset > (unsigned long long) actualFileSize) ||
+        (section->size > (unsigned long long) actualFileSize - section->offset)) {
+        fprintf(stderr, "\ncMag ERROR field values section size does not match the grid in: [%s]\n", path);
+        return false;
+    }
+
+    if (!createMapArena(&(header.grid), path, parts)) {
+        return false;
+    }
+    void *data = parts->fieldValues;
+
+    if ((fseek(file, (long) section->offset, SEEK_SET) != 0) ||
+        (fread(data, 1, section->size, file) != section->size)) {
+        fprintf(stderr, "\ncMag ERROR could not read the field values from: [%s]\n", path);
+        freeFieldArray(parts->arena);
+        return false;
+    }
+
+    if (crc32c(0, data, section->size) != section->crc) {
+        fprintf(stderr, "\ncMag ERROR field values checksum mismatch in: [%s]\n", path);
+        freeFieldArray(parts->arena);
+        return false;
+    }
+
+    if (swap) {
+        swap32((char *) data, 3 * numValues);
+    }
+    return true;
+}
+
+/**
+ * Byte swap a version 2 header read from a file of the other byte order.
+ * @param header the header.
+ */
+static void swapHeader2(FieldMapHeader2 *header) {
+    swap32((char *) header, sizeof(FieldMapHeader2) / 4);
+
+    //word swapping leaves the halves of the 64 bit values exchanged
+    for (int i = 0; i < V2MAXSECTIONS; i++) {
+        unsigned int *offset = (unsigned int *) &(header->sections[i].offset);
+        unsigned int *size = (unsigned int *) &(header->sections[i].size);
+        unsigned int temp = offset[0];
+        offset[0] = offset[1];
+        offset[1] = temp;
+        temp = size[0];
+        size[0] = size[1];
+        size[1] = temp;
+    }
+}
+
+/**
+ * Look at the first word of a file to get its format version.
+ * @param file the open file. It is left positioned at the start.
+ * @return FILEVERSION2 for a version 2 file, otherwise 1.
+ */
+static int fileVersion(FILE *file) {
+    unsigned int word = 0;
+    fread(&word, sizeof(unsigned int), 1, file);
+    rewind(file);
+
+    unsigned int swapped = word;
+    swap32((char *) &swapped, 1);
+    return ((word == MAGICWORD2) || (swapped == MAGICWORD2)) ? FILEVERSION2 : 1;
+}
+
+/**
+ * Get the format version of a field map file.
+ * @param path the path to the file.
+ * @return 1 or 2, or -1 if the file could not be read or is not a field map.
+ */
+int getFileVersion(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    unsigned int word = 0;
+    bool ok = (fread(&word, sizeof(unsigned int), 1, file) == 1);
+    rewind(file);
+    int version = fileVersion(file);
+    fclose(file);
+
+    if (!ok) {
+        return -1;
+    }
+    if (version == FILEVERSION2) {
+        return version;
+    }
+    return ((word == MAGICWORD) || (htonl(word) == MAGICWORD)) ? 1 : -1;
+}
+
+/**
+ * Write a field map as a version 2 file, in the byte order of this
+ * machine. The header is followed by the field values section, each
+ * padded to a multiple of V2ALIGNMENT.
+ * @param fieldPtr the field map.
+ * @param path the path of the new file.
+ * @return true on success.
+ */
+bool writeFieldMap2(MagneticFieldPtr fieldPtr, const char *path) {
+    FieldMapHeader2 header;
+    memset(&header, 0, sizeof(FieldMapHeader2));
+
+    header.magicWord = MAGICWORD2;
+    header.version = FILEVERSION2;
+    header.byteOrder = BYTEORDERMARK;
+    header.alignment = V2ALIGNMENT;
+    header.numSections = 1;
+    header.grid = *(fieldPtr->headerPtr);
+    header.grid.magicWord = MAGICWORD;
+
+    size_t dataSize = (size_t) fieldPtr->numValues * sizeof(FieldValue);
+    SectionEntry *section = header.sections;
+    section->type = SECTION_FIELD_VALUES;
+    section->layout = LAYOUT_LINEAR;
+    section->offset = V2ALIGNMENT;
+    section->size = dataSize;
+    section->elementSize = sizeof(FieldValue);
+    section->crc = crc32c(0, fieldPtr->fieldValues, dataSize);
+
+    header.headerCrc = crc32c(0, &header, sizeof(FieldMapHeader2));
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not create field map file: [%s]\n", path);
+        return false;
+    }
+
+    bool ok = (fwrite(&header, sizeof(FieldMapHeader2), 1, file) == 1) &&
+              writePadding(file, V2ALIGNMENT - sizeof(FieldMapHeader2)) &&
+              (fwrite(fieldPtr->fieldValues, 1, dataSize, file) == dataSize) &&
+              writePadding(file, (V2ALIGNMENT - dataSize % V2ALIGNMENT) % V2ALIGNMENT);
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok) {
+        fprintf(stderr, "\ncMag ERROR failed writing field map file: [%s]\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Convert a field map file of any version to version 2.
+ * @param inPath the path to the existing map.
+ * @param outPath the path of the version 2 file.
+ * @return true on success.
  */
-void createCell3D(MagneticFieldPtr fieldPtr) {
+bool convertFieldMap(const char *inPath, const char *outPath) {
+    MagneticFieldPtr fieldPtr = readField(inPath);
+    if (fieldPtr == NULL) {
+        return false;
+    }
+
+    bool ok = writeFieldMap2(fieldPtr, outPath);
+    freeFieldMap(fieldPtr);
+    return ok;
+}
+
+/**
+ * Write zero bytes.
+ * @param file the file.
+ * @param num the number of bytes.
+ * @return true on success.
+ */
+static bool writePadding(FILE *file, size_t num) {
+    static const char zeros[V2ALIGNMENT];
+    return (num == 0) || (fwrite(zeros, 1, num, file) == num);
+}
+
+/**
+ * Allocate a 3D cell, which is used by the torus, that contains nothing yet.
+ * @param fieldPtr the torus field that owns the cell.
+ * @param values the copy of the field values the cell reads.
+ * @return the new cell.
+ */
+static Cell3DPtr newCell3D(MagneticFieldPtr fieldPtr, FieldValuePtr values) {
     Cell3DPtr cell3DPtr = (Cell3DPtr) malloc(sizeof(Cell3D));
+    initCell3D(cell3DPtr, fieldPtr, values);
+    return cell3DPtr;
+}
+
+/**
+ * Initialize a 3D cell so that it contains nothing yet.
+ * @param cell3DPtr the cell.
+ * @param fieldPtr the torus field that owns the cell.
+ * @param values the copy of the field values the cell reads.
+ */
+static void initCell3D(Cell3DPtr cell3DPtr, MagneticFieldPtr fieldPtr, FieldValuePtr values) {
     cell3DPtr->phiMin = INFINITY;
     cell3DPtr->phiMax = -INFINITY;
     cell3DPtr->rhoMin = INFINITY;
@@ -177,25 +630,78 @@ void createCell3D(MagneticFieldPtr fieldPtr) {
     cell3DPtr->zMin = INFINITY;
     cell3DPtr->zMax = -INFINITY;
     cell3DPtr->fieldPtr = fieldPtr;
-    fieldPtr->cell3DPtr = cell3DPtr;
+    cell3DPtr->values = values;
 }
 
 /**
- * Create a 2D cell, which is used by the solenoid, since the lack
- * of phi dependence renders the solenoidal field effectively 2D.
- * Note that nothing is
- * returned, the field's 2D cell pointer is made to point at the cell,
- * and the cell is given a reference to the field.
- * @param fieldPtr a pointer to the solenoid field.
+ * Allocate a 2D cell, which is used by the solenoid since the lack
+ * of phi dependence renders the solenoidal field effectively 2D,
+ * that contains nothing yet.
+ * @param fieldPtr the solenoid field that owns the cell.
+ * @param values the copy of the field values the cell reads.
+ * @return the new cell.
  */
-void createCell2D(MagneticFieldPtr fieldPtr) {
+static Cell2DPtr newCell2D(MagneticFieldPtr fieldPtr, FieldValuePtr values) {
     Cell2DPtr cell2DPtr = (Cell2DPtr) malloc(sizeof(Cell2D));
+    initCell2D(cell2DPtr, fieldPtr, values);
+    return cell2DPtr;
+}
+
+/**
+ * Initialize a 2D cell so that it contains nothing yet.
+ * @param cell2DPtr the cell.
+ * @param fieldPtr the solenoid field that owns the cell.
+ * @param values the copy of the field values the cell reads.
+ */
+static void initCell2D(Cell2DPtr cell2DPtr, MagneticFieldPtr fieldPtr, FieldValuePtr values) {
     cell2DPtr->rhoMin = INFINITY;
     cell2DPtr->rhoMax = -INFINITY;
     cell2DPtr->zMin = INFINITY;
     cell2DPtr->zMax = -INFINITY;
     cell2DPtr->fieldPtr = fieldPtr;
-    fieldPtr->cell2DPtr = cell2DPtr;
+    cell2DPtr->values = values;
+}
+
+/**
+ * Create a probe of a field. The probe has its own cell, so a thread
+ * that queries through its own probe (getProbeFieldValue) never
+ * interferes with other threads querying the same field. If the field
+ * has been replicated across NUMA nodes the probe reads the replica local
+ * to the calling thread, so create probes on the threads that use them.
+ * @param fieldPtr the field to probe.
+ * @return the new probe. Free it with freeProbe.
+ */
+FieldProbePtr createProbe(MagneticFieldPtr fieldPtr) {
+    FieldProbePtr probePtr = (FieldProbePtr) malloc(sizeof(FieldProbe));
+    probePtr->fieldPtr = fieldPtr;
+    probePtr->cell3DPtr = NULL;
+    probePtr->cell2DPtr = NULL;
+
+    FieldValuePtr values = localFieldValues(fieldPtr);
+    if (fieldPtr->type == TORUS) {
+        probePtr->cell3DPtr = newCell3D(fieldPtr, values);
+    }
+    else {
+        probePtr->cell2DPtr = newCell2D(fieldPtr, values);
+    }
+    return probePtr;
+}
+
+/**
+ * Free the memory associated with a probe. The field is not affected.
+ * @param probePtr a pointer to the probe.
+ */
+void freeProbe(FieldProbePtr probePtr) {
+    if (probePtr == NULL) {
+        return;
+    }
+    if (probePtr->cell3DPtr != NULL) {
+        freeCell3D(probePtr->cell3DPtr);
+    }
+    if (probePtr->cell2DPtr != NULL) {
+        freeCell2D(probePtr->cell2DPtr);
+    }
+    free(probePtr);
 }
 
 /**
@@ -227,13 +733,13 @@ static FieldMapHeaderPtr readMapHeader(FILE *fd) {
 
     //get the actual file size in bytes
     long actualFileSize = getFileSize(fd);
-    debugPrint("Actual file size: %ld bytes\n", actualFileSize);
+    LOG_DEBUG("Actual file size: %ld bytes", actualFileSize);
 
     //get the magic word and see if byteswap required
     fread(&(headerPtr->magicWord), sizeof(unsigned int), 1, fd);
     swapBytes = (headerPtr->magicWord != MAGICWORD);
 
-    debugPrint("byteswap required: %s\n", swapBytes ? "yes" : "no");
+    LOG_DEBUG("byteswap required: %s", swapBytes ? "yes" : "no");
 
     if (swapBytes) {
         headerPtr->magicWord = htonl(headerPtr->magicWord);
@@ -256,28 +762,33 @@ static FieldMapHeaderPtr readMapHeader(FILE *fd) {
     }
 
     //if debugging, print header
-    debugPrint("\nHEADER:\nmagic word: \"%03x\"\n", headerPtr->magicWord);
-    debugPrint("grid CS: %s\n", csLabels[headerPtr->gridCS]);
-    debugPrint("field CS: %s\n", csLabels[headerPtr->fieldCS]);
-
-    debugPrint("length units: %s\n", lengthUnitLabels[headerPtr->lengthUnits]);
-    debugPrint("angular units: %s\n", angleUnitLabels[headerPtr->angleUnits]);
-    debugPrint("field units: %s\n", fieldUnitLabels[headerPtr->fieldUnits]);
-    debugPrint("q1Min: %-5.2f\n", headerPtr->q1min);
-    debugPrint("q1Max: %-5.2f\n", headerPtr->q1max);
-    debugPrint("NumQ2: %d\n", headerPtr->nq1);
-    debugPrint("q2Min: %-5.2f\n", headerPtr->q2min);
-    debugPrint("q2Max: %-5.2f\n", headerPtr->q2max);
-    debugPrint("NumQ2: %d\n", headerPtr->nq2);
-    debugPrint("q3Min: %-5.2f\n", headerPtr->q3min);
-    debugPrint("q3Max: %-5.2f\n", headerPtr->q3max);
-    debugPrint("NumQ3: %d\n", headerPtr->nq3);
+    LOG_DEBUG("header magic word: \"%03x\"", headerPtr->magicWord);
+    LOG_DEBUG("grid CS: %s", csLabels[headerPtr->gridCS]);
+    LOG_DEBUG("field CS: %s", csLabels[headerPtr->fieldCS]);
+
+    LOG_DEBUG("length units: %s", lengthUnitLabels[headerPtr->lengthUnits]);
+    LOG_DEBUG("angular units: %s", angleUnitLabels[headerPtr->angleUnits]);
+    LOG_DEBUG("field units: %s", fieldUnitLabels[headerPtr->fieldUnits]);
+    LOG_DEBUG("q1Min: %-5.2f", headerPtr->q1min);
+    LOG_DEBUG("q1Max: %-5.2f", headerPtr->q1max);
+    LOG_DEBUG("NumQ2: %d", headerPtr->nq1);
+    LOG_DEBUG("q2Min: %-5.2f", headerPtr->q2min);
+    LOG_DEBUG("q2Max: %-5.2f", headerPtr->q2max);
+    LOG_DEBUG("NumQ2: %d", headerPtr->nq2);
+    LOG_DEBUG("q3Min: %-5.2f", headerPtr->q3min);
+    LOG_DEBUG("q3Max: %-5.2f", headerPtr->q3max);
+    LOG_DEBUG("NumQ3: %d", headerPtr->nq3);
 
     //get the number of field values and the computed file size
-    int numFieldValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
-    long computedFileSize = sizeof(FieldMapHeader) + 4 * 3 * numFieldValues;
+    size_t numFieldValues, numBytes;
+    if (!fieldMapSize(headerPtr, &numFieldValues, &numBytes) || (numBytes > LONG_MAX - sizeof(FieldMapHeader))) {
+        fprintf(stderr, "\ncMag ERROR bad or overflowing grid size in field map header.\n");
+        free(headerPtr);
+        return NULL;
+    }
+    long computedFileSize = (long) (sizeof(FieldMapHeader) + numBytes);
 
-    debugPrint("Computed file size: %ld bytes\n", computedFileSize);
+    LOG_DEBUG("Computed file size: %ld bytes", computedFileSize);
     if (actualFileSize != computedFileSize) {
         fprintf(stderr,
                 "\ncMag ERROR computed file size and actual file size do not match.\n");
@@ -299,10 +810,13 @@ static void computeFieldMetrics(MagneticFieldPtr fieldPtr) {
     metrics->maxFieldMagnitude = 0;
     metrics->avgFieldMagnitude = 0;
 
-    for (unsigned int i = 0; i < fieldPtr->numValues; i++) {
+    for (size_t i = 0; i < fieldPtr->numValues; i++) {
         FieldValuePtr fieldValuePtr = fieldPtr->fieldValues+i;
 
         double magnitude = fieldMagnitude(fieldValuePtr);
+        if (fieldPtr->magnitudes != NULL) {
+            fieldPtr->magnitudes[i] = (float) magnitude;
+        }
         if (magnitude > metrics->maxFieldMagnitude) {
             metrics->maxFieldMagnitude = magnitude;
             metrics->maxFieldIndex = i;
@@ -317,21 +831,23 @@ static void computeFieldMetrics(MagneticFieldPtr fieldPtr) {
 
 /**
  * Get the creation date of a field map.
- * @param fieldPtr a pointer to the field map.
- * @return A string representation of the date and the the field map
- * was created from the engineering data.
+ * @param headerPtr the map's header.
+ * @param date upon return, a string representation of the date and time
+ * the field map was created from the engineering data. Must have room for
+ * DATESIZE characters.
  */
-static char *getCreationDate(MagneticFieldPtr fieldPtr) {
+static void getCreationDate(FieldMapHeaderPtr headerPtr, char *date) {
 
-    int high = fieldPtr->headerPtr->cdHigh;
-    int low = fieldPtr->headerPtr->cdLow;
+    int high = headerPtr->cdHigh;
+    int low = headerPtr->cdLow;
 
     //the divide by 1000 is because Java creation time (which was used) is in nS
     long dlow = low & 0x00000000ffffffffL;
     time_t utime = (((long) high << 32) | (dlow & 0xffffffffL)) / 1000;
 
-    return ctime(&utime);
-
+    if (ctime_r(&utime, date) == NULL) {
+        strcpy(date, "unknown\n");
+    }
 }
 
 /**
@@ -352,8 +868,9 @@ static long getFileSize(FILE *fd) {
  * @param ptr a pointer to the block.
  * @param num32 the number of entities.
  */
-static void swap32(char *ptr, int num32) {
-    int i, j, k;
+static void swap32(char *ptr, size_t num32) {
+    size_t i, j;
+    int k;
     char temp[4];
 
     for (i = 0, j = 0; i < num32; i++, j += 4) {
@@ -365,3 +882,217 @@ static void swap32(char *ptr, int num32) {
         }
     }
 }
+
+/**
+ * A unit test for the version 2 format: the CRC, a round trip of the
+ * test field and the rejection of a corrupted file.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *formatUnitTest() {
+    const char *path = "cMagFormatUnitTest.cmag";
+
+    //the standard CRC32C check value
+    mu_assert("crc32c check value is wrong", crc32c(0, "123456789", 9) == 0xe3069283);
+    mu_assert("crc32c does not continue", crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    mu_assert("Could not write the version 2 file", writeFieldMap2(testFieldPtr, path));
+    mu_assert("The version 2 file was not detected", getFileVersion(path) == FILEVERSION2);
+    mu_assert("The original file was not detected as version 1", getFileVersion(testFieldPtr->path) == 1);
+
+    MagneticFieldPtr fieldPtr = readField(path);
+    mu_assert("Could not read the version 2 file", fieldPtr != NULL);
+    mu_assert("The version 2 field has a different type", fieldPtr->type == testFieldPtr->type);
+    mu_assert("The version 2 field has a different size", fieldPtr->numValues == testFieldPtr->numValues);
+    mu_assert("The version 2 grid differs",
+              memcmp(fieldPtr->headerPtr, testFieldPtr->headerPtr, sizeof(FieldMapHeader)) == 0);
+    mu_assert("The version 2 values differ", memcmp(fieldPtr->fieldValues, testFieldPtr->fieldValues,
+                                                    fieldPtr->numValues * sizeof(FieldValue)) == 0);
+    mu_assert("The version 2 values are not aligned", ((size_t) fieldPtr->fieldValues) % V2ALIGNMENT == 0);
+    freeFieldMap(fieldPtr);
+
+    //rewrite the file in the other byte order, with checksums to match
+    FILE *file = fopen(path, "rb");
+    mu_assert("Could not reopen the version 2 file", file != NULL);
+    long fileSize = getFileSize(file);
+    char *buffer = (char *) malloc(fileSize);
+    fread(buffer, 1, fileSize, file);
+    fclose(file);
+
+    FieldMapHeader2 *foreign = (FieldMapHeader2 *) buffer;
+    SectionEntry *section = foreign->sections;
+    swap32(buffer + section->offset, section->size / 4);
+    section->crc = crc32c(0, buffer + section->offset, section->size);
+    foreign->headerCrc = 0;
+    swapHeader2(foreign);
+    unsigned int headerCrc = crc32c(0, foreign, sizeof(FieldMapHeader2));
+    swap32((char *) &headerCrc, 1);
+    foreign->headerCrc = headerCrc;
+
+    file = fopen(path, "wb");
+    fwrite(buffer, 1, fileSize, file);
+    fclose(file);
+    free(buffer);
+
+    fieldPtr = readField(path);
+    mu_assert("Could not read the byte swapped version 2 file", fieldPtr != NULL);
+    mu_assert("The byte swapped values differ", memcmp(fieldPtr->fieldValues, testFieldPtr->fieldValues,
+                                                       fieldPtr->numValues * sizeof(FieldValue)) == 0);
+    freeFieldMap(fieldPtr);
+
+    //flip one bit of the field values
+    file = fopen(path, "r+b");
+    mu_assert("Could not reopen the version 2 file", file != NULL);
+    fseek(file, V2ALIGNMENT + 100, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, V2ALIGNMENT + 100, SEEK_SET);
+    fputc(c ^ 0x10, file);
+    fclose(file);
+
+    fprintf(stdout, "\nexpect a checksum error for the corrupted test file:");
+    fieldPtr = readField(path);
+    remove(path);
+    mu_assert("A corrupted version 2 file was accepted", fieldPtr == NULL);
+
+    fprintf(stdout, "\nPASSED formatUnitTest\n");
+    return NULL;
+}
+
+/**
+ * A unit test that headers whose grids overflow a size_t, or have a zero
+ * dimension, are rejected by fieldMapSize and by both readers, which
+ * fail before allocating anything for the grid.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *headerUnitTest() {
+    const char *path = "cMagHeaderUnitTest.dat";
+
+    //points overflow, bytes overflow, no rho, and a solenoid with no z
+    unsigned int dims[4][3] = {{0xffffffff, 0xffffffff, 0xffffffff},
+                               {1u << 31, 1u << 31, 2},
+                               {16, 0, 251},
+                               {1, 601, 0}};
+    for (int i = 0; i < 4; i++) {
+        FieldMapHeader header;
+        memset(&header, 0, sizeof(FieldMapHeader));
+        header.magicWord = MAGICWORD;
+        header.q1max = 30;
+        header.q2max = 500;
+        header.q3max = 500;
+        header.nq1 = dims[i][0];
+        header.nq2 = dims[i][1];
+        header.nq3 = dims[i][2];
+
+        size_t numValues = 0, numBytes = 0;
+        mu_assert("A bad grid size was accepted", !fieldMapSize(&header, &numValues, &numBytes));
+
+        //version 1, with a few values after the header
+        FILE *file = fopen(path, "wb");
+        mu_assert("Could not write a test header", file != NULL);
+        FieldValue values[4] = {{0, 0, 0}};
+        fwrite(&header, sizeof(FieldMapHeader), 1, file);
+        fwrite(values, sizeof(FieldValue), 4, file);
+        fclose(file);
+        mu_assert("A version 1 map with a bad grid size was read", readField(path) == NULL);
+
+        //version 2, with a consistent header checksum
+        FieldMapHeader2 header2;
+        memset(&header2, 0, sizeof(FieldMapHeader2));
+        header2.magicWord = MAGICWORD2;
+        header2.version = FILEVERSION2;
+        header2.byteOrder = BYTEORDERMARK;
+        header2.alignment = V2ALIGNMENT;
+        header2.numSections = 1;
+        header2.grid = header;
+        header2.sections[0].type = SECTION_FIELD_VALUES;
+        header2.sections[0].layout = LAYOUT_LINEAR;
+        header2.sections[0].offset = V2ALIGNMENT;
+        header2.sections[0].size = sizeof(values);
+        header2.sections[0].elementSize = sizeof(FieldValue);
+        header2.sections[0].crc = crc32c(0, values, sizeof(values));
+        header2.headerCrc = crc32c(0, &header2, sizeof(FieldMapHeader2));
+
+        file = fopen(path, "wb");
+        mu_assert("Could not write a test header", file != NULL);
+        fwrite(&header2, sizeof(FieldMapHeader2), 1, file);
+        writePadding(file, V2ALIGNMENT - sizeof(FieldMapHeader2));
+        fwrite(values, sizeof(FieldValue), 4, file);
+        fclose(file);
+        mu_assert("A version 2 map with a bad grid size was read", readField(path) == NULL);
+    }
+
+    remove(path);
+    fprintf(stdout, "\nPASSED headerUnitTest\n");
+    return NULL;
+}
+
+/**
+ * Check that a piece of a map lies within its arena.
+ * @param arena the arena.
+ * @param arenaBytes the size of the arena.
+ * @param piece the piece.
+ * @param bytes the size of the piece.
+ * @return true if the piece is inside.
+ */
+static bool inArena(const void *arena, size_t arenaBytes, const void *piece, size_t bytes) {
+    const char *start = (const char *) arena;
+    const char *p = (const char *) piece;
+    return (p >= start) && (p + bytes <= start + arenaBytes);
+}
+
+/**
+ * A unit test for the single arena layout of a map: every piece of the
+ * test field's map must be inside one allocation, which freeFieldMap
+ * releases.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *arenaUnitTest() {
+    MagneticFieldPtr fieldPtr = readField(testFieldPtr->path);
+    MagneticFieldPtr secondPtr = readField(testFieldPtr->path);
+    mu_assert("Could not reread the test field", (fieldPtr != NULL) && (secondPtr != NULL));
+
+    FieldArrayInfo info;
+    mu_assert("The arena is not a field array", getFieldArrayInfo(fieldPtr->arena, &info));
+    mu_assert("The arena is not the start of its allocation", info.base == fieldPtr->arena);
+    size_t arenaBytes = info.bytes;
+    void *arena = fieldPtr->arena;
+
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    mu_assert("The field is not in the arena", inArena(arena, arenaBytes, fieldPtr, sizeof(MagneticField)));
+    for (int i = 0; i < 3; i++) {
+        mu_assert("A grid is not in the arena", inArena(arena, arenaBytes, grids[i], sizeof(Grid)));
+        mu_assert("A grid name is not in the arena", inArena(arena, arenaBytes, grids[i]->name,
+                                                             strlen(grids[i]->name) + 1));
+        mu_assert("Grid values are not in the arena", inArena(arena, arenaBytes, grids[i]->values,
+                                                              grids[i]->num * sizeof(double)));
+    }
+
+    mu_assert("The header is not in the arena", inArena(arena, arenaBytes, fieldPtr->headerPtr, sizeof(FieldMapHeader)));
+    mu_assert("The metrics are not in the arena", inArena(arena, arenaBytes, fieldPtr->metricsPtr, sizeof(FieldMetrics)));
+    mu_assert("The path is not in the arena", inArena(arena, arenaBytes, fieldPtr->path, strlen(fieldPtr->path) + 1));
+    mu_assert("The date is not in the arena", inArena(arena, arenaBytes, fieldPtr->creationDate,
+                                                      strlen(fieldPtr->creationDate) + 1));
+    mu_assert("The values are not in the arena", inArena(arena, arenaBytes, fieldPtr->fieldValues,
+                                                         fieldPtr->numValues * sizeof(FieldValue)));
+    mu_assert("The values are not aligned", ((size_t) fieldPtr->fieldValues) % V2ALIGNMENT == 0);
+
+    //the structures used by every query lead the arena
+    const void *cell = (fieldPtr->type == TORUS) ? (const void *) fieldPtr->cell3DPtr : (const void *) fieldPtr->cell2DPtr;
+    size_t cellBytes = (fieldPtr->type == TORUS) ? sizeof(Cell3D) : sizeof(Cell2D);
+    mu_assert("The cell is not in the arena", inArena(arena, arenaBytes, cell, cellBytes));
+    mu_assert("The hot metadata is not at the front of the arena",
+              ((const char *) cell + cellBytes <= (const char *) fieldPtr->metricsPtr) &&
+              ((const char *) fieldPtr < (const char *) grids[0]));
+
+    //each map keeps its own date, and the same values as the original
+    mu_assert("The creation dates differ", strcmp(fieldPtr->creationDate, testFieldPtr->creationDate) == 0);
+    mu_assert("The dates share storage", fieldPtr->creationDate != secondPtr->creationDate);
+    mu_assert("The reread values differ", memcmp(fieldPtr->fieldValues, testFieldPtr->fieldValues,
+                                                 fieldPtr->numValues * sizeof(FieldValue)) == 0);
+
+    freeFieldMap(fieldPtr);
+    freeFieldMap(secondPtr);
+    mu_assert("The arena was not freed", !getFieldArrayInfo(arena, &info));
+
+    fprintf(stdout, "\nPASSED arenaUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,500 @@
+//
+//  magfieldlines.c
+//  cMag
+//
+//  Field lines by the Bogacki-Shampine 3(2) pair: three new evaluations a
+//  step, the last of which is the first of the next, and an embedded second
+//  order estimate of the error that sets the size of the next step. The
+//  field is followed through probes, whose cached cells make consecutive
+//  evaluations along a line cheap. Many lines are traced in parallel, a
+//  line at a time per thread, each thread with probes of its own.
+//
+
+#include "magfieldlines.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+//the most a step can shrink or grow from one step to the next
+#define STEP_SHRINK 0.2
+#define STEP_GROW   5.0
+
+//the lines traced by a pool of threads, taken a line at a time
+typedef struct linework {
+    const double *seeds;
+    int numSeeds;
+    MagneticFieldPtr field1;
+    MagneticFieldPtr field2;
+    const FieldLineParams *params;
+    FieldLinePtr lines;
+    int nextLine;        //taken atomically
+    bool failed;         //out of memory
+} LineWork;
+
+//local prototypes
+static bool lineDirection(const double *, FieldProbePtr, FieldProbePtr, const FieldLineParams *, double *,
+                          FieldLinePtr);
+static bool addLinePoint(FieldLinePtr, const double *);
+static bool inBox(const double *, const FieldLineParams *);
+static double segmentDistance(const double *, const double *, const double *);
+static void *traceLines(void *);
+
+/**
+ * Fill in the default parameters: steps from 0.01 to 10 cm with an error of
+ * at most 0.01 cm each, up to 10 m and 10000 points, in 3D, along B,
+ * stopping below 0.1 G or beyond 10 m of the origin, and closed within 0.5 cm.
+ * @param params upon return, the defaults.
+ */
+void defaultFieldLineParams(FieldLineParamsPtr params) {
+    memset(params, 0, sizeof(FieldLineParams));
+    params->tolerance = 0.01;
+    params->minStep = 0.01;
+    params->maxStep = 10;
+    params->maxLength = 1000;
+    params->maxPoints = 10000;
+    params->minField = 1.0e-4;
+    params->closeDistance = 0.5;
+    for (int i = 0; i < 3; i++) {
+        params->lo[i] = -1000;
+        params->hi[i] = 1000;
+    }
+    params->inPlane = false;
+    params->normal[2] = 1;
+    params->direction = 1;
+    params->numThreads = 0;
+}
+
+/**
+ * Trace a field line from a seed, through probes of up to two fields.
+ * @param line the line, zeroed before its first use. Upon return the points,
+ * from the seed, and how the line ended.
+ * @param seed the x, y and z of the seed, cm.
+ * @param probe1 a probe of the first field (can be NULL).
+ * @param probe2 a probe of the second field (can be NULL).
+ * @param params how to trace.
+ * @return false if out of memory.
+ */
+bool traceFieldLine(FieldLinePtr line, const double *seed, FieldProbePtr probe1, FieldProbePtr probe2,
+                    const FieldLineParams *params) {
+    line->numPoints = 0;
+    line->length = 0;
+    line->numSteps = 0;
+    line->numRejected = 0;
+    line->numEvaluations = 0;
+
+    double p[3] = {seed[0], seed[1], seed[2]};
+    if (!addLinePoint(line, p)) {
+        return false;
+    }
+    double k1[3], k2[3], k3[3], k4[3], q[3], next[3];
+    if (!inBox(p, params)) {
+        line->end = LINE_OUT_OF_BOUNDS;
+        return true;
+    }
+    if (!lineDirection(p, probe1, probe2, params, k1, line)) {
+        line->end = LINE_WEAK_FIELD;
+        return true;
+    }
+
+    double tolerance = params->tolerance;
+    double h = fmin(params->maxStep, fmax(params->minStep, 0.25 * params->maxStep));
+    bool left = false; //been well away from the seed
+    while (true) {
+        if (line->length >= params->maxLength) {
+            line->end = LINE_MAX_LENGTH;
+            return true;
+        }
+        if (line->numPoints >= params->maxPoints) {
+            line->end = LINE_MAX_POINTS;
+            return true;
+        }
+        h = fmin(h, params->maxLength - line->length);
+
+        bool evaluated;
+        for (int i = 0; i < 3; i++) {
+            q[i] = p[i] + 0.5 * h * k1[i];
+        }
+        evaluated = lineDirection(q, probe1, probe2, params, k2, line);
+        if (evaluated) {
+            for (int i = 0; i < 3; i++) {
+                q[i] = p[i] + 0.75 * h * k2[i];
+            }
+            evaluated = lineDirection(q, probe1, probe2, params, k3, line);
+        }
+        if (evaluated) {
+            for (int i = 0; i < 3; i++) {
+                next[i] = p[i] + h * (2.0 / 9.0 * k1[i] + 1.0 / 3.0 * k2[i] + 4.0 / 9.0 * k3[i]);
+            }
+            evaluated = lineDirection(next, probe1, probe2, params, k4, line);
+        }
+
+        //a step into a weak field is retried shorter, down to the smallest
+        if (!evaluated) {
+            if (h <= params->minStep) {
+                line->end = LINE_WEAK_FIELD;
+                return true;
+            }
+            h = fmax(params->minStep, STEP_SHRINK * h);
+            line->numRejected++;
+            continue;
+        }
+
+        //the difference from the second order solution
+        double error = 0;
+        for (int i = 0; i < 3; i++) {
+            double lower = p[i] + h * (7.0 / 24.0 * k1[i] + 0.25 * k2[i] + 1.0 / 3.0 * k3[i] + 0.125 * k4[i]);
+            error += (next[i] - lower) * (next[i] - lower);
+        }
+        error = sqrt(error);
+        double factor = (error > 0) ? 0.9 * cbrt(tolerance / error) : STEP_GROW;
+
+        if ((error > tolerance) && (h > params->minStep)) {
+            h = fmax(params->minStep, h * fmax(STEP_SHRINK, factor));
+            line->numRejected++;
+            continue;
+        }
+
+        //accepted
+        line->numSteps++;
+        line->length += h;
+        double last[3] = {p[0], p[1], p[2]};
+        memcpy(p, next, sizeof(p));
+        memcpy(k1, k4, sizeof(k1));
+        if (!addLinePoint(line, p)) {
+            return false;
+        }
+
+        if (!inBox(p, params)) {
+            line->end = LINE_OUT_OF_BOUNDS;
+            return true;
+        }
+        if (params->closeDistance > 0) {
+            if (left && (segmentDistance(seed, last, p) < params->closeDistance)) {
+                if (!addLinePoint(line, seed)) {
+                    return false;
+                }
+                line->end = LINE_CLOSED;
+                return true;
+            }
+            double dx = p[0] - seed[0], dy = p[1] - seed[1], dz = p[2] - seed[2];
+            left = left || (dx * dx + dy * dy + dz * dz > 4 * params->closeDistance * params->closeDistance);
+        }
+
+        h = fmin(params->maxStep, h * fmin(STEP_GROW, factor));
+    }
+}
+
+/**
+ * Trace field lines from many seeds in parallel, with a pool of threads
+ * that each have probes of their own. The lines do not depend on the
+ * number of threads.
+ * @param seeds the x, y and z of each seed, cm.
+ * @param numSeeds the number of seeds.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ * @param params how to trace.
+ * @return the lines, a line per seed, to be freed with freeFieldLines, or NULL if out of memory.
+ */
+FieldLinePtr traceFieldLines(const double *seeds, int numSeeds, MagneticFieldPtr field1, MagneticFieldPtr field2,
+                             const FieldLineParams *params) {
+    FieldLinePtr lines = (FieldLinePtr) calloc((numSeeds > 0) ? numSeeds : 1, sizeof(FieldLine));
+    if (lines == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory for %d field lines\n", numSeeds);
+        return NULL;
+    }
+
+    LineWork work = {.seeds = seeds, .numSeeds = numSeeds, .field1 = field1, .field2 = field2,
+                     .params = params, .lines = lines, .nextLine = 0, .failed = false};
+
+    //the threads claim lines from the shared counter
+    runWorkers(traceLines, &work, 0, numWorkers(params->numThreads, (numSeeds > 0) ? numSeeds : 0));
+
+    if (work.failed) {
+        fprintf(stderr, "\ncMag ERROR out of memory tracing %d field lines\n", numSeeds);
+        freeFieldLines(lines, numSeeds);
+        return NULL;
+    }
+    return lines;
+}
+
+/**
+ * Free field lines made by traceFieldLines.
+ * @param lines the lines, may be NULL.
+ * @param numLines the number of lines.
+ */
+void freeFieldLines(FieldLinePtr lines, int numLines) {
+    if (lines == NULL) {
+        return;
+    }
+    for (int i = 0; i < numLines; i++) {
+        free(lines[i].points);
+    }
+    free(lines);
+}
+
+/**
+ * The body of a tracing thread: take lines until none are left, with
+ * private probes of the fields.
+ * @param arg the shared LineWork.
+ * @return NULL.
+ */
+static void *traceLines(void *arg) {
+    LineWork *work = (LineWork *) arg;
+    FieldProbePtr probe1 = (work->field1 == NULL) ? NULL : createProbe(work->field1);
+    FieldProbePtr probe2 = (work->field2 == NULL) ? NULL : createProbe(work->field2);
+
+    while (true) {
+        int index = __atomic_fetch_add(&(work->nextLine), 1, __ATOMIC_RELAXED);
+        if (index >= work->numSeeds) {
+            break;
+        }
+        if (!traceFieldLine(work->lines + index, work->seeds + 3 * index, probe1, probe2, work->params)) {
+            __atomic_store_n(&(work->failed), true, __ATOMIC_RELAXED);
+        }
+    }
+
+    freeProbe(probe1);
+    freeProbe(probe2);
+    return NULL;
+}
+
+/**
+ * The direction to step in: the unit vector of the field, projected onto
+ * the plane if there is one, along or against B.
+ * @param p the point, cm.
+ * @param probe1 a probe of the first field (can be NULL).
+ * @param probe2 a probe of the second field (can be NULL).
+ * @param params how to trace.
+ * @param direction upon return, the unit direction.
+ * @param line the line, whose evaluations are counted.
+ * @return false if the field is too weak to follow.
+ */
+static bool lineDirection(const double *p, FieldProbePtr probe1, FieldProbePtr probe2, const FieldLineParams *params,
+                          double *direction, FieldLinePtr line) {
+    FieldValue value;
+    getCompositeProbeFieldValue(&value, p[0], p[1], p[2], probe1, probe2);
+    line->numEvaluations++;
+
+    double b[3] = {value.b1, value.b2, value.b3};
+    if (params->inPlane) {
+        const double *n = params->normal;
+        double dot = b[0] * n[0] + b[1] * n[1] + b[2] * n[2];
+        for (int i = 0; i < 3; i++) {
+            b[i] -= dot * n[i];
+        }
+    }
+
+    double magnitude = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+    if (!(magnitude >= params->minField) || (magnitude == 0)) {
+        return false;
+    }
+    double scale = params->direction / magnitude;
+    for (int i = 0; i < 3; i++) {
+        direction[i] = scale * b[i];
+    }
+    return true;
+}
+
+/**
+ * Add a point to a line, making room if need be.
+ * @param line the line.
+ * @param p the point.
+ * @return false if out of memory.
+ */
+static bool addLinePoint(FieldLinePtr line, const double *p) {
+    if (line->numPoints >= line->capacity) {
+        int capacity = (line->capacity < 256) ? 256 : 2 * line->capacity;
+        double *points = (double *) realloc(line->points, 3 * (size_t) capacity * sizeof(double));
+        if (points == NULL) {
+            return false;
+        }
+        line->points = points;
+        line->capacity = capacity;
+    }
+    memcpy(line->points + 3 * line->numPoints++, p, 3 * sizeof(double));
+    return true;
+}
+
+/**
+ * Whether a point is in the box of the parameters.
+ * @param p the point.
+ * @param params how to trace.
+ * @return true if it is inside.
+ */
+static bool inBox(const double *p, const FieldLineParams *params) {
+    for (int i = 0; i < 3; i++) {
+        if (!((p[i] >= params->lo[i]) && (p[i] <= params->hi[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The distance from a point to a segment.
+ * @param p the point.
+ * @param a the start of the segment.
+ * @param b the end of the segment.
+ * @return the distance.
+ */
+static double segmentDistance(const double *p, const double *a, const double *b) {
+    double ab[3], ap[3];
+    double length2 = 0, along = 0;
+    for (int i = 0; i < 3; i++) {
+        ab[i] = b[i] - a[i];
+        ap[i] = p[i] - a[i];
+        length2 += ab[i] * ab[i];
+        along += ab[i] * ap[i];
+    }
+    double t = (length2 > 0) ? fmax(0, fmin(1, along / length2)) : 0;
+    double distance2 = 0;
+    for (int i = 0; i < 3; i++) {
+        double d = ap[i] - t * ab[i];
+        distance2 += d * d;
+    }
+    return sqrt(distance2);
+}
+
+/**
+ * Rotate a point about the z axis.
+ */
+static void rotateZ(const double *p, double degrees, double *rotated) {
+    double c = cos(toRadians(degrees));
+    double s = sin(toRadians(degrees));
+    rotated[0] = c * p[0] - s * p[1];
+    rotated[1] = s * p[0] + c * p[1];
+    rotated[2] = p[2];
+}
+
+/**
+ * A unit test of field lines for the map in testFieldPtr: the same for any
+ * number of threads, tangent to the field, kept in their plane, closed
+ * round the beam line by a torus at fixed z, and, for the solenoid and
+ * symmetric torus, unchanged by the rotations the map is symmetric under.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *fieldLineUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal;
+    double zMin = fieldPtr->zGridPtr->minVal;
+    double zMax = fieldPtr->zGridPtr->maxVal;
+    int count = 60;
+    double seeds[3 * count];
+
+    for (int i = 0; i < count; i++) {
+        double phi = toRadians(randomDouble(0, 360));
+        double rho = randomDouble(0.1, 0.9) * rhoMax;
+        seeds[3 * i] = rho * cos(phi);
+        seeds[3 * i + 1] = rho * sin(phi);
+        seeds[3 * i + 2] = randomDouble(zMin, zMax);
+    }
+
+    FieldLineParams params;
+    defaultFieldLineParams(&params);
+    params.maxLength = 300;
+    params.tolerance = 1.0e-3;
+    params.numThreads = 1;
+    FieldLinePtr serial = traceFieldLines(seeds, count, fieldPtr, NULL, &params);
+    params.numThreads = 3;
+    FieldLinePtr parallel = traceFieldLines(seeds, count, fieldPtr, NULL, &params);
+    mu_assert("Could not trace field lines", (serial != NULL) && (parallel != NULL));
+
+    //the same lines whatever the threads, each step along the field
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    int numSteps = 0;
+    int numBent = 0;
+    long evaluations = 0;
+    for (int i = 0; i < count; i++) {
+        FieldLinePtr line = serial + i;
+        mu_assert("Field lines depend on the number of threads",
+                  (line->numPoints == parallel[i].numPoints) && (line->end == parallel[i].end) &&
+                  (memcmp(line->points, parallel[i].points, 3 * line->numPoints * sizeof(double)) == 0));
+        mu_assert("A field line does not start at its seed", memcmp(line->points, seeds + 3 * i, 24) == 0);
+        evaluations += line->numEvaluations;
+
+        for (int j = 1; j < line->numPoints; j++) {
+            const double *a = line->points + 3 * (j - 1);
+            const double *b = line->points + 3 * j;
+            double chord[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            double length = sqrt(chord[0] * chord[0] + chord[1] * chord[1] + chord[2] * chord[2]);
+            FieldValue value;
+            getProbeFieldValue(&value, 0.5 * (a[0] + b[0]), 0.5 * (a[1] + b[1]), 0.5 * (a[2] + b[2]), probePtr);
+            double magnitude = sqrt(value.b1 * value.b1 + value.b2 * value.b2 + value.b3 * value.b3);
+            if ((length > 0) && (magnitude > 0) && (line->end != LINE_CLOSED || j < line->numPoints - 1)) {
+                double cosine = (chord[0] * value.b1 + chord[1] * value.b2 + chord[2] * value.b3) /
+                                (length * magnitude);
+                numSteps++;
+                numBent += (cosine < 0.99);
+            }
+        }
+    }
+    freeFieldLines(parallel, count);
+    mu_assert("Field lines should take steps", numSteps > count);
+    mu_assert("Field line steps are not along the field", numBent * 100 < numSteps);
+
+    //in a plane, staying in it, and closed round the beam line by a torus
+    FieldLine line = {0};
+    params.inPlane = true;
+    params.closeDistance = 1;
+    params.maxLength = 20 * rhoMax;
+    params.maxPoints = 100000;
+    double seed[3] = {0.4 * rhoMax * cos(toRadians(20)), 0.4 * rhoMax * sin(toRadians(20)), 0.5 * (zMin + zMax)};
+    mu_assert("Could not trace a field line", traceFieldLine(&line, seed, probePtr, NULL, &params));
+    for (int j = 0; j < line.numPoints; j++) {
+        mu_assert("A field line left its plane", fabs(line.points[3 * j + 2] - seed[2]) < 1.0e-9);
+    }
+    if (fieldPtr->type == TORUS) {
+        mu_assert("A torus field line at fixed z is not closed", line.end == LINE_CLOSED);
+        mu_assert("A closed field line does not end on its seed",
+                  memcmp(line.points + 3 * (line.numPoints - 1), seed, 24) == 0);
+    }
+    params.inPlane = false;
+    params.closeDistance = 0.5;
+    params.maxLength = 300;
+
+    //the solenoid is symmetric under any rotation about z, a symmetric
+    //torus under rotations by a sector
+    if ((fieldPtr->type == SOLENOID) || fieldPtr->symmetric) {
+        double worst = 0;
+        int numCompared = 0;
+        for (int i = 0; i < 10; i++) {
+            double angle = (fieldPtr->type == SOLENOID) ? randomDouble(-180, 180) : 60 * randomInt(1, 5);
+            double rotated[3], end[3];
+            rotateZ(seeds + 3 * i, angle, rotated);
+            traceFieldLine(&line, rotated, probePtr, NULL, &params);
+            const double *last = serial[i].points + 3 * (serial[i].numPoints - 1);
+            rotateZ(last, angle, end);
+            if (line.end == serial[i].end) {
+                const double *other = line.points + 3 * (line.numPoints - 1);
+                double distance = sqrt((end[0] - other[0]) * (end[0] - other[0]) +
+                                       (end[1] - other[1]) * (end[1] - other[1]) +
+                                       (end[2] - other[2]) * (end[2] - other[2]));
+                worst = fmax(worst, distance);
+                numCompared++;
+            }
+        }
+        mu_assert("Rotated field lines do not match", (numCompared > 5) && (worst < 0.1));
+    }
+    free(line.points);
+    freeProbe(probePtr);
+
+    //the rate, one thread
+    params.numThreads = 1;
+    params.maxLength = 100;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FieldLinePtr timed = traceFieldLines(seeds, count, fieldPtr, NULL, &params);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - start.tv_sec) + 1.0e-9 * (stop.tv_nsec - start.tv_nsec);
+    freeFieldLines(timed, count);
+    freeFieldLines(serial, count);
+
+    fprintf(stdout, "\nPASSED fieldLineUnitTest (%ld evaluations per line, %.0f lines of 1 m per second)\n",
+            evaluations / count, count / fmax(seconds, 1.0e-9));
+    return NULL;
+}
@@ -0,0 +1,393 @@
+//
+//  magfieldlog.c
+//  cMag
+//
+//  Leveled, rate limited logging. Each logging thread owns a ring of
+//  preformatted messages with a single producer (the thread) and a single
+//  consumer (whoever holds drainLock), so posting a message needs no lock.
+//  A background thread drains the rings to the log stream every
+//  CMAG_LOG_FLUSH_MS, or at once for errors. Messages beyond a thread's
+//  rate limit, or that find its ring full, are counted rather than kept,
+//  and the counts are reported in the log.
+//
+
+#include "magfieldlog.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+//the most threads that can hold a ring at once; others drop their messages
+#define CMAG_MAX_LOG_RINGS 256
+
+typedef struct logring *LogRingPtr;
+
+//one preformatted message
+typedef struct logentry {
+    LogLevel level;
+    char text[CMAG_LOG_MESSAGE_SIZE];
+} LogEntry;
+
+//a thread's ring. head is only written by the owner, tail by the drainer.
+typedef struct logring {
+    _Alignas(64) atomic_uint head;
+    atomic_ullong dropped;     //ring was full
+    atomic_ullong suppressed;  //over the rate limit
+    double tokens;             //rate limit bucket, owner only
+    double lastRefill;         //time of the last refill, owner only
+    atomic_bool owned;         //false once the owning thread exits
+    _Alignas(64) atomic_uint tail;
+    LogEntry entries[CMAG_LOG_RING_SIZE];
+} LogRing;
+
+volatile int logLevel = LOG_LEVEL_WARN;
+
+static const char *levelNames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static LogRingPtr rings[CMAG_MAX_LOG_RINGS];
+static atomic_int numRings = 0;
+
+//messages lost because every ring was taken
+static atomic_ullong ringless = 0;
+
+//total dropped or suppressed messages reported so far
+static atomic_ullong totalLost = 0;
+
+//the stream and the consumer side of every ring are guarded by drainLock
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *logStream = NULL;
+
+//the flusher sleeps on wakeCond
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t startOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+
+static _Thread_local LogRingPtr myRing = NULL;
+
+//local prototypes
+static void startFlusher(void);
+static void *flushLoop(void *);
+static void releaseRing(void *);
+static LogRingPtr claimRing(void);
+static bool takeToken(LogRingPtr);
+static void drainRings(void);
+static double nowSeconds(void);
+
+/**
+ * Pick up the initial level from the CMAG_LOG_LEVEL environment variable
+ * (error, warn, info or debug) when the library is loaded.
+ */
+__attribute__((constructor))
+static void initLogLevel() {
+    const char *env = getenv("CMAG_LOG_LEVEL");
+    if (env == NULL) {
+        return;
+    }
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcasecmp(env, levelNames[i]) == 0) {
+            logLevel = i;
+        }
+    }
+}
+
+/**
+ * Set the runtime log level. Messages less severe are skipped before
+ * they are formatted.
+ * @param level the new level.
+ */
+void setLogLevel(LogLevel level) {
+    logLevel = level;
+}
+
+/**
+ * Get the runtime log level.
+ * @return the current level.
+ */
+LogLevel getLogLevel() {
+    return (LogLevel) logLevel;
+}
+
+/**
+ * Set the stream the flusher writes to. The default is stderr.
+ * @param stream the stream, or NULL for stderr.
+ */
+void setLogStream(FILE *stream) {
+    pthread_mutex_lock(&drainLock);
+    logStream = stream;
+    pthread_mutex_unlock(&drainLock);
+}
+
+/**
+ * Post a message. Normally called through the LOG_ERROR, LOG_WARN,
+ * LOG_INFO and LOG_DEBUG macros, which check the level first.
+ * @param level the level of the message.
+ * @param fmt a printf style format, followed by its arguments.
+ */
+void logMessage(LogLevel level, const char *fmt, ...) {
+    pthread_once(&startOnce, startFlusher);
+
+    LogRingPtr ring = (myRing != NULL) ? myRing : claimRing();
+    if (ring == NULL) {
+        atomic_fetch_add(&ringless, 1);
+        return;
+    }
+
+    if (!takeToken(ring)) {
+        atomic_fetch_add_explicit(&ring->suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= CMAG_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogEntry *entry = ring->entries + (head % CMAG_LOG_RING_SIZE);
+    entry->level = level;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(entry->text, CMAG_LOG_MESSAGE_SIZE, fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    if (level == LOG_LEVEL_ERROR) {
+        pthread_mutex_lock(&wakeLock);
+        pthread_cond_signal(&wakeCond);
+        pthread_mutex_unlock(&wakeLock);
+    }
+}
+
+/**
+ * Write out every pending message now. Also called at exit.
+ */
+void flushLog() {
+    pthread_mutex_lock(&drainLock);
+    drainRings();
+    pthread_mutex_unlock(&drainLock);
+}
+
+/**
+ * Get the number of messages that were dropped (full ring) or suppressed
+ * (rate limit) and have been reported as such by the flusher.
+ * @return the number of lost messages so far.
+ */
+unsigned long long getLogDropped() {
+    return atomic_load(&totalLost);
+}
+
+/**
+ * Start the flusher thread. Run once, on the first message.
+ */
+static void startFlusher() {
+    pthread_key_create(&ringKey, releaseRing);
+    atexit(flushLog);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, flushLoop, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * The body of the flusher thread.
+ * @param arg unused.
+ * @return never returns.
+ */
+static void *flushLoop(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += CMAG_LOG_FLUSH_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&wakeLock);
+        pthread_cond_timedwait(&wakeCond, &wakeLock, &until);
+        pthread_mutex_unlock(&wakeLock);
+
+        flushLog();
+    }
+    return NULL;
+}
+
+/**
+ * Write out the pending messages of every ring, then the loss counts.
+ * Must hold drainLock.
+ */
+static void drainRings() {
+    FILE *stream = (logStream != NULL) ? logStream : stderr;
+    unsigned long long lost = atomic_exchange(&ringless, 0);
+
+    int n = atomic_load(&numRings);
+    for (int i = 0; i < n; i++) {
+        LogRingPtr ring = rings[i];
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            LogEntry *entry = ring->entries + (tail % CMAG_LOG_RING_SIZE);
+            fprintf(stream, "cMag %s %s\n", levelNames[entry->level], entry->text);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        lost += atomic_exchange(&ring->dropped, 0);
+        lost += atomic_exchange(&ring->suppressed, 0);
+    }
+
+    if (lost > 0) {
+        fprintf(stream, "cMag WARN %llu log messages dropped or rate limited\n", lost);
+        atomic_fetch_add(&totalLost, lost);
+    }
+    fflush(stream);
+}
+
+/**
+ * Give the calling thread a ring, reusing one whose owner has exited
+ * if possible.
+ * @return the ring, or NULL if all CMAG_MAX_LOG_RINGS are in use.
+ */
+static LogRingPtr claimRing() {
+    LogRingPtr ring = NULL;
+
+    int n = atomic_load(&numRings);
+    for (int i = 0; (i < n) && (ring == NULL); i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&rings[i]->owned, &expected, true)) {
+            ring = rings[i];
+        }
+    }
+
+    if (ring == NULL) {
+        pthread_mutex_lock(&drainLock);
+        n = atomic_load(&numRings);
+        if (n < CMAG_MAX_LOG_RINGS) {
+            ring = (LogRingPtr) calloc(1, sizeof(LogRing));
+            if (ring != NULL) {
+                atomic_store(&ring->owned, true);
+                rings[n] = ring;
+                atomic_store(&numRings, n + 1);
+            }
+        }
+        pthread_mutex_unlock(&drainLock);
+        if (ring == NULL) {
+            return NULL;
+        }
+    }
+
+    ring->tokens = CMAG_LOG_BURST;
+    ring->lastRefill = nowSeconds();
+    pthread_setspecific(ringKey, ring);
+    myRing = ring;
+    return ring;
+}
+
+/**
+ * Thread exit hook: give the ring back. Pending messages stay in it
+ * until the next drain, before which a new owner can only append.
+ * @param arg the ring.
+ */
+static void releaseRing(void *arg) {
+    LogRingPtr ring = (LogRingPtr) arg;
+    atomic_store(&ring->owned, false);
+}
+
+/**
+ * Take one token from the ring's rate limit bucket, refilling it at
+ * CMAG_LOG_RATE per second up to CMAG_LOG_BURST.
+ * @param ring the calling thread's ring.
+ * @return true if the message may be posted.
+ */
+static bool takeToken(LogRingPtr ring) {
+    if (ring->tokens < 1) {
+        double now = nowSeconds();
+        ring->tokens += (now - ring->lastRefill) * CMAG_LOG_RATE;
+        if (ring->tokens > CMAG_LOG_BURST) {
+            ring->tokens = CMAG_LOG_BURST;
+        }
+        ring->lastRefill = now;
+        if (ring->tokens < 1) {
+            return false;
+        }
+    }
+    ring->tokens -= 1;
+    return true;
+}
+
+/**
+ * A monotonic clock.
+ * @return the time in seconds.
+ */
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+/**
+ * Logs from a fresh thread well past the burst limit.
+ * @param arg the number of messages.
+ * @return NULL.
+ */
+static void *floodLog(void *arg) {
+    int num = *((int *) arg);
+    for (int i = 0; i < num; i++) {
+        LOG_INFO("flood %d", i);
+    }
+    return NULL;
+}
+
+/**
+ * A unit test for the level filter, the flush and the rate limit.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *logUnitTest() {
+    FILE *stream = tmpfile();
+    mu_assert("Could not create the log test file", stream != NULL);
+
+    LogLevel saveLevel = getLogLevel();
+    flushLog();
+    setLogStream(stream);
+    setLogLevel(LOG_LEVEL_INFO);
+
+    LOG_DEBUG("hidden %d", 1);
+    LOG_INFO("shown %d", 2);
+
+    int num = 1000;
+    unsigned long long lostBefore = getLogDropped();
+    pthread_t thread;
+    mu_assert("Could not create the log test thread", pthread_create(&thread, NULL, floodLog, &num) == 0);
+    pthread_join(thread, NULL);
+    flushLog();
+
+    setLogStream(NULL);
+    setLogLevel(saveLevel);
+
+    int shown = 0, hidden = 0, flood = 0;
+    char line[CMAG_LOG_MESSAGE_SIZE + 32];
+    rewind(stream);
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        shown += (strstr(line, "cMag INFO shown 2") != NULL);
+        hidden += (strstr(line, "hidden") != NULL);
+        flood += (strstr(line, "flood") != NULL);
+    }
+    fclose(stream);
+
+    mu_assert("The INFO message was not logged", shown == 1);
+    mu_assert("The DEBUG message was logged at INFO level", hidden == 0);
+    mu_assert("The flood was not rate limited", (flood >= 1) && (flood <= CMAG_LOG_BURST + CMAG_LOG_RATE));
+    mu_assert("The lost messages were not counted", getLogDropped() - lostBefore == (unsigned long long) (num - flood));
+
+    fprintf(stdout, "\nPASSED logUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,413 @@
+//
+//  magfieldmagnitude.c
+//  cMag
+//
+//  A grid of |B| and a magnitude-only fast path. The renderers, the field
+//  metrics and step size heuristics only want |B|, but used to evaluate
+//  the full vector (with the reflection and sector rotation of the
+//  symmetric torus) and then take its norm. The magnitude is invariant
+//  under those rotations and reflections, so with one float per grid
+//  point a query needs no sector handling and reads 4 bytes per corner
+//  instead of 12. A map read with the grid option on (readField, for
+//  either file version) has its grid filled by computeFieldMetrics, which
+//  computes every magnitude anyway, so there it costs only its memory.
+//  A grid added to a map already loaded, by buildMagnitudeGrid, is a pass
+//  of its own: an allocation of 4 bytes per grid point and a square root
+//  per point, about 6 ns a point (half a millisecond for a 100k point
+//  map), on top of the load. Interpolating the magnitudes gives a value at least
+//  the magnitude of the interpolated vector (the norm is convex); they
+//  agree at grid points and differ at second order in between.
+//
+
+#include "magfieldmagnitude.h"
+#include "magfieldutil.h"
+#include "magfieldio.h"
+#include "magfieldmem.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static volatile bool magnitudeGrids = false;
+
+//local prototypes
+static double gridMagnitude(MagneticFieldPtr, double, double, double);
+static int cellIndex(GridPtr, double, double *);
+
+/**
+ * Pick up the magnitude grid option from the CMAG_MAGNITUDE_GRID
+ * environment variable (any value but 0) when the library is loaded.
+ */
+__attribute__((constructor))
+static void initMagnitudeGrids() {
+    const char *env = getenv("CMAG_MAGNITUDE_GRID");
+    if ((env != NULL) && (strcmp(env, "0") != 0)) {
+        magnitudeGrids = true;
+    }
+}
+
+/**
+ * Set whether field maps read from now on get a grid of |B|. It costs a
+ * third of the memory of the field values. It is off by default;
+ * buildMagnitudeGrid adds one later.
+ * @param build true to build magnitude grids.
+ */
+void setMagnitudeGrids(bool build) {
+    magnitudeGrids = build;
+}
+
+/**
+ * Get whether field maps get a grid of |B| when read.
+ * @return true if they do.
+ */
+bool getMagnitudeGrids() {
+    return magnitudeGrids;
+}
+
+/**
+ * Build the grid of |B| of a map, replacing any it has.
+ * @param fieldPtr the field map.
+ * @return true on success.
+ */
+bool buildMagnitudeGrid(MagneticFieldPtr fieldPtr) {
+    float *magnitudes = (float *) allocFieldArray(fieldPtr->numValues * sizeof(float));
+    if (magnitudes == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory building a magnitude grid for [%s]\n", fieldPtr->path);
+        return false;
+    }
+
+    for (size_t i = 0; i < fieldPtr->numValues; i++) {
+        magnitudes[i] = (float) fieldMagnitude(fieldPtr->fieldValues + i);
+    }
+
+    freeMagnitudeGrid(fieldPtr);
+    fieldPtr->magnitudes = magnitudes;
+    return true;
+}
+
+/**
+ * Free the grid of |B| of a map, if it has one.
+ * @param fieldPtr the field map.
+ */
+void freeMagnitudeGrid(MagneticFieldPtr fieldPtr) {
+    freeFieldArray(fieldPtr->magnitudes);
+    fieldPtr->magnitudes = NULL;
+}
+
+/**
+ * Obtain the magnitude of the field. This uses the map's magnitude grid if
+ * it has one, otherwise the full vector. Like getFieldValue it shares the
+ * map's cell when there is no grid, so it is only thread safe with one.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr the field map.
+ * @return |B| in kG, including the scale factor.
+ */
+double getFieldMagnitude(double x, double y, double z, MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->magnitudes == NULL) {
+        FieldValue value = fieldValueAt(x, y, z, fieldPtr);
+        return fieldMagnitude(&value);
+    }
+    return gridMagnitude(fieldPtr, x - fieldPtr->shiftX, y - fieldPtr->shiftY, z - fieldPtr->shiftZ);
+}
+
+/**
+ * Obtain the magnitude of the field at many points. This is the batch form
+ * of getFieldMagnitude.
+ * @param magnitudes space for num values. Upon return, |B| at each point in kG.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param num the number of points.
+ * @param fieldPtr the field map.
+ */
+void getFieldMagnitudes(double *magnitudes, const double *x, const double *y, const double *z, size_t num,
+                        MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->magnitudes == NULL) {
+        for (size_t i = 0; i < num; i++) {
+            magnitudes[i] = getFieldMagnitude(x[i], y[i], z[i], fieldPtr);
+        }
+        return;
+    }
+
+    double shiftX = fieldPtr->shiftX, shiftY = fieldPtr->shiftY, shiftZ = fieldPtr->shiftZ;
+    for (size_t i = 0; i < num; i++) {
+        magnitudes[i] = gridMagnitude(fieldPtr, x[i] - shiftX, y[i] - shiftY, z[i] - shiftZ);
+    }
+}
+
+/**
+ * Obtain the magnitude of the combined field of two maps. Where only one
+ * map covers the point its magnitude grid is used; where both do, the
+ * vectors must be added first.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ * @return |B| in kG.
+ */
+double getCompositeFieldMagnitude(double x, double y, double z, MagneticFieldPtr field1,
+                                  MagneticFieldPtr field2) {
+    bool in1 = (field1 != NULL) &&
+               containsCartesian(field1, x - field1->shiftX, y - field1->shiftY, z - field1->shiftZ);
+    bool in2 = (field2 != NULL) &&
+               containsCartesian(field2, x - field2->shiftX, y - field2->shiftY, z - field2->shiftZ);
+
+    if (in1 && in2) {
+        FieldValue value = compositeFieldValueAt(x, y, z, field1, field2);
+        return fieldMagnitude(&value);
+    }
+    if (in1) {
+        return getFieldMagnitude(x, y, z, field1);
+    }
+    if (in2) {
+        return getFieldMagnitude(x, y, z, field2);
+    }
+    return 0;
+}
+
+/**
+ * Obtain the magnitude of the field through a probe. The thread safe form
+ * of getFieldMagnitude: without a grid it uses the probe's cell.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a probe of the field map.
+ * @return |B| in kG, including the scale factor.
+ */
+double getProbeFieldMagnitude(double x, double y, double z, FieldProbePtr probePtr) {
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    if (fieldPtr->magnitudes == NULL) {
+        FieldValue value = probeFieldValueAt(x, y, z, probePtr);
+        return fieldMagnitude(&value);
+    }
+    return gridMagnitude(fieldPtr, x - fieldPtr->shiftX, y - fieldPtr->shiftY, z - fieldPtr->shiftZ);
+}
+
+/**
+ * Obtain the magnitude of the combined field of two maps through probes.
+ * The thread safe form of getCompositeFieldMagnitude.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probe1 a probe of the first field (can be NULL).
+ * @param probe2 a probe of the second field (can be NULL).
+ * @return |B| in kG.
+ */
+double getCompositeProbeFieldMagnitude(double x, double y, double z, FieldProbePtr probe1,
+                                       FieldProbePtr probe2) {
+    MagneticFieldPtr field1 = (probe1 == NULL) ? NULL : probe1->fieldPtr;
+    MagneticFieldPtr field2 = (probe2 == NULL) ? NULL : probe2->fieldPtr;
+    bool in1 = (field1 != NULL) &&
+               containsCartesian(field1, x - field1->shiftX, y - field1->shiftY, z - field1->shiftZ);
+    bool in2 = (field2 != NULL) &&
+               containsCartesian(field2, x - field2->shiftX, y - field2->shiftY, z - field2->shiftZ);
+
+    if (in1 && in2) {
+        FieldValue value = compositeProbeFieldValueAt(x, y, z, probe1, probe2);
+        return fieldMagnitude(&value);
+    }
+    if (in1) {
+        return getProbeFieldMagnitude(x, y, z, probe1);
+    }
+    if (in2) {
+        return getProbeFieldMagnitude(x, y, z, probe2);
+    }
+    return 0;
+}
+
+/**
+ * Interpolate the magnitude grid.
+ * @param fieldPtr the field map, with a magnitude grid.
+ * @param x the x coordinate in cm, relative to the map.
+ * @param y the y coordinate in cm, relative to the map.
+ * @param z the z coordinate in cm, relative to the map.
+ * @return |B| in kG, scaled.
+ */
+static double gridMagnitude(MagneticFieldPtr fieldPtr, double x, double y, double z) {
+    double rho = sqrt(x * x + y * y);
+    if (!containsCylindrical(fieldPtr, rho, z)) {
+        return 0;
+    }
+
+    double fPhi = 0, fRho, fZ;
+    int iPhi = 0;
+    if (fieldPtr->type == TORUS) {
+        //no flips or rotations: |B| is the same in every sector half, so
+        //fold phi onto [0, 30] about the nearest sector midplane
+        double phi = toDegrees(atan2(y, x));
+        phi = fieldPtr->symmetric ? fabs(phi - 60 * nearbyint(phi / 60)) : ((phi < 0) ? phi + 360 : phi);
+        iPhi = cellIndex(fieldPtr->phiGridPtr, phi, &fPhi);
+    }
+    int iRho = cellIndex(fieldPtr->rhoGridPtr, rho, &fRho);
+    int iZ = cellIndex(fieldPtr->zGridPtr, z, &fZ);
+
+    if (getAlgorithm() == NEAREST_NEIGHBOR) {
+        fPhi = (fPhi < 0.5) ? 0 : 1;
+        fRho = (fRho < 0.5) ? 0 : 1;
+        fZ = (fZ < 0.5) ? 0 : 1;
+    }
+
+    size_t nZ = fieldPtr->zGridPtr->num;
+    const float *m = fieldPtr->magnitudes + (size_t) iPhi * fieldPtr->N23 + (size_t) iRho * nZ + iZ;
+
+    double c0 = (1 - fRho) * ((1 - fZ) * m[0] + fZ * m[1]) + fRho * ((1 - fZ) * m[nZ] + fZ * m[nZ + 1]);
+    if (fieldPtr->type == TORUS) {
+        m += fieldPtr->N23;
+        double c1 = (1 - fRho) * ((1 - fZ) * m[0] + fZ * m[1]) + fRho * ((1 - fZ) * m[nZ] + fZ * m[nZ + 1]);
+        c0 = (1 - fPhi) * c0 + fPhi * c1;
+    }
+    return c0 * fabs(fieldPtr->scale);
+}
+
+/**
+ * The cell of a uniform grid holding a coordinate that is inside the grid.
+ * @param gridPtr the grid.
+ * @param q the coordinate.
+ * @param fract upon return, the fraction of the way across the cell.
+ * @return the index of the cell's low grid point.
+ */
+static int cellIndex(GridPtr gridPtr, double q, double *fract) {
+    double f = (q - gridPtr->minVal) / gridPtr->delta;
+    int i = (int) f;
+    int last = (int) gridPtr->num - 2;
+    i = (i > last) ? last : ((i < 0) ? 0 : i);
+    *fract = f - i;
+    return i;
+}
+
+/**
+ * A unit test of the magnitude grid of the test field: it holds |B| of
+ * every grid point, the fast path agrees with the vector path at grid
+ * points and never falls below it in between, honours the symmetry,
+ * scale, shifts and the algorithm, and the batch and composite forms
+ * agree with the scalar form.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *magnitudeUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    float *saved = fieldPtr->magnitudes;
+    fieldPtr->magnitudes = NULL;
+
+    int count = 5000;
+    double x[count], y[count], z[count], fast[count];
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal;
+    double zMin = fieldPtr->zGridPtr->minVal, zMax = fieldPtr->zGridPtr->maxVal;
+    for (int i = 0; i < count; i++) {
+        cylindricalToCartesian(x + i, y + i, randomDouble(0, 360), randomDouble(0, 1.05 * rhoMax));
+        z[i] = randomDouble(zMin - 5, zMax + 5);
+    }
+
+    //without a grid the fast path is the vector path
+    for (int i = 0; i < 100; i++) {
+        FieldValue value = fieldValueAt(x[i], y[i], z[i], fieldPtr);
+        mu_assert("Without a grid the magnitude is not that of the vector",
+                  getFieldMagnitude(x[i], y[i], z[i], fieldPtr) == fieldMagnitude(&value));
+    }
+
+    mu_assert("Could not build the magnitude grid", buildMagnitudeGrid(fieldPtr));
+    for (size_t i = 0; i < fieldPtr->numValues; i++) {
+        mu_assert("The grid does not hold |B|",
+                  fieldPtr->magnitudes[i] == (float) fieldMagnitude(fieldPtr->fieldValues + i));
+    }
+
+    double maxField = fieldPtr->metricsPtr->maxFieldMagnitude;
+    double slack = 1.0e-5 * (1 + maxField);
+
+    //equal at grid points, never below the vector in between, and close to it
+    for (int n = 0; n < 500; n++) {
+        int iPhi = randomInt(0, fieldPtr->phiGridPtr->num - 1);
+        int iRho = randomInt(0, fieldPtr->rhoGridPtr->num - 1);
+        int iZ = randomInt(0, fieldPtr->zGridPtr->num - 1);
+        double gx, gy;
+        cylindricalToCartesian(&gx, &gy, valueAtIndex(fieldPtr->phiGridPtr, iPhi),
+                               valueAtIndex(fieldPtr->rhoGridPtr, iRho));
+        double node = fieldPtr->magnitudes[getCompositeIndex(fieldPtr, iPhi, iRho, iZ)];
+        double magnitude = getFieldMagnitude(gx, gy, valueAtIndex(fieldPtr->zGridPtr, iZ), fieldPtr);
+        mu_assert("The magnitude differs from the grid at a grid point", fabs(magnitude - node) < slack);
+    }
+
+    double sumDifference = 0, sumMagnitude = 0;
+    for (int i = 0; i < count; i++) {
+        FieldValue value = fieldValueAt(x[i], y[i], z[i], fieldPtr);
+        double magnitude = getFieldMagnitude(x[i], y[i], z[i], fieldPtr);
+        mu_assert("The interpolated magnitude is below the magnitude of the interpolated field",
+                  magnitude >= fieldMagnitude(&value) - slack);
+        mu_assert("The magnitude is not zero outside the map",
+                  containsCartesian(fieldPtr, x[i], y[i], z[i]) || (magnitude == 0));
+        sumDifference += magnitude - fieldMagnitude(&value);
+        sumMagnitude += magnitude;
+    }
+    mu_assert("The interpolated magnitude is far from the vector path", sumDifference < 0.02 * sumMagnitude);
+
+    //the same in every sector half
+    if (fieldPtr->symmetric) {
+        for (int i = 0; i < 200; i++) {
+            double rho = hypot(x[i], y[i]);
+            double phi = toDegrees(atan2(y[i], x[i]));
+            double magnitude = getFieldMagnitude(x[i], y[i], z[i], fieldPtr);
+            double mx, my;
+            cylindricalToCartesian(&mx, &my, 120 - phi, rho);
+            mu_assert("The magnitude is not symmetric",
+                      fabs(getFieldMagnitude(mx, my, z[i], fieldPtr) - magnitude) < slack);
+        }
+    }
+
+    //the batch form, then scale and shift
+    getFieldMagnitudes(fast, x, y, z, count, fieldPtr);
+    for (int i = 0; i < count; i++) {
+        mu_assert("The batch magnitude differs", fast[i] == getFieldMagnitude(x[i], y[i], z[i], fieldPtr));
+    }
+
+    double scale = fieldPtr->scale;
+    fieldPtr->scale = -2 * scale;
+    fieldPtr->shiftZ += 5;
+    for (int i = 0; i < 200; i++) {
+        double magnitude = getFieldMagnitude(x[i], y[i], z[i] + 5, fieldPtr);
+        mu_assert("The magnitude ignores the scale or shift", fabs(magnitude - 2 * fabs(scale) * fast[i]) < slack);
+    }
+    fieldPtr->scale = scale;
+    fieldPtr->shiftZ -= 5;
+
+    //one map alone is its fast path, two overlapping maps add vectors,
+    //and the probe forms agree with the shared ones
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    for (int i = 0; i < 200; i++) {
+        FieldValue value = compositeFieldValueAt(x[i], y[i], z[i], fieldPtr, fieldPtr);
+        mu_assert("The composite magnitude of one map differs",
+                  getCompositeFieldMagnitude(x[i], y[i], z[i], NULL, fieldPtr) == fast[i]);
+        mu_assert("The composite magnitude of two maps differs",
+                  getCompositeFieldMagnitude(x[i], y[i], z[i], fieldPtr, fieldPtr) == fieldMagnitude(&value));
+        mu_assert("The probe magnitude differs", getProbeFieldMagnitude(x[i], y[i], z[i], probePtr) == fast[i]);
+        mu_assert("The composite probe magnitude differs",
+                  getCompositeProbeFieldMagnitude(x[i], y[i], z[i], probePtr, probePtr) == fieldMagnitude(&value));
+    }
+    float *grid = fieldPtr->magnitudes;
+    fieldPtr->magnitudes = NULL;
+    for (int i = 0; i < 200; i++) {
+        mu_assert("The probe magnitude without a grid differs",
+                  getProbeFieldMagnitude(x[i], y[i], z[i], probePtr) == getFieldMagnitude(x[i], y[i], z[i], fieldPtr));
+        mu_assert("The composite probe magnitude without a grid differs",
+                  getCompositeProbeFieldMagnitude(x[i], y[i], z[i], NULL, probePtr) ==
+                  getCompositeFieldMagnitude(x[i], y[i], z[i], fieldPtr, NULL));
+    }
+    fieldPtr->magnitudes = grid;
+    freeProbe(probePtr);
+
+    //nearest neighbor reads the grid point the vector path reads
+    enum Algorithm algorithm = getAlgorithm();
+    setAlgorithm(NEAREST_NEIGHBOR);
+    for (int i = 0; i < 500; i++) {
+        FieldValue value = fieldValueAt(x[i], y[i], z[i], fieldPtr);
+        mu_assert("The nearest neighbor magnitude differs",
+                  fabs(getFieldMagnitude(x[i], y[i], z[i], fieldPtr) - fieldMagnitude(&value)) < slack);
+    }
+    setAlgorithm(algorithm);
+
+    freeMagnitudeGrid(fieldPtr);
+    fieldPtr->magnitudes = saved;
+    fprintf(stdout, "\nPASSED magnitudeUnitTest\n");
+    return NULL;
+}
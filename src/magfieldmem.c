@@ -0,0 +1,426 @@
+//
+//  magfieldmem.c
+//  cMag
+//
+//  Huge page backed allocation of the field arrays. The full torus is
+//  hundreds of MB, so with 4 KiB pages nearly every random query misses
+//  the TLB. Large arrays are mapped with hugetlbfs pages when requested
+//  and reserved, otherwise 2 MiB aligned and advised for transparent huge
+//  pages. Every allocation is registered so it can be freed correctly and
+//  so we can report what the kernel actually gave us.
+//
+
+#define _GNU_SOURCE
+#include "magfieldmem.h"
+#include "magfieldlog.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+//not all headers define the hugetlb size selectors
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_2MB)
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_1GB)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+//small arrays and the fallback are aligned to this
+#define SMALL_ALIGNMENT 4096
+
+//one registered allocation
+typedef struct fieldarray {
+    void *ptr;
+    FieldArrayInfo info;
+    struct fieldarray *next;
+} FieldArray;
+
+static const char *policyNames[] = {"off", "thp", "2m", "1g"};
+
+static volatile PagePolicy pagePolicy = PAGES_TRANSPARENT;
+
+static FieldArray *arrays = NULL;
+static pthread_mutex_t arraysLock = PTHREAD_MUTEX_INITIALIZER;
+
+//local prototypes
+static void *mapHugetlb(size_t, size_t, int);
+static void *mapTransparent(size_t, bool *);
+static size_t roundUp(size_t, size_t);
+static FieldArray *findArray(const void *);
+static size_t smapsHugeBytes(const void *);
+
+/**
+ * Pick up the initial policy from the CMAG_HUGE_PAGES environment
+ * variable (off, thp, 2m or 1g) when the library is loaded.
+ */
+__attribute__((constructor))
+static void initPagePolicy() {
+    const char *env = getenv("CMAG_HUGE_PAGES");
+    if (env == NULL) {
+        return;
+    }
+    for (int i = 0; i <= PAGES_HUGE_1G; i++) {
+        if (strcasecmp(env, policyNames[i]) == 0) {
+            pagePolicy = i;
+        }
+    }
+}
+
+/**
+ * Set how arrays allocated from now on are backed. Arrays that are
+ * already allocated keep their pages.
+ * @param policy the new policy.
+ */
+void setPagePolicy(PagePolicy policy) {
+    pagePolicy = policy;
+}
+
+/**
+ * Get the current page policy.
+ * @return the policy.
+ */
+PagePolicy getPagePolicy() {
+    return pagePolicy;
+}
+
+/**
+ * Get the short name of a policy, as accepted in CMAG_HUGE_PAGES.
+ * @param policy the policy.
+ * @return its name.
+ */
+const char *pagePolicyName(PagePolicy policy) {
+    return ((policy >= PAGES_DEFAULT) && (policy <= PAGES_HUGE_1G)) ? policyNames[policy] : "?";
+}
+
+/**
+ * Allocate a large array according to the page policy, falling back
+ * from 1 GiB to 2 MiB hugetlb pages, then to transparent huge pages,
+ * then to ordinary pages. The memory is not initialized. Arrays smaller
+ * than CMAG_HUGE_PAGE_MIN always get ordinary pages. Every result is at
+ * least 4096 byte aligned. Free with freeFieldArray.
+ * @param bytes the size in bytes.
+ * @return the array, or NULL if out of memory.
+ */
+void *allocFieldArray(size_t bytes) {
+    FieldArray *array = (FieldArray *) malloc(sizeof(FieldArray));
+    if (array == NULL) {
+        return NULL;
+    }
+
+    PagePolicy requested = pagePolicy;
+    PagePolicy policy = (bytes < CMAG_HUGE_PAGE_MIN) ? PAGES_DEFAULT : requested;
+    void *ptr = NULL;
+    size_t mappedBytes = bytes;
+
+#ifdef MAP_HUGETLB
+    if (policy == PAGES_HUGE_1G) {
+        mappedBytes = roundUp(bytes, CMAG_PAGE_1G);
+        ptr = mapHugetlb(bytes, mappedBytes, MAP_HUGE_1GB);
+        if (ptr == NULL) {
+            LOG_INFO("no 1 GiB huge pages for %zu bytes, trying 2 MiB", bytes);
+            policy = PAGES_HUGE_2M;
+        }
+    }
+    if ((ptr == NULL) && (policy == PAGES_HUGE_2M)) {
+        mappedBytes = roundUp(bytes, CMAG_PAGE_2M);
+        ptr = mapHugetlb(bytes, mappedBytes, MAP_HUGE_2MB);
+        if (ptr == NULL) {
+            LOG_INFO("no 2 MiB huge pages for %zu bytes, using transparent huge pages", bytes);
+            policy = PAGES_TRANSPARENT;
+        }
+    }
+#else
+    if (policy > PAGES_TRANSPARENT) {
+        policy = PAGES_TRANSPARENT;
+    }
+#endif
+
+    if ((ptr == NULL) && (policy == PAGES_TRANSPARENT)) {
+        bool advised = false;
+        mappedBytes = roundUp(bytes, CMAG_PAGE_2M);
+        ptr = mapTransparent(mappedBytes, &advised);
+        if ((ptr != NULL) && !advised) {
+            LOG_INFO("transparent huge pages are not available, using ordinary pages");
+            policy = PAGES_DEFAULT;
+        }
+    }
+
+    bool mapped = (ptr != NULL);
+
+    if (ptr == NULL) {
+        policy = PAGES_DEFAULT;
+        mappedBytes = bytes;
+        if (posix_memalign(&ptr, SMALL_ALIGNMENT, (bytes > 0) ? bytes : 1) != 0) {
+            free(array);
+            return NULL;
+        }
+    }
+
+    array->ptr = ptr;
+    array->info.base = ptr;
+    array->info.mapped = mapped;
+    array->info.bytes = bytes;
+    array->info.mappedBytes = mappedBytes;
+    array->info.requested = requested;
+    array->info.obtained = policy;
+    array->info.hugeBytes = 0;
+
+    pthread_mutex_lock(&arraysLock);
+    array->next = arrays;
+    arrays = array;
+    pthread_mutex_unlock(&arraysLock);
+
+    LOG_DEBUG("allocated %zu bytes with %s pages (requested %s)", bytes,
+              pagePolicyName(policy), pagePolicyName(requested));
+    return ptr;
+}
+
+/**
+ * Free an array from allocFieldArray. NULL is ignored.
+ * @param ptr the array.
+ */
+void freeFieldArray(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arraysLock);
+    FieldArray **link = &arrays;
+    while ((*link != NULL) && ((*link)->ptr != ptr)) {
+        link = &((*link)->next);
+    }
+    FieldArray *array = *link;
+    if (array != NULL) {
+        *link = array->next;
+    }
+    pthread_mutex_unlock(&arraysLock);
+
+    if (array == NULL) {
+        LOG_ERROR("freeFieldArray called with an unknown pointer %p", ptr);
+        return;
+    }
+
+    if (array->info.mapped) {
+        munmap(ptr, array->info.mappedBytes);
+    }
+    else {
+        free(ptr);
+    }
+    free(array);
+}
+
+/**
+ * Get what an array was given. The huge page count for transparent huge
+ * pages is read from /proc/self/smaps, so it reflects the pages the kernel
+ * has actually used so far (only touched memory is backed at all).
+ * @param ptr the array, from allocFieldArray, or any address within it.
+ * @param info upon success, the allocation info.
+ * @return true if ptr is a registered array.
+ */
+bool getFieldArrayInfo(const void *ptr, FieldArrayInfo *info) {
+    pthread_mutex_lock(&arraysLock);
+    FieldArray *array = findArray(ptr);
+    if (array != NULL) {
+        *info = array->info;
+    }
+    pthread_mutex_unlock(&arraysLock);
+
+    if (array == NULL) {
+        return false;
+    }
+
+    if ((info->obtained == PAGES_HUGE_2M) || (info->obtained == PAGES_HUGE_1G)) {
+        info->hugeBytes = info->bytes;
+    }
+    else if (info->obtained == PAGES_TRANSPARENT) {
+        info->hugeBytes = smapsHugeBytes(ptr);
+        if (info->hugeBytes > info->bytes) {
+            info->hugeBytes = info->bytes;
+        }
+    }
+    return true;
+}
+
+/**
+ * Print a one line report of how an array is backed.
+ * @param ptr the array, from allocFieldArray, or any address within it.
+ * @param stream the output stream.
+ */
+void printFieldArrayInfo(const void *ptr, FILE *stream) {
+    FieldArrayInfo info;
+    if (!getFieldArrayInfo(ptr, &info)) {
+        fprintf(stream, "pages: unknown (not from allocFieldArray)\n");
+        return;
+    }
+
+    double mb = 1024.0 * 1024.0;
+    fprintf(stream, "pages: requested %s, obtained %s, %.1f of %.1f MB huge page backed\n",
+            pagePolicyName(info.requested), pagePolicyName(info.obtained),
+            info.hugeBytes / mb, info.bytes / mb);
+}
+
+/**
+ * Map hugetlb pages of a given size.
+ * @param bytes the size requested, for logging.
+ * @param mappedBytes the size rounded up to the page size.
+ * @param sizeFlag the MAP_HUGE_* page size selector.
+ * @return the mapping, or NULL if none are available.
+ */
+static void *mapHugetlb(size_t bytes, size_t mappedBytes, int sizeFlag) {
+#ifdef MAP_HUGETLB
+    void *ptr = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+    LOG_DEBUG("hugetlb mapping of %zu bytes %s", bytes, (ptr == MAP_FAILED) ? "failed" : "succeeded");
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * Map anonymous memory aligned to 2 MiB, so that it can be backed
+ * entirely by transparent huge pages, and advise the kernel to do so.
+ * The kernel only aligns to the base page, so we over-map and trim.
+ * @param mappedBytes the size, a multiple of 2 MiB.
+ * @param advised upon return, whether the advice was accepted.
+ * @return the mapping, or NULL on failure.
+ */
+static void *mapTransparent(size_t mappedBytes, bool *advised) {
+    size_t extra = CMAG_PAGE_2M;
+    char *raw = (char *) mmap(NULL, mappedBytes + extra, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *ptr = (char *) roundUp((size_t) raw, CMAG_PAGE_2M);
+    size_t head = ptr - raw;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    if (extra - head > 0) {
+        munmap(ptr + mappedBytes, extra - head);
+    }
+
+#ifdef MADV_HUGEPAGE
+    *advised = (madvise(ptr, mappedBytes, MADV_HUGEPAGE) == 0);
+#else
+    *advised = false;
+#endif
+    return ptr;
+}
+
+/**
+ * Round up to a multiple of a power of two.
+ * @param n the value.
+ * @param unit the power of two.
+ * @return the rounded value.
+ */
+static size_t roundUp(size_t n, size_t unit) {
+    return (n + unit - 1) & ~(unit - 1);
+}
+
+/**
+ * Find the registered array containing an address. The caller must hold
+ * arraysLock.
+ * @param ptr the address.
+ * @return its record, or NULL.
+ */
+static FieldArray *findArray(const void *ptr) {
+    const char *address = (const char *) ptr;
+    for (FieldArray *array = arrays; array != NULL; array = array->next) {
+        const char *start = (const char *) array->ptr;
+        if ((address >= start) && ((address < start + array->info.bytes) || (address == start))) {
+            return array;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read the AnonHugePages of the mapping containing an address from
+ * /proc/self/smaps. Adjacent mappings with the same flags are merged by
+ * the kernel, so this can include a neighbouring array.
+ * @param ptr the address.
+ * @return the huge page backed bytes, or 0 if unknown.
+ */
+static size_t smapsHugeBytes(const void *ptr) {
+    FILE *file = fopen("/proc/self/smaps", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    uintptr_t address = (uintptr_t) ptr;
+    bool inside = false;
+    size_t hugeBytes = 0;
+    char line[512];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            inside = (address >= start) && (address < end);
+        }
+        else if (inside && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)) {
+            hugeBytes = kb * 1024;
+            break;
+        }
+    }
+
+    fclose(file);
+    return hugeBytes;
+}
+
+/**
+ * Unit test for the huge page allocator. Whether huge pages are obtained
+ * depends on the system, so we only check the fallbacks give usable,
+ * aligned memory that is reported and freed consistently.
+ * @return NULL if successful, or an error message.
+ */
+char *memUnitTest() {
+    PagePolicy savePolicy = getPagePolicy();
+    size_t sizes[] = {1000, 3 * CMAG_PAGE_2M + 12345};
+
+    for (int p = PAGES_DEFAULT; p <= PAGES_HUGE_1G; p++) {
+        setPagePolicy(p);
+        for (int s = 0; s < 2; s++) {
+            size_t bytes = sizes[s];
+            unsigned char *array = (unsigned char *) allocFieldArray(bytes);
+            mu_assert("Could not allocate a field array", array != NULL);
+            mu_assert("Field array is not page aligned", ((size_t) array) % SMALL_ALIGNMENT == 0);
+
+            memset(array, p + 1, bytes);
+            mu_assert("Field array is not writable to the end", array[bytes - 1] == p + 1);
+
+            FieldArrayInfo info;
+            mu_assert("Field array is not registered", getFieldArrayInfo(array, &info));
+            mu_assert("Field array info has the wrong base", info.base == array);
+            mu_assert("Field array interior is not registered", getFieldArrayInfo(array + bytes / 2, &info) &&
+                                                                (info.base == array));
+            mu_assert("Field array info has the wrong size", info.bytes == bytes);
+            mu_assert("Field array info has the wrong policy", info.requested == (PagePolicy) p);
+            mu_assert("Field array got better pages than requested", info.obtained <= (PagePolicy) p);
+            mu_assert("Small field array got huge pages", (bytes >= CMAG_HUGE_PAGE_MIN) ||
+                                                           (info.obtained == PAGES_DEFAULT));
+            mu_assert("Field array mapping is too small", info.mappedBytes >= bytes);
+            mu_assert("Field array has too many huge pages", info.hugeBytes <= info.bytes);
+
+            if (info.obtained == PAGES_TRANSPARENT) {
+                mu_assert("Transparent field array is not 2 MiB aligned", ((size_t) array) % CMAG_PAGE_2M == 0);
+            }
+
+            freeFieldArray(array);
+            mu_assert("Freed field array is still registered", !getFieldArrayInfo(array, &info));
+        }
+    }
+
+    setPagePolicy(savePolicy);
+    fprintf(stdout, "\nPASSED memUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,400 @@
+//
+//  magfieldnuma.c
+//  cMag
+//
+//  NUMA replication of the field values. The values are read only after
+//  loading, so on a multi-socket machine we can keep one copy per node and
+//  have each probe read the copy local to the thread that created it,
+//  rather than every socket fetching corners from the node that happened
+//  to touch the array first. The topology comes from sysfs and placement
+//  uses the raw mbind and get_mempolicy system calls, so libnuma is not
+//  needed. Where those are unavailable each copy is made by a thread pinned
+//  to the node's CPUs, which places the pages by first touch.
+//
+
+#define _GNU_SOURCE
+#include "magfieldnuma.h"
+#include "magfieldio.h"
+#include "magfieldmem.h"
+#include "magfieldlog.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+//from linux/mempolicy.h, which is not always installed
+#define CMAG_MPOL_BIND 2
+#define CMAG_MPOL_F_NODE (1 << 0)
+#define CMAG_MPOL_F_ADDR (1 << 1)
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+//one copy to be made on a node
+typedef struct replicajob {
+    void *dest;
+    const void *src;
+    size_t bytes;
+} ReplicaJob;
+
+//the topology, read once
+static int numNodes = 1;
+#ifdef __linux__
+static cpu_set_t nodeCpus[CMAG_MAX_NUMA_NODES];
+static bool nodeHasCpus[CMAG_MAX_NUMA_NODES];
+#endif
+static pthread_once_t topologyOnce = PTHREAD_ONCE_INIT;
+
+static volatile bool numaReplication = false;
+
+//local prototypes
+static void readTopology(void);
+static bool replicate(MagneticFieldPtr, int);
+static int homeNode(const void *);
+static void bindToNode(void *, size_t, int);
+static void copyOnNode(ReplicaJob *, int);
+static void *copyReplica(void *);
+
+/**
+ * Pick up the replication option from the CMAG_NUMA_REPLICATE environment
+ * variable (any value but 0) when the library is loaded.
+ */
+__attribute__((constructor))
+static void initNumaReplication() {
+    const char *env = getenv("CMAG_NUMA_REPLICATE");
+    if ((env != NULL) && (strcmp(env, "0") != 0)) {
+        numaReplication = true;
+    }
+}
+
+/**
+ * Set whether field maps read from now on are replicated to every
+ * NUMA node. This trades one extra copy of the field values per node for
+ * local memory access on every socket. It is off by default.
+ * @param replicate true to replicate.
+ */
+void setNumaReplication(bool replicate) {
+    numaReplication = replicate;
+}
+
+/**
+ * Get whether field maps are replicated to every NUMA node when read.
+ * @return true if they are.
+ */
+bool getNumaReplication() {
+    return numaReplication;
+}
+
+/**
+ * Get the number of NUMA nodes. Node ids are assumed to run from 0, as
+ * they do on every machine we know of.
+ * @return the number of nodes, 1 if there is no NUMA information.
+ */
+int numaNodeCount() {
+    pthread_once(&topologyOnce, readTopology);
+    return numNodes;
+}
+
+/**
+ * Get the NUMA node the calling thread is running on. Threads can
+ * migrate, so this is only a hint unless the thread is pinned.
+ * @return the node, or 0 if unknown.
+ */
+int currentNumaNode() {
+    int count = numaNodeCount();
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+    if ((syscall(SYS_getcpu, &cpu, &node, NULL) == 0) && ((int) node < count)) {
+        return (int) node;
+    }
+#endif
+    (void) count;
+    return 0;
+}
+
+/**
+ * Replicate the field values of a map to every NUMA node. Do this before
+ * creating the probes that should use the replicas; probes pick their
+ * replica when they are created (see createProbe). The field's own cell
+ * keeps reading the original values. Nothing is done on a single node.
+ * @param fieldPtr the field map.
+ * @return true if the map is replicated or there is nothing to do, false
+ * if a replica could not be made, in which case threads on that node
+ * read the original.
+ */
+bool replicateFieldMap(MagneticFieldPtr fieldPtr) {
+    int count = numaNodeCount();
+    if (count < 2) {
+        LOG_INFO("single NUMA node, not replicating [%s]", fieldPtr->path);
+        return true;
+    }
+    return replicate(fieldPtr, count);
+}
+
+/**
+ * Free the NUMA replicas of a field map, if any. Any probes of the
+ * field must be freed first.
+ * @param fieldPtr the field map.
+ */
+void freeReplicas(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->replicas == NULL) {
+        return;
+    }
+    for (int i = 0; i < fieldPtr->numReplicas; i++) {
+        if (fieldPtr->replicas[i] != fieldPtr->fieldValues) {
+            freeFieldArray(fieldPtr->replicas[i]);
+        }
+    }
+    free(fieldPtr->replicas);
+    fieldPtr->replicas = NULL;
+    fieldPtr->numReplicas = 0;
+}
+
+/**
+ * Get the copy of the field values local to the calling thread.
+ * @param fieldPtr the field map.
+ * @return the local replica, or the original values if the map is not
+ * replicated.
+ */
+FieldValuePtr localFieldValues(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->replicas == NULL) {
+        return fieldPtr->fieldValues;
+    }
+    int node = currentNumaNode();
+    if ((node < fieldPtr->numReplicas) && (fieldPtr->replicas[node] != NULL)) {
+        return fieldPtr->replicas[node];
+    }
+    return fieldPtr->fieldValues;
+}
+
+/**
+ * Read the nodes and their CPUs from sysfs.
+ */
+static void readTopology() {
+#ifdef __linux__
+    int highest = -1;
+    for (int node = 0; node < CMAG_MAX_NUMA_NODES; node++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+
+        char list[4096];
+        CPU_ZERO(&nodeCpus[node]);
+        if (fgets(list, sizeof(list), file) != NULL) {
+            //a comma separated list of cpus and ranges, e.g. 0-3,8-11
+            for (char *token = strtok(list, ",\n"); token != NULL; token = strtok(NULL, ",\n")) {
+                int first, last;
+                int n = sscanf(token, "%d-%d", &first, &last);
+                if (n < 1) {
+                    continue;
+                }
+                if (n == 1) {
+                    last = first;
+                }
+                for (int cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++) {
+                    CPU_SET(cpu, &nodeCpus[node]);
+                    nodeHasCpus[node] = true;
+                }
+            }
+        }
+        fclose(file);
+        highest = node;
+    }
+    numNodes = (highest < 0) ? 1 : highest + 1;
+    LOG_DEBUG("NUMA nodes: %d", numNodes);
+#endif
+}
+
+/**
+ * Make one replica per node for a given number of nodes. The original
+ * values serve as the replica for the node they are on.
+ * @param fieldPtr the field map.
+ * @param nodes the number of nodes.
+ * @return true if every replica was made.
+ */
+static bool replicate(MagneticFieldPtr fieldPtr, int nodes) {
+    if (fieldPtr->replicas != NULL) {
+        return true;
+    }
+
+    FieldValuePtr *replicas = (FieldValuePtr *) calloc(nodes, sizeof(FieldValuePtr));
+    if (replicas == NULL) {
+        return false;
+    }
+
+    size_t bytes = fieldPtr->numValues * sizeof(FieldValue);
+    int home = homeNode(fieldPtr->fieldValues);
+    bool ok = true;
+
+    for (int node = 0; node < nodes; node++) {
+        if (node == home) {
+            replicas[node] = fieldPtr->fieldValues;
+            continue;
+        }
+
+        FieldValuePtr copy = (FieldValuePtr) allocFieldArray(bytes);
+        if (copy == NULL) {
+            LOG_WARN("out of memory replicating [%s] to NUMA node %d", fieldPtr->path, node);
+            ok = false;
+            continue;
+        }
+
+        bindToNode(copy, bytes, node);
+        ReplicaJob job = {copy, fieldPtr->fieldValues, bytes};
+        copyOnNode(&job, node);
+        replicas[node] = copy;
+    }
+
+    fieldPtr->replicas = replicas;
+    fieldPtr->numReplicas = nodes;
+    LOG_INFO("replicated [%s] to %d NUMA nodes (%.1f MB each)", fieldPtr->path, nodes,
+             bytes / (1024.0 * 1024.0));
+    return ok;
+}
+
+/**
+ * Find the node holding the first page of an array.
+ * @param ptr the array.
+ * @return the node, or the current node if it can't be found.
+ */
+static int homeNode(const void *ptr) {
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+    int node = -1;
+    if ((syscall(SYS_get_mempolicy, &node, NULL, 0, ptr, CMAG_MPOL_F_NODE | CMAG_MPOL_F_ADDR) == 0) &&
+        (node >= 0) && (node < numaNodeCount())) {
+        return node;
+    }
+#endif
+    (void) ptr;
+    return currentNumaNode();
+}
+
+/**
+ * Bind a replica's pages to a node before they are touched. Only arrays
+ * with a mapping of their own are bound, so that nothing else sharing
+ * their pages is affected. Failure is harmless: the pinned copy still
+ * places the pages by first touch.
+ * @param ptr the array.
+ * @param bytes its size.
+ * @param node the node.
+ */
+static void bindToNode(void *ptr, size_t bytes, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    FieldArrayInfo info;
+    if (!getFieldArrayInfo(ptr, &info) || !info.mapped) {
+        return;
+    }
+
+    unsigned long mask[CMAG_MAX_NUMA_NODES / BITS_PER_LONG] = {0};
+    mask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+    if (syscall(SYS_mbind, info.base, info.mappedBytes, CMAG_MPOL_BIND, mask, 8 * sizeof(mask) + 1, 0) != 0) {
+        LOG_DEBUG("mbind to NUMA node %d failed, relying on first touch", node);
+    }
+#endif
+    (void) ptr;
+    (void) bytes;
+    (void) node;
+}
+
+/**
+ * Copy a replica from a thread pinned to a node's CPUs, so that first
+ * touch places its pages there. If the node has no CPUs, or the thread
+ * can't be started, the caller does the copy.
+ * @param job the copy to make.
+ * @param node the node.
+ */
+static void copyOnNode(ReplicaJob *job, int node) {
+#ifdef __linux__
+    if ((node < CMAG_MAX_NUMA_NODES) && nodeHasCpus[node]) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &nodeCpus[node]);
+        int result = pthread_create(&thread, &attr, copyReplica, job);
+        pthread_attr_destroy(&attr);
+        if (result == 0) {
+            pthread_join(thread, NULL);
+            return;
+        }
+    }
+#endif
+    (void) node;
+    copyReplica(job);
+}
+
+/**
+ * Make a copy.
+ * @param arg the ReplicaJob.
+ * @return NULL.
+ */
+static void *copyReplica(void *arg) {
+    ReplicaJob *job = (ReplicaJob *) arg;
+    memcpy(job->dest, job->src, job->bytes);
+    return NULL;
+}
+
+/**
+ * Unit test for NUMA replication. Most machines we test on have one
+ * node, so we replicate to two nodes regardless, and check that probes
+ * reading either replica agree with the field itself.
+ * @return NULL if successful, or an error message.
+ */
+char *numaUnitTest() {
+    int nodes = numaNodeCount();
+    mu_assert("Bad NUMA node count", (nodes >= 1) && (nodes <= CMAG_MAX_NUMA_NODES));
+    int node = currentNumaNode();
+    mu_assert("Current NUMA node out of range", (node >= 0) && (node < nodes));
+
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    mu_assert("The test field is already replicated", fieldPtr->replicas == NULL);
+    mu_assert("Could not replicate the field", replicate(fieldPtr, 2));
+    mu_assert("Wrong number of replicas", fieldPtr->numReplicas == 2);
+    mu_assert("The replicas are the same array", fieldPtr->replicas[0] != fieldPtr->replicas[1]);
+
+    size_t bytes = fieldPtr->numValues * sizeof(FieldValue);
+    for (int n = 0; n < 2; n++) {
+        mu_assert("Missing replica", fieldPtr->replicas[n] != NULL);
+        mu_assert("The replica differs from the field", memcmp(fieldPtr->replicas[n], fieldPtr->fieldValues, bytes) == 0);
+
+        //a new probe, pointed at this replica before its first query
+        FieldProbePtr probePtr = createProbe(fieldPtr);
+        if (probePtr->cell3DPtr != NULL) {
+            probePtr->cell3DPtr->values = fieldPtr->replicas[n];
+        }
+        else {
+            probePtr->cell2DPtr->values = fieldPtr->replicas[n];
+        }
+
+        for (int i = 0; i < 1000; i++) {
+            double rho = randomDouble(fieldPtr->rhoGridPtr->minVal, fieldPtr->rhoGridPtr->maxVal);
+            double phi = randomDouble(0, 2 * M_PI);
+            double z = randomDouble(fieldPtr->zGridPtr->minVal, fieldPtr->zGridPtr->maxVal);
+            double x = rho * cos(phi);
+            double y = rho * sin(phi);
+
+            FieldValue expected, actual;
+            getFieldValue(&expected, x, y, z, fieldPtr);
+            getProbeFieldValue(&actual, x, y, z, probePtr);
+            mu_assert("The replica gives a different field",
+                      (expected.b1 == actual.b1) && (expected.b2 == actual.b2) && (expected.b3 == actual.b3));
+        }
+        freeProbe(probePtr);
+    }
+
+    freeReplicas(fieldPtr);
+    mu_assert("The replicas were not freed", (fieldPtr->replicas == NULL) && (fieldPtr->numReplicas == 0));
+    mu_assert("An unreplicated field has a local replica", localFieldValues(fieldPtr) == fieldPtr->fieldValues);
+
+    fprintf(stdout, "\nPASSED numaUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,982 @@
+//
+//  magfieldpyramid.c
+//  cMag
+//
+//  A min/max pyramid over a field map. An adaptive stepper wants a bound
+//  on |B| and on its gradient over the next step, and analysis tools want
+//  to know where |B| is above some value; both used to mean scanning the
+//  field values the way computeFieldMetrics does. Here the base of the
+//  pyramid summarizes blocks of CMAG_PYRAMID_BLOCK^3 cells: the smallest
+//  and largest |B| at their grid points and a bound on the gradient of
+//  the interpolated field. Each level above combines 2x2x2 nodes of the
+//  one below. A box query descends from the top and stops at nodes that
+//  are inside the box or outside it, so a small box costs O(log n) node
+//  visits, and threshold queries skip every node whose maximum is below
+//  the threshold.
+//
+//  The maximum |B| of a block bounds the interpolated field, which is a
+//  convex combination of the corner values. The gradient bound of a cell
+//  is the root sum of squares of its largest differences along rho, z
+//  and phi (as arc length at the cell's inner radius) over the grid
+//  spacing. That bounds the derivative of the trilinear interpolant in
+//  any direction, except in cells on the axis, where the arc length is
+//  taken at the outer radius and the bound is an estimate.
+//
+
+#include "magfieldpyramid.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldlog.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+//the nodes of one level filled by one thread
+typedef struct pyramidwork {
+    MagneticFieldPtr fieldPtr;
+    FieldPyramidPtr pyramidPtr;
+    int level;
+    size_t start;
+    size_t end;
+} PyramidWork;
+
+//a query in units of base blocks
+typedef struct blockrange {
+    unsigned int lo[3];
+    unsigned int hi[3];
+} BlockRange;
+
+static volatile bool fieldPyramids = false;
+
+//local prototypes
+static void *fillNodes(void *);
+static void fillBlock(MagneticFieldPtr, FieldPyramidPtr, unsigned int, unsigned int, unsigned int, FieldExtrema *);
+static double cellGradient(MagneticFieldPtr, unsigned int, unsigned int, unsigned int);
+static void combineChildren(FieldPyramidPtr, int, unsigned int, unsigned int, unsigned int, FieldExtrema *);
+static double differenceSquared(FieldValuePtr, FieldValuePtr);
+static void merge(FieldExtrema *, const FieldExtrema *);
+static bool toBlockRange(MagneticFieldPtr, const double *, const double *, BlockRange *, bool *);
+static void visitRange(FieldPyramidPtr, int, unsigned int, unsigned int, unsigned int, const BlockRange *,
+                       FieldExtrema *);
+static int visitAbove(MagneticFieldPtr, int, unsigned int, unsigned int, unsigned int, int, double,
+                      FieldRegionCallback, void *);
+static bool queryGrid(MagneticFieldPtr, const double *, const double *, FieldExtrema *, bool *);
+static int phiIntervals(MagneticFieldPtr, double, double, double *);
+static double foldedPhi(double);
+static void scaleExtrema(FieldExtrema *, double);
+static FieldExtrema *nodeAt(FieldPyramidPtr, int, unsigned int, unsigned int, unsigned int);
+
+/**
+ * Pick up the pyramid option from the CMAG_FIELD_PYRAMID environment
+ * variable (any value but 0) when the library is loaded.
+ */
+__attribute__((constructor))
+static void initFieldPyramids() {
+    const char *env = getenv("CMAG_FIELD_PYRAMID");
+    if ((env != NULL) && (strcmp(env, "0") != 0)) {
+        fieldPyramids = true;
+    }
+}
+
+/**
+ * Set whether field maps read from now on get a min/max pyramid. It
+ * costs about 1.7 bytes per field value and a pass over the values at
+ * load time. It is off by default; buildFieldPyramid adds one later.
+ * @param build true to build pyramids.
+ */
+void setFieldPyramids(bool build) {
+    fieldPyramids = build;
+}
+
+/**
+ * Get whether field maps get a min/max pyramid when read.
+ * @return true if they do.
+ */
+bool getFieldPyramids() {
+    return fieldPyramids;
+}
+
+/**
+ * Build the min/max pyramid of a map, replacing any it has. Each level is
+ * filled in parallel.
+ * @param fieldPtr the field map.
+ * @param numThreads the threads to build with. If less than 1, one per
+ * online processor.
+ * @return true on success.
+ */
+bool buildFieldPyramid(MagneticFieldPtr fieldPtr, int numThreads) {
+    FieldPyramidPtr pyramidPtr = (FieldPyramidPtr) malloc(sizeof(FieldPyramid));
+    if (pyramidPtr == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory building a field pyramid\n");
+        return false;
+    }
+
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    for (int d = 0; d < 3; d++) {
+        pyramidPtr->cells[d] = (grids[d]->num > 1) ? grids[d]->num - 1 : 1;
+        pyramidPtr->dims[0][d] = (pyramidPtr->cells[d] + CMAG_PYRAMID_BLOCK - 1) / CMAG_PYRAMID_BLOCK;
+    }
+
+    //halve every dimension until there is a single node
+    int level = 0;
+    pyramidPtr->offsets[0] = 0;
+    pyramidPtr->numNodes = 0;
+    while (true) {
+        unsigned int *dims = pyramidPtr->dims[level];
+        pyramidPtr->numNodes += (size_t) dims[0] * dims[1] * dims[2];
+        if ((dims[0] == 1) && (dims[1] == 1) && (dims[2] == 1)) {
+            break;
+        }
+        level++;
+        for (int d = 0; d < 3; d++) {
+            pyramidPtr->dims[level][d] = (dims[d] + 1) / 2;
+        }
+        pyramidPtr->offsets[level] = pyramidPtr->numNodes;
+    }
+    pyramidPtr->numLevels = level + 1;
+
+    pyramidPtr->nodes = (FieldExtrema *) malloc(pyramidPtr->numNodes * sizeof(FieldExtrema));
+    if (pyramidPtr->nodes == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory building a field pyramid\n");
+        free(pyramidPtr);
+        return false;
+    }
+
+    numThreads = numWorkers(numThreads, pyramidPtr->numNodes);
+    PyramidWork work[numThreads];
+
+    //each level is read by the next, so the workers finish between levels
+    for (level = 0; level < pyramidPtr->numLevels; level++) {
+        unsigned int *dims = pyramidPtr->dims[level];
+        size_t levelNodes = (size_t) dims[0] * dims[1] * dims[2];
+        for (int i = 0; i < numThreads; i++) {
+            work[i].fieldPtr = fieldPtr;
+            work[i].pyramidPtr = pyramidPtr;
+            work[i].level = level;
+            work[i].start = (levelNodes * i) / numThreads;
+            work[i].end = (levelNodes * (i + 1)) / numThreads;
+        }
+        runWorkers(fillNodes, work, sizeof(PyramidWork), numThreads);
+    }
+
+    freeFieldPyramid(fieldPtr);
+    fieldPtr->pyramidPtr = pyramidPtr;
+    LOG_DEBUG("built a %d level field pyramid for [%s]", pyramidPtr->numLevels, fieldPtr->name);
+    return true;
+}
+
+/**
+ * Free the min/max pyramid of a map, if it has one.
+ * @param fieldPtr the field map.
+ */
+void freeFieldPyramid(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->pyramidPtr != NULL) {
+        free(fieldPtr->pyramidPtr->nodes);
+        free(fieldPtr->pyramidPtr);
+        fieldPtr->pyramidPtr = NULL;
+    }
+}
+
+/**
+ * Get the extremes of a map over a box in the coordinates of its grid,
+ * to the resolution of the base blocks of its pyramid (so the bounds may
+ * cover a little more than the box). The phi range is ignored for a
+ * solenoid.
+ * @param fieldPtr the field map, which must have a pyramid.
+ * @param phiMin the box in degrees, cm and cm.
+ * @param phiMax
+ * @param rhoMin
+ * @param rhoMax
+ * @param zMin
+ * @param zMax
+ * @param extremaPtr upon return, the extremes scaled by the map's scale
+ * factor. The minimum is 0 if the box reaches outside the grid, where the
+ * field is zero.
+ * @return false if the map has no pyramid.
+ */
+bool getGridExtrema(MagneticFieldPtr fieldPtr, double phiMin, double phiMax, double rhoMin, double rhoMax,
+                    double zMin, double zMax, FieldExtrema *extremaPtr) {
+    if (fieldPtr->pyramidPtr == NULL) {
+        return false;
+    }
+
+    double lo[3] = {phiMin, rhoMin, zMin};
+    double hi[3] = {phiMax, rhoMax, zMax};
+    bool outside;
+    extremaPtr->minField = FLT_MAX;
+    extremaPtr->maxField = 0;
+    extremaPtr->maxGradient = 0;
+
+    if (!queryGrid(fieldPtr, lo, hi, extremaPtr, &outside) || outside) {
+        extremaPtr->minField = 0;
+    }
+    scaleExtrema(extremaPtr, fieldPtr->scale);
+    return true;
+}
+
+/**
+ * Get the extremes of a map over a box in lab coordinates, allowing for
+ * the map's shifts, symmetry and scale. The box is converted to the
+ * smallest (phi, rho, z) box around it, so the bounds are conservative.
+ * @param fieldPtr the field map, which must have a pyramid.
+ * @param boxMin the low corner of the box, x, y and z in cm.
+ * @param boxMax the high corner of the box.
+ * @param extremaPtr upon return, the extremes. The minimum is 0 if the
+ * box reaches outside the map.
+ * @return false if the map has no pyramid.
+ */
+bool getFieldExtrema(MagneticFieldPtr fieldPtr, const double *boxMin, const double *boxMax,
+                     FieldExtrema *extremaPtr) {
+    if (fieldPtr->pyramidPtr == NULL) {
+        return false;
+    }
+
+    double x0 = boxMin[0] - fieldPtr->shiftX, x1 = boxMax[0] - fieldPtr->shiftX;
+    double y0 = boxMin[1] - fieldPtr->shiftY, y1 = boxMax[1] - fieldPtr->shiftY;
+
+    //the nearest and farthest points of the box from the beam line
+    double xNear = (x0 > 0) ? x0 : ((x1 < 0) ? x1 : 0);
+    double yNear = (y0 > 0) ? y0 : ((y1 < 0) ? y1 : 0);
+    double xFar = fmax(fabs(x0), fabs(x1));
+    double yFar = fmax(fabs(y0), fabs(y1));
+
+    double lo[3] = {0, hypot(xNear, yNear), boxMin[2] - fieldPtr->shiftZ};
+    double hi[3] = {0, hypot(xFar, yFar), boxMax[2] - fieldPtr->shiftZ};
+
+    //the azimuths the box subtends, less than 180 degrees unless it holds the beam line
+    double phiLo = -180, phiHi = 180;
+    if ((xNear != 0) || (yNear != 0)) {
+        double center = toDegrees(atan2(0.5 * (y0 + y1), 0.5 * (x0 + x1)));
+        double xs[4] = {x0, x1, x0, x1}, ys[4] = {y0, y0, y1, y1};
+        double devLo = 0, devHi = 0;
+        for (int i = 0; i < 4; i++) {
+            double dev = remainder(toDegrees(atan2(ys[i], xs[i])) - center, 360.0);
+            devLo = fmin(devLo, dev);
+            devHi = fmax(devHi, dev);
+        }
+        phiLo = center + devLo;
+        phiHi = center + devHi;
+    }
+
+    double intervals[4];
+    int numIntervals = phiIntervals(fieldPtr, phiLo, phiHi, intervals);
+
+    extremaPtr->minField = FLT_MAX;
+    extremaPtr->maxField = 0;
+    extremaPtr->maxGradient = 0;
+    bool found = false, outside = false;
+
+    for (int i = 0; i < numIntervals; i++) {
+        bool out;
+        lo[0] = intervals[2 * i];
+        hi[0] = intervals[2 * i + 1];
+        found = queryGrid(fieldPtr, lo, hi, extremaPtr, &out) || found;
+        outside = outside || out;
+    }
+
+    if (!found || outside) {
+        extremaPtr->minField = 0;
+    }
+    scaleExtrema(extremaPtr, fieldPtr->scale);
+    return true;
+}
+
+/**
+ * The longest step, up to a maximum, over which the field can change by
+ * no more than a given amount, from the gradient bound of the pyramid in
+ * a cube around the point. Steppers can take long steps in quiet regions
+ * and fall back to short ones near the coils.
+ * @param fieldPtr the field map, which must have a pyramid.
+ * @param x the point in cm.
+ * @param y
+ * @param z
+ * @param maxStep the longest step wanted in cm.
+ * @param maxChange the largest change of the field allowed over a step, kG.
+ * @return the step length in cm, or -1 if the map has no pyramid.
+ */
+double safeStepLength(MagneticFieldPtr fieldPtr, double x, double y, double z, double maxStep, double maxChange) {
+    if (fieldPtr->pyramidPtr == NULL) {
+        return -1;
+    }
+
+    FieldExtrema extrema;
+    double step = maxStep;
+    double best = 0;
+
+    //shrinking the cube can only lower the bound, so maxChange / gradient is
+    //always safe; a few rounds find a longer step where the cube gets quieter
+    for (int round = 0; round < 4; round++) {
+        double boxMin[3] = {x - step, y - step, z - step};
+        double boxMax[3] = {x + step, y + step, z + step};
+        getFieldExtrema(fieldPtr, boxMin, boxMax, &extrema);
+
+        bool safe = (extrema.maxGradient * step <= maxChange);
+        best = fmax(best, safe ? step : maxChange / extrema.maxGradient);
+
+        double next = (extrema.maxGradient > 0) ? fmin(maxStep, maxChange / extrema.maxGradient) : maxStep;
+        if (safe && (next <= step)) {
+            break;
+        }
+        step = next;
+    }
+    return best;
+}
+
+/**
+ * Find the regions of a map where |B| may exceed a threshold: the nodes
+ * of one level of the pyramid whose maximum is at least the threshold.
+ * Level 0 gives blocks of CMAG_PYRAMID_BLOCK cells per side; each level
+ * up doubles the size.
+ * @param fieldPtr the field map, which must have a pyramid.
+ * @param threshold the threshold in kG, after scaling.
+ * @param level the level of the regions, clamped to the levels there are.
+ * @param callback called with each region, in grid order. May be NULL to
+ * just count them.
+ * @param data passed to the callback.
+ * @return the number of regions, or -1 if the map has no pyramid.
+ */
+int findFieldRegions(MagneticFieldPtr fieldPtr, double threshold, int level, FieldRegionCallback callback,
+                     void *data) {
+    FieldPyramidPtr pyramidPtr = fieldPtr->pyramidPtr;
+    if (pyramidPtr == NULL) {
+        return -1;
+    }
+    level = (level < 0) ? 0 : ((level >= pyramidPtr->numLevels) ? pyramidPtr->numLevels - 1 : level);
+    return visitAbove(fieldPtr, pyramidPtr->numLevels - 1, 0, 0, 0, level, threshold, callback, data);
+}
+
+/**
+ * The body of a build thread: fill a run of the nodes of one level.
+ * @param arg the PyramidWork.
+ * @return NULL.
+ */
+static void *fillNodes(void *arg) {
+    PyramidWork *work = (PyramidWork *) arg;
+    FieldPyramidPtr pyramidPtr = work->pyramidPtr;
+    unsigned int *dims = pyramidPtr->dims[work->level];
+    FieldExtrema *nodes = pyramidPtr->nodes + pyramidPtr->offsets[work->level];
+
+    for (size_t n = work->start; n < work->end; n++) {
+        unsigned int k = (unsigned int) (n % dims[2]);
+        unsigned int j = (unsigned int) ((n / dims[2]) % dims[1]);
+        unsigned int i = (unsigned int) (n / ((size_t) dims[1] * dims[2]));
+        if (work->level == 0) {
+            fillBlock(work->fieldPtr, pyramidPtr, i, j, k, nodes + n);
+        } else {
+            combineChildren(pyramidPtr, work->level, i, j, k, nodes + n);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Summarize a base block from the field values.
+ * @param fieldPtr the field map.
+ * @param pyramidPtr the pyramid.
+ * @param i the block indices in phi, rho and z.
+ * @param j
+ * @param k
+ * @param nodePtr will hold the summary.
+ */
+static void fillBlock(MagneticFieldPtr fieldPtr, FieldPyramidPtr pyramidPtr, unsigned int i, unsigned int j,
+                      unsigned int k, FieldExtrema *nodePtr) {
+    unsigned int index[3] = {i, j, k};
+    unsigned int nums[3] = {fieldPtr->phiGridPtr->num, fieldPtr->rhoGridPtr->num, fieldPtr->zGridPtr->num};
+    unsigned int first[3], last[3];
+
+    //the grid points of the block, and its cells (first[d]..last[d]-1)
+    for (int d = 0; d < 3; d++) {
+        first[d] = index[d] * CMAG_PYRAMID_BLOCK;
+        last[d] = first[d] + CMAG_PYRAMID_BLOCK;
+        last[d] = (last[d] > pyramidPtr->cells[d]) ? pyramidPtr->cells[d] : last[d];
+        last[d] = (nums[d] > 1) ? last[d] : 0;
+    }
+
+    double minField = DBL_MAX, maxField = 0, maxGradient = 0;
+    for (unsigned int ip = first[0]; ip <= last[0]; ip++) {
+        for (unsigned int ir = first[1]; ir <= last[1]; ir++) {
+            for (unsigned int iz = first[2]; iz <= last[2]; iz++) {
+                double magnitude = fieldMagnitude(fieldPtr->fieldValues + getCompositeIndex(fieldPtr, ip, ir, iz));
+                minField = fmin(minField, magnitude);
+                maxField = fmax(maxField, magnitude);
+
+                bool cell = ((ip < last[0]) || (nums[0] == 1)) && (ir < last[1]) && (iz < last[2]);
+                if (cell) {
+                    maxGradient = fmax(maxGradient, cellGradient(fieldPtr, ip, ir, iz));
+                }
+            }
+        }
+    }
+
+    nodePtr->minField = (float) minField;
+    nodePtr->maxField = (float) maxField;
+    nodePtr->maxGradient = (float) maxGradient;
+}
+
+/**
+ * A bound on the derivative, in any direction, of the field interpolated
+ * in one cell.
+ * @param fieldPtr the field map.
+ * @param ip the indices of the cell's low corner.
+ * @param ir
+ * @param iz
+ * @return the bound in kG/cm, unscaled.
+ */
+static double cellGradient(MagneticFieldPtr fieldPtr, unsigned int ip, unsigned int ir, unsigned int iz) {
+    FieldValuePtr values = fieldPtr->fieldValues;
+    bool threeD = (fieldPtr->phiGridPtr->num > 1);
+    int numPhi = threeD ? 2 : 1;
+
+    double rhoIn = valueAtIndex(fieldPtr->rhoGridPtr, ir);
+    if (rhoIn <= 0) {
+        rhoIn = valueAtIndex(fieldPtr->rhoGridPtr, ir + 1);
+    }
+
+    double dRho = 0, dZ = 0, dPhi = 0;
+    for (int a = 0; a < numPhi; a++) {
+        for (int b = 0; b < 2; b++) {
+            FieldValuePtr v = values + getCompositeIndex(fieldPtr, ip + a, ir + b, iz);
+            FieldValuePtr vz = values + getCompositeIndex(fieldPtr, ip + a, ir + b, iz + 1);
+            FieldValuePtr vr = values + getCompositeIndex(fieldPtr, ip + a, ir + 1, iz + b);
+            FieldValuePtr v0 = values + getCompositeIndex(fieldPtr, ip + a, ir, iz + b);
+
+            dZ = fmax(dZ, differenceSquared(vz, v));
+            dRho = fmax(dRho, differenceSquared(vr, v0));
+
+            if (threeD) {
+                FieldValuePtr w0 = values + getCompositeIndex(fieldPtr, ip, ir + a, iz + b);
+                FieldValuePtr w1 = values + getCompositeIndex(fieldPtr, ip + 1, ir + a, iz + b);
+                dPhi = fmax(dPhi, differenceSquared(w1, w0));
+            } else {
+                //a 2D map turns with phi: the derivative along the arc is Brho / rho
+                dPhi = fmax(dPhi, v->b2 * v->b2);
+                dPhi = fmax(dPhi, vz->b2 * vz->b2);
+            }
+        }
+    }
+
+    //the differences are squared, so are the spacings
+    double arc = threeD ? rhoIn * toRadians(fieldPtr->phiGridPtr->delta) : rhoIn;
+    double rhoDelta = fieldPtr->rhoGridPtr->delta;
+    double zDelta = fieldPtr->zGridPtr->delta;
+    return sqrt(dRho / (rhoDelta * rhoDelta) + dZ / (zDelta * zDelta) + dPhi / (arc * arc));
+}
+
+/**
+ * Summarize a node from its (up to) eight children on the level below.
+ * @param pyramidPtr the pyramid.
+ * @param level the level of the node, at least 1.
+ * @param i the node indices.
+ * @param j
+ * @param k
+ * @param nodePtr will hold the summary.
+ */
+static void combineChildren(FieldPyramidPtr pyramidPtr, int level, unsigned int i, unsigned int j,
+                            unsigned int k, FieldExtrema *nodePtr) {
+    unsigned int *below = pyramidPtr->dims[level - 1];
+    nodePtr->minField = FLT_MAX;
+    nodePtr->maxField = 0;
+    nodePtr->maxGradient = 0;
+
+    for (unsigned int a = 2 * i; (a <= 2 * i + 1) && (a < below[0]); a++) {
+        for (unsigned int b = 2 * j; (b <= 2 * j + 1) && (b < below[1]); b++) {
+            for (unsigned int c = 2 * k; (c <= 2 * k + 1) && (c < below[2]); c++) {
+                merge(nodePtr, nodeAt(pyramidPtr, level - 1, a, b, c));
+            }
+        }
+    }
+}
+
+/**
+ * The square of the magnitude of the difference of two field values.
+ * @param a the first value.
+ * @param b the second value.
+ * @return |a - b|^2.
+ */
+static double differenceSquared(FieldValuePtr a, FieldValuePtr b) {
+    double d1 = a->b1 - b->b1;
+    double d2 = a->b2 - b->b2;
+    double d3 = a->b3 - b->b3;
+    return d1 * d1 + d2 * d2 + d3 * d3;
+}
+
+/**
+ * Merge one summary into another.
+ * @param dest the summary to grow.
+ * @param src the summary merged in.
+ */
+static void merge(FieldExtrema *dest, const FieldExtrema *src) {
+    dest->minField = fminf(dest->minField, src->minField);
+    dest->maxField = fmaxf(dest->maxField, src->maxField);
+    dest->maxGradient = fmaxf(dest->maxGradient, src->maxGradient);
+}
+
+/**
+ * Convert a box in grid coordinates to the range of base blocks it touches.
+ * @param fieldPtr the field map.
+ * @param lo the low corner, phi, rho and z.
+ * @param hi the high corner.
+ * @param rangePtr will hold the blocks.
+ * @param outside set true if the box reaches outside the grid.
+ * @return false if the box misses the grid.
+ */
+static bool toBlockRange(MagneticFieldPtr fieldPtr, const double *lo, const double *hi, BlockRange *rangePtr,
+                         bool *outside) {
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    FieldPyramidPtr pyramidPtr = fieldPtr->pyramidPtr;
+    *outside = false;
+
+    for (int d = 0; d < 3; d++) {
+        GridPtr gridPtr = grids[d];
+        if (gridPtr->num < 2) {
+            rangePtr->lo[d] = 0;
+            rangePtr->hi[d] = 0;
+            continue;
+        }
+        if ((hi[d] < gridPtr->minVal) || (lo[d] > gridPtr->maxVal) || (hi[d] < lo[d])) {
+            return false;
+        }
+        *outside = *outside || (lo[d] < gridPtr->minVal) || (hi[d] > gridPtr->maxVal);
+
+        unsigned int cells = pyramidPtr->cells[d];
+        double cLo = floor((fmax(lo[d], gridPtr->minVal) - gridPtr->minVal) / gridPtr->delta);
+        double cHi = floor((fmin(hi[d], gridPtr->maxVal) - gridPtr->minVal) / gridPtr->delta);
+        cLo = fmin(fmax(cLo, 0), cells - 1);
+        cHi = fmin(fmax(cHi, 0), cells - 1);
+        rangePtr->lo[d] = (unsigned int) cLo / CMAG_PYRAMID_BLOCK;
+        rangePtr->hi[d] = (unsigned int) cHi / CMAG_PYRAMID_BLOCK;
+    }
+    return true;
+}
+
+/**
+ * Merge in the summaries of a node, or of its descendants that touch a
+ * range of base blocks. The node must touch the range.
+ * @param pyramidPtr the pyramid.
+ * @param level the node's level.
+ * @param i the node indices.
+ * @param j
+ * @param k
+ * @param rangePtr the range of base blocks.
+ * @param extremaPtr the summary to grow.
+ */
+static void visitRange(FieldPyramidPtr pyramidPtr, int level, unsigned int i, unsigned int j, unsigned int k,
+                       const BlockRange *rangePtr, FieldExtrema *extremaPtr) {
+    //nothing below a node can widen the summary if the node itself cannot
+    FieldExtrema *nodePtr = nodeAt(pyramidPtr, level, i, j, k);
+    if ((nodePtr->minField >= extremaPtr->minField) && (nodePtr->maxField <= extremaPtr->maxField) &&
+        (nodePtr->maxGradient <= extremaPtr->maxGradient)) {
+        return;
+    }
+
+    //the children that overlap the range; the node is inside it if they all are
+    unsigned int index[3] = {i, j, k};
+    unsigned int first[3], last[3];
+    bool inside = true;
+
+    for (int d = 0; d < 3; d++) {
+        unsigned long nodeFirst = (unsigned long) index[d] << level;
+        unsigned long nodeLast = (((unsigned long) index[d] + 1) << level) - 1;
+        nodeLast = (nodeLast >= pyramidPtr->dims[0][d]) ? pyramidPtr->dims[0][d] - 1 : nodeLast;
+        inside = inside && (nodeFirst >= rangePtr->lo[d]) && (nodeLast <= rangePtr->hi[d]);
+
+        if (level > 0) {
+            unsigned int lo = rangePtr->lo[d] >> (level - 1);
+            unsigned int hi = rangePtr->hi[d] >> (level - 1);
+            first[d] = (2 * index[d] > lo) ? 2 * index[d] : lo;
+            last[d] = (2 * index[d] + 1 < hi) ? 2 * index[d] + 1 : hi;
+            last[d] = (last[d] >= pyramidPtr->dims[level - 1][d]) ? pyramidPtr->dims[level - 1][d] - 1 : last[d];
+        }
+    }
+
+    if (inside || (level == 0)) {
+        merge(extremaPtr, nodePtr);
+        return;
+    }
+
+    for (unsigned int a = first[0]; a <= last[0]; a++) {
+        for (unsigned int b = first[1]; b <= last[1]; b++) {
+            for (unsigned int c = first[2]; c <= last[2]; c++) {
+                visitRange(pyramidPtr, level - 1, a, b, c, rangePtr, extremaPtr);
+            }
+        }
+    }
+}
+
+/**
+ * Report the nodes of a level, under a node, whose maximum reaches a
+ * threshold.
+ * @param fieldPtr the field map.
+ * @param level the node's level.
+ * @param i the node indices.
+ * @param j
+ * @param k
+ * @param target the level of the regions.
+ * @param threshold the threshold in kG, after scaling.
+ * @param callback called with each region, may be NULL.
+ * @param data passed to the callback.
+ * @return the number of regions found.
+ */
+static int visitAbove(MagneticFieldPtr fieldPtr, int level, unsigned int i, unsigned int j, unsigned int k,
+                      int target, double threshold, FieldRegionCallback callback, void *data) {
+    FieldPyramidPtr pyramidPtr = fieldPtr->pyramidPtr;
+    FieldExtrema *nodePtr = nodeAt(pyramidPtr, level, i, j, k);
+    double scale = fabs(fieldPtr->scale);
+
+    if (nodePtr->maxField * scale < threshold) {
+        return 0;
+    }
+
+    if (level == target) {
+        if (callback != NULL) {
+            GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+            unsigned int index[3] = {i, j, k};
+            double lo[3], hi[3];
+            for (int d = 0; d < 3; d++) {
+                unsigned long cells = (unsigned long) CMAG_PYRAMID_BLOCK << level;
+                unsigned long first = index[d] * cells;
+                unsigned long last = (first + cells > pyramidPtr->cells[d]) ? pyramidPtr->cells[d] : first + cells;
+                bool flat = (grids[d]->num < 2);
+                lo[d] = grids[d]->minVal + (flat ? 0 : first * grids[d]->delta);
+                hi[d] = flat ? grids[d]->minVal : fmin(grids[d]->maxVal, grids[d]->minVal + last * grids[d]->delta);
+            }
+
+            FieldRegion region = {lo[0], hi[0], lo[1], hi[1], lo[2], hi[2], *nodePtr};
+            scaleExtrema(&(region.extrema), fieldPtr->scale);
+            callback(&region, data);
+        }
+        return 1;
+    }
+
+    int count = 0;
+    unsigned int *below = pyramidPtr->dims[level - 1];
+    for (unsigned int a = 2 * i; (a <= 2 * i + 1) && (a < below[0]); a++) {
+        for (unsigned int b = 2 * j; (b <= 2 * j + 1) && (b < below[1]); b++) {
+            for (unsigned int c = 2 * k; (c <= 2 * k + 1) && (c < below[2]); c++) {
+                count += visitAbove(fieldPtr, level - 1, a, b, c, target, threshold, callback, data);
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Merge the unscaled extremes over a box in grid coordinates.
+ * @param fieldPtr the field map, with a pyramid.
+ * @param lo the low corner, phi, rho and z.
+ * @param hi the high corner.
+ * @param extremaPtr the summary to grow.
+ * @param outside set true if the box reaches outside the grid.
+ * @return false if the box misses the grid.
+ */
+static bool queryGrid(MagneticFieldPtr fieldPtr, const double *lo, const double *hi, FieldExtrema *extremaPtr,
+                      bool *outside) {
+    BlockRange range;
+    if (!toBlockRange(fieldPtr, lo, hi, &range, outside)) {
+        *outside = true;
+        return false;
+    }
+    visitRange(fieldPtr->pyramidPtr, fieldPtr->pyramidPtr->numLevels - 1, 0, 0, 0, &range, extremaPtr);
+    return true;
+}
+
+/**
+ * Convert a range of lab azimuths to ranges of the phi grid of a map.
+ * @param fieldPtr the field map.
+ * @param phiLo the lab range in degrees, less than 360 wide.
+ * @param phiHi
+ * @param intervals will hold up to two [lo, hi] pairs.
+ * @return the number of pairs.
+ */
+static int phiIntervals(MagneticFieldPtr fieldPtr, double phiLo, double phiHi, double *intervals) {
+    GridPtr phiGridPtr = fieldPtr->phiGridPtr;
+    double width = phiHi - phiLo;
+
+    if ((phiGridPtr->num < 2) || (width >= 360)) {
+        intervals[0] = phiGridPtr->minVal;
+        intervals[1] = phiGridPtr->maxVal;
+        return 1;
+    }
+
+    if (fieldPtr->symmetric) {
+        //|phi relative to the sector midplane| is a triangle wave of period 60
+        double lo = fmin(foldedPhi(phiLo), foldedPhi(phiHi));
+        double hi = fmax(foldedPhi(phiLo), foldedPhi(phiHi));
+        if ((width >= 60) || (60 * floor(phiHi / 60) > phiLo)) {
+            lo = 0;
+        }
+        if ((width >= 60) || (60 * floor((phiHi - 30) / 60) + 30 > phiLo)) {
+            hi = 30;
+        }
+        intervals[0] = lo;
+        intervals[1] = hi;
+        return 1;
+    }
+
+    //a full map covers [0, 360]; a range across 0 becomes two
+    double start = phiLo - 360 * floor(phiLo / 360);
+    intervals[0] = start;
+    intervals[1] = fmin(start + width, 360);
+    if (start + width <= 360) {
+        return 1;
+    }
+    intervals[2] = 0;
+    intervals[3] = start + width - 360;
+    return 2;
+}
+
+/**
+ * The phi of a symmetric map at a lab azimuth.
+ * @param phi the lab azimuth in degrees.
+ * @return the map phi in [0, 30].
+ */
+static double foldedPhi(double phi) {
+    return fabs(relativePhi(phi - 360 * floor(phi / 360)));
+}
+
+/**
+ * Apply a map's scale factor to a summary.
+ * @param extremaPtr the summary.
+ * @param scale the scale factor.
+ */
+static void scaleExtrema(FieldExtrema *extremaPtr, double scale) {
+    scale = fabs(scale);
+    extremaPtr->minField = (float) (extremaPtr->minField * scale);
+    extremaPtr->maxField = (float) (extremaPtr->maxField * scale);
+    extremaPtr->maxGradient = (float) (extremaPtr->maxGradient * scale);
+}
+
+/**
+ * A node of the pyramid.
+ * @param pyramidPtr the pyramid.
+ * @param level the level.
+ * @param i the indices in phi, rho and z.
+ * @param j
+ * @param k
+ * @return the node.
+ */
+static FieldExtrema *nodeAt(FieldPyramidPtr pyramidPtr, int level, unsigned int i, unsigned int j, unsigned int k) {
+    unsigned int *dims = pyramidPtr->dims[level];
+    return pyramidPtr->nodes + pyramidPtr->offsets[level] + ((size_t) i * dims[1] + j) * dims[2] + k;
+}
+
+//counts regions and checks them against a threshold, for the unit test
+typedef struct regioncount {
+    double threshold;
+    int count;
+    int below;
+    double maxField;
+} RegionCount;
+
+/**
+ * Count a region found by the unit test.
+ * @param regionPtr the region.
+ * @param data the RegionCount.
+ */
+static void countRegion(const FieldRegion *regionPtr, void *data) {
+    RegionCount *countPtr = (RegionCount *) data;
+    countPtr->count++;
+    countPtr->below += (regionPtr->extrema.maxField < countPtr->threshold) ? 1 : 0;
+    countPtr->maxField = fmax(countPtr->maxField, regionPtr->extrema.maxField);
+}
+
+/**
+ * A unit test of the pyramid of the test field: threaded builds match, box
+ * queries match a scan of the base blocks and bound the field and its
+ * differences at random points, step lengths respect the bound, and the
+ * regions above a threshold are exactly the blocks above it.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *pyramidUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    bool hadPyramid = (fieldPtr->pyramidPtr != NULL);
+    FieldPyramidPtr saved = fieldPtr->pyramidPtr;
+    fieldPtr->pyramidPtr = NULL;
+
+    FieldExtrema extrema;
+    double origin[3] = {0, 0, 0};
+    mu_assert("A map without a pyramid answered a query", !getFieldExtrema(fieldPtr, origin, origin, &extrema));
+
+    mu_assert("Could not build the serial pyramid", buildFieldPyramid(fieldPtr, 1));
+    FieldPyramidPtr serialPtr = fieldPtr->pyramidPtr;
+    fieldPtr->pyramidPtr = NULL;
+    mu_assert("Could not build the threaded pyramid", buildFieldPyramid(fieldPtr, 3));
+    FieldPyramidPtr pyramidPtr = fieldPtr->pyramidPtr;
+    mu_assert("The threaded pyramid differs from the serial one", (serialPtr->numNodes == pyramidPtr->numNodes) &&
+              (memcmp(serialPtr->nodes, pyramidPtr->nodes, pyramidPtr->numNodes * sizeof(FieldExtrema)) == 0));
+    free(serialPtr->nodes);
+    free(serialPtr);
+
+    //the top node summarizes the whole map
+    FieldExtrema *top = nodeAt(pyramidPtr, pyramidPtr->numLevels - 1, 0, 0, 0);
+    mu_assert("The top of the pyramid misses the largest field",
+              top->maxField == (float) fieldPtr->metricsPtr->maxFieldMagnitude);
+
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    double maxField = fieldPtr->metricsPtr->maxFieldMagnitude;
+    double slack = 1.0e-4 * (1 + maxField);
+
+    //grid boxes agree with a scan of the base blocks they touch
+    for (int trial = 0; trial < 200; trial++) {
+        double lo[3], hi[3];
+        for (int d = 0; d < 3; d++) {
+            double a = randomDouble(grids[d]->minVal, grids[d]->maxVal);
+            double b = randomDouble(grids[d]->minVal, grids[d]->maxVal);
+            lo[d] = fmin(a, b);
+            hi[d] = (trial % 2) ? fmin(fmax(a, b), lo[d] + 6 * grids[d]->delta) : fmax(a, b);
+        }
+        getGridExtrema(fieldPtr, lo[0], hi[0], lo[1], hi[1], lo[2], hi[2], &extrema);
+
+        BlockRange range;
+        bool outside;
+        toBlockRange(fieldPtr, lo, hi, &range, &outside);
+        FieldExtrema scan = {FLT_MAX, 0, 0};
+        for (unsigned int i = range.lo[0]; i <= range.hi[0]; i++) {
+            for (unsigned int j = range.lo[1]; j <= range.hi[1]; j++) {
+                for (unsigned int k = range.lo[2]; k <= range.hi[2]; k++) {
+                    merge(&scan, nodeAt(pyramidPtr, 0, i, j, k));
+                }
+            }
+        }
+        scaleExtrema(&scan, fieldPtr->scale);
+        mu_assert("A grid box differs from a scan of its blocks", (extrema.minField == scan.minField) &&
+                  (extrema.maxField == scan.maxField) && (extrema.maxGradient == scan.maxGradient));
+    }
+
+    //lab boxes bound |B| and its differences inside them. Boxes keep off the
+    //axis, where the gradient is only an estimate, and inside the grid, where
+    //the field drops to zero
+    double rhoMin = 3 * grids[1]->delta + grids[1]->minVal;
+    double rhoMax = grids[1]->maxVal;
+    for (int trial = 0; trial < 300; trial++) {
+        double half = randomDouble(0.5, 10);
+        double rho = randomDouble(rhoMin + 1.5 * half, rhoMax - 1.5 * half);
+        double phi = randomDouble(0, 360);
+        double z = randomDouble(grids[2]->minVal + half, grids[2]->maxVal - half);
+        double center[3];
+        cylindricalToCartesian(center, center + 1, phi, rho);
+        center[0] += fieldPtr->shiftX;
+        center[1] += fieldPtr->shiftY;
+        center[2] = z + fieldPtr->shiftZ;
+
+        double boxMin[3] = {center[0] - half, center[1] - half, center[2] - half};
+        double boxMax[3] = {center[0] + half, center[1] + half, center[2] + half};
+        getFieldExtrema(fieldPtr, boxMin, boxMax, &extrema);
+
+        for (int n = 0; n < 20; n++) {
+            double p[3], q[3];
+            for (int d = 0; d < 3; d++) {
+                p[d] = randomDouble(boxMin[d], boxMax[d]);
+                q[d] = randomDouble(boxMin[d], boxMax[d]);
+            }
+            FieldValue bp = fieldValueAt(p[0], p[1], p[2], fieldPtr);
+            FieldValue bq = fieldValueAt(q[0], q[1], q[2], fieldPtr);
+            double distance = hypot(hypot(p[0] - q[0], p[1] - q[1]), p[2] - q[2]);
+            double change = hypot(hypot(bp.b1 - bq.b1, bp.b2 - bq.b2), bp.b3 - bq.b3);
+            mu_assert("A field value exceeds the maximum of its box", fieldMagnitude(&bp) <= extrema.maxField + slack);
+            mu_assert("A field difference exceeds the gradient bound of its box",
+                      change <= extrema.maxGradient * distance * (1 + 1.0e-4) + slack);
+        }
+    }
+
+    //a lab box across a sector plane, or across phi = 0, covers the grid
+    //points on the plane, at the far ends of the phi grid of the map
+    for (int trial = 0; trial < 100; trial++) {
+        double planes[4] = {0, 30, 60, 90};
+        double plane = planes[trial % 4];
+        double rho = randomDouble(rhoMin + 20, rhoMax - 20);
+        double z = randomDouble(grids[2]->minVal + 5, grids[2]->maxVal - 5);
+        double half = 0.5 + 0.1 * rho * toRadians(4 * CMAG_PYRAMID_BLOCK * fmax(grids[0]->delta, 1));
+        double center[3];
+        cylindricalToCartesian(center, center + 1, plane, rho);
+        double boxMin[3] = {center[0] + fieldPtr->shiftX - half, center[1] + fieldPtr->shiftY - half,
+                            z + fieldPtr->shiftZ - 1};
+        double boxMax[3] = {center[0] + fieldPtr->shiftX + half, center[1] + fieldPtr->shiftY + half,
+                            z + fieldPtr->shiftZ + 1};
+        getFieldExtrema(fieldPtr, boxMin, boxMax, &extrema);
+
+        double gridPhi = fieldPtr->symmetric ? foldedPhi(plane) : plane;
+        for (int end = 0; end < 2; end++) {
+            FieldExtrema inner;
+            getGridExtrema(fieldPtr, gridPhi, gridPhi, rho, rho, z, z, &inner);
+            mu_assert("A lab box misses the grid points on a plane it crosses",
+                      (inner.maxField <= extrema.maxField) && (inner.minField >= extrema.minField) &&
+                      (inner.maxGradient <= extrema.maxGradient));
+            gridPhi = (!fieldPtr->symmetric && (plane == 0)) ? grids[0]->maxVal : gridPhi;
+        }
+    }
+
+    //the synthetic maps are symmetric under phi -> -phi, so make the first
+    //phi slice of a full map stronger to see that a box across phi = 0 reads
+    //the start of the grid as well as the end
+    if (!fieldPtr->symmetric && (grids[0]->num > 2)) {
+        size_t sliceBytes = fieldPtr->N23 * sizeof(FieldValue);
+        FieldValuePtr slice = fieldPtr->fieldValues + fieldPtr->N23;
+        FieldValuePtr original = (FieldValuePtr) malloc(sliceBytes);
+        memcpy(original, slice, sliceBytes);
+        for (size_t i = 0; i < fieldPtr->N23; i++) {
+            slice[i].b1 *= 3;
+            slice[i].b2 *= 3;
+            slice[i].b3 *= 3;
+        }
+        buildFieldPyramid(fieldPtr, 1);
+
+        double boxMin[3] = {rhoMax / 2, -1, grids[2]->minVal};
+        double boxMax[3] = {rhoMax / 2 + 1, 1, grids[2]->maxVal};
+        FieldExtrema inner;
+        getFieldExtrema(fieldPtr, boxMin, boxMax, &extrema);
+        getGridExtrema(fieldPtr, grids[0]->values[1], grids[0]->values[1], rhoMax / 2, rhoMax / 2,
+                       grids[2]->minVal, grids[2]->maxVal, &inner);
+        memcpy(slice, original, sliceBytes);
+        free(original);
+        buildFieldPyramid(fieldPtr, 1);
+        pyramidPtr = fieldPtr->pyramidPtr;
+        top = nodeAt(pyramidPtr, pyramidPtr->numLevels - 1, 0, 0, 0);
+        mu_assert("A lab box across phi = 0 misses the start of the grid", inner.maxField <= extrema.maxField);
+    }
+
+    //a box beyond the map has no field, one across its edge has a minimum of zero
+    double farMin[3] = {0, 0, grids[2]->maxVal + 10 + fieldPtr->shiftZ};
+    double farMax[3] = {1, 1, grids[2]->maxVal + 20 + fieldPtr->shiftZ};
+    getFieldExtrema(fieldPtr, farMin, farMax, &extrema);
+    mu_assert("A box beyond the map has a field", (extrema.maxField == 0) && (extrema.maxGradient == 0));
+    farMin[2] -= 20;
+    getFieldExtrema(fieldPtr, farMin, farMax, &extrema);
+    mu_assert("A box across the edge of the map has a nonzero minimum", extrema.minField == 0);
+
+    //steps respect the bound, and are full length where there is no field
+    for (int trial = 0; trial < 100; trial++) {
+        double x = randomDouble(-rhoMax, rhoMax);
+        double y = randomDouble(-rhoMax, rhoMax);
+        double z = randomDouble(grids[2]->minVal, grids[2]->maxVal);
+        double step = safeStepLength(fieldPtr, x, y, z, 50, 0.01 * (1 + maxField));
+        double boxMin[3] = {x - step, y - step, z - step};
+        double boxMax[3] = {x + step, y + step, z + step};
+        getFieldExtrema(fieldPtr, boxMin, boxMax, &extrema);
+        mu_assert("A step is out of range", (step > 0) && (step <= 50));
+        mu_assert("A step exceeds the allowed change", extrema.maxGradient * step <= 0.01 * (1 + maxField) * 1.000001);
+    }
+    mu_assert("A step far from the map is not full length",
+              safeStepLength(fieldPtr, 0, 0, grids[2]->maxVal + 500 + fieldPtr->shiftZ, 50, 0.01) == 50);
+
+    //the regions above half the largest field are the base blocks above it
+    RegionCount counter = {0.5 * maxField, 0, 0, 0};
+    int found = findFieldRegions(fieldPtr, counter.threshold, 0, countRegion, &counter);
+    int expected = 0;
+    for (size_t n = 0; n < pyramidPtr->offsets[0] + (size_t) pyramidPtr->dims[0][0] * pyramidPtr->dims[0][1] *
+                                                    pyramidPtr->dims[0][2]; n++) {
+        expected += (pyramidPtr->nodes[n].maxField * fabs(fieldPtr->scale) >= counter.threshold) ? 1 : 0;
+    }
+    mu_assert("The regions above a threshold are wrong", (found == expected) && (counter.count == found) &&
+              (counter.below == 0) && (counter.maxField == top->maxField * (float) fabs(fieldPtr->scale)));
+    mu_assert("Coarser regions are not fewer", findFieldRegions(fieldPtr, counter.threshold, 2, NULL, NULL) <= found);
+
+    freeFieldPyramid(fieldPtr);
+    if (hadPyramid) {
+        fieldPtr->pyramidPtr = saved;
+    }
+    fprintf(stdout, "\nPASSED pyramidUnitTest\n");
+    return NULL;
+}
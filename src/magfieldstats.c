@@ -0,0 +1,260 @@
+//
+//  magfieldstats.c
+//  cMag
+//
+//  Per-thread query counters. Each thread claims its own cache-line
+//  padded slot on first use, so counting into it needs no lock or
+//  atomic; the slots are only summed when someone asks for a report.
+//  Threads beyond CMAG_MAX_STATS_SLOTS all count into one shared
+//  overflow slot, and those counts are made with __atomic_fetch_add.
+//  When a thread exits its counts are added to a retired total and its
+//  slot is freed for the next thread, so short lived worker threads never
+//  run out of slots.
+//
+
+#include "magfieldstats.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+//one thread's counters, padded out to a full cache line
+typedef struct statsslot {
+    _Alignas(CMAG_CACHE_LINE) FieldStats stats;
+} StatsSlot;
+
+//a slot per live thread, then the slot shared by threads beyond those
+static StatsSlot slots[CMAG_MAX_STATS_SLOTS + 1];
+#define SHARED_SLOT CMAG_MAX_STATS_SLOTS
+
+//the slots claimed so far, the freed ones among them, and the counts of
+//the threads that freed them, all under the lock
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static int numSlots = 0;
+static int freeSlots[CMAG_MAX_STATS_SLOTS];
+static int numFree = 0;
+static FieldStats retired;
+
+//frees a thread's slot when it exits
+static pthread_key_t slotKey;
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+
+_Thread_local FieldStatsPtr threadStatsPtr = NULL;
+_Thread_local bool threadStatsShared = false;
+
+//local prototypes
+static void createSlotKey(void);
+static void releaseStatsSlot(void *);
+static void addStats(FieldStatsPtr, const FieldStats *);
+
+/**
+ * Claim a counter slot for the calling thread. Called once per thread,
+ * by the STATS_INC macro, the first time the thread counts something.
+ * @return the calling thread's slot.
+ */
+FieldStatsPtr claimStatsSlot() {
+    pthread_once(&slotKeyOnce, createSlotKey);
+
+    pthread_mutex_lock(&statsLock);
+    int index = SHARED_SLOT;
+    if (numFree > 0) {
+        index = freeSlots[--numFree];
+    }
+    else if (numSlots < CMAG_MAX_STATS_SLOTS) {
+        index = numSlots++;
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    threadStatsPtr = &(slots[index].stats);
+    threadStatsShared = (index == SHARED_SLOT);
+
+    //the shared slot is never freed
+    if (!threadStatsShared) {
+        pthread_setspecific(slotKey, threadStatsPtr);
+    }
+    return threadStatsPtr;
+}
+
+/**
+ * Sum the counters over all threads, those that have exited included.
+ * Threads that are still querying may make the result slightly stale,
+ * but never inconsistent enough to matter for a report.
+ * @param totalPtr upon return, holds the aggregate counts.
+ */
+void getFieldStats(FieldStatsPtr totalPtr) {
+    pthread_mutex_lock(&statsLock);
+    *totalPtr = retired;
+    for (int i = 0; i < numSlots; i++) {
+        addStats(totalPtr, &(slots[i].stats));
+    }
+    addStats(totalPtr, &(slots[SHARED_SLOT].stats));
+    pthread_mutex_unlock(&statsLock);
+}
+
+/**
+ * Zero the counters of every thread. Threads keep their slots.
+ */
+void resetFieldStats() {
+    pthread_mutex_lock(&statsLock);
+    memset(&retired, 0, sizeof(FieldStats));
+    for (int i = 0; i < numSlots; i++) {
+        memset(&(slots[i].stats), 0, sizeof(FieldStats));
+    }
+    memset(&(slots[SHARED_SLOT].stats), 0, sizeof(FieldStats));
+    pthread_mutex_unlock(&statsLock);
+}
+
+/**
+ * Create the key whose destructor frees a thread's slot.
+ */
+static void createSlotKey() {
+    pthread_key_create(&slotKey, releaseStatsSlot);
+}
+
+/**
+ * Free an exiting thread's slot, keeping its counts in the retired total.
+ * @param arg the thread's slot.
+ */
+static void releaseStatsSlot(void *arg) {
+    FieldStatsPtr statsPtr = (FieldStatsPtr) arg;
+    StatsSlot *slot = (StatsSlot *) statsPtr;
+
+    pthread_mutex_lock(&statsLock);
+    addStats(&retired, statsPtr);
+    memset(statsPtr, 0, sizeof(FieldStats));
+    freeSlots[numFree++] = (int) (slot - slots);
+    pthread_mutex_unlock(&statsLock);
+
+    //anything counted later in the thread's exit claims a slot again
+    threadStatsPtr = NULL;
+}
+
+/**
+ * Add one set of counters to another.
+ * @param totalPtr the counters added to.
+ * @param statsPtr the counters to add.
+ */
+static void addStats(FieldStatsPtr totalPtr, const FieldStats *statsPtr) {
+    totalPtr->calls += statsPtr->calls;
+    totalPtr->cellHits += statsPtr->cellHits;
+    totalPtr->cellResets += statsPtr->cellResets;
+    totalPtr->outOfBounds += statsPtr->outOfBounds;
+    totalPtr->symmetricFlips += statsPtr->symmetricFlips;
+    totalPtr->sectorRotations += statsPtr->sectorRotations;
+    totalPtr->badIndices += statsPtr->badIndices;
+}
+
+//the counting threads of the unit test, all alive at once
+#define STATS_TEST_THREADS (CMAG_MAX_STATS_SLOTS + 44)
+#define STATS_TEST_COUNTS  1000
+
+//the threads of the unit test wait for all of them to have slots
+static pthread_mutex_t testLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t testGo = PTHREAD_COND_INITIALIZER;
+static bool testStarted;
+
+/**
+ * The body of a counting thread of the unit test: claim a slot, wait
+ * until every thread has one, then count.
+ * @param arg unused.
+ * @return NULL.
+ */
+static void *countStats(void *arg) {
+    (void) arg;
+    STATS_COUNT(symmetricFlips);
+
+    pthread_mutex_lock(&testLock);
+    while (!testStarted) {
+        pthread_cond_wait(&testGo, &testLock);
+    }
+    pthread_mutex_unlock(&testLock);
+
+    for (int i = 0; i < STATS_TEST_COUNTS; i++) {
+        STATS_COUNT(calls);
+        STATS_COUNT(cellHits);
+    }
+    return NULL;
+}
+
+/**
+ * Run a batch of counting threads, all alive at once.
+ * @return the number of threads run.
+ */
+static int runCountingThreads() {
+    pthread_t threads[STATS_TEST_THREADS];
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, 64 * 1024);
+    testStarted = false;
+
+    int made = 0;
+    while ((made < STATS_TEST_THREADS) && (pthread_create(threads + made, &attributes, countStats, NULL) == 0)) {
+        made++;
+    }
+    pthread_attr_destroy(&attributes);
+
+    pthread_mutex_lock(&testLock);
+    testStarted = true;
+    pthread_cond_broadcast(&testGo);
+    pthread_mutex_unlock(&testLock);
+
+    for (int i = 0; i < made; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return made;
+}
+
+/**
+ * A unit test of the counters: more threads alive at once than there are
+ * slots, then as many again in the freed slots, lose no counts, and the
+ * report prints the totals.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *statsUnitTest() {
+    resetFieldStats();
+    int made = runCountingThreads();
+    made += runCountingThreads();
+    mu_assert("Could not make the counting threads", made == 2 * STATS_TEST_THREADS);
+
+    FieldStats stats;
+    getFieldStats(&stats);
+    unsigned long long expected = 2ULL * STATS_TEST_THREADS * STATS_TEST_COUNTS;
+    mu_assert("Threads lost counts", (stats.calls == expected) && (stats.cellHits == expected));
+    mu_assert("Threads lost slot claims", stats.symmetricFlips == 2ULL * STATS_TEST_THREADS);
+
+    //every slot is free again, but the caller's own
+    pthread_mutex_lock(&statsLock);
+    int held = numSlots - numFree;
+    pthread_mutex_unlock(&statsLock);
+    mu_assert("Exited threads kept their slots", held == (((threadStatsPtr != NULL) && !threadStatsShared) ? 1 : 0));
+
+    //the report, which only prints the counts if they are compiled in
+    const char *path = "cMagStatsUnitTest.txt";
+    FILE *fp = fopen(path, "w");
+    mu_assert("Could not write the stats report", fp != NULL);
+    printFieldStats(fp);
+    fclose(fp);
+
+    char line[256];
+    bool found = false;
+    char expectedLine[64];
+    if (CMAG_STATS) {
+        snprintf(expectedLine, sizeof(expectedLine), "calls: %llu\n", expected);
+    }
+    else {
+        snprintf(expectedLine, sizeof(expectedLine), "field query statistics not compiled in");
+    }
+    fp = fopen(path, "r");
+    mu_assert("Could not read the stats report", fp != NULL);
+    while (!found && (fgets(line, sizeof(line), fp) != NULL)) {
+        found = (strncmp(line, expectedLine, strlen(expectedLine)) == 0);
+    }
+    fclose(fp);
+    remove(path);
+    mu_assert("The stats report is wrong", found);
+
+    resetFieldStats();
+    fprintf(stdout, "\nPASSED statsUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,597 @@
+//
+//  magfieldtrace.c
+//  cMag
+//
+//  Query trace recording and replay. While a recording is active every
+//  call to getFieldValue or getCompositeFieldValue appends a 16 byte
+//  record to a buffer owned by the calling thread. Full buffers are
+//  handed to a background thread that writes them to the trace file,
+//  so the query path itself never touches stdio.
+//
+
+#include "magfieldtrace.h"
+#include "magfieldutil.h"
+#include "magfieldlog.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef struct tracebuffer *TraceBufferPtr;
+typedef struct tracethread *TraceThreadPtr;
+
+//a block of records, either owned by a thread, queued, or free
+typedef struct tracebuffer {
+    TraceBufferPtr next; //link for the write queue and free list
+    int count;           //number of records in use
+    TraceRecord records[TRACEBUFFERSIZE];
+} TraceBuffer;
+
+//a recording thread
+typedef struct tracethread {
+    TraceThreadPtr next;    //link for the list of recording threads
+    TraceBufferPtr current; //the buffer being filled
+} TraceThread;
+
+volatile int traceRecording = 0;
+
+//everything below is guarded by traceLock
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t traceCond = PTHREAD_COND_INITIALIZER;
+static TraceBufferPtr queueHead = NULL;
+static TraceBufferPtr queueTail = NULL;
+static TraceBufferPtr freeList = NULL;
+static TraceThreadPtr threadList = NULL;
+static FILE *traceFile = NULL;
+static pthread_t flushThread;
+static bool stopping = false;
+static bool outOfMemory = false; //reported once per recording
+
+//incremented by every start so threads know to re-register
+static int session = 0;
+
+static _Thread_local TraceThreadPtr myThread = NULL;
+static _Thread_local int mySession = -1;
+
+//local prototypes
+static TraceBufferPtr getBuffer(void);
+static void enqueue(TraceBufferPtr);
+static TraceThreadPtr registerThread(void);
+static void reportOutOfMemory(void);
+static void *flushLoop(void *);
+static int openCacheMissCounter(void);
+static long long readCacheMissCounter(int);
+
+/**
+ * Start recording field queries.
+ * @param path the path to the trace file, which will be overwritten.
+ * @return true on success, false if the file could not be opened or
+ * a recording is already active.
+ */
+bool startTraceRecording(const char *path) {
+
+    pthread_mutex_lock(&traceLock);
+
+    if (traceFile != NULL) {
+        pthread_mutex_unlock(&traceLock);
+        fprintf(stderr, "\ncMag ERROR a trace recording is already active.\n");
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        pthread_mutex_unlock(&traceLock);
+        fprintf(stderr, "\ncMag ERROR could not open trace file: [%s]\n", path);
+        return false;
+    }
+
+    TraceHeader header = {TRACEMAGICWORD, TRACEVERSION, sizeof(TraceRecord), 0};
+    if (fwrite(&header, sizeof(TraceHeader), 1, file) != 1) {
+        fclose(file);
+        pthread_mutex_unlock(&traceLock);
+        fprintf(stderr, "\ncMag ERROR could not write the trace file header: [%s]\n", path);
+        return false;
+    }
+
+    traceFile = file;
+    stopping = false;
+    outOfMemory = false;
+    session++;
+
+    if (pthread_create(&flushThread, NULL, flushLoop, NULL) != 0) {
+        fclose(traceFile);
+        traceFile = NULL;
+        pthread_mutex_unlock(&traceLock);
+        fprintf(stderr, "\ncMag ERROR could not start the trace writer thread.\n");
+        return false;
+    }
+
+    traceRecording = 1;
+    pthread_mutex_unlock(&traceLock);
+    return true;
+}
+
+/**
+ * Stop recording, write any partially filled buffers and close the
+ * trace file. This should be called once the recording threads have
+ * stopped querying the field, e.g. at the end of a job.
+ */
+void stopTraceRecording() {
+
+    pthread_mutex_lock(&traceLock);
+
+    if (traceFile == NULL) {
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+
+    traceRecording = 0;
+
+    //hand over what the threads still hold
+    TraceThreadPtr tt = threadList;
+    while (tt != NULL) {
+        TraceThreadPtr next = tt->next;
+        if (tt->current == NULL) {
+            //ran out of memory for a buffer, so stopped recording
+        }
+        else if (tt->current->count > 0) {
+            enqueue(tt->current);
+        }
+        else {
+            tt->current->next = freeList;
+            freeList = tt->current;
+        }
+        free(tt);
+        tt = next;
+    }
+    threadList = NULL;
+
+    stopping = true;
+    pthread_cond_signal(&traceCond);
+    pthread_mutex_unlock(&traceLock);
+
+    pthread_join(flushThread, NULL);
+
+    pthread_mutex_lock(&traceLock);
+    while (freeList != NULL) {
+        TraceBufferPtr next = freeList->next;
+        free(freeList);
+        freeList = next;
+    }
+
+    fclose(traceFile);
+    traceFile = NULL;
+    pthread_mutex_unlock(&traceLock);
+}
+
+/**
+ * Append a query to the calling thread's buffer. Normally reached through
+ * the TRACE_QUERY macro, which skips the call when no recording is active.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldId TRACE_TORUS, TRACE_SOLENOID or TRACE_COMPOSITE.
+ */
+void traceRecord(double x, double y, double z, unsigned int fieldId) {
+
+    TraceThreadPtr tt = myThread;
+    if (mySession != session) {
+        tt = registerThread();
+    }
+
+    //not recording, or out of memory for this thread's buffers
+    TraceBufferPtr buf = (tt == NULL) ? NULL : tt->current;
+    if (buf == NULL) {
+        return;
+    }
+
+    TraceRecordPtr rec = buf->records + buf->count;
+    rec->x = (float) x;
+    rec->y = (float) y;
+    rec->z = (float) z;
+    rec->fieldId = fieldId;
+
+    if (++(buf->count) == TRACEBUFFERSIZE) {
+        pthread_mutex_lock(&traceLock);
+        enqueue(buf);
+        tt->current = getBuffer();
+        pthread_mutex_unlock(&traceLock);
+    }
+}
+
+/**
+ * Give the calling thread a buffer of its own for this recording session.
+ * If there is no memory for one the thread records nothing more this session.
+ * @return the thread record, or NULL if recording has been stopped or
+ * there was no memory.
+ */
+static TraceThreadPtr registerThread() {
+    pthread_mutex_lock(&traceLock);
+
+    if (!traceRecording) {
+        pthread_mutex_unlock(&traceLock);
+        return NULL;
+    }
+
+    TraceThreadPtr tt = (TraceThreadPtr) malloc(sizeof(TraceThread));
+    if (tt == NULL) {
+        reportOutOfMemory();
+    }
+    TraceBufferPtr buf = (tt == NULL) ? NULL : getBuffer();
+    if (buf == NULL) {
+        free(tt);
+        myThread = NULL;
+        mySession = session;
+        pthread_mutex_unlock(&traceLock);
+        return NULL;
+    }
+
+    tt->current = buf;
+    tt->next = threadList;
+    threadList = tt;
+
+    myThread = tt;
+    mySession = session;
+
+    pthread_mutex_unlock(&traceLock);
+    return tt;
+}
+
+/**
+ * Get an empty buffer, recycling one if possible. Caller holds the lock.
+ * @return an empty buffer, or NULL if there was no memory for one.
+ */
+static TraceBufferPtr getBuffer() {
+    TraceBufferPtr buf = freeList;
+    if (buf != NULL) {
+        freeList = buf->next;
+    }
+    else {
+        buf = (TraceBufferPtr) malloc(sizeof(TraceBuffer));
+        if (buf == NULL) {
+            reportOutOfMemory();
+            return NULL;
+        }
+    }
+    buf->next = NULL;
+    buf->count = 0;
+    return buf;
+}
+
+/**
+ * Report running out of memory while recording, once per recording, as
+ * the queries of the thread that ran out are no longer recorded. Caller
+ * holds the lock.
+ */
+static void reportOutOfMemory() {
+    if (!outOfMemory) {
+        outOfMemory = true;
+        LOG_ERROR("out of memory recording a trace, some queries will not be recorded");
+    }
+}
+
+/**
+ * Queue a full buffer for writing. Caller holds the lock.
+ * @param buf the buffer to write.
+ */
+static void enqueue(TraceBufferPtr buf) {
+    buf->next = NULL;
+    if (queueTail == NULL) {
+        queueHead = buf;
+    }
+    else {
+        queueTail->next = buf;
+    }
+    queueTail = buf;
+    pthread_cond_signal(&traceCond);
+}
+
+/**
+ * The body of the writer thread. Writes queued buffers until told to
+ * stop and the queue is empty.
+ * @param arg unused.
+ * @return NULL.
+ */
+static void *flushLoop(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&traceLock);
+
+    while (true) {
+        while ((queueHead == NULL) && !stopping) {
+            pthread_cond_wait(&traceCond, &traceLock);
+        }
+
+        if (queueHead == NULL) {
+            break;
+        }
+
+        TraceBufferPtr buf = queueHead;
+        queueHead = buf->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+
+        //write without holding the lock so recorders are not held up
+        pthread_mutex_unlock(&traceLock);
+        fwrite(buf->records, sizeof(TraceRecord), buf->count, traceFile);
+        pthread_mutex_lock(&traceLock);
+
+        buf->count = 0;
+        buf->next = freeList;
+        freeList = buf;
+    }
+
+    pthread_mutex_unlock(&traceLock);
+    return NULL;
+}
+
+/**
+ * Replay a recorded trace. The queries are evaluated with whatever
+ * algorithm is currently set, so the same trace can be used to compare
+ * maps, algorithms and storage layouts.
+ * @param path the path to the trace file.
+ * @param torus the field used for torus queries (can be NULL).
+ * @param solenoid the field used for solenoid queries (can be NULL).
+ * @param resultPtr upon return holds the timing results.
+ * @return true on success, false if the trace could not be read.
+ */
+bool replayTrace(const char *path, MagneticFieldPtr torus, MagneticFieldPtr solenoid,
+                 ReplayResultPtr resultPtr) {
+
+    memset(resultPtr, 0, sizeof(ReplayResult));
+    resultPtr->cacheMisses = -1;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open trace file: [%s]\n", path);
+        return false;
+    }
+
+    TraceHeader header;
+    if ((fread(&header, sizeof(TraceHeader), 1, file) != 1) ||
+        (header.magicWord != TRACEMAGICWORD) || (header.recordSize != sizeof(TraceRecord))) {
+        fprintf(stderr, "\ncMag ERROR not a trace file (or from a different byte order): [%s]\n", path);
+        fclose(file);
+        return false;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long recordBytes = ftell(file) - (long) sizeof(TraceHeader);
+    long numRecords = recordBytes / (long) sizeof(TraceRecord);
+    if ((recordBytes < 0) || (recordBytes % (long) sizeof(TraceRecord) != 0)) {
+        fprintf(stderr, "\ncMag ERROR truncated trace file: [%s]\n", path);
+        fclose(file);
+        return false;
+    }
+    fseek(file, sizeof(TraceHeader), SEEK_SET);
+
+    size_t count = (size_t) numRecords;
+    TraceRecordPtr records = (TraceRecordPtr) malloc((count > 0 ? count : 1) * sizeof(TraceRecord));
+    if ((records == NULL) || (fread(records, sizeof(TraceRecord), count, file) != count)) {
+        fprintf(stderr, "\ncMag ERROR could not read trace records from: [%s]\n", path);
+        free(records);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    FieldValue fieldValue;
+    double checksum = 0;
+    unsigned long skipped = 0;
+
+    int counter = openCacheMissCounter();
+    long long missesStart = readCacheMissCounter(counter);
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < numRecords; i++) {
+        TraceRecordPtr rec = records + i;
+
+        switch (rec->fieldId) {
+            case TRACE_TORUS:
+                if (torus == NULL) {
+                    skipped++;
+                    continue;
+                }
+                getFieldValue(&fieldValue, rec->x, rec->y, rec->z, torus);
+                break;
+
+            case TRACE_SOLENOID:
+                if (solenoid == NULL) {
+                    skipped++;
+                    continue;
+                }
+                getFieldValue(&fieldValue, rec->x, rec->y, rec->z, solenoid);
+                break;
+
+            default:
+                getCompositeFieldValue(&fieldValue, rec->x, rec->y, rec->z, torus, solenoid);
+                break;
+        }
+
+        checksum += fieldMagnitude(&fieldValue);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    long long missesStop = readCacheMissCounter(counter);
+
+#ifdef __linux__
+    if (counter >= 0) {
+        close(counter);
+    }
+#endif
+
+    free(records);
+
+    resultPtr->numQueries = numRecords - skipped;
+    resultPtr->numSkipped = skipped;
+    resultPtr->seconds = (stop.tv_sec - start.tv_sec) + 1.0e-9 * (stop.tv_nsec - start.tv_nsec);
+    resultPtr->nsPerQuery = (resultPtr->numQueries > 0) ?
+            1.0e9 * resultPtr->seconds / resultPtr->numQueries : 0;
+    if ((missesStart >= 0) && (missesStop >= 0)) {
+        resultPtr->cacheMisses = missesStop - missesStart;
+    }
+    resultPtr->checksum = checksum;
+    return true;
+}
+
+/**
+ * Print the result of a replay.
+ * @param resultPtr the replay result.
+ * @param stream a file stream, e.g. stdout.
+ */
+void printReplayResult(ReplayResultPtr resultPtr, FILE *stream) {
+    fprintf(stream, "\n========================================\n");
+    fprintf(stream, "TRACE REPLAY (%s)\n", (getAlgorithm() == INTERPOLATION) ? "INTERPOLATION" : "NEAREST_NEIGHBOR");
+    fprintf(stream, "queries: %lu (skipped %lu)\n", resultPtr->numQueries, resultPtr->numSkipped);
+    fprintf(stream, "time: %-10.6f s\n", resultPtr->seconds);
+    fprintf(stream, "ns/query: %-8.2f\n", resultPtr->nsPerQuery);
+    if (resultPtr->cacheMisses < 0) {
+        fprintf(stream, "cache misses: unavailable\n");
+    }
+    else {
+        fprintf(stream, "cache misses: %lld (%-6.3f per query)\n", resultPtr->cacheMisses,
+                (resultPtr->numQueries > 0) ? (double) resultPtr->cacheMisses / resultPtr->numQueries : 0);
+    }
+    fprintf(stream, "checksum: %-16.6f\n", resultPtr->checksum);
+}
+
+/**
+ * Open a hardware counter of cache misses for the calling thread.
+ * @return the counter's file descriptor, or -1 if unavailable
+ * (not Linux, no PMU access, or perf_event_paranoid too strict).
+ */
+static int openCacheMissCounter() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Read a cache miss counter.
+ * @param fd the counter from openCacheMissCounter.
+ * @return the count so far, or -1 if unavailable.
+ */
+static long long readCacheMissCounter(int fd) {
+#ifdef __linux__
+    long long count;
+    if ((fd >= 0) && (read(fd, &count, sizeof(count)) == sizeof(count))) {
+        return count;
+    }
+#endif
+    return -1;
+}
+
+/**
+ * Copy the start of a file. Only for the unit test.
+ * @param from the file to copy.
+ * @param to the copy.
+ * @param size the bytes to copy.
+ * @param flip the byte to invert in the copy, or -1 for none.
+ * @return true on success.
+ */
+static bool copyFileStart(const char *from, const char *to, long size, long flip) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    bool copied = (in != NULL) && (out != NULL);
+    for (long i = 0; copied && (i < size); i++) {
+        int c = fgetc(in);
+        copied = (c != EOF) && (fputc((i == flip) ? (c ^ 0xff) : c, out) != EOF);
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return copied;
+}
+
+/**
+ * A unit test of recording and replay for the map in testFieldPtr: a
+ * replayed trace has the recorded queries, over several buffers, and
+ * gives the recorded field values, and truncated or corrupt traces are
+ * rejected.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *traceUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    MagneticFieldPtr torus = (fieldPtr->type == TORUS) ? fieldPtr : NULL;
+    MagneticFieldPtr solenoid = (fieldPtr->type == TORUS) ? NULL : fieldPtr;
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal;
+    double zMin = fieldPtr->zGridPtr->minVal;
+    double zMax = fieldPtr->zGridPtr->maxVal;
+    const char *path = "cMagTraceUnitTest.bin";
+    const char *badPath = "cMagTraceUnitTest2.bin";
+
+    //single and composite queries, some outside the map. The trace keeps
+    //floats, so query at floats to replay the same values.
+    unsigned long num = 3 * TRACEBUFFERSIZE + 17;
+    double checksum = 0;
+    mu_assert("Could not start a trace recording", startTraceRecording(path));
+    for (unsigned long i = 0; i < num; i++) {
+        float x = (float) randomDouble(-1.1 * rhoMax, 1.1 * rhoMax);
+        float y = (float) randomDouble(-1.1 * rhoMax, 1.1 * rhoMax);
+        float z = (float) randomDouble(zMin - 10, zMax + 10);
+        FieldValue value;
+        if (i % 3 == 0) {
+            getCompositeFieldValue(&value, x, y, z, torus, solenoid);
+        }
+        else {
+            getFieldValue(&value, x, y, z, fieldPtr);
+        }
+        checksum += fieldMagnitude(&value);
+    }
+    stopTraceRecording();
+
+    //the same queries and values, and none for a map not supplied
+    ReplayResult result;
+    mu_assert("Could not replay a trace", replayTrace(path, torus, solenoid, &result));
+    mu_assert("The replay has the wrong number of queries", (result.numQueries == num) && (result.numSkipped == 0));
+    mu_assert("The replay gives different field values", result.checksum == checksum);
+    mu_assert("Could not replay a trace without its map", replayTrace(path, NULL, NULL, &result));
+    mu_assert("The replay did not skip the missing map",
+              (result.numSkipped == num - (num + 2) / 3) && (result.numQueries == (num + 2) / 3));
+
+    //a header alone is an empty trace; part of a record, or a bad header, is an error
+    long size = (long) (sizeof(TraceHeader) + num * sizeof(TraceRecord));
+    mu_assert("Could not copy a trace", copyFileStart(path, badPath, sizeof(TraceHeader), -1));
+    mu_assert("Could not replay an empty trace", replayTrace(badPath, torus, solenoid, &result) &&
+                                                 (result.numQueries == 0));
+    mu_assert("Could not copy a trace", copyFileStart(path, badPath, size - 5, -1));
+    mu_assert("A truncated trace was replayed", !replayTrace(badPath, torus, solenoid, &result));
+    mu_assert("Could not copy a trace", copyFileStart(path, badPath, sizeof(TraceHeader) / 2, -1));
+    mu_assert("A truncated header was replayed", !replayTrace(badPath, torus, solenoid, &result));
+    mu_assert("Could not copy a trace", copyFileStart(path, badPath, size, 1));
+    mu_assert("A corrupt trace was replayed", !replayTrace(badPath, torus, solenoid, &result));
+    mu_assert("A missing trace was replayed", !replayTrace("cMagTraceUnitTestMissing.bin", torus, solenoid, &result));
+
+    remove(path);
+    remove(badPath);
+    fprintf(stdout, "\nPASSED traceUnitTest\n");
+    return NULL;
+}
@@ -8,15 +8,26 @@
 #include "magfield.h"
 #include "magfieldio.h"
 #include "magfieldutil.h"
+#include "magfieldstats.h"
+#include "magfieldmem.h"
+#include "magfieldnuma.h"
+#include "magfieldpyramid.h"
+#include "magfieldmagnitude.h"
 #include "munittest.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 //used for comparing real numbers
 double const TINY = 1.0e-8;
 
+//CRC32C lookup tables, built on first use
+static unsigned int crcTables[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
 //this is used by the minimal unit testing
 int mtests_run = 0;
 
@@ -30,7 +41,6 @@ const char *angleUnitLabels[] = { "degrees", "radians" };
 const char *fieldUnitLabels[] = { "kG", "G", "T" };
 
 //local prototypes
-static void freeGrid(GridPtr gridPtr);
 
 /**
  * Convert an angle from radians to degrees.
@@ -195,11 +205,23 @@ void printFieldSummary(MagneticFieldPtr fieldPtr, FILE *stream) {
     fprintf(stream, "scale factor: %-6.2f\n", fieldPtr->scale);
 
     //print the grid info for the three coordinate grids
-    fprintf(stream, "%s\n", gridStr(fieldPtr->phiGridPtr));
-    fprintf(stream, "%s\n", gridStr(fieldPtr->rhoGridPtr));
-    fprintf(stream, "%s\n", gridStr(fieldPtr->zGridPtr));
-
-    fprintf(stream, "numColors field values: %d\n", fieldPtr->numValues);
+    char gridBuf[GRIDSTRLEN];
+    fprintf(stream, "%s\n", gridString(fieldPtr->phiGridPtr, gridBuf, sizeof(gridBuf)));
+    fprintf(stream, "%s\n", gridString(fieldPtr->rhoGridPtr, gridBuf, sizeof(gridBuf)));
+    fprintf(stream, "%s\n", gridString(fieldPtr->zGridPtr, gridBuf, sizeof(gridBuf)));
+
+    fprintf(stream, "numColors field values: %zu\n", fieldPtr->numValues);
+    printFieldArrayInfo(fieldPtr->fieldValues, stream);
+    if (fieldPtr->numReplicas > 0) {
+        fprintf(stream, "NUMA replicas: %d\n", fieldPtr->numReplicas);
+    }
+    if (fieldPtr->magnitudes != NULL) {
+        fprintf(stream, "magnitude grid: %-.1f MB\n", fieldPtr->numValues * sizeof(float) / (1024. * 1024.));
+    }
+    if (fieldPtr->pyramidPtr != NULL) {
+        fprintf(stream, "pyramid: %d levels, %-.1f MB\n", fieldPtr->pyramidPtr->numLevels,
+                fieldPtr->pyramidPtr->numNodes * sizeof(FieldExtrema) / (1024. * 1024.));
+    }
     fprintf(stream, "grid cs: %s\n", csLabels[headerPtr->gridCS]);
     fprintf(stream, "field cs: %s\n", csLabels[headerPtr->fieldCS]);
     fprintf(stream, "length unit: %s\n",
@@ -209,7 +231,7 @@ void printFieldSummary(MagneticFieldPtr fieldPtr, FILE *stream) {
     fprintf(stream, "field unit: %s\n", fieldUnitLabels[headerPtr->fieldUnits]);
 
     //now the metrics
-    fprintf(stream, "max field at index: %d\n",
+    fprintf(stream, "max field at index: %zu\n",
             fieldPtr->metricsPtr->maxFieldIndex);
 
 
@@ -231,6 +253,35 @@ void printFieldSummary(MagneticFieldPtr fieldPtr, FILE *stream) {
     fprintf(stdout, "avg field magnitude: %-10.6f %s", fieldPtr->metricsPtr->avgFieldMagnitude, fieldUnits(fieldPtr));
 }
 
+/**
+ * Print the per-thread query counters, summed over all threads. Only
+ * meaningful if the library was built with CMAG_STATS=1.
+ * @param stream a file stream, e.g. stdout.
+ */
+void printFieldStats(FILE *stream) {
+    if (!CMAG_STATS) {
+        fprintf(stream, "\nfield query statistics not compiled in (build with -DCMAG_STATS=1)\n");
+        return;
+    }
+
+    FieldStats stats;
+    getFieldStats(&stats);
+
+    unsigned long long inside = stats.cellHits + stats.cellResets;
+    double hitRate = (inside > 0) ? (100.0 * stats.cellHits) / inside : 0;
+    double oobRate = (stats.calls > 0) ? (100.0 * stats.outOfBounds) / stats.calls : 0;
+
+    fprintf(stream, "\n========================================\n");
+    fprintf(stream, "FIELD QUERY STATISTICS\n");
+    fprintf(stream, "calls: %llu\n", stats.calls);
+    fprintf(stream, "cell hits: %llu (%-6.2f%%)\n", stats.cellHits, hitRate);
+    fprintf(stream, "cell resets: %llu (%-6.2f%%)\n", stats.cellResets, (inside > 0) ? 100 - hitRate : 0);
+    fprintf(stream, "out of bounds: %llu (%-6.2f%%)\n", stats.outOfBounds, oobRate);
+    fprintf(stream, "symmetric flips: %llu\n", stats.symmetricFlips);
+    fprintf(stream, "sector rotations: %llu\n", stats.sectorRotations);
+    fprintf(stream, "bad indices: %llu\n", stats.badIndices);
+}
+
  /**
   * Get the field units of the magnetic field
   * @param fieldPtr a pointer to the field.
@@ -261,49 +312,17 @@ void printFieldValue(FieldValuePtr fvPtr, FILE *stream) {
             fvPtr->b2, fvPtr->b3, fieldMagnitude(fvPtr));
 }
 
- /**
-  * Allocate a field map with no content.
-  * @return a pointer to an empty field map structure.
-  */
-MagneticFieldPtr createFieldMap() {
-     MagneticFieldPtr fieldPtr = (MagneticFieldPtr) malloc(sizeof(MagneticField));
-     fieldPtr->metricsPtr = (FieldMetricsPtr) malloc(sizeof(FieldMetrics));
-     fieldPtr->scale = 1;
-     fieldPtr->shiftX = 0;
-     fieldPtr->shiftY = 0;
-     fieldPtr->shiftZ = 0;
-
-     return fieldPtr;
-}
-
-
 /**
- * Free the memory associated with a field map.
+ * Free the memory associated with a field map. The map lives in a single
+ * arena (see readField), so apart from any NUMA replicas this is one free.
+ * Any probes of the field must be freed first.
  * @param fieldPtr a pointer to the field
  */
 void freeFieldMap(MagneticFieldPtr fieldPtr) {
-    free(fieldPtr->metricsPtr);
-    freeGrid(fieldPtr->phiGridPtr);
-    freeGrid(fieldPtr->rhoGridPtr);
-    freeGrid(fieldPtr->zGridPtr);
-
-    if (fieldPtr->type == TORUS) {
-        freeCell3D(fieldPtr->cell3DPtr);
-    }
-    else {
-        freeCell2D(fieldPtr->cell2DPtr);
-    }
-    free(fieldPtr);
-}
-
-/**
- * Free the memory associated with a coordinate grid.
- * @param gridPtr the poiner to deallocate.
- */
-static void freeGrid(GridPtr gridPtr) {
-    free(gridPtr->name);
-    free(gridPtr->values);
-    free(gridPtr);
+    freeReplicas(fieldPtr);
+    freeFieldPyramid(fieldPtr);
+    freeMagnitudeGrid(fieldPtr);
+    freeFieldArray(fieldPtr->arena);
 }
 
 /**
@@ -315,7 +334,7 @@ static void freeGrid(GridPtr gridPtr) {
 void stringCopy(char **dest, const char *src) {
     unsigned long len = strlen(src);
     *dest = (char*) malloc(len + 1);
-    strncpy(*dest, src, len);
+    memcpy(*dest, src, len + 1);
 }
 
 /**
@@ -331,6 +350,136 @@ int randomInt(int minVal, int maxVal) {
     return minVal + (randVal % (del + 1) );
 }
 
+/**
+ * Compute the number of grid points of a map, and the bytes needed to
+ * store their field values, checking for overflow. Grids beyond 2^32
+ * points are fine on 64 bit machines; the product is never truncated.
+ * @param headerPtr the header that defines the grid.
+ * @param numValues upon success, the number of grid points.
+ * @param numBytes upon success, the bytes of field values (can be NULL).
+ * @return false if a dimension is zero or the size does not fit in a size_t.
+ */
+bool fieldMapSize(FieldMapHeaderPtr headerPtr, size_t *numValues, size_t *numBytes) {
+    size_t n12, n123, bytes;
+
+    if ((headerPtr->nq1 == 0) || (headerPtr->nq2 == 0) || (headerPtr->nq3 == 0)) {
+        return false;
+    }
+
+    if (__builtin_mul_overflow((size_t) headerPtr->nq1, (size_t) headerPtr->nq2, &n12) ||
+        __builtin_mul_overflow(n12, (size_t) headerPtr->nq3, &n123) ||
+        __builtin_mul_overflow(n123, sizeof(FieldValue), &bytes)) {
+        return false;
+    }
+
+    *numValues = n123;
+    if (numBytes != NULL) {
+        *numBytes = bytes;
+    }
+    return true;
+}
+
+/**
+ * Build the CRC32C (Castagnoli) tables for slicing by 8.
+ */
+static void makeCrcTables() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crcTables[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crcTables[t][i] = (crcTables[t - 1][i] >> 8) ^ crcTables[0][crcTables[t - 1][i] & 0xff];
+        }
+    }
+}
+
+/**
+ * Compute or continue a CRC32C (Castagnoli) checksum, the one used by
+ * version 2 field map files.
+ * @param crc the CRC so far, 0 to start.
+ * @param data the bytes to add.
+ * @param length the number of bytes.
+ * @return the updated CRC.
+ */
+unsigned int crc32c(unsigned int crc, const void *data, size_t length) {
+    pthread_once(&crcOnce, makeCrcTables);
+
+    const unsigned char *p = (const unsigned char *) data;
+    crc = ~crc;
+
+    //eight bytes at a time, assembled little endian so the result
+    //does not depend on the byte order of the machine
+    while (length >= 8) {
+        unsigned int lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24));
+        crc = crcTables[7][lo & 0xff] ^ crcTables[6][(lo >> 8) & 0xff] ^
+              crcTables[5][(lo >> 16) & 0xff] ^ crcTables[4][lo >> 24] ^
+              crcTables[3][p[4]] ^ crcTables[2][p[5]] ^ crcTables[1][p[6]] ^ crcTables[0][p[7]];
+        p += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ crcTables[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+/**
+ * The number of threads to use for some work.
+ * @param requested the number asked for. If less than 1, one per online processor.
+ * @param numItems the number of items of work; more threads than this would be idle.
+ * @return the number of threads, at least 1.
+ */
+int numWorkers(int requested, size_t numItems) {
+    int numThreads = requested;
+    if (numThreads < 1) {
+        numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((size_t) numThreads > numItems) {
+        numThreads = (int) numItems;
+    }
+    return (numThreads < 1) ? 1 : numThreads;
+}
+
+/**
+ * Run a worker function on a number of threads, the caller being one of
+ * them, and wait for them all. If a thread cannot be created the caller
+ * does its work, so the work is always done.
+ * @param worker the worker function.
+ * @param args the argument of each thread: an array of numThreads arguments of
+ * argSize bytes each, or if argSize is 0 one argument shared by every thread, in
+ * which case the workers share out the work themselves (e.g. with an atomic counter).
+ * @param argSize the size of one argument, or 0 for a shared argument.
+ * @param numThreads the number of threads, the caller included.
+ */
+void runWorkers(void *(*worker)(void *), void *args, size_t argSize, int numThreads) {
+    numThreads = (numThreads < 1) ? 1 : numThreads;
+    pthread_t threads[numThreads];
+    bool started[numThreads];
+
+    for (int i = 0; i < numThreads; i++) {
+        void *arg = (char *) args + i * argSize;
+        started[i] = (i > 0) && (pthread_create(threads + i, NULL, worker, arg) == 0);
+    }
+
+    //the caller does the first share, and any that could not be started; a
+    //shared argument's work is drained by a single call
+    for (int i = 0; i < numThreads; i++) {
+        if (!started[i] && ((i == 0) || (argSize > 0))) {
+            worker((char *) args + i * argSize);
+        }
+    }
+    for (int i = 0; i < numThreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
 /**
  * Sign function
  * @param x the value to check
@@ -562,3 +711,80 @@ char *binarySearchUnitTest() {
     fprintf(stdout, "\nPASSED binarySearchUnitTest\n");
     return NULL;
 }
+
+//the work of the runWorkers unit test
+#define WORKER_TEST_ITEMS 1000
+
+typedef struct workertest {
+    int counts[WORKER_TEST_ITEMS];
+    unsigned int nextItem;
+    int start;
+    int end;
+} WorkerTest;
+
+/**
+ * A runWorkers unit test worker with a range of its own.
+ * @param arg the worker's WorkerTest.
+ * @return NULL.
+ */
+static void *countRange(void *arg) {
+    WorkerTest *test = (WorkerTest *) arg;
+    for (int i = test->start; i < test->end; i++) {
+        test->counts[i]++;
+    }
+    return NULL;
+}
+
+/**
+ * A runWorkers unit test worker that claims items from a shared counter.
+ * @param arg the shared WorkerTest.
+ * @return NULL.
+ */
+static void *countShared(void *arg) {
+    WorkerTest *test = (WorkerTest *) arg;
+    while (true) {
+        unsigned int item = __atomic_fetch_add(&(test->nextItem), 1, __ATOMIC_RELAXED);
+        if (item >= WORKER_TEST_ITEMS) {
+            return NULL;
+        }
+        __atomic_fetch_add(test->counts + item, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * A unit test of the worker threads: every item is done exactly once,
+ * with an argument per thread and with a shared one.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *workersUnitTest() {
+    mu_assert("Bad default number of workers", numWorkers(0, 1000000) >= 1);
+    mu_assert("More workers than items", numWorkers(8, 3) == 3);
+    mu_assert("No worker for no items", numWorkers(8, 0) == 1);
+
+    int numThreads = 5;
+    WorkerTest *ranges = (WorkerTest *) calloc(numThreads, sizeof(WorkerTest));
+    WorkerTest *shared = (WorkerTest *) calloc(1, sizeof(WorkerTest));
+    mu_assert("Could not allocate the worker test", (ranges != NULL) && (shared != NULL));
+
+    for (int i = 0; i < numThreads; i++) {
+        ranges[i].start = (WORKER_TEST_ITEMS * i) / numThreads;
+        ranges[i].end = (WORKER_TEST_ITEMS * (i + 1)) / numThreads;
+    }
+    runWorkers(countRange, ranges, sizeof(WorkerTest), numThreads);
+    runWorkers(countShared, shared, 0, numThreads);
+
+    bool once = true;
+    for (int item = 0; item < WORKER_TEST_ITEMS; item++) {
+        int count = 0;
+        for (int i = 0; i < numThreads; i++) {
+            count += ranges[i].counts[item];
+        }
+        once = once && (count == 1) && (shared->counts[item] == 1);
+    }
+    free(ranges);
+    free(shared);
+    mu_assert("The workers did not do every item exactly once", once);
+
+    fprintf(stdout, "\nPASSED workersUnitTest\n");
+    return NULL;
+}
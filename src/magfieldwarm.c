@@ -0,0 +1,544 @@
+//
+//  magfieldwarm.c
+//  cMag
+//
+//  Warm-up of a field map before the first query. The pages of a large
+//  map may have been swapped or compacted since loading, and a new job
+//  starts with cold caches, TLB and branch predictors, so the first
+//  queries can be far slower than steady state. warmField touches the
+//  pages in parallel (madvising them in first where possible) and can run
+//  a burst of queries. profileColdStart measures how long the first queries
+//  take to settle, so the effect of warming can be checked.
+//
+
+#define _GNU_SOURCE
+#include "magfieldwarm.h"
+#include "magfieldio.h"
+#include "magfieldmem.h"
+#include "magfieldnuma.h"
+#include "magfieldlog.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+
+//strides for touching; pages to fault them in, cache lines to load them
+#define PAGE_STRIDE 4096
+#define LINE_STRIDE 64
+
+//ranges per thread when splitting a whole array, for load balance
+#define CHUNKS_PER_THREAD 4
+
+//a contiguous range of bytes to touch
+typedef struct warmrange {
+    const char *start;
+    size_t bytes;
+} WarmRange;
+
+//the ranges to touch, shared by the warming threads
+typedef struct warmlist {
+    WarmRange *ranges;
+    int num;
+    int capacity;
+    size_t stride;
+} WarmList;
+
+//one warming thread's share
+typedef struct warmjob {
+    WarmList *list;
+    int first;  //the first range, then every step'th
+    int step;
+    unsigned long sum;
+} WarmJob;
+
+//keeps the touches from being optimized away
+static volatile unsigned long warmSink;
+static volatile double querySink;
+
+//local prototypes
+static bool warm(MagneticFieldPtr, int, const int *, const int *, size_t);
+static bool addRange(WarmList *, const char *, size_t, bool);
+static void touchAll(WarmList *);
+static void *touchRanges(void *);
+static void adviseWillNeed(const void *);
+static void warmQueries(MagneticFieldPtr, const int *, const int *);
+static int clampIndex(GridPtr, double);
+static double nowNs(void);
+static bool median(const double *, int, double *);
+
+/**
+ * Warm an entire field map. With WARM_PAGES every page of the values
+ * read by the calling thread's probes is faulted in, in parallel.
+ * WARM_DERIVED also touches the coordinate grids and every NUMA replica,
+ * and WARM_QUERIES runs a burst of queries over the whole grid.
+ * @param fieldPtr the field map.
+ * @param mode the WARM_ flags.
+ * @return true on success.
+ */
+bool warmField(MagneticFieldPtr fieldPtr, int mode) {
+    int lo[3] = {0, 0, 0};
+    int hi[3] = {(int) fieldPtr->phiGridPtr->num - 1, (int) fieldPtr->rhoGridPtr->num - 1,
+                 (int) fieldPtr->zGridPtr->num - 1};
+    return warm(fieldPtr, mode, lo, hi, PAGE_STRIDE);
+}
+
+/**
+ * Warm the part of a field map covering a region, given in the map's own
+ * grid coordinates (phi in degrees, rho and z in cm), clipped to the
+ * grid. Since the region is expected to be queried heavily, every cache
+ * line of it is touched, not just every page. The mode is as for warmField;
+ * WARM_DERIVED applies the region to every replica, and WARM_QUERIES
+ * queries inside the region.
+ * @param fieldPtr the field map.
+ * @param mode the WARM_ flags.
+ * @param phiMin the min phi.
+ * @param phiMax the max phi.
+ * @param rhoMin the min rho.
+ * @param rhoMax the max rho.
+ * @param zMin the min z.
+ * @param zMax the max z.
+ * @return true on success, false if the region is empty.
+ */
+bool warmFieldRegion(MagneticFieldPtr fieldPtr, int mode, double phiMin, double phiMax,
+                     double rhoMin, double rhoMax, double zMin, double zMax) {
+    if ((phiMin > phiMax) || (rhoMin > rhoMax) || (zMin > zMax)) {
+        LOG_WARN("empty warm-up region for [%s]", fieldPtr->path);
+        return false;
+    }
+
+    //a solenoid has a single phi value
+    if (fieldPtr->phiGridPtr->num < 2) {
+        phiMin = phiMax = fieldPtr->phiGridPtr->minVal;
+    }
+
+    int lo[3] = {clampIndex(fieldPtr->phiGridPtr, phiMin), clampIndex(fieldPtr->rhoGridPtr, rhoMin),
+                 clampIndex(fieldPtr->zGridPtr, zMin)};
+    int hi[3] = {clampIndex(fieldPtr->phiGridPtr, phiMax), clampIndex(fieldPtr->rhoGridPtr, rhoMax),
+                 clampIndex(fieldPtr->zGridPtr, zMax)};
+
+    //the cells at the upper edge need the next grid point too
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    for (int i = 0; i < 3; i++) {
+        if (hi[i] < (int) grids[i]->num - 1) {
+            hi[i]++;
+        }
+    }
+    return warm(fieldPtr, mode, lo, hi, LINE_STRIDE);
+}
+
+/**
+ * Time each of a sequence of queries made through a probe, and summarize
+ * how quickly they settle. To measure a cold start, use a new probe of a
+ * newly read (and perhaps warmed) field, and make no queries before this.
+ * The cost of reading the clock is measured and subtracted.
+ * @param probePtr the probe.
+ * @param x the x coordinates, in cm.
+ * @param y the y coordinates, in cm.
+ * @param z the z coordinates, in cm.
+ * @param num the number of queries, at least 2 * CMAG_STEADY_WINDOW.
+ * @param profile upon success, the profile.
+ * @return true on success.
+ */
+bool profileColdStart(FieldProbePtr probePtr, const double *x, const double *y, const double *z, int num,
+                      ColdStartProfile *profile) {
+    if (num < 2 * CMAG_STEADY_WINDOW) {
+        LOG_ERROR("a cold start profile needs at least %d queries", 2 * CMAG_STEADY_WINDOW);
+        return false;
+    }
+
+    double *latency = (double *) malloc(num * sizeof(double));
+    if (latency == NULL) {
+        LOG_ERROR("out of memory profiling %d queries", num);
+        return false;
+    }
+
+    //the cheapest clock read we see is the overhead
+    double overhead = INFINITY;
+    for (int i = 0; i < 100; i++) {
+        double t0 = nowNs();
+        double t1 = nowNs();
+        overhead = fmin(overhead, t1 - t0);
+    }
+
+    FieldValue value;
+    double sum = 0;
+    for (int i = 0; i < num; i++) {
+        double t0 = nowNs();
+        getProbeFieldValue(&value, x[i], y[i], z[i], probePtr);
+        double t1 = nowNs();
+        latency[i] = fmax(0, t1 - t0 - overhead);
+        sum += value.b1 + value.b2 + value.b3;
+    }
+    querySink = sum;
+
+    profile->numQueries = num;
+    profile->firstQueryNs = latency[0];
+    profile->worstNs = latency[0];
+    for (int i = 1; i < num; i++) {
+        profile->worstNs = fmax(profile->worstNs, latency[i]);
+    }
+    if (!median(latency + num / 2, num - num / 2, &(profile->steadyNs))) {
+        free(latency);
+        return false;
+    }
+
+    //the first window that is close enough to steady state
+    profile->queriesToSteady = num;
+    for (int w = 0; w + CMAG_STEADY_WINDOW <= num; w += CMAG_STEADY_WINDOW) {
+        double windowNs;
+        if (!median(latency + w, CMAG_STEADY_WINDOW, &windowNs)) {
+            free(latency);
+            return false;
+        }
+        if (windowNs <= CMAG_STEADY_FACTOR * profile->steadyNs) {
+            profile->queriesToSteady = w;
+            break;
+        }
+    }
+
+    profile->timeToSteadyNs = 0;
+    for (int i = 0; i < profile->queriesToSteady; i++) {
+        profile->timeToSteadyNs += latency[i];
+    }
+
+    free(latency);
+    return true;
+}
+
+/**
+ * Print a cold start profile.
+ * @param profile the profile.
+ * @param stream the output stream.
+ */
+void printColdStartProfile(const ColdStartProfile *profile, FILE *stream) {
+    fprintf(stream, "first query: %.0f ns, worst: %.0f ns, steady state: %.1f ns, "
+                    "reached after %d queries (%.1f us)\n",
+            profile->firstQueryNs, profile->worstNs, profile->steadyNs,
+            profile->queriesToSteady, profile->timeToSteadyNs / 1000);
+}
+
+/**
+ * Warm the grid index box [lo, hi] of a field map.
+ * @param fieldPtr the field map.
+ * @param mode the WARM_ flags.
+ * @param lo the low phi, rho and z indices.
+ * @param hi the high phi, rho and z indices, inclusive.
+ * @param stride bytes between touches.
+ * @return true on success.
+ */
+static bool warm(MagneticFieldPtr fieldPtr, int mode, const int *lo, const int *hi, size_t stride) {
+
+    if (mode & WARM_DERIVED) {
+        GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+        double sum = 0;
+        for (int i = 0; i < 3; i++) {
+            for (unsigned int j = 0; j < grids[i]->num; j++) {
+                sum += grids[i]->values[j];
+            }
+        }
+        querySink = sum;
+    }
+
+    if (mode & (WARM_PAGES | WARM_DERIVED)) {
+        //the local values, and with WARM_DERIVED every other copy as well
+        FieldValuePtr arrays[CMAG_MAX_NUMA_NODES + 1];
+        int numArrays = 0;
+        arrays[numArrays++] = localFieldValues(fieldPtr);
+        if (mode & WARM_DERIVED) {
+            if (arrays[0] != fieldPtr->fieldValues) {
+                arrays[numArrays++] = fieldPtr->fieldValues;
+            }
+            for (int i = 0; i < fieldPtr->numReplicas; i++) {
+                FieldValuePtr replica = fieldPtr->replicas[i];
+                if ((replica != NULL) && (replica != arrays[0]) && (replica != fieldPtr->fieldValues)) {
+                    arrays[numArrays++] = replica;
+                }
+            }
+        }
+
+        WarmList list = {NULL, 0, 0, stride};
+        bool whole = (lo[0] == 0) && (lo[1] == 0) && (lo[2] == 0) &&
+                     (hi[0] == (int) fieldPtr->phiGridPtr->num - 1) &&
+                     (hi[1] == (int) fieldPtr->rhoGridPtr->num - 1) &&
+                     (hi[2] == (int) fieldPtr->zGridPtr->num - 1);
+
+        for (int a = 0; a < numArrays; a++) {
+            adviseWillNeed(arrays[a]);
+            const char *base = (const char *) arrays[a];
+
+            for (int n1 = lo[0]; n1 <= hi[0]; n1++) {
+                for (int n2 = lo[1]; n2 <= hi[1]; n2++) {
+                    size_t first = getCompositeIndex(fieldPtr, n1, n2, lo[2]);
+                    size_t last = getCompositeIndex(fieldPtr, n1, n2, hi[2]);
+                    if (!addRange(&list, base + first * sizeof(FieldValue), (last - first + 1) * sizeof(FieldValue), true)) {
+                        free(list.ranges);
+                        return false;
+                    }
+                }
+            }
+        }
+
+        //a whole array is one range, so split it up between the threads
+        if (whole) {
+            WarmList split = {NULL, 0, 0, stride};
+            int chunks = CMAG_WARM_THREADS * CHUNKS_PER_THREAD;
+            for (int r = 0; r < list.num; r++) {
+                size_t chunk = (list.ranges[r].bytes + chunks - 1) / chunks;
+                chunk = (chunk + PAGE_STRIDE - 1) & ~((size_t) PAGE_STRIDE - 1);
+                for (size_t offset = 0; offset < list.ranges[r].bytes; offset += chunk) {
+                    size_t bytes = list.ranges[r].bytes - offset;
+                    if (!addRange(&split, list.ranges[r].start + offset, (bytes < chunk) ? bytes : chunk, false)) {
+                        free(split.ranges);
+                        free(list.ranges);
+                        return false;
+                    }
+                }
+            }
+            free(list.ranges);
+            list = split;
+        }
+
+        touchAll(&list);
+        free(list.ranges);
+    }
+
+    if (mode & WARM_QUERIES) {
+        warmQueries(fieldPtr, lo, hi);
+    }
+    return true;
+}
+
+/**
+ * Add a range to a list.
+ * @param list the list.
+ * @param start the start of the range.
+ * @param bytes the size of the range.
+ * @param merge if true, extend the last range instead if they are contiguous.
+ * @return false if out of memory.
+ */
+static bool addRange(WarmList *list, const char *start, size_t bytes, bool merge) {
+    if (merge && (list->num > 0)) {
+        WarmRange *last = list->ranges + list->num - 1;
+        if (last->start + last->bytes == start) {
+            last->bytes += bytes;
+            return true;
+        }
+    }
+
+    if (list->num == list->capacity) {
+        int capacity = (list->capacity == 0) ? 64 : 2 * list->capacity;
+        WarmRange *ranges = (WarmRange *) realloc(list->ranges, capacity * sizeof(WarmRange));
+        if (ranges == NULL) {
+            return false;
+        }
+        list->ranges = ranges;
+        list->capacity = capacity;
+    }
+
+    list->ranges[list->num].start = start;
+    list->ranges[list->num].bytes = bytes;
+    list->num++;
+    return true;
+}
+
+/**
+ * Touch every range of a list, dealing the ranges out to up to
+ * CMAG_WARM_THREADS threads.
+ * @param list the ranges.
+ */
+static void touchAll(WarmList *list) {
+    int numRanges = (list->num < CMAG_WARM_THREADS) ? list->num : CMAG_WARM_THREADS;
+    int numThreads = numWorkers(0, (size_t) numRanges);
+    WarmJob jobs[CMAG_WARM_THREADS];
+
+    for (int t = 0; t < numThreads; t++) {
+        jobs[t].list = list;
+        jobs[t].first = t;
+        jobs[t].step = numThreads;
+        jobs[t].sum = 0;
+    }
+    runWorkers(touchRanges, jobs, sizeof(WarmJob), numThreads);
+
+    unsigned long sum = 0;
+    for (int t = 0; t < numThreads; t++) {
+        sum += jobs[t].sum;
+    }
+    warmSink = sum;
+}
+
+/**
+ * Touch a thread's share of the ranges.
+ * @param arg the WarmJob.
+ * @return NULL.
+ */
+static void *touchRanges(void *arg) {
+    WarmJob *job = (WarmJob *) arg;
+    WarmList *list = job->list;
+    unsigned long sum = 0;
+
+    for (int r = job->first; r < list->num; r += job->step) {
+        const volatile char *start = list->ranges[r].start;
+        size_t bytes = list->ranges[r].bytes;
+        for (size_t offset = 0; offset < bytes; offset += list->stride) {
+            sum += start[offset];
+        }
+        sum += start[bytes - 1];
+    }
+
+    job->sum = sum;
+    return NULL;
+}
+
+/**
+ * Ask the kernel to read in an array's pages ahead of the touches,
+ * which matters if they have been swapped out. Only arrays with a
+ * mapping of their own are advised.
+ * @param ptr the array.
+ */
+static void adviseWillNeed(const void *ptr) {
+#ifdef MADV_WILLNEED
+    FieldArrayInfo info;
+    if (getFieldArrayInfo(ptr, &info) && info.mapped) {
+        madvise(info.base, info.mappedBytes, MADV_WILLNEED);
+    }
+#endif
+}
+
+/**
+ * Make CMAG_WARM_QUERIES queries spread over a grid index box, through a
+ * probe of the calling thread.
+ * @param fieldPtr the field map.
+ * @param lo the low phi, rho and z indices.
+ * @param hi the high phi, rho and z indices, inclusive.
+ */
+static void warmQueries(MagneticFieldPtr fieldPtr, const int *lo, const int *hi) {
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+
+    double minVal[3], range[3];
+    for (int i = 0; i < 3; i++) {
+        minVal[i] = grids[i]->values[lo[i]];
+        range[i] = grids[i]->values[hi[i]] - minVal[i];
+    }
+
+    //a low discrepancy sequence, so as not to disturb the caller's random numbers
+    const double alpha[3] = {0.8191725133961645, 0.6710436067037893, 0.5497004779019703};
+    double u[3] = {0.5, 0.5, 0.5};
+    double sum = 0;
+    FieldValue value;
+
+    for (int i = 0; i < CMAG_WARM_QUERIES; i++) {
+        for (int k = 0; k < 3; k++) {
+            u[k] += alpha[k];
+            u[k] -= floor(u[k]);
+        }
+        double x, y;
+        cylindricalToCartesian(&x, &y, minVal[0] + u[0] * range[0], minVal[1] + u[1] * range[1]);
+        getProbeFieldValue(&value, x, y, minVal[2] + u[2] * range[2], probePtr);
+        sum += value.b1 + value.b2 + value.b3;
+    }
+
+    querySink = sum;
+    freeProbe(probePtr);
+}
+
+/**
+ * Get the grid index of a coordinate, clamped to the grid.
+ * @param gridPtr the grid.
+ * @param value the coordinate.
+ * @return the index of the grid point at or below the value.
+ */
+static int clampIndex(GridPtr gridPtr, double value) {
+    if ((gridPtr->num < 2) || !(value > gridPtr->minVal)) {
+        return 0;
+    }
+    double index = floor((value - gridPtr->minVal) / gridPtr->delta);
+    return (index >= gridPtr->num - 1) ? (int) gridPtr->num - 1 : (int) index;
+}
+
+/**
+ * A monotonic clock.
+ * @return the time in ns.
+ */
+static double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1.0e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+/**
+ * The median of some values, which are left unchanged.
+ * @param values the values.
+ * @param num the number of values.
+ * @param result upon success, the median.
+ * @return false if there was no memory to sort the values.
+ */
+static bool median(const double *values, int num, double *result) {
+    double *sorted = (double *) malloc(num * sizeof(double));
+    if (sorted == NULL) {
+        LOG_ERROR("out of memory taking the median of %d values", num);
+        return false;
+    }
+
+    memcpy(sorted, values, num * sizeof(double));
+    sortArray(sorted, num);
+    *result = (num % 2) ? sorted[num / 2] : 0.5 * (sorted[num / 2 - 1] + sorted[num / 2]);
+    free(sorted);
+    return true;
+}
+
+/**
+ * Unit test for warming and cold start profiles. Warming must leave the
+ * field unchanged, and the profile must be self consistent.
+ * @return NULL if successful, or an error message.
+ */
+char *warmUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    size_t bytes = fieldPtr->numValues * sizeof(FieldValue);
+    unsigned int crc = crc32c(0, fieldPtr->fieldValues, bytes);
+
+    mu_assert("Could not warm the whole field", warmField(fieldPtr, WARM_ALL));
+    mu_assert("Could not warm the field pages", warmField(fieldPtr, WARM_PAGES));
+
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+    double rhoMid = 0.5 * (rhoGrid->minVal + rhoGrid->maxVal);
+    double zMid = 0.5 * (zGrid->minVal + zGrid->maxVal);
+    mu_assert("Could not warm a region", warmFieldRegion(fieldPtr, WARM_ALL, 0, 10, rhoGrid->minVal, rhoMid,
+                                                         zMid, zGrid->maxVal));
+    mu_assert("Could not warm a region larger than the grid", warmFieldRegion(fieldPtr, WARM_PAGES, -1000, 1000,
+                                                                              -1000, 1000, -1000, 1000));
+    mu_assert("Warmed an empty region", !warmFieldRegion(fieldPtr, WARM_PAGES, 0, 10, rhoMid, rhoGrid->minVal,
+                                                         zGrid->minVal, zMid));
+    mu_assert("Warming changed the field", crc32c(0, fieldPtr->fieldValues, bytes) == crc);
+
+    int num = 2000;
+    double *x = (double *) malloc(3 * num * sizeof(double));
+    double *y = x + num;
+    double *z = y + num;
+    for (int i = 0; i < num; i++) {
+        cylindricalToCartesian(x + i, y + i, randomDouble(0, 360), randomDouble(rhoGrid->minVal, rhoGrid->maxVal));
+        z[i] = randomDouble(zGrid->minVal, zGrid->maxVal);
+    }
+
+    ColdStartProfile profile;
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    mu_assert("Profiled too few queries", !profileColdStart(probePtr, x, y, z, CMAG_STEADY_WINDOW, &profile));
+    mu_assert("Could not profile a cold start", profileColdStart(probePtr, x, y, z, num, &profile));
+    freeProbe(probePtr);
+    free(x);
+
+    mu_assert("Wrong number of profiled queries", profile.numQueries == num);
+    mu_assert("Bad steady state latency", profile.steadyNs >= 0);
+    mu_assert("The worst query is not the worst", (profile.worstNs >= profile.firstQueryNs) &&
+                                                  (profile.worstNs >= profile.steadyNs));
+    mu_assert("Bad queries to steady state", (profile.queriesToSteady >= 0) && (profile.queriesToSteady <= num));
+    mu_assert("Bad time to steady state", (profile.timeToSteadyNs >= 0) &&
+                                          (profile.timeToSteadyNs <= profile.queriesToSteady * profile.worstNs));
+
+    fprintf(stdout, "\nPASSED warmUnitTest\n");
+    return NULL;
+}
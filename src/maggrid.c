@@ -27,18 +27,37 @@ GridPtr createGrid(const char *name, const double minVal, const double maxVal,
 
     gridPtr = (GridPtr) malloc(sizeof(Grid));
 
-    stringCopy(&(gridPtr->name), name);
+    char *nameCopy;
+    stringCopy(&nameCopy, name);
+    double *values = (double *) malloc(((num < 2) ? 1 : num) * sizeof(double));
+
+    initGrid(gridPtr, nameCopy, values, minVal, maxVal, num);
+    return gridPtr;
+}
+
+/**
+ * Initialize a uniform coordinate grid in storage provided by the caller,
+ * for example a field map's arena.
+ * @param gridPtr the grid to initialize.
+ * @param name the name of the coordinate, kept (not copied) by the grid.
+ * @param values space for the values, at least max(num, 1) of them.
+ * @param minVal the minimum value of the grid.
+ * @param maxVal the maximum value of the grid.
+ * @param num the number of points on the grid, including the ends.
+ */
+void initGrid(GridPtr gridPtr, char *name, double *values, const double minVal, const double maxVal,
+              const unsigned int num) {
+    gridPtr->name = name;
     gridPtr->minVal = minVal;
     gridPtr->maxVal = maxVal;
     gridPtr->num = num;
+    gridPtr->values = values;
 
     if (num < 2) { //happens for solenoid q1 only
         gridPtr->delta = INFINITY;
-        gridPtr->values = (double *) malloc(sizeof(double));
         gridPtr->values[0] = 0;
     } else {
         gridPtr->delta = (maxVal - minVal) / (num - 1);
-        gridPtr->values = (double *) malloc(num * sizeof(double));
 
         gridPtr->values[0] = minVal;
         gridPtr->values[num - 1] = maxVal;
@@ -47,19 +66,28 @@ GridPtr createGrid(const char *name, const double minVal, const double maxVal,
             gridPtr->values[i] = minVal + i * gridPtr->delta;
         }
     }
-
-    return gridPtr;
 }
 
 /**
- * Get a string representation of the grid.
+ * Get a string representation of the grid. The caller must free the string;
+ * gridString writes into caller storage instead.
  * @param gridPtr the pointer to the coordinate grid.
  * @return  a string representation of the grid.
  */
 char *gridStr(GridPtr gridPtr) {
-    char *str = (char*) malloc(128);
+    char *str = (char*) malloc(GRIDSTRLEN);
+    return gridString(gridPtr, str, GRIDSTRLEN);
+}
 
-    sprintf(str, "%3s min: %6.1f  max: %6.1f  Np: %4d  delta: %6.1f",
+/**
+ * Write a string representation of the grid into caller storage.
+ * @param gridPtr the pointer to the coordinate grid.
+ * @param str space for the string, GRIDSTRLEN is always enough.
+ * @param len the size of str.
+ * @return str, for use as an argument.
+ */
+char *gridString(GridPtr gridPtr, char *str, size_t len) {
+    snprintf(str, len, "%3s min: %6.1f  max: %6.1f  Np: %4d  delta: %6.1f",
             gridPtr->name, gridPtr->minVal, gridPtr->maxVal, gridPtr->num, gridPtr->delta);
     return str;
 }
@@ -85,6 +113,11 @@ int getIndex(const GridPtr gridPtr, const double val) {
     else {
         double fract = (val - gridPtr->minVal) / gridPtr->delta;
         index = (int) (fract);
+
+        //the max value itself belongs to the last cell
+        if (index > (int) gridPtr->num - 2) {
+            index = gridPtr->num - 2;
+        }
     }
     return index;
 }
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include "magfield.h"
 #include "magfieldio.h"
@@ -14,13 +15,102 @@
 #include "magfieldutil.h"
 #include "magfielddraw.h"
 #include "svg.h"
+#include "raster.h"
+#include "contour.h"
 #include "mapcolor.h"
+#include "magfieldgen.h"
+#include "magfieldlog.h"
+#include "magfieldmem.h"
+#include "magfieldnuma.h"
+#include "magfieldwarm.h"
+#include "magfieldcomposite.h"
+#include "magfieldintegral.h"
+#include "magfieldbdl.h"
+#include "magfieldpyramid.h"
+#include "magfieldmagnitude.h"
+#include "magfieldlines.h"
+#include "magfieldstats.h"
+#include "magfieldtrace.h"
 
 //the three fields we'll try to initialize
 static MagneticFieldPtr symmetricTorus;
 static MagneticFieldPtr fullTorus;
 static MagneticFieldPtr solenoid;
 
+//true if we fell back to the generated maps
+static bool synthetic = false;
+
+//local prototypes
+static char *allTests(void);
+static char *allocationUnitTest(void);
+
+//the drawing threads of the steady state render
+#define RENDER_THREADS 2
+
+//With glibc we count heap allocations by interposing the allocator of this
+//program (not the library), forwarding to glibc's own. Elsewhere, or under
+//the address sanitizer which interposes the allocator itself, the count is
+//unavailable and allocationUnitTest is skipped.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define CMAG_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static long _allocations;
+static size_t _largestAllocation;
+
+/**
+ * Count an allocation, keeping track of the largest one asked for.
+ * @param size the size of the allocation in bytes.
+ */
+static void countAllocation(size_t size) {
+    __atomic_add_fetch(&_allocations, 1, __ATOMIC_RELAXED);
+    size_t largest = __atomic_load_n(&_largestAllocation, __ATOMIC_RELAXED);
+    while ((size > largest) &&
+           !__atomic_compare_exchange_n(&_largestAllocation, &largest, size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void *malloc(size_t size) {
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+    size_t total;
+    countAllocation(__builtin_mul_overflow(num, size, &total) ? SIZE_MAX : total);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/**
+ * The number of heap allocations made so far by the program.
+ * @return the count of malloc, calloc and realloc calls.
+ */
+static long allocations() {
+    return __atomic_load_n(&_allocations, __ATOMIC_RELAXED);
+}
+
+/**
+ * The largest single allocation asked for since the last call.
+ * @return the size in bytes of the largest allocation.
+ */
+static size_t largestAllocation() {
+    return __atomic_exchange_n(&_largestAllocation, 0, __ATOMIC_RELAXED);
+}
+#endif
+
 
 /**
  * The main method of the test application.
@@ -28,14 +118,15 @@ static MagneticFieldPtr solenoid;
 int main(int argc, const char * argv[]) {
     
     //paths to field maps
-    char *solenoidPath = (char*) malloc(255);
-    char *torusSymmetricPath = (char*) malloc(255);
-    char *torusFullPath = (char*) malloc(255);
+    char *solenoidPath = (char*) malloc(512);
+    char *torusSymmetricPath = (char*) malloc(512);
+    char *torusFullPath = (char*) malloc(512);
 
 
     //for testing will look for mag fields in either the first
     // command line argument, if provided, or in $HOME/magfield.
     //Here we build the paths
+    char homeDir[255];
     const char *dataDir;
 
     if (argc > 1) {
@@ -43,15 +134,20 @@ int main(int argc, const char * argv[]) {
         fprintf(stdout, "Using command line data directory: [%s]", dataDir);
     }
     else {
-        dataDir = strcat(getenv("HOME"), "/magfield");
+        snprintf(homeDir, sizeof(homeDir), "%s/magfield", getenv("HOME"));
+        dataDir = homeDir;
     }
 
-    //build the full paths
-    sprintf(solenoidPath, "%s/Symm_solenoid_r601_phi1_z1201_13June2018.dat", dataDir);
-    sprintf(torusSymmetricPath, "%s/Symm_torus_r2501_phi16_z251_24Apr2018.dat", dataDir);
-    sprintf(torusFullPath, "%s/Full_torus_r251_phi181_z251_03March2020.dat", dataDir);
+    //build the full paths. Where the CLAS12 maps are missing
+    //use the ones written by cMagGenerate, if present.
+    synthetic |= mapFilePath(solenoidPath, dataDir, "Symm_solenoid_r601_phi1_z1201_13June2018.dat",
+                             SYNTHETIC_SOLENOID);
+    synthetic |= mapFilePath(torusSymmetricPath, dataDir, "Symm_torus_r2501_phi16_z251_24Apr2018.dat",
+                             SYNTHETIC_SYMMETRIC_TORUS);
+    synthetic |= mapFilePath(torusFullPath, dataDir, "Full_torus_r251_phi181_z251_03March2020.dat",
+                             SYNTHETIC_FULL_TORUS);
 
-    fprintf(stdout, "\nTesting the cMag library\n");
+    fprintf(stdout, "\nTesting the cMag library%s\n", synthetic ? " (synthetic maps)" : "");
 
     //try to read the symmetric torus
     symmetricTorus = initializeTorus(torusSymmetricPath);
@@ -75,13 +171,15 @@ int main(int argc, const char * argv[]) {
         return 1;
     }
 
+    char *testResult = allTests();
+    if (testResult != NULL) {
+        fprintf(stdout, "\nFAILED: %s\n", testResult);
+        return 1;
+    }
+    setAlgorithm(INTERPOLATION);
 
 
 
-    FieldValuePtr torusValuePtr = (FieldValuePtr) malloc(sizeof (FieldValue));
-    FieldValuePtr solenoidValuePtr = (FieldValuePtr) malloc(sizeof (FieldValue));
-    FieldValuePtr combinedValuePtr = (FieldValuePtr) malloc(sizeof (FieldValue));    
-
     double rho = 60.0;
     double phi = 0.0;
     double z = 400.0;
@@ -97,8 +195,8 @@ int main(int argc, const char * argv[]) {
     //getFieldValueTorus(torusValuePtr, phiRad, rhoRad, z, fullTorus);
     //getFieldValueSolenoid(solenoidValuePtr, phiRad, rhoRad, z, solenoid);
 
-    getCompositeFieldValue(combinedValuePtr, rho*cosPhi, rho*sinPhi, z, fullTorus, solenoid);
-    double magnitude = fieldMagnitude(combinedValuePtr);
+    FieldValue combined = compositeFieldValueAt(rho*cosPhi, rho*sinPhi, z, fullTorus, solenoid);
+    double magnitude = fieldMagnitude(&combined);
     
     //double tbx = torusValuePtr->b1;
     //double tby = torusValuePtr->b2;
@@ -109,21 +207,214 @@ int main(int argc, const char * argv[]) {
     //double sbz = solenoidValuePtr->b3;
 
 
-    printf("\n", 0.0);
-    printf("\n", 0.0);
+    printf("\n");
     printf("Total Field Magnitude is %lf \n", magnitude);
 
+    //the queries of the tests after the stats test, if counted
+    if (CMAG_STATS) {
+        printFieldStats(stdout);
+    }
+
+    fprintf(stdout, "\nTests run: %d\nProgram ran successfully.\n", mtests_run);
     return 0;
-    //return (testResult == NULL) ? 0 : 1;
 }
 
+/**
+ * Run all the unit tests.
+ * @return an error message if a test fails, or NULL if they all pass.
+ */
+static char *allTests() {
+    mu_run_test(gridUnitTest);
+    mu_run_test(randomUnitTest);
+    mu_run_test(conversionUnitTest);
+    mu_run_test(binarySearchUnitTest);
+    mu_run_test(workersUnitTest);
+    mu_run_test(generatorUnitTest);
+    mu_run_test(logUnitTest);
+    mu_run_test(statsUnitTest);
+    mu_run_test(memUnitTest);
+    mu_run_test(rasterUnitTest);
+    mu_run_test(svgUnitTest);
+    mu_run_test(colorMapUnitTest);
+    mu_run_test(contourUnitTest);
+
+    MagneticFieldPtr fields[] = {solenoid, symmetricTorus, fullTorus};
+    for (int i = 0; i < 3; i++) {
+        testFieldPtr = fields[i];
+        mu_run_test(compositeIndexUnitTest);
+        mu_run_test(containsUnitTest);
+        mu_run_test(coordinatesUnitTest);
+    }
 
+    //interpolation reproduces a field linear in each coordinate, for 2D and 3D maps
+    mu_run_test(interpolationUnitTest);
+
+    //recorded queries replay to the same values, for 2D and 3D maps
+    testFieldPtr = solenoid;
+    mu_run_test(traceUnitTest);
+    testFieldPtr = fullTorus;
+    mu_run_test(traceUnitTest);
+
+    //round trip through the version 2 format (the solenoid is the smallest map)
+    testFieldPtr = solenoid;
+    mu_run_test(formatUnitTest);
+
+    //grids that overflow or have no points are rejected by both readers
+    mu_run_test(headerUnitTest);
+
+    //a reread map must be wholly inside its arena, for 2D and 3D maps
+    mu_run_test(arenaUnitTest);
+    testFieldPtr = fullTorus;
+    mu_run_test(arenaUnitTest);
+
+    //replicas must read the same as the original, for 2D and 3D cells
+    testFieldPtr = solenoid;
+    mu_run_test(numaUnitTest);
+    testFieldPtr = fullTorus;
+    mu_run_test(numaUnitTest);
+
+    testFieldPtr = fullTorus;
+    mu_run_test(warmUnitTest);
+
+    //any number of maps, with queries sent only to the maps that can contain them
+    testFieldPtr = solenoid;
+    mu_run_test(compositeUnitTest);
+    testFieldPtr = fullTorus;
+    mu_run_test(compositeUnitTest);
+
+    //line integrals by walking the cells, and field lines, for 2D, symmetric
+    //and full maps
+    for (int i = 0; i < 3; i++) {
+        testFieldPtr = fields[i];
+        mu_run_test(integralUnitTest);
+        mu_run_test(bdlUnitTest);
+        mu_run_test(pyramidUnitTest);
+        mu_run_test(magnitudeUnitTest);
+        mu_run_test(fieldLineUnitTest);
+    }
 
+    //images must not depend on the number of drawing threads
+    testFieldPtr = symmetricTorus;
+    mu_run_test(drawUnitTest);
+    testFieldPtr = fullTorus;
+    mu_run_test(drawUnitTest);
+
+    //steady state evaluation and rendering must not touch the heap
+    mu_run_test(allocationUnitTest);
+
+    //the nearest neighbor reference values come from the CLAS12 maps
+    if (!synthetic) {
+        testFieldPtr = solenoid;
+        mu_run_test(nearestNeighborUnitTest);
+        testFieldPtr = symmetricTorus;
+        mu_run_test(nearestNeighborUnitTest);
+    }
+    else {
+        fprintf(stdout, "\nSKIPPED nearestNeighborUnitTest (needs the CLAS12 solenoid and torus maps)\n");
+    }
 
+    return NULL;
+}
 
+/**
+ * A unit test that steady state evaluation, through every value API and
+ * for 2D and 3D maps, makes no heap allocations, and that rendering an
+ * image makes the same allocations whatever its size, and that maps with
+ * bad grid sizes are rejected without allocating their grids.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+static char *allocationUnitTest() {
+#ifdef CMAG_COUNT_ALLOCS
+    const int num = 256;
+    double x[num], y[num], z[num];
+    float bx[num], by[num], bz[num];
+    FieldValue values[num];
+
+    //points along a line through both maps, some outside them
+    for (int i = 0; i < num; i++) {
+        x[i] = -300.0 + 600.0*i/num;
+        y[i] = 0.5*x[i] + 10.0;
+        z[i] = -200.0 + 800.0*i/num;
+    }
 
+    FieldProbePtr torusProbe = createProbe(fullTorus);
+    FieldProbePtr solenoidProbe = createProbe(solenoid);
+
+    //one pass to get anything lazy out of the way
+    getProbeFieldValues(values, x, y, z, num, torusProbe);
+
+    long before = allocations();
+    double sum = 0;
+    for (int pass = 0; pass < 20; pass++) {
+        for (int i = 0; i < num; i++) {
+            FieldValue value = fieldValueAt(x[i], y[i], z[i], fullTorus);
+            sum += value.b1;
+            value = probeFieldValueAt(x[i], y[i], z[i], solenoidProbe);
+            sum += value.b2;
+            value = compositeFieldValueAt(x[i], y[i], z[i], fullTorus, solenoid);
+            sum += value.b3;
+            value = compositeProbeFieldValueAt(x[i], y[i], z[i], torusProbe, solenoidProbe);
+            sum += fieldMagnitude(&value);
+            getCompositeFieldValue(&value, x[i], y[i], z[i], symmetricTorus, NULL);
+            sum += value.b1;
+        }
+        getProbeFieldValues(values, x, y, z, num, torusProbe);
+        getProbeFieldComponents(x, y, z, num, solenoidProbe, bx, by, bz);
+        sum += values[num/2].b1 + bz[num/2];
+    }
+    long evalAllocs = allocations() - before;
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+
+    mu_assert("Evaluation gave a non-finite sum", isfinite(sum));
+    mu_assert("Steady state evaluation allocated from the heap", evalAllocs == 0);
+
+    //rendering: the first image builds the shared color map. Images of
+    //three sizes, as rasters and as rectangles, must then make the same
+    //allocations: the per image setup, none per pixel or per row
+    const char *path = "cMagAllocUnitTest.svg";
+    int drawThreads = getDrawThreads();
+    bool drawRaster = getDrawRaster();
+    setDrawThreads(RENDER_THREADS);
+    createSVGImageFixedZ((char *) path, 50, fullTorus, solenoid);
+    long renderAllocs[2][3];
+    for (int raster = 0; raster < 2; raster++) {
+        setDrawRaster(raster == 1);
+        for (int size = 0; size < 3; size++) {
+            before = allocations();
+            if (size == 0) {
+                createSVGImageFixedZ((char *) path, 50, fullTorus, solenoid);   //240 x 240 cm
+            }
+            else if (size == 1) {
+                createSVGImageFixedZ((char *) path, 150, fullTorus, solenoid);  //720 x 720 cm
+            }
+            else {
+                createSVGImageFixedPhi((char *) path, 10, fullTorus, solenoid); //600 x 360 cm
+            }
+            renderAllocs[raster][size] = allocations() - before;
+        }
+    }
+    setDrawThreads(drawThreads);
+    setDrawRaster(drawRaster);
+    remove(path);
+
+    for (int raster = 0; raster < 2; raster++) {
+        mu_assert("Rendering allocations depend on the image size",
+                  (renderAllocs[raster][1] == renderAllocs[raster][0]) &&
+                  (renderAllocs[raster][2] == renderAllocs[raster][0]));
+    }
 
-
-
-
-
+    //maps with bad grid sizes are rejected before anything is allocated for the grid
+    largestAllocation();
+    char *headerResult = headerUnitTest();
+    mu_assert(headerResult, headerResult == NULL);
+    mu_assert("Rejecting a bad grid size allocated a grid", largestAllocation() < (1 << 20));
+
+    fprintf(stdout, "\nPASSED allocationUnitTest (%ld raster, %ld rectangle render allocations)\n",
+            renderAllocs[1][0], renderAllocs[0][0]);
+#else
+    fprintf(stdout, "\nSKIPPED allocationUnitTest (allocations cannot be counted)\n");
+#endif
+    return NULL;
+}
@@ -2,94 +2,444 @@
 // Created by David Heddle on 5/30/20.
 // Used only to make the svg picture of the map
 //
+// A value is colored in constant time through a table over the range of
+// the map: bins narrow enough to hold at most one threshold, each with
+// the number of thresholds above it, so a lookup is one multiply, one
+// table read and one comparison. Maps whose thresholds are too close for
+// a table of reasonable size use a branchless binary search instead.
+//
 
 #include "mapcolor.h"
 #include "magfieldutil.h"
+#include "munittest.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+//the most bins of a lookup table
+#define MAX_COLOR_BINS 65536
+
+//the default color map, built once and shared. If building it runs out
+//of memory the next request tries again.
+static ColorMap _defaultColorMap;
+static bool _defaultReady = false;
+static pthread_mutex_t _defaultLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *defaultColors[] = {
+        "#7f007f","#8e0070","#9c0062","#aa0054","#b80046","#c70038",
+        "#d5002a","#e3001c","#f1000e","#ff0000","#ff0f00","#ff1d00",
+        "#ff2b00","#ff3900","#ff4800","#ff5600","#ff6400","#ff7200",
+        "#ff8000","#ff8f00","#ff9d00","#ffab00","#ffb900","#ffc700",
+        "#ffd500","#ffe300","#fff100","#ffff00","#f1f306","#e3e80c",
+        "#d6dd11","#c8d217","#bac71d","#adbc22","#9fb128","#91a62e",
+        "#849b33","#799c32","#6e9d30","#649e30","#599f2f","#4f9f2e",
+        "#44a02d","#3aa12c","#2fa22b","#25a22a","#35a93f","#44b054",
+        "#54b769","#63be7e","#73c593","#82cca8","#92d3bd","#a1dad2",
+        "#b0e0e6","#b9e4e5","#c2e7e5","#cbeae5","#d4eee4","#d7f1e4",
+        "#dcf1e4","#d9f1e4","#dbf1e4","#ddf1e4","#dff1e4","#f1f1e4",
+        "#f3f1e4","#f5f1e4","#f7f1e4","#f9f1e4","#fbf1e4","#fdf1e4",
+        "#fef4f2"};
+
+static double defaultValues[] = {
+        66.00000, 61.63079, 57.55083, 53.74095, 50.18330, 46.86116,
+        43.75894, 40.86209, 38.15702, 35.63102, 33.27224, 31.06962,
+        29.01280, 27.09215, 25.29865, 23.62388, 22.05997, 20.59960,
+        19.23591, 17.96249, 16.77337, 15.66297, 14.62608, 13.65783,
+        12.75368, 11.90939, 11.12098, 10.38477, 9.69730, 9.05534,
+        8.45588, 7.89610, 7.37337, 6.88526, 6.42945, 6.00382,
+        5.60637, 5.23523, 4.88866, 4.56503, 4.26282, 3.98062,
+        3.71711, 3.47103, 3.24125, 3.02668, 2.82631, 2.63921,
+        2.46450, 2.30135, 2.14900, 2.00674, 1.87389, 1.74984,
+        1.63400, 1.52583, 1.42482, 1.33050, 1.24242, 1.16017,
+        1.08337, 1.01165, 0.94468, 0.88214, 0.82375, 0.76921,
+        0.71829, 0.67074, 0.62634, 0.58488, 0.54616, 0.51000,
+        0.47624, 0.1};
+
+//local prototypes
+static bool buildDefaultColorMap(void);
+static bool prepareColorMap(ColorMapPtr);
+static bool parseColor(const char *, unsigned int *);
+static int countAbove(ColorMapPtr, double);
+static int searchAbove(ColorMapPtr, double);
 
 /**
- * Get a color from a color map.
+ * Get the index of the color of a value in a color map's packed colors.
  * @param cmapPtr a valid pointer to a color map.
  * @param value the value to convert into a color.
- * @return the color in "#rrggbb" format.
+ * @return 0 for values above the map, 1 to numColors for its colors, and
+ * numColors + 1 for values at or below its minimum (and NaN).
  */
-char *getColor(ColorMapPtr cmapPtr, double value) {
+int getColorIndex(ColorMapPtr cmapPtr, double value) {
 
     //the values are in descending order
 
     if (value > cmapPtr->values[0]) {
-        return "black";
+        return 0;
     }
-    if (value <= cmapPtr->values[cmapPtr->numColors]) {
-        return "white";
+    if (!(value > cmapPtr->values[cmapPtr->numColors])) {
+        return cmapPtr->numColors + 1;
     }
+    return 1 + countAbove(cmapPtr, value);
+}
 
-    int index;
-    for (index = 0; index < cmapPtr->numColors; index++) {
-        if (cmapPtr->values[index+1] < value) {
-            break;
-        }
+/**
+ * Get a color from a color map.
+ * @param cmapPtr a valid pointer to a color map.
+ * @param value the value to convert into a color.
+ * @return the color in "#rrggbb" format, or the map's too big or too small color.
+ */
+char *getColor(ColorMapPtr cmapPtr, double value) {
+    int index = getColorIndex(cmapPtr, value);
+    if (index == 0) {
+        return cmapPtr->tooBigColor;
     }
-    return cmapPtr->colors[index];
+    if (index > cmapPtr->numColors) {
+        return cmapPtr->tooSmallColor;
+    }
+    return cmapPtr->colors[index - 1];
 }
 
+/**
+ * Get a color from a color map as red, green and blue bytes.
+ * @param cmapPtr a valid pointer to a color map.
+ * @param value the value to convert into a color.
+ * @param rgb upon return, the three components [0..255].
+ */
+void getColorRGB(ColorMapPtr cmapPtr, double value, unsigned char *rgb) {
+    unsigned int packed = cmapPtr->packed[getColorIndex(cmapPtr, value)];
+    rgb[0] = (unsigned char) (packed >> 16);
+    rgb[1] = (unsigned char) (packed >> 8);
+    rgb[2] = (unsigned char) packed;
+}
 
 /**
- * Get the default color map optimized for displaying torus and solenoid
- * @return he default color map.
+ * Color many values at once, into packed RGB, three bytes per value.
+ * This is the inner loop of the raster images.
+ * @param cmapPtr a valid pointer to a color map.
+ * @param values the values.
+ * @param num the number of values.
+ * @param rgb upon return, the 3 * num components [0..255].
+ */
+void colorize(ColorMapPtr cmapPtr, const double *values, size_t num, unsigned char *rgb) {
+    const unsigned int *packed = cmapPtr->packed;
+    double top = cmapPtr->values[0];
+    double bottom = cmapPtr->values[cmapPtr->numColors];
+    int tooSmall = cmapPtr->numColors + 1;
+
+    for (size_t i = 0; i < num; i++) {
+        double value = values[i];
+        int index = (value > top) ? 0 : (!(value > bottom) ? tooSmall : 1 + countAbove(cmapPtr, value));
+        unsigned int color = packed[index];
+        rgb[0] = (unsigned char) (color >> 16);
+        rgb[1] = (unsigned char) (color >> 8);
+        rgb[2] = (unsigned char) color;
+        rgb += 3;
+    }
+}
+
+/**
+ * Get the default color map optimized for displaying torus and solenoid.
+ * The map is built on the first call and shared after that, so drawing
+ * does not allocate a new one per image. It must not be freed.
+ * @return the default color map, or NULL if there was no memory to build it.
  */
 ColorMapPtr defaultColorMap() {
+    if (!__atomic_load_n(&_defaultReady, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&_defaultLock);
+        if (!_defaultReady) {
+            __atomic_store_n(&_defaultReady, buildDefaultColorMap(), __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&_defaultLock);
+    }
+    return _defaultReady ? &_defaultColorMap : NULL;
+}
 
-    ColorMapPtr cmapPtr = (ColorMapPtr) malloc(sizeof(ColorMap));
-
-    int colorlen = 73;
-    cmapPtr->numColors = colorlen;
-    stringCopy(&(cmapPtr->tooSmallColor), "#ffffff");
-    stringCopy(&(cmapPtr->tooBigColor), "#000000");
-
-    char* colors[] = {
-            "#7f007f","#8e0070","#9c0062","#aa0054","#b80046","#c70038",
-            "#d5002a","#e3001c","#f1000e","#ff0000","#ff0f00","#ff1d00",
-            "#ff2b00","#ff3900","#ff4800","#ff5600","#ff6400","#ff7200",
-            "#ff8000","#ff8f00","#ff9d00","#ffab00","#ffb900","#ffc700",
-            "#ffd500","#ffe300","#fff100","#ffff00","#f1f306","#e3e80c",
-            "#d6dd11","#c8d217","#bac71d","#adbc22","#9fb128","#91a62e",
-            "#849b33","#799c32","#6e9d30","#649e30","#599f2f","#4f9f2e",
-            "#44a02d","#3aa12c","#2fa22b","#25a22a","#35a93f","#44b054",
-            "#54b769","#63be7e","#73c593","#82cca8","#92d3bd","#a1dad2",
-            "#b0e0e6","#b9e4e5","#c2e7e5","#cbeae5","#d4eee4","#d7f1e4",
-            "#dcf1e4","#d9f1e4","#dbf1e4","#ddf1e4","#dff1e4","#f1f1e4",
-            "#f3f1e4","#f5f1e4","#f7f1e4","#f9f1e4","#fbf1e4","#fdf1e4",
-            "#fef4f2"};
-
-
-
-    double values[] = {
-            66.00000, 61.63079, 57.55083, 53.74095, 50.18330, 46.86116,
-            43.75894, 40.86209, 38.15702, 35.63102, 33.27224, 31.06962,
-            29.01280, 27.09215, 25.29865, 23.62388, 22.05997, 20.59960,
-            19.23591, 17.96249, 16.77337, 15.66297, 14.62608, 13.65783,
-            12.75368, 11.90939, 11.12098, 10.38477, 9.69730, 9.05534,
-            8.45588, 7.89610, 7.37337, 6.88526, 6.42945, 6.00382,
-            5.60637, 5.23523, 4.88866, 4.56503, 4.26282, 3.98062,
-            3.71711, 3.47103, 3.24125, 3.02668, 2.82631, 2.63921,
-            2.46450, 2.30135, 2.14900, 2.00674, 1.87389, 1.74984,
-            1.63400, 1.52583, 1.42482, 1.33050, 1.24242, 1.16017,
-            1.08337, 1.01165, 0.94468, 0.88214, 0.82375, 0.76921,
-            0.71829, 0.67074, 0.62634, 0.58488, 0.54616, 0.51000,
-            0.47624, 0.1};
-
-    for (int i = 0; i < colorlen; i++) {
-        cmapPtr->colors[i] = colors[i];
-    }
-
-    for (int i = 0; i <= colorlen; i++) {
-        cmapPtr->values[i] = values[i];
+/**
+ * Read a color map from a text file. Each line is the upper value of a
+ * color and the color, "#rrggbb", in descending order of value, and the
+ * last line is the lowest value alone. Optional "above #rrggbb" and
+ * "below #rrggbb" lines set the colors outside the map (black and white
+ * by default). Blank lines and lines starting with '#' are ignored.
+ * @param path the path to the file.
+ * @return the color map, or NULL on error. Free it with freeColorMap.
+ */
+ColorMapPtr readColorMap(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open color map [%s]\n", path);
+        return NULL;
     }
 
+    ColorMapPtr cmapPtr = (ColorMapPtr) calloc(1, sizeof(ColorMap));
+    int capacity = 64;
+    cmapPtr->values = (double *) malloc((capacity + 1) * sizeof(double));
+    cmapPtr->colors = (char **) malloc(capacity * sizeof(char *));
+    cmapPtr->tooBigColor = strdup("#000000");
+    cmapPtr->tooSmallColor = strdup("#ffffff");
+    cmapPtr->owned = true;
+
+    char line[256];
+    int lineNumber = 0;
+    int numValues = 0;
+    bool ended = false;
+    const char *error = NULL;
+
+    while ((error == NULL) && (fgets(line, sizeof(line), fp) != NULL)) {
+        lineNumber++;
+        char word[64], color[64], extra[2];
+        int numWords = sscanf(line, "%63s %63s %1s", word, color, extra);
+        unsigned int packed;
+
+        if ((numWords < 1) || (word[0] == '#')) {
+            continue;
+        }
+        if ((strcmp(word, "above") == 0) || (strcmp(word, "below") == 0)) {
+            if ((numWords != 2) || (color[0] != '#') || !parseColor(color, &packed)) {
+                error = "bad above or below color";
+            }
+            else {
+                char **target = (word[0] == 'a') ? &(cmapPtr->tooBigColor) : &(cmapPtr->tooSmallColor);
+                free(*target);
+                *target = strdup(color);
+            }
+            continue;
+        }
+
+        char *end;
+        double value = strtod(word, &end);
+        if ((*end != '\0') || !isfinite(value) || ended) {
+            error = ended ? "a line after the lowest value" : "bad value";
+        }
+        else if ((numValues > 0) && !(value < cmapPtr->values[numValues - 1])) {
+            error = "values are not descending";
+        }
+        else if (numWords == 1) {
+            cmapPtr->values[numValues++] = value;
+            ended = true;
+        }
+        else if ((numWords != 2) || (color[0] != '#') || !parseColor(color, &packed)) {
+            error = "bad color";
+        }
+        else {
+            if (numValues == capacity) {
+                capacity *= 2;
+                cmapPtr->values = (double *) realloc(cmapPtr->values, (capacity + 1) * sizeof(double));
+                cmapPtr->colors = (char **) realloc(cmapPtr->colors, capacity * sizeof(char *));
+            }
+            cmapPtr->colors[numValues] = strdup(color);
+            cmapPtr->values[numValues++] = value;
+        }
+    }
+    fclose(fp);
+
+    cmapPtr->numColors = numValues - 1;
+    if ((error == NULL) && (!ended || (numValues < 2))) {
+        error = "no lowest value, or no colors";
+        lineNumber = 0;
+    }
+    if ((error == NULL) && !prepareColorMap(cmapPtr)) {
+        error = "out of memory";
+        lineNumber = 0;
+    }
+    if (error != NULL) {
+        fprintf(stderr, "\ncMag ERROR in color map [%s] line %d: %s\n", path, lineNumber, error);
+        if (!ended) {
+            cmapPtr->numColors = numValues;
+        }
+        freeColorMap(cmapPtr);
+        return NULL;
+    }
     return cmapPtr;
 }
 
+/**
+ * Free a color map read by readColorMap. The default map is not freed.
+ * @param cmapPtr the color map, may be NULL.
+ */
+void freeColorMap(ColorMapPtr cmapPtr) {
+    if ((cmapPtr == NULL) || !cmapPtr->owned) {
+        return;
+    }
+    for (int i = 0; i < cmapPtr->numColors; i++) {
+        free(cmapPtr->colors[i]);
+    }
+    free(cmapPtr->colors);
+    free(cmapPtr->values);
+    free(cmapPtr->tooBigColor);
+    free(cmapPtr->tooSmallColor);
+    free(cmapPtr->packed);
+    free(cmapPtr->binCounts);
+    free(cmapPtr->binThresholds);
+    free(cmapPtr);
+}
+
+/**
+ * Fill in the shared default color map.
+ * @return false if out of memory, in which case nothing is left allocated.
+ */
+static bool buildDefaultColorMap() {
+
+    ColorMapPtr cmapPtr = &_defaultColorMap;
+
+    cmapPtr->numColors = (int) (sizeof(defaultColors) / sizeof(defaultColors[0]));
+    cmapPtr->tooSmallColor = "white";
+    cmapPtr->tooBigColor = "black";
+    cmapPtr->colors = defaultColors;
+    cmapPtr->values = defaultValues;
+    cmapPtr->owned = false;
+
+    if (!prepareColorMap(cmapPtr)) {
+        fprintf(stderr, "\ncMag ERROR out of memory preparing the default color map\n");
+        free(cmapPtr->packed);
+        cmapPtr->packed = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Derive the packed colors and the lookup table of a map.
+ * @param cmapPtr the color map, with its values and colors.
+ * @return false if out of memory.
+ */
+static bool prepareColorMap(ColorMapPtr cmapPtr) {
+    int n = cmapPtr->numColors;
+    cmapPtr->packed = (unsigned int *) malloc((n + 2) * sizeof(unsigned int));
+    if (cmapPtr->packed == NULL) {
+        return false;
+    }
+    parseColor(cmapPtr->tooBigColor, cmapPtr->packed);
+    parseColor(cmapPtr->tooSmallColor, cmapPtr->packed + n + 1);
+    for (int i = 0; i < n; i++) {
+        parseColor(cmapPtr->colors[i], cmapPtr->packed + i + 1);
+    }
+
+    //bins half the narrowest color wide hold at most one threshold each,
+    //whatever the rounding of the bin of a value
+    double bottom = cmapPtr->values[n];
+    double range = cmapPtr->values[0] - bottom;
+    double narrowest = range;
+    for (int i = 0; i < n; i++) {
+        double width = cmapPtr->values[i] - cmapPtr->values[i + 1];
+        narrowest = (width < narrowest) ? width : narrowest;
+    }
+
+    cmapPtr->numBins = 0;
+    cmapPtr->binCounts = NULL;
+    cmapPtr->binThresholds = NULL;
+    double bins = ceil(2 * range / narrowest);
+    if (!(bins <= MAX_COLOR_BINS)) {
+        return true; //binary search
+    }
+
+    int numBins = (int) bins + 1;
+    cmapPtr->binScale = (numBins - 1) / range;
+    cmapPtr->binCounts = (unsigned int *) malloc(numBins * sizeof(unsigned int));
+    cmapPtr->binThresholds = (double *) malloc(numBins * sizeof(double));
+    if ((cmapPtr->binCounts == NULL) || (cmapPtr->binThresholds == NULL)) {
+        free(cmapPtr->binCounts);
+        free(cmapPtr->binThresholds);
+        cmapPtr->binCounts = NULL;
+        cmapPtr->binThresholds = NULL;
+        return false;
+    }
+
+    //the thresholds inside the map, values[1] to values[n-1], fall in bins
+    //in descending order; a bin counts those in higher bins
+    for (int bin = 0; bin < numBins; bin++) {
+        cmapPtr->binThresholds[bin] = -HUGE_VAL;
+    }
+    for (int i = 1; i < n; i++) {
+        int bin = (int) ((cmapPtr->values[i] - bottom) * cmapPtr->binScale);
+        if (cmapPtr->binThresholds[bin] != -HUGE_VAL) {
+            //too close after rounding, so search instead
+            free(cmapPtr->binCounts);
+            free(cmapPtr->binThresholds);
+            cmapPtr->binCounts = NULL;
+            cmapPtr->binThresholds = NULL;
+            return true;
+        }
+        cmapPtr->binThresholds[bin] = cmapPtr->values[i];
+    }
+    unsigned int above = 0;
+    for (int bin = numBins - 1; bin >= 0; bin--) {
+        cmapPtr->binCounts[bin] = above;
+        if (cmapPtr->binThresholds[bin] != -HUGE_VAL) {
+            above++;
+        }
+    }
+
+    cmapPtr->numBins = numBins;
+    return true;
+}
+
+/**
+ * Count the thresholds values[1] to values[n-1] at or above a value
+ * inside the map, which is the index of its color.
+ * @param cmapPtr the color map.
+ * @param value a value above values[n] and at most values[0].
+ * @return the index of the color of the value.
+ */
+static int countAbove(ColorMapPtr cmapPtr, double value) {
+    if (cmapPtr->numBins == 0) {
+        return searchAbove(cmapPtr, value);
+    }
+    int bin = (int) ((value - cmapPtr->values[cmapPtr->numColors]) * cmapPtr->binScale);
+    bin = (bin < cmapPtr->numBins) ? bin : cmapPtr->numBins - 1;
+    return (int) cmapPtr->binCounts[bin] + (cmapPtr->binThresholds[bin] >= value);
+}
+
+/**
+ * Count the thresholds values[1] to values[n-1] at or above a value with a
+ * branchless binary search, for maps with no lookup table.
+ * @param cmapPtr the color map.
+ * @param value a value above values[n] and at most values[0].
+ * @return the index of the color of the value.
+ */
+static int searchAbove(ColorMapPtr cmapPtr, double value) {
+    const double *first = cmapPtr->values + 1;
+    const double *base = first;
+    int length = cmapPtr->numColors - 1;
+    if (length < 1) {
+        return 0;
+    }
+    while (length > 1) {
+        int half = length / 2;
+        base = (base[half] >= value) ? base + half : base;
+        length -= half;
+    }
+    return (int) (base - first) + (base[0] >= value);
+}
+
+/**
+ * Parse a color, "#rrggbb", "black" or "white".
+ * @param text the color.
+ * @param packed upon return, the color as 0xrrggbb.
+ * @return false if the color is not understood.
+ */
+static bool parseColor(const char *text, unsigned int *packed) {
+    *packed = 0;
+    if (strcmp(text, "black") == 0) {
+        return true;
+    }
+    if (strcmp(text, "white") == 0) {
+        *packed = 0xffffff;
+        return true;
+    }
+    if ((text[0] != '#') || (strlen(text) != 7)) {
+        return false;
+    }
+    char *end;
+    unsigned long value = strtoul(text + 1, &end, 16);
+    if (*end != '\0') {
+        return false;
+    }
+    *packed = (unsigned int) value;
+    return true;
+}
+
 
 /**
  * Get the hex color string from color components
@@ -102,3 +452,170 @@ void colorToHex(char * colorStr, int r, int g, int b) {
     sprintf(colorStr, "#%02x%02x%02x", r, g, b);
 }
 
+/**
+ * The color index of a value by a linear scan, the reference for the tests.
+ */
+static int scanColorIndex(ColorMapPtr cmapPtr, double value) {
+    if (value > cmapPtr->values[0]) {
+        return 0;
+    }
+    if (!(value > cmapPtr->values[cmapPtr->numColors])) {
+        return cmapPtr->numColors + 1;
+    }
+    int index;
+    for (index = 0; index < cmapPtr->numColors; index++) {
+        if (cmapPtr->values[index+1] < value) {
+            break;
+        }
+    }
+    return index + 1;
+}
+
+/**
+ * Check the lookups of a map against a linear scan, at and either side of
+ * every threshold, outside the map, and at random values.
+ * @return NULL, or the failure.
+ */
+static char *checkColorMap(ColorMapPtr cmapPtr) {
+    int n = cmapPtr->numColors;
+    double top = cmapPtr->values[0];
+    double range = top - cmapPtr->values[n];
+
+    int numValues = 3 * (n + 1) + 4 + 10000;
+    double *values = (double *) malloc(numValues * sizeof(double));
+    int count = 0;
+    for (int i = 0; i <= n; i++) {
+        values[count++] = cmapPtr->values[i];
+        values[count++] = nextafter(cmapPtr->values[i], HUGE_VAL);
+        values[count++] = nextafter(cmapPtr->values[i], -HUGE_VAL);
+    }
+    values[count++] = NAN;
+    values[count++] = HUGE_VAL;
+    values[count++] = -HUGE_VAL;
+    values[count++] = 0;
+    while (count < numValues) {
+        values[count++] = top - 1.2 * range * randomDouble(-0.05, 1.0);
+    }
+
+    unsigned char *rgb = (unsigned char *) malloc(3 * (size_t) numValues);
+    colorize(cmapPtr, values, numValues, rgb);
+
+    char *message = NULL;
+    for (int i = 0; (i < numValues) && (message == NULL); i++) {
+        int index = scanColorIndex(cmapPtr, values[i]);
+        unsigned char one[3];
+        getColorRGB(cmapPtr, values[i], one);
+        const char *expected = (index == 0) ? cmapPtr->tooBigColor :
+                (index > n) ? cmapPtr->tooSmallColor : cmapPtr->colors[index - 1];
+
+        if (getColorIndex(cmapPtr, values[i]) != index) {
+            message = "Color index differs from a linear scan";
+        }
+        else if (strcmp(getColor(cmapPtr, values[i]), expected) != 0) {
+            message = "Color differs from a linear scan";
+        }
+        else if (memcmp(one, rgb + 3 * i, 3) != 0) {
+            message = "Batch colors differ from single colors";
+        }
+        else if (((unsigned int) one[0] << 16 | one[1] << 8 | one[2]) != cmapPtr->packed[index]) {
+            message = "Wrong packed color";
+        }
+    }
+    free(values);
+    free(rgb);
+    return message;
+}
+
+/**
+ * Write a text file for the tests.
+ */
+static void writeTestFile(const char *path, const char *text) {
+    FILE *fp = fopen(path, "w");
+    if (fp != NULL) {
+        fputs(text, fp);
+        fclose(fp);
+    }
+}
+
+/**
+ * Unit test for the color maps.
+ * @return NULL if the test passes, or an error message.
+ */
+char *colorMapUnitTest() {
+    char *message;
+
+    ColorMapPtr cmapPtr = defaultColorMap();
+    mu_assert("Could not build the default map", cmapPtr != NULL);
+    mu_assert("Default map should use a lookup table", cmapPtr->numBins > 0);
+    message = checkColorMap(cmapPtr);
+    mu_assert(message, message == NULL);
+    mu_assert("Default too big color", strcmp(getColor(cmapPtr, 1.0e6), "black") == 0);
+    mu_assert("Default too small color", strcmp(getColor(cmapPtr, -1), "white") == 0);
+    mu_assert("Default map in order", strcmp(getColor(cmapPtr, cmapPtr->values[0]), cmapPtr->colors[0]) == 0);
+
+
+    const char *path = "cMagColorMapUnitTest.txt";
+
+    //loaded, with a lookup table
+    writeTestFile(path, "# a test map\n"
+                        "above #102030\n"
+                        "30 #ff0000\n"
+                        "\n"
+                        "20.5 #00ff00\n"
+                        "7 #0000FF\n"
+                        "-1\n"
+                        "below #405060\n");
+    cmapPtr = readColorMap(path);
+    mu_assert("Could not read a color map", cmapPtr != NULL);
+    mu_assert("Wrong number of colors", cmapPtr->numColors == 3);
+    mu_assert("Wrong lowest value", cmapPtr->values[3] == -1);
+    mu_assert("Wrong color", strcmp(getColor(cmapPtr, 20.5), "#00ff00") == 0);
+    mu_assert("Wrong above color", strcmp(getColor(cmapPtr, 31), "#102030") == 0);
+    mu_assert("Wrong below color", cmapPtr->packed[4] == 0x405060);
+    mu_assert("Wrong packed color", cmapPtr->packed[3] == 0x0000ff);
+    mu_assert("Small map should use a lookup table", cmapPtr->numBins > 0);
+    message = checkColorMap(cmapPtr);
+    mu_assert(message, message == NULL);
+    freeColorMap(cmapPtr);
+
+    //thresholds too close for a table, so a binary search
+    char text[8192];
+    size_t length = 0;
+    double value = 100;
+    for (int i = 0; i < 200; i++) {
+        length += sprintf(text + length, "%.17g #%06x\n", value, (unsigned int) (i * 0x10305));
+        value -= (i % 7 == 3) ? 1.0e-9 : (1 + i % 5);
+    }
+    sprintf(text + length, "%.17g\n", value);
+    writeTestFile(path, text);
+    cmapPtr = readColorMap(path);
+    mu_assert("Could not read a large color map", (cmapPtr != NULL) && (cmapPtr->numColors == 200));
+    mu_assert("Close thresholds should use a binary search", cmapPtr->numBins == 0);
+    message = checkColorMap(cmapPtr);
+    mu_assert(message, message == NULL);
+    freeColorMap(cmapPtr);
+
+    //one color
+    writeTestFile(path, "1 #abcdef\n0\n");
+    cmapPtr = readColorMap(path);
+    mu_assert("Could not read a one color map", (cmapPtr != NULL) && (cmapPtr->numColors == 1));
+    message = checkColorMap(cmapPtr);
+    mu_assert(message, message == NULL);
+    freeColorMap(cmapPtr);
+
+    //bad maps
+    const char *bad[] = {"3 #ff0000\n4 #00ff00\n0\n", "3 #ff0000\n2 #00ff00\n",
+                         "3 #ff00\n0\n", "3 red\n0\n", "3 #ff0000\n0\n2 #00ff00\n",
+                         "x #ff0000\n0\n", "0\n", "3 #ff0000 #00ff00\n0\n", "above #ff0000\n"};
+    for (int i = 0; i < (int) (sizeof(bad) / sizeof(bad[0])); i++) {
+        writeTestFile(path, bad[i]);
+        cmapPtr = readColorMap(path);
+        freeColorMap(cmapPtr);
+        mu_assert("A bad color map was read", cmapPtr == NULL);
+    }
+    remove(path);
+    mu_assert("A missing color map was read", readColorMap(path) == NULL);
+
+    fprintf(stdout, "\nPASSED colorMapUnitTest\n");
+    return NULL;
+}
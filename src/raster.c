@@ -0,0 +1,859 @@
+//
+//  raster.c
+//  cMag
+//
+//  A small raster image writer with no external dependencies. Images are
+//  8 bit RGB, row by row from the top. PPM is written as is. PNG rows are
+//  filtered (none, sub or up, whichever gives the smallest sum of
+//  residuals) and compressed with a deflate encoder that uses the fixed
+//  Huffman codes and LZ77 matches found with hash chains, falling back to
+//  stored blocks if that would be smaller. Field slices are large areas
+//  of a few colors, which this compresses well without dynamic codes.
+//
+
+#include "raster.h"
+#include "munittest.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+//deflate limits
+#define WINDOW_SIZE   32768
+#define MIN_MATCH     3
+#define MAX_MATCH     258
+#define HASH_BITS     15
+#define MAX_CHAIN     32
+#define STORED_BLOCK  65535
+
+//the bytes of a PNG header, chunk framing and trailers
+#define PNG_OVERHEAD  (8 + 25 + 12 + 12)
+
+//appends bits to a byte buffer, least significant first
+typedef struct bitwriter {
+    unsigned char *data;
+    size_t size;
+    unsigned int bits;
+    int count;
+} BitWriter;
+
+static const unsigned short lengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char lengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short distanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char distanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static const char base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//the table of the PNG (IEEE) CRC, built once
+static unsigned int crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+//local prototypes
+static void makeCrcTable(void);
+static unsigned char *filterRows(const unsigned char *, int, int, size_t *);
+static size_t deflateFixed(unsigned char *, const unsigned char *, size_t);
+static size_t deflateStored(unsigned char *, const unsigned char *, size_t);
+static void putBits(BitWriter *, unsigned int, int);
+static void putCode(BitWriter *, unsigned int, int);
+static void putLiteral(BitWriter *, int);
+static void putMatch(BitWriter *, int, int);
+static unsigned char *putChunk(unsigned char *, const char *, const unsigned char *, size_t);
+static void putBigEndian(unsigned char *, unsigned int);
+static unsigned int getBigEndian(const unsigned char *);
+static size_t inflateTest(unsigned char *, size_t, const unsigned char *, size_t);
+static unsigned int getBits(const unsigned char *, size_t *, int);
+static char *checkPNG(const unsigned char *, int, int);
+
+/**
+ * Encode an image as a PNG in memory.
+ * @param rgb the pixels, three bytes each, row by row from the top.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @param size upon return, the size of the PNG in bytes.
+ * @return the PNG, to be freed by the caller, or NULL on error.
+ */
+unsigned char *encodePNG(const unsigned char *rgb, int width, int height, size_t *size) {
+    *size = 0;
+    if ((width < 1) || (height < 1)) {
+        fprintf(stderr, "\ncMag ERROR bad PNG size %d x %d\n", width, height);
+        return NULL;
+    }
+
+    size_t filteredSize;
+    unsigned char *filtered = filterRows(rgb, width, height, &filteredSize);
+    if (filtered == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory encoding a %d x %d PNG\n", width, height);
+        return NULL;
+    }
+
+    //room for stored blocks, which the fixed codes are only kept if they beat
+    size_t storedSize = filteredSize + 5 * (filteredSize / STORED_BLOCK + 1);
+    size_t fixedRoom = filteredSize + filteredSize / 2 + 16;
+    size_t room = (fixedRoom > storedSize) ? fixedRoom : storedSize;
+    unsigned char *png = (unsigned char *) malloc(PNG_OVERHEAD + 6 + room);
+    if (png == NULL) {
+        free(filtered);
+        fprintf(stderr, "\ncMag ERROR out of memory encoding a %d x %d PNG\n", width, height);
+        return NULL;
+    }
+
+    //the zlib stream goes where the IDAT data will be
+    unsigned char *zlib = png + 8 + 25 + 8;
+    zlib[0] = 0x78;
+    zlib[1] = 0x01;
+    size_t deflated = deflateFixed(zlib + 2, filtered, filteredSize);
+    if (deflated > storedSize) {
+        deflated = deflateStored(zlib + 2, filtered, filteredSize);
+    }
+    putBigEndian(zlib + 2 + deflated, rasterAdler32(1, filtered, filteredSize));
+    size_t zlibSize = deflated + 6;
+    free(filtered);
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    memcpy(png, signature, 8);
+
+    unsigned char header[13];
+    putBigEndian(header, (unsigned int) width);
+    putBigEndian(header + 4, (unsigned int) height);
+    header[8] = 8;   //bits per sample
+    header[9] = 2;   //truecolor
+    header[10] = 0;  //deflate
+    header[11] = 0;  //adaptive filtering
+    header[12] = 0;  //not interlaced
+
+    unsigned char *end = putChunk(png + 8, "IHDR", header, 13);
+    end = putChunk(end, "IDAT", zlib, zlibSize);
+    end = putChunk(end, "IEND", NULL, 0);
+
+    *size = (size_t) (end - png);
+    return png;
+}
+
+/**
+ * Write an image as a PNG file.
+ * @param path the path of the file.
+ * @param rgb the pixels, three bytes each, row by row from the top.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @return true on success.
+ */
+bool writePNG(const char *path, const unsigned char *rgb, int width, int height) {
+    size_t size;
+    unsigned char *png = encodePNG(rgb, width, height, &size);
+    if (png == NULL) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    bool written = (fp != NULL) && (fwrite(png, 1, size, fp) == size);
+    if ((fp != NULL) && (fclose(fp) != 0)) {
+        written = false;
+    }
+    free(png);
+
+    if (!written) {
+        fprintf(stderr, "\ncMag ERROR could not write PNG file [%s]\n", path);
+    }
+    return written;
+}
+
+/**
+ * Write an image as a binary (P6) PPM file.
+ * @param path the path of the file.
+ * @param rgb the pixels, three bytes each, row by row from the top.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @return true on success.
+ */
+bool writePPM(const char *path, const unsigned char *rgb, int width, int height) {
+    size_t size = 3 * (size_t) width * height;
+    FILE *fp = fopen(path, "wb");
+    bool written = (fp != NULL) && (width > 0) && (height > 0) &&
+                   (fprintf(fp, "P6\n%d %d\n255\n", width, height) > 0) &&
+                   (fwrite(rgb, 1, size, fp) == size);
+    if ((fp != NULL) && (fclose(fp) != 0)) {
+        written = false;
+    }
+
+    if (!written) {
+        fprintf(stderr, "\ncMag ERROR could not write PPM file [%s]\n", path);
+    }
+    return written;
+}
+
+/**
+ * Write an image as a PPM file if the path ends in ".ppm", otherwise as a PNG.
+ * @param path the path of the file.
+ * @param rgb the pixels, three bytes each, row by row from the top.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @return true on success.
+ */
+bool writeRaster(const char *path, const unsigned char *rgb, int width, int height) {
+    size_t len = strlen(path);
+    if ((len >= 4) && (strcasecmp(path + len - 4, ".ppm") == 0)) {
+        return writePPM(path, rgb, width, height);
+    }
+    return writePNG(path, rgb, width, height);
+}
+
+/**
+ * Compute the CRC-32 used by PNG chunks and zip files (the IEEE polynomial,
+ * not the Castagnoli one of crc32c).
+ * @param crc the CRC so far, 0 to start.
+ * @param data the bytes to add.
+ * @param length the number of bytes.
+ * @return the updated CRC.
+ */
+unsigned int rasterCrc32(unsigned int crc, const void *data, size_t length) {
+    pthread_once(&crcOnce, makeCrcTable);
+
+    const unsigned char *p = (const unsigned char *) data;
+    crc = ~crc;
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ crcTable[(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+/**
+ * Compute the Adler-32 checksum of a zlib stream.
+ * @param adler the checksum so far, 1 to start.
+ * @param data the bytes to add.
+ * @param length the number of bytes.
+ * @return the updated checksum.
+ */
+unsigned int rasterAdler32(unsigned int adler, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned int a = adler & 0xffff;
+    unsigned int b = adler >> 16;
+
+    while (length > 0) {
+        //5552 bytes is the most that cannot overflow before the modulo
+        size_t block = (length < 5552) ? length : 5552;
+        length -= block;
+        while (block-- > 0) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * Encode bytes as base64.
+ * @param dst space for BASE64_LENGTH(length) characters. No terminator is added.
+ * @param src the bytes.
+ * @param length the number of bytes.
+ * @return the number of characters written.
+ */
+size_t base64Encode(char *dst, const unsigned char *src, size_t length) {
+    char *start = dst;
+    while (length >= 3) {
+        unsigned int triple = (src[0] << 16) | (src[1] << 8) | src[2];
+        *dst++ = base64Digits[triple >> 18];
+        *dst++ = base64Digits[(triple >> 12) & 0x3f];
+        *dst++ = base64Digits[(triple >> 6) & 0x3f];
+        *dst++ = base64Digits[triple & 0x3f];
+        src += 3;
+        length -= 3;
+    }
+
+    if (length > 0) {
+        unsigned int triple = (src[0] << 16) | ((length > 1) ? (src[1] << 8) : 0);
+        *dst++ = base64Digits[triple >> 18];
+        *dst++ = base64Digits[(triple >> 12) & 0x3f];
+        *dst++ = (length > 1) ? base64Digits[(triple >> 6) & 0x3f] : '=';
+        *dst++ = '=';
+    }
+    return (size_t) (dst - start);
+}
+
+/**
+ * Fill in the CRC table.
+ */
+static void makeCrcTable() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (0xedb88320 ^ (crc >> 1)) : (crc >> 1);
+        }
+        crcTable[i] = crc;
+    }
+}
+
+/**
+ * Filter the rows of an image for PNG, each with the filter that leaves
+ * the smallest sum of residuals.
+ * @param rgb the pixels.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @param size upon return, the size of the filtered data.
+ * @return the filtered data, a filter byte before each row, or NULL if out of memory.
+ */
+static unsigned char *filterRows(const unsigned char *rgb, int width, int height, size_t *size) {
+    size_t rowSize = 3 * (size_t) width;
+    *size = (rowSize + 1) * height;
+    unsigned char *filtered = (unsigned char *) malloc(*size);
+    if (filtered == NULL) {
+        return NULL;
+    }
+
+    for (int row = 0; row < height; row++) {
+        const unsigned char *line = rgb + row * rowSize;
+        const unsigned char *above = (row > 0) ? line - rowSize : NULL;
+        unsigned char *out = filtered + row * (rowSize + 1);
+
+        //the cost of each filter, residuals taken as signed bytes
+        unsigned long costs[3] = {0, 0, 0};
+        for (size_t i = 0; i < rowSize; i++) {
+            unsigned char sub = (unsigned char) (line[i] - ((i >= 3) ? line[i - 3] : 0));
+            unsigned char up = (unsigned char) (line[i] - ((above != NULL) ? above[i] : 0));
+            costs[0] += (line[i] < 128) ? line[i] : 256 - line[i];
+            costs[1] += (sub < 128) ? sub : 256 - sub;
+            costs[2] += (up < 128) ? up : 256 - up;
+        }
+
+        int filter = 0;
+        for (int f = 1; f < 3; f++) {
+            if (costs[f] < costs[filter]) {
+                filter = f;
+            }
+        }
+
+        out[0] = (unsigned char) filter;
+        for (size_t i = 0; i < rowSize; i++) {
+            unsigned char predictor = 0;
+            if (filter == 1) {
+                predictor = (i >= 3) ? line[i - 3] : 0;
+            }
+            else if ((filter == 2) && (above != NULL)) {
+                predictor = above[i];
+            }
+            out[i + 1] = (unsigned char) (line[i] - predictor);
+        }
+    }
+    return filtered;
+}
+
+/**
+ * Compress with one final deflate block of the fixed Huffman codes.
+ * Matches are found with hash chains over the last 32 kB.
+ * @param dst space for at least length + length/2 + 16 bytes.
+ * @param src the bytes to compress.
+ * @param length the number of bytes.
+ * @return the size of the compressed data.
+ */
+static size_t deflateFixed(unsigned char *dst, const unsigned char *src, size_t length) {
+    BitWriter writer = {.data = dst, .size = 0, .bits = 0, .count = 0};
+    putBits(&writer, 1, 1); //final block
+    putBits(&writer, 1, 2); //fixed codes
+
+    //the most recent position of each hash, and the one before each position
+    int *head = (int *) malloc(sizeof(int) << HASH_BITS);
+    int *prev = (int *) malloc(sizeof(int) * WINDOW_SIZE);
+    bool matching = (head != NULL) && (prev != NULL);
+    if (matching) {
+        memset(head, -1, sizeof(int) << HASH_BITS);
+    }
+
+    size_t i = 0;
+    while (i < length) {
+        int bestLength = 0;
+        int bestDistance = 0;
+
+        if (matching && (i + MIN_MATCH <= length)) {
+            size_t maxLength = (length - i < MAX_MATCH) ? length - i : MAX_MATCH;
+            unsigned int hash = ((src[i] << 10) ^ (src[i + 1] << 5) ^ src[i + 2]) & ((1 << HASH_BITS) - 1);
+            int candidate = head[hash];
+            int chain = MAX_CHAIN;
+            while ((candidate >= 0) && (i - candidate <= WINDOW_SIZE) && (chain-- > 0)) {
+                const unsigned char *a = src + candidate;
+                const unsigned char *b = src + i;
+                size_t n = 0;
+                while ((n < maxLength) && (a[n] == b[n])) {
+                    n++;
+                }
+                if ((int) n > bestLength) {
+                    bestLength = (int) n;
+                    bestDistance = (int) (i - candidate);
+                    if (n == maxLength) {
+                        break;
+                    }
+                }
+                int next = prev[candidate & (WINDOW_SIZE - 1)];
+                if (next >= candidate) {
+                    break; //overwritten by a newer position
+                }
+                candidate = next;
+            }
+        }
+
+        size_t advance = 1;
+        if (bestLength >= MIN_MATCH) {
+            putMatch(&writer, bestLength, bestDistance);
+            advance = (size_t) bestLength;
+        }
+        else {
+            putLiteral(&writer, src[i]);
+        }
+
+        if (matching) {
+            for (size_t j = i; (j < i + advance) && (j + MIN_MATCH <= length); j++) {
+                unsigned int hash = ((src[j] << 10) ^ (src[j + 1] << 5) ^ src[j + 2]) & ((1 << HASH_BITS) - 1);
+                prev[j & (WINDOW_SIZE - 1)] = head[hash];
+                head[hash] = (int) j;
+            }
+        }
+        i += advance;
+    }
+
+    putLiteral(&writer, 256); //end of block
+    if (writer.count > 0) {
+        putBits(&writer, 0, 8 - writer.count);
+    }
+
+    free(head);
+    free(prev);
+    return writer.size;
+}
+
+/**
+ * Store bytes uncompressed in deflate blocks.
+ * @param dst space for length + 5 bytes per 65535 and 5 more.
+ * @param src the bytes to store.
+ * @param length the number of bytes.
+ * @return the size of the stored data.
+ */
+static size_t deflateStored(unsigned char *dst, const unsigned char *src, size_t length) {
+    unsigned char *out = dst;
+    do {
+        size_t block = (length < STORED_BLOCK) ? length : STORED_BLOCK;
+        length -= block;
+        *out++ = (length == 0) ? 1 : 0; //final flag, stored type
+        *out++ = (unsigned char) (block & 0xff);
+        *out++ = (unsigned char) (block >> 8);
+        *out++ = (unsigned char) (~block & 0xff);
+        *out++ = (unsigned char) ((~block >> 8) & 0xff);
+        memcpy(out, src, block);
+        out += block;
+        src += block;
+    } while (length > 0);
+    return (size_t) (out - dst);
+}
+
+/**
+ * Append bits, least significant first.
+ * @param writer the writer.
+ * @param value the bits.
+ * @param count the number of bits, at most 16.
+ */
+static void putBits(BitWriter *writer, unsigned int value, int count) {
+    writer->bits |= value << writer->count;
+    writer->count += count;
+    while (writer->count >= 8) {
+        writer->data[writer->size++] = (unsigned char) (writer->bits & 0xff);
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+/**
+ * Append a Huffman code, which deflate packs most significant bit first.
+ * @param writer the writer.
+ * @param code the code.
+ * @param count the length of the code in bits.
+ */
+static void putCode(BitWriter *writer, unsigned int code, int count) {
+    unsigned int reversed = 0;
+    for (int i = 0; i < count; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    putBits(writer, reversed, count);
+}
+
+/**
+ * Append a literal/length symbol in the fixed code.
+ * @param writer the writer.
+ * @param symbol the symbol, 0 to 287.
+ */
+static void putLiteral(BitWriter *writer, int symbol) {
+    if (symbol < 144) {
+        putCode(writer, 0x30 + symbol, 8);
+    }
+    else if (symbol < 256) {
+        putCode(writer, 0x190 + symbol - 144, 9);
+    }
+    else if (symbol < 280) {
+        putCode(writer, symbol - 256, 7);
+    }
+    else {
+        putCode(writer, 0xc0 + symbol - 280, 8);
+    }
+}
+
+/**
+ * Append a match in the fixed code.
+ * @param writer the writer.
+ * @param length the length of the match, 3 to 258.
+ * @param distance how far back the match is, 1 to 32768.
+ */
+static void putMatch(BitWriter *writer, int length, int distance) {
+    int code = 28;
+    while (lengthBase[code] > length) {
+        code--;
+    }
+    putLiteral(writer, 257 + code);
+    putBits(writer, length - lengthBase[code], lengthExtra[code]);
+
+    code = 29;
+    while (distanceBase[code] > distance) {
+        code--;
+    }
+    putCode(writer, code, 5);
+    putBits(writer, distance - distanceBase[code], distanceExtra[code]);
+}
+
+/**
+ * Write a PNG chunk.
+ * @param out where the chunk goes.
+ * @param type the four character chunk type.
+ * @param data the data, which may already be in place at out + 8.
+ * @param length the length of the data.
+ * @return the end of the chunk.
+ */
+static unsigned char *putChunk(unsigned char *out, const char *type, const unsigned char *data, size_t length) {
+    putBigEndian(out, (unsigned int) length);
+    memcpy(out + 4, type, 4);
+    if ((length > 0) && (data != out + 8)) {
+        memmove(out + 8, data, length);
+    }
+    putBigEndian(out + 8 + length, rasterCrc32(0, out + 4, length + 4));
+    return out + 12 + length;
+}
+
+/**
+ * Store a 32 bit value most significant byte first.
+ * @param out where the four bytes go.
+ * @param value the value.
+ */
+static void putBigEndian(unsigned char *out, unsigned int value) {
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+/**
+ * Read a 32 bit value stored most significant byte first.
+ * @param in the four bytes.
+ * @return the value.
+ */
+static unsigned int getBigEndian(const unsigned char *in) {
+    return ((unsigned int) in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+}
+
+/**
+ * Read bits, least significant first. Only for the unit test.
+ * @param data the bytes.
+ * @param bit the bit position, advanced past the bits read.
+ * @param count the number of bits.
+ * @return the bits.
+ */
+static unsigned int getBits(const unsigned char *data, size_t *bit, int count) {
+    unsigned int value = 0;
+    for (int i = 0; i < count; i++, (*bit)++) {
+        value |= ((data[*bit >> 3] >> (*bit & 7)) & 1) << i;
+    }
+    return value;
+}
+
+/**
+ * Decompress the stored and fixed code deflate blocks this file writes.
+ * A deliberately separate, slow, bit at a time decoder for the unit test.
+ * @param dst space for the decompressed bytes.
+ * @param room the space in dst.
+ * @param src the deflate data.
+ * @param length the size of the deflate data.
+ * @return the number of bytes decompressed, or (size_t) -1 if the data is bad.
+ */
+static size_t inflateTest(unsigned char *dst, size_t room, const unsigned char *src, size_t length) {
+    size_t bit = 0;
+    size_t out = 0;
+    bool final = false;
+
+    while (!final) {
+        if (bit + 3 > 8 * length) {
+            return (size_t) -1;
+        }
+        final = getBits(src, &bit, 1) == 1;
+        unsigned int type = getBits(src, &bit, 2);
+
+        if (type == 0) {
+            bit = (bit + 7) & ~(size_t) 7;
+            size_t at = bit >> 3;
+            if (at + 4 > length) {
+                return (size_t) -1;
+            }
+            size_t block = src[at] | (src[at + 1] << 8);
+            size_t check = src[at + 2] | (src[at + 3] << 8);
+            if (((block ^ check) != 0xffff) || (at + 4 + block > length) || (out + block > room)) {
+                return (size_t) -1;
+            }
+            memcpy(dst + out, src + at + 4, block);
+            out += block;
+            bit = 8 * (at + 4 + block);
+            continue;
+        }
+        if (type != 1) {
+            return (size_t) -1;
+        }
+
+        while (true) {
+            if (bit >= 8 * length) {
+                return (size_t) -1;
+            }
+            //the fixed codes: 7 bits for 256-279, 8 for 0-143 and 280-287, 9 for 144-255
+            unsigned int code = 0;
+            for (int i = 0; i < 7; i++) {
+                code = (code << 1) | getBits(src, &bit, 1);
+            }
+            int symbol;
+            if (code <= 0x17) {
+                symbol = 256 + (int) code;
+            }
+            else {
+                code = (code << 1) | getBits(src, &bit, 1);
+                if ((code >= 0x30) && (code <= 0xbf)) {
+                    symbol = (int) code - 0x30;
+                }
+                else if ((code >= 0xc0) && (code <= 0xc7)) {
+                    symbol = 280 + (int) code - 0xc0;
+                }
+                else {
+                    code = (code << 1) | getBits(src, &bit, 1);
+                    symbol = 144 + (int) code - 0x190;
+                }
+            }
+
+            if (symbol < 256) {
+                if (out >= room) {
+                    return (size_t) -1;
+                }
+                dst[out++] = (unsigned char) symbol;
+                continue;
+            }
+            if (symbol == 256) {
+                break;
+            }
+            if (symbol > 285) {
+                return (size_t) -1;
+            }
+
+            int index = symbol - 257;
+            size_t matchLength = lengthBase[index] + getBits(src, &bit, lengthExtra[index]);
+            unsigned int distanceCode = 0;
+            for (int i = 0; i < 5; i++) {
+                distanceCode = (distanceCode << 1) | getBits(src, &bit, 1);
+            }
+            if (distanceCode > 29) {
+                return (size_t) -1;
+            }
+            size_t distance = distanceBase[distanceCode] + getBits(src, &bit, distanceExtra[distanceCode]);
+            if ((distance > out) || (out + matchLength > room)) {
+                return (size_t) -1;
+            }
+            for (size_t i = 0; i < matchLength; i++, out++) {
+                dst[out] = dst[out - distance];
+            }
+        }
+    }
+    return out;
+}
+
+/**
+ * Decode a PNG written by encodePNG and compare it with the image.
+ * @param rgb the pixels that were encoded.
+ * @param width the width in pixels.
+ * @param height the height in pixels.
+ * @return an error message, or NULL if the PNG decodes to the image.
+ */
+static char *checkPNG(const unsigned char *rgb, int width, int height) {
+    size_t size;
+    unsigned char *png = encodePNG(rgb, width, height, &size);
+    mu_assert("Could not encode a PNG", png != NULL);
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    char *message = (memcmp(png, signature, 8) == 0) ? NULL : "Bad PNG signature";
+
+    //walk the chunks, checking their CRCs
+    const unsigned char *zlib = NULL;
+    size_t zlibSize = 0;
+    bool ended = false;
+    size_t at = 8;
+    while ((message == NULL) && !ended && (at + 12 <= size)) {
+        size_t length = getBigEndian(png + at);
+        if (at + 12 + length > size) {
+            message = "A PNG chunk runs past the end";
+            break;
+        }
+        if (rasterCrc32(0, png + at + 4, length + 4) != getBigEndian(png + at + 8 + length)) {
+            message = "Bad PNG chunk CRC";
+        }
+        else if (memcmp(png + at + 4, "IHDR", 4) == 0) {
+            const unsigned char *h = png + at + 8;
+            if ((length != 13) || (getBigEndian(h) != (unsigned int) width) ||
+                (getBigEndian(h + 4) != (unsigned int) height) || (h[8] != 8) || (h[9] != 2)) {
+                message = "Bad PNG header";
+            }
+        }
+        else if (memcmp(png + at + 4, "IDAT", 4) == 0) {
+            zlib = png + at + 8;
+            zlibSize = length;
+        }
+        else if (memcmp(png + at + 4, "IEND", 4) == 0) {
+            ended = (at + 12 == size);
+        }
+        at += 12 + length;
+    }
+    if ((message == NULL) && (!ended || (zlib == NULL) || (zlibSize < 6))) {
+        message = "Missing or misplaced PNG chunks";
+    }
+    if ((message == NULL) && (((zlib[0] << 8) | zlib[1]) % 31 != 0)) {
+        message = "Bad zlib header";
+    }
+
+    size_t rowSize = 3 * (size_t) width;
+    size_t filteredSize = (rowSize + 1) * height;
+    unsigned char *filtered = (unsigned char *) malloc(filteredSize + 1);
+    if ((message == NULL) &&
+        (inflateTest(filtered, filteredSize + 1, zlib + 2, zlibSize - 6) != filteredSize)) {
+        message = "The PNG data does not inflate to the image size";
+    }
+    if ((message == NULL) && (rasterAdler32(1, filtered, filteredSize) != getBigEndian(zlib + zlibSize - 4))) {
+        message = "Bad zlib checksum";
+    }
+
+    //undo the filters in place and compare
+    for (int row = 0; (message == NULL) && (row < height); row++) {
+        unsigned char *line = filtered + row * (rowSize + 1);
+        const unsigned char *above = (row > 0) ? line - (rowSize + 1) : NULL;
+        if (line[0] > 2) {
+            message = "Unexpected PNG filter";
+            break;
+        }
+        for (size_t i = 0; i < rowSize; i++) {
+            unsigned char predictor = 0;
+            if (line[0] == 1) {
+                predictor = (i >= 3) ? line[i - 2] : 0;
+            }
+            else if ((line[0] == 2) && (above != NULL)) {
+                predictor = above[i];
+            }
+            line[i + 1] = (unsigned char) (line[i + 1] + predictor);
+        }
+        if (memcmp(line + 1, rgb + row * rowSize, rowSize) != 0) {
+            message = "The PNG does not decode to the image";
+        }
+        //shift the row down a byte so the next row's up filter sees plain pixels
+        memmove(line, line + 1, rowSize);
+    }
+
+    free(filtered);
+    free(png);
+    return message;
+}
+
+/**
+ * A unit test of the checksums, base64, PPM and PNG encoders. PNGs are
+ * decoded by an independent inflater and compared with their images, for
+ * images that compress well, one that does not, and single pixels.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *rasterUnitTest() {
+    mu_assert("Bad CRC-32", rasterCrc32(0, "123456789", 9) == 0xcbf43926);
+    mu_assert("Bad CRC-32 when continued", rasterCrc32(rasterCrc32(0, "1234", 4), "56789", 5) == 0xcbf43926);
+    mu_assert("Bad Adler-32", rasterAdler32(1, "Wikipedia", 9) == 0x11e60398);
+
+    char encoded[16];
+    const char *plain[] = {"", "M", "Ma", "Man", "Many"};
+    const char *expected[] = {"", "TQ==", "TWE=", "TWFu", "TWFueQ=="};
+    for (int i = 0; i < 5; i++) {
+        size_t n = strlen(plain[i]);
+        mu_assert("Bad base64 length", base64Encode(encoded, (const unsigned char *) plain[i], n) == BASE64_LENGTH(n));
+        mu_assert("Bad base64", strncmp(encoded, expected[i], BASE64_LENGTH(n)) == 0);
+    }
+
+    //bands of a few colors, like a field slice, then noise, then single pixels
+    int width = 211;
+    int height = 97;
+    unsigned char *rgb = (unsigned char *) malloc(3 * (size_t) width * height);
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            unsigned char *p = rgb + 3 * ((size_t) row * width + col);
+            int band = ((row - 48) * (row - 48) + (col - 100) * (col - 100)) / 300;
+            p[0] = (unsigned char) (40 * band);
+            p[1] = (unsigned char) (255 - 17 * band);
+            p[2] = (unsigned char) ((band % 3) * 90);
+        }
+    }
+    char *message = checkPNG(rgb, width, height);
+
+    size_t size;
+    unsigned char *png = encodePNG(rgb, width, height, &size);
+    bool compressed = (png != NULL) && (size < (size_t) width * height / 4);
+    free(png);
+
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < 3 * (size_t) width * height; i++) {
+        seed = seed * 1103515245 + 12345;
+        rgb[i] = (unsigned char) (seed >> 16);
+    }
+    if (message == NULL) {
+        message = checkPNG(rgb, width, height);
+    }
+    if (message == NULL) {
+        message = checkPNG(rgb, 1, 1);
+    }
+    if (message == NULL) {
+        message = checkPNG(rgb, 1, 7);
+    }
+
+    //a PPM is a header and the pixels
+    const char *path = "cMagRasterUnitTest.ppm";
+    bool written = writeRaster(path, rgb, width, height);
+    char header[32];
+    snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    size_t headerSize = strlen(header);
+    size_t ppmSize = headerSize + 3 * (size_t) width * height;
+    unsigned char *ppm = (unsigned char *) malloc(ppmSize + 1);
+    FILE *fp = fopen(path, "rb");
+    bool read = (fp != NULL) && (fread(ppm, 1, ppmSize + 1, fp) == ppmSize);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    remove(path);
+    bool ppmGood = read && (memcmp(ppm, header, headerSize) == 0) &&
+                   (memcmp(ppm + headerSize, rgb, ppmSize - headerSize) == 0);
+    free(ppm);
+    free(rgb);
+
+    mu_assert(message, message == NULL);
+    mu_assert("A banded image did not compress", compressed);
+    mu_assert("Could not write a PPM", written);
+    mu_assert("The PPM is not the image", ppmGood);
+    mu_assert("Accepted a bad PNG size", encodePNG(NULL, 0, 5, &size) == NULL);
+
+    fprintf(stdout, "\nPASSED rasterUnitTest\n");
+    return NULL;
+}
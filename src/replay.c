@@ -0,0 +1,124 @@
+//
+//  replay.c
+//  cMag
+//
+//  Replays a recorded query trace against a torus and/or solenoid map
+//  and reports the time per query and the cache miss count.
+//
+//  usage: cMagReplay trace torusMap solenoidMap [nn]
+//         cMagReplay -record trace torusMap solenoidMap [numQueries]
+//  Pass "-" for a map that should not be loaded. Passing "nn" as the
+//  last argument replays with the NEAREST_NEIGHBOR algorithm. With
+//  -record, random queries of the maps are recorded to the trace instead.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "magfield.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldtrace.h"
+
+//local prototypes
+static bool recordQueries(const char *, MagneticFieldPtr, MagneticFieldPtr, long);
+
+/**
+ * The main method of the replay application.
+ */
+int main(int argc, const char * argv[]) {
+
+    bool record = (argc > 1) && (strcmp(argv[1], "-record") == 0);
+    if (record) {
+        argc--;
+        argv++;
+    }
+
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s trace torusMap solenoidMap [nn]\n", argv[0]);
+        fprintf(stderr, "       %s -record trace torusMap solenoidMap [numQueries]\n", argv[0]);
+        return 1;
+    }
+
+    const char *tracePath = argv[1];
+    MagneticFieldPtr torus = NULL;
+    MagneticFieldPtr solenoid = NULL;
+
+    if (strcmp(argv[2], "-") != 0) {
+        torus = initializeTorus(argv[2]);
+        if (torus == NULL) {
+            return 1;
+        }
+    }
+
+    if (strcmp(argv[3], "-") != 0) {
+        solenoid = initializeSolenoid(argv[3]);
+        if (solenoid == NULL) {
+            return 1;
+        }
+    }
+
+    if (record) {
+        long num = (argc > 4) ? atol(argv[4]) : 100000;
+        return recordQueries(tracePath, torus, solenoid, num) ? 0 : 1;
+    }
+
+    if ((argc > 4) && (strcmp(argv[4], "nn") == 0)) {
+        setAlgorithm(NEAREST_NEIGHBOR);
+    }
+
+    ReplayResult result;
+    if (!replayTrace(tracePath, torus, solenoid, &result)) {
+        return 1;
+    }
+
+    printReplayResult(&result, stdout);
+    return 0;
+}
+
+/**
+ * Record random queries of the maps, within and just beyond them, a third
+ * of them composite, to a trace.
+ * @param path the path to the trace file.
+ * @param torus the torus (can be NULL).
+ * @param solenoid the solenoid (can be NULL).
+ * @param num the number of queries.
+ * @return false if the recording could not be made.
+ */
+static bool recordQueries(const char *path, MagneticFieldPtr torus, MagneticFieldPtr solenoid, long num) {
+    MagneticFieldPtr fields[2] = {torus, solenoid};
+    double rhoMax = 0, zMin = 0, zMax = 0;
+    for (int i = 0; i < 2; i++) {
+        if (fields[i] != NULL) {
+            rhoMax = fmax(rhoMax, fields[i]->rhoGridPtr->maxVal);
+            zMin = fmin(zMin, fields[i]->zGridPtr->minVal);
+            zMax = fmax(zMax, fields[i]->zGridPtr->maxVal);
+        }
+    }
+    if (rhoMax <= 0) {
+        fprintf(stderr, "\ncMag ERROR no map to record queries of\n");
+        return false;
+    }
+
+    if (!startTraceRecording(path)) {
+        return false;
+    }
+    for (long i = 0; i < num; i++) {
+        double x = randomDouble(-1.1 * rhoMax, 1.1 * rhoMax);
+        double y = randomDouble(-1.1 * rhoMax, 1.1 * rhoMax);
+        double z = randomDouble(zMin - 10, zMax + 10);
+        MagneticFieldPtr fieldPtr = fields[i % 2];
+        FieldValue value;
+        if ((i % 3 == 0) || (fieldPtr == NULL)) {
+            getCompositeFieldValue(&value, x, y, z, torus, solenoid);
+        }
+        else {
+            getFieldValue(&value, x, y, z, fieldPtr);
+        }
+    }
+    stopTraceRecording();
+
+    fprintf(stdout, "\nrecorded %ld queries to [%s]\n", num, path);
+    return true;
+}
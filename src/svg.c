@@ -4,26 +4,87 @@
 //
 
 #include"svg.h"
+#include"raster.h"
+#include"munittest.h"
+#include<string.h>
+#include<limits.h>
+
+/**
+ * Write out the buffered text.
+ * @param psvg pointer to the svg information.
+ */
+static void svgFlush(svg* psvg) {
+    if ((psvg->fd != NULL) && (psvg->length > 0)) {
+        fwrite(psvg->buffer, 1, psvg->length, psvg->fd);
+    }
+    psvg->length = 0;
+}
+
+/**
+ * Append characters to the svg. Text is collected in the svg's buffer
+ * and written a buffer at a time.
+ * @param psvg pointer to the svg information.
+ * @param text the characters to append.
+ * @param length the number of characters.
+ */
+static void svgAppend(svg* psvg, const char* text, size_t length) {
+    if (psvg->length + length > SVG_BUFFER_SIZE) {
+        svgFlush(psvg);
+        if (length > SVG_BUFFER_SIZE) {
+            if (psvg->fd != NULL) {
+                fwrite(text, 1, length, psvg->fd);
+            }
+            return;
+        }
+    }
+    memcpy(psvg->buffer + psvg->length, text, length);
+    psvg->length += length;
+}
 
 /**
  * Append a string to the open svg file.
  * @param psvg pointer to the svg information.
  * @param text the text to append to the svg file.
  */
-static void svgAppendString(svg* psvg, char* text) {
-    if (psvg->fd != NULL) {
-        fprintf(psvg->fd, "%s", text);
-    }
+static void svgAppendString(svg* psvg, const char* text) {
+    svgAppend(psvg, text, strlen(text));
 }
 
 /**
- * Append an integer value to the open svg file.
+ * Append an integer value to the open svg file. The digits are
+ * formatted here rather than by printf.
  * @param psvg pointer to the svg information.
  * @param n the integer to append
  */
 static void svgAppendInt(svg* psvg, int n) {
-    if (psvg->fd != NULL) {
-        fprintf(psvg->fd, "%d", n);
+    char digits[12];
+    char *p = digits + sizeof(digits);
+    unsigned int u = (n < 0) ? 0u - (unsigned int) n : (unsigned int) n;
+    do {
+        *--p = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (n < 0) {
+        *--p = '-';
+    }
+    svgAppend(psvg, p, (size_t) (digits + sizeof(digits) - p));
+}
+
+/**
+ * Append a coordinate to a tenth of a pixel, without a trailing ".0".
+ * @param psvg pointer to the svg information.
+ * @param v the coordinate.
+ */
+static void svgAppendTenths(svg* psvg, double v) {
+    long tenths = lround(10 * v);
+    if (tenths < 0) {
+        svgAppendString(psvg, "-");
+        tenths = -tenths;
+    }
+    svgAppendInt(psvg, (int) (tenths / 10));
+    if (tenths % 10 != 0) {
+        char decimal[2] = {'.', (char) ('0' + tenths % 10)};
+        svgAppend(psvg, decimal, 2);
     }
 }
 
@@ -37,7 +98,18 @@ static void svgAppendInt(svg* psvg, int n) {
 svg* svgStart(char *path, int width, int height) {
     svg* psvg = malloc(sizeof(svg));
     FILE *fd = fopen(path, "w");
-    *psvg = (svg){.fd = fd, .width = width, .height = height, .finalized = false};
+    if (fd == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open svg file [%s]\n", path);
+    }
+    else {
+        //the svg buffers its own text, so stdio needs no buffer of its own
+        setvbuf(fd, NULL, _IONBF, 0);
+    }
+    psvg->fd = fd;
+    psvg->width = width;
+    psvg->height = height;
+    psvg->finalized = false;
+    psvg->length = 0;
 
     svgAppendString(psvg, "<svg width='");
     svgAppendInt(psvg, width);
@@ -54,13 +126,13 @@ svg* svgStart(char *path, int width, int height) {
  * @param psvg pointer to the svg information.
  */
 void svgEnd(svg* psvg) {
-    if(psvg->fd != NULL) {
-        svgAppendString(psvg, "</svg>");
-        psvg->finalized = true;
-        fflush(psvg->fd);
+    svgAppendString(psvg, "</svg>");
+    svgFlush(psvg);
+    psvg->finalized = true;
+    if (psvg->fd != NULL) {
         fclose(psvg->fd);
-        free(psvg);
     }
+    free(psvg);
 }
 
 /**
@@ -151,6 +223,155 @@ void svgRectangle(svg* psvg, int width, int height, int x, int y,
     svgAppendString(psvg, "' />\n");
 }
 
+/**
+ * Draw many rectangles of the same style as one path, far smaller and
+ * faster than a rect element each. All units are pixels.
+ * @param psvg pointer to the svg information.
+ * @param num the number of rectangles.
+ * @param x the lefts of the rectangles.
+ * @param y the tops of the rectangles.
+ * @param width the widths of the rectangles.
+ * @param height the heights of the rectangles.
+ * @param fill the fill color, usually in "#rrggbb" format.
+ * @param stroke the outline color, usually in "#rrggbb" format.
+ * @param strokewidth the width of the outline.
+ */
+void svgRectangles(svg* psvg, int num, const int* x, const int* y, const int* width, const int* height,
+                   char* fill, char* stroke, int strokewidth) {
+    if (num < 1) {
+        return;
+    }
+    svgAppendString(psvg, "    <path fill='");
+    svgAppendString(psvg, fill);
+    svgAppendString(psvg, "' stroke='");
+    svgAppendString(psvg, stroke);
+    svgAppendString(psvg, "' stroke-width='");
+    svgAppendInt(psvg, strokewidth);
+    svgAppendString(psvg, "px' d='");
+    for (int i = 0; i < num; i++) {
+        svgAppendString(psvg, (i == 0) ? "M" : " M");
+        svgAppendInt(psvg, x[i]);
+        svgAppendString(psvg, " ");
+        svgAppendInt(psvg, y[i]);
+        svgAppendString(psvg, "h");
+        svgAppendInt(psvg, width[i]);
+        svgAppendString(psvg, "v");
+        svgAppendInt(psvg, height[i]);
+        svgAppendString(psvg, "h");
+        svgAppendInt(psvg, -width[i]);
+        svgAppendString(psvg, "z");
+    }
+    svgAppendString(psvg, "' />\n");
+}
+
+/**
+ * Draw many unfilled polylines of the same style as one path. Grid lines
+ * are polylines of two points. All units are pixels.
+ * @param psvg pointer to the svg information.
+ * @param stroke the line color, usually in "#rrggbb" format.
+ * @param strokewidth the width of the lines.
+ * @param numLines the number of polylines.
+ * @param lengths the number of points of each polyline.
+ * @param x the horizontal coordinates of the points of all the polylines, in order.
+ * @param y the vertical coordinates of the points of all the polylines, in order.
+ */
+void svgPolylines(svg* psvg, char* stroke, int strokewidth, int numLines, const int* lengths,
+                  const int* x, const int* y) {
+    if (numLines < 1) {
+        return;
+    }
+    svgAppendString(psvg, "    <path fill='none' stroke='");
+    svgAppendString(psvg, stroke);
+    svgAppendString(psvg, "' stroke-width='");
+    svgAppendInt(psvg, strokewidth);
+    svgAppendString(psvg, "px' d='");
+    for (int line = 0; line < numLines; line++) {
+        for (int i = 0; i < lengths[line]; i++) {
+            svgAppendString(psvg, (i == 0) ? ((line == 0) ? "M" : " M") : " ");
+            svgAppendInt(psvg, *x++);
+            svgAppendString(psvg, " ");
+            svgAppendInt(psvg, *y++);
+        }
+    }
+    svgAppendString(psvg, "' />\n");
+}
+
+/**
+ * Draw many polylines as one unfilled path, like svgPolylines, with the
+ * points to a tenth of a pixel, for smooth curves such as contours.
+ * @param psvg pointer to the svg information.
+ * @param stroke the line color.
+ * @param strokewidth the line width.
+ * @param numLines the number of lines.
+ * @param lengths the number of points of each line.
+ * @param x the x coordinates of all the points, line after line.
+ * @param y the y coordinates of all the points, line after line.
+ */
+void svgFinePolylines(svg* psvg, char* stroke, int strokewidth, int numLines, const int* lengths,
+                      const double* x, const double* y) {
+    if (numLines < 1) {
+        return;
+    }
+    svgAppendString(psvg, "    <path fill='none' stroke='");
+    svgAppendString(psvg, stroke);
+    svgAppendString(psvg, "' stroke-width='");
+    svgAppendInt(psvg, strokewidth);
+    svgAppendString(psvg, "px' d='");
+    for (int line = 0; line < numLines; line++) {
+        for (int i = 0; i < lengths[line]; i++) {
+            svgAppendString(psvg, (i == 0) ? ((line == 0) ? "M" : " M") : " ");
+            svgAppendTenths(psvg, *x++);
+            svgAppendString(psvg, " ");
+            svgAppendTenths(psvg, *y++);
+        }
+    }
+    svgAppendString(psvg, "' />\n");
+}
+
+/**
+ * Draw a raster image, embedded as a base64 PNG. The pixels are scaled to
+ * the given size without smoothing. All units are pixels.
+ * @param psvg pointer to the svg information.
+ * @param width the width of the image in the svg.
+ * @param height the height of the image in the svg.
+ * @param x the left of the image.
+ * @param y the top of the image.
+ * @param rgb the raster, three bytes per pixel, row by row from the top.
+ * @param cols the width of the raster in pixels.
+ * @param rows the height of the raster in pixels.
+ * @return false if the raster could not be encoded.
+ */
+bool svgImage(svg* psvg, int width, int height, int x, int y,
+              const unsigned char *rgb, int cols, int rows) {
+    size_t size;
+    unsigned char *png = encodePNG(rgb, cols, rows, &size);
+    if (png == NULL) {
+        return false;
+    }
+
+    svgAppendString(psvg, "    <image width='");
+    svgAppendInt(psvg, width);
+    svgAppendString(psvg, "' height='");
+    svgAppendInt(psvg, height);
+    svgAppendString(psvg, "' y='");
+    svgAppendInt(psvg, y);
+    svgAppendString(psvg, "' x='");
+    svgAppendInt(psvg, x);
+    svgAppendString(psvg, "' preserveAspectRatio='none' style='image-rendering:pixelated'"
+                          " xlink:href='data:image/png;base64,");
+
+    //encoded a block at a time, a multiple of three bytes so only the last pads
+    char text[BASE64_LENGTH(3072)];
+    for (size_t i = 0; i < size; i += 3072) {
+        size_t block = (size - i < 3072) ? size - i : 3072;
+        svgAppend(psvg, text, base64Encode(text, png + i, block));
+    }
+
+    svgAppendString(psvg, "' />\n");
+    free(png);
+    return true;
+}
+
 /**
  * Fill the whole image area.
  * @param psvg pointer to the svg information.
@@ -266,3 +487,83 @@ void svgEllipse(svg* psvg, int cx, int cy, int rx, int ry,
 
 
 
+
+/**
+ * A unit test that the buffered writer writes what printf would: integers
+ * of every size and sign, text longer than the buffer, elements that
+ * straddle a flush, and the batch forms.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *svgUnitTest() {
+    const char *path = "cMagSvgUnitTest.svg";
+    size_t room = 4 * SVG_BUFFER_SIZE + 400000;
+    char *expected = (char *) malloc(room);
+    char *text = (char *) malloc(SVG_BUFFER_SIZE + 1001);
+    size_t length = 0;
+
+    svg *psvg = svgStart((char *) path, 300, -7);
+    length += sprintf(expected + length, "<svg width='300px' height='-7px' xmlns='http://www.w3.org/2000/svg'"
+                                         " version='1.1' xmlns:xlink='http://www.w3.org/1999/xlink'>\n");
+
+    int values[] = {0, 7, -7, 10, -10, 123456789, INT_MAX, INT_MIN, INT_MIN + 1};
+    for (int i = 0; i < 9; i++) {
+        int v = values[i];
+        svgLine(psvg, "#123456", 1, v, -v, v / 3, 42);
+        length += sprintf(expected + length, "    <line stroke='#123456' stroke-width='1px' y2='42' x2='%d'"
+                                             " y1='%d' x1='%d' />\n", v / 3, -v, v);
+    }
+
+    //many elements, so some straddle the end of the buffer
+    for (int i = 0; i < 5000; i++) {
+        svgCircle(psvg, "red", 2, "none", i, -i, 3 * i);
+        length += sprintf(expected + length, "    <circle stroke='red' stroke-width='2px' fill='none' r='%d'"
+                                             " cy='%d' cx='%d' />\n", i, 3 * i, -i);
+    }
+
+    //text longer than the buffer
+    memset(text, 'a', SVG_BUFFER_SIZE + 1000);
+    text[SVG_BUFFER_SIZE + 1000] = '\0';
+    svgText(psvg, 1, 2, "times", 12, "black", "none", text);
+    length += sprintf(expected + length, "    <text x='1' y = '2' font-family='times' stroke='none' fill='black'"
+                                         " font-size='12px'>%s</text>\n", text);
+
+    int x[] = {1, -20, 5};
+    int y[] = {2, 30, -6};
+    int w[] = {10, 4, 1};
+    int h[] = {3, 9, 1};
+    int lengths[] = {2, 1};
+    svgRectangles(psvg, 2, x, y, w, h, "#abcdef", "none", 0);
+    svgRectangles(psvg, 0, x, y, w, h, "#abcdef", "none", 0);
+    svgPolylines(psvg, "blue", 1, 2, lengths, x, y);
+    svgPolylines(psvg, "blue", 1, 0, lengths, x, y);
+    length += sprintf(expected + length, "    <path fill='#abcdef' stroke='none' stroke-width='0px'"
+                                         " d='M1 2h10v3h-10z M-20 30h4v9h-4z' />\n");
+    length += sprintf(expected + length, "    <path fill='none' stroke='blue' stroke-width='1px'"
+                                         " d='M1 2 -20 30 M5 -6' />\n");
+
+    double fineX[] = {1.04, -20.27, 5.5, -0.04};
+    double fineY[] = {2, 30.96, -6.06, 0.51};
+    int fineLengths[] = {3, 1};
+    svgFinePolylines(psvg, "red", 2, 2, fineLengths, fineX, fineY);
+    length += sprintf(expected + length, "    <path fill='none' stroke='red' stroke-width='2px'"
+                                         " d='M1 2 -20.3 31 5.5 -6.1 M0 0.5' />\n");
+    svgEnd(psvg);
+    length += sprintf(expected + length, "</svg>");
+
+    char *written = (char *) malloc(length + 2);
+    FILE *fp = fopen(path, "r");
+    size_t read = (fp == NULL) ? 0 : fread(written, 1, length + 2, fp);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    remove(path);
+    bool same = (read == length) && (memcmp(written, expected, length) == 0);
+
+    free(written);
+    free(text);
+    free(expected);
+
+    mu_assert("The svg writer wrote the wrong text", same);
+    fprintf(stdout, "\nPASSED svgUnitTest\n");
+    return NULL;
+}